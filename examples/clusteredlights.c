@@ -0,0 +1,297 @@
+#include <stdlib.h>
+#include <math.h>
+#include <gtk/gtk.h>
+
+#include <epoxy/gl.h>
+
+#include <gthree/gthree.h>
+#include "utils.h"
+
+/* A floor with a grid of spheres lit by up to 1024 moving point lights
+ * with a short range. With clustered lighting each fragment only
+ * evaluates the lights near it. The benchmark button renders the scene
+ * with 8 to 1024 lights and prints the average frame times. Without
+ * clustering the lights are uniform arrays, which only works for a
+ * limited number of lights. */
+
+#define MAX_LIGHTS 1024
+#define MAX_UNIFORM_LIGHTS 64
+#define BENCHMARK_FRAMES 30
+#define LIGHT_DISTANCE 150
+
+GthreeScene *scene;
+GthreePerspectiveCamera *camera;
+GthreePointLight *lights[MAX_LIGHTS];
+float light_radius[MAX_LIGHTS];
+float light_angle[MAX_LIGHTS];
+float light_speed[MAX_LIGHTS];
+int n_lights = 256;
+gboolean clustered = TRUE;
+gboolean run_benchmark;
+
+GthreeScene *
+init_scene (void)
+{
+  GthreeMeshPhongMaterial *material;
+  GthreeGeometry *floor_geometry, *sphere_geometry;
+  GthreeMesh *mesh;
+  GthreeAmbientLight *ambient_light;
+  graphene_vec3_t color;
+  graphene_euler_t rot;
+  graphene_point3d_t pos;
+  int i, x, z;
+
+  scene = gthree_scene_new ();
+
+  material = gthree_mesh_phong_material_new ();
+
+  floor_geometry = gthree_geometry_new_plane (2000, 2000, 1, 1);
+  mesh = gthree_mesh_new (floor_geometry, GTHREE_MATERIAL (material));
+  gthree_object_set_rotation (GTHREE_OBJECT (mesh),
+                              graphene_euler_init (&rot, -90, 0, 0));
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (mesh));
+
+  sphere_geometry = gthree_geometry_new_sphere (30, 24, 12);
+  for (x = -4; x <= 4; x++)
+    for (z = -4; z <= 4; z++)
+      {
+        mesh = gthree_mesh_new (sphere_geometry, GTHREE_MATERIAL (material));
+        gthree_object_set_position_point3d (GTHREE_OBJECT (mesh),
+                                            graphene_point3d_init (&pos, x * 200, 30, z * 200));
+        gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (mesh));
+      }
+
+  ambient_light = gthree_ambient_light_new (graphene_vec3_init (&color, 0.05, 0.05, 0.05));
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (ambient_light));
+
+  for (i = 0; i < MAX_LIGHTS; i++)
+    {
+      graphene_vec3_init (&color,
+                          g_random_double_range (0.2, 1),
+                          g_random_double_range (0.2, 1),
+                          g_random_double_range (0.2, 1));
+      lights[i] = gthree_point_light_new (&color, 2, LIGHT_DISTANCE);
+      gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (lights[i]));
+
+      light_radius[i] = g_random_double_range (50, 950);
+      light_angle[i] = g_random_double_range (0, 2 * G_PI);
+      light_speed[i] = g_random_double_range (-0.01, 0.01);
+    }
+
+  g_object_unref (material);
+  g_object_unref (floor_geometry);
+  g_object_unref (sphere_geometry);
+
+  return scene;
+}
+
+static void
+set_n_lights (int n)
+{
+  int i;
+
+  n_lights = n;
+  for (i = 0; i < MAX_LIGHTS; i++)
+    gthree_object_set_visible (GTHREE_OBJECT (lights[i]), i < n_lights);
+}
+
+static void
+move_lights (void)
+{
+  graphene_point3d_t pos;
+  int i;
+
+  for (i = 0; i < n_lights; i++)
+    {
+      light_angle[i] += light_speed[i];
+      gthree_object_set_position_point3d (GTHREE_OBJECT (lights[i]),
+                                          graphene_point3d_init (&pos,
+                                                                 cos (light_angle[i]) * light_radius[i],
+                                                                 40,
+                                                                 sin (light_angle[i]) * light_radius[i]));
+    }
+}
+
+static double
+time_frames (GthreeRenderer *renderer)
+{
+  gint64 start;
+  int i;
+
+  /* Compile the programs for this light setup outside the timing */
+  gthree_renderer_render (renderer, scene, GTHREE_CAMERA (camera));
+  glFinish ();
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < BENCHMARK_FRAMES; i++)
+    {
+      move_lights ();
+      gthree_renderer_render (renderer, scene, GTHREE_CAMERA (camera));
+    }
+  glFinish ();
+
+  return (g_get_monotonic_time () - start) / 1000.0 / BENCHMARK_FRAMES;
+}
+
+static void
+benchmark (GthreeRenderer *renderer)
+{
+  int old_n_lights = n_lights;
+  int n;
+
+  g_print ("%6s %14s %14s\n", "lights", "uniforms (ms)", "clustered (ms)");
+
+  for (n = 8; n <= MAX_LIGHTS; n *= 2)
+    {
+      set_n_lights (n);
+      g_print ("%6d ", n);
+
+      if (n <= MAX_UNIFORM_LIGHTS)
+        {
+          gthree_renderer_set_clustered_lighting (renderer, FALSE);
+          g_print ("%14.2f ", time_frames (renderer));
+        }
+      else
+        g_print ("%14s ", "-");
+
+      gthree_renderer_set_clustered_lighting (renderer, TRUE);
+      g_print ("%14.2f\n", time_frames (renderer));
+    }
+
+  set_n_lights (old_n_lights);
+  gthree_renderer_set_clustered_lighting (renderer, clustered);
+}
+
+static gboolean
+render_area (GtkGLArea    *area,
+             GdkGLContext *context)
+{
+  GthreeRenderer *renderer = gthree_area_get_renderer (GTHREE_AREA (area));
+
+  if (run_benchmark)
+    {
+      run_benchmark = FALSE;
+      benchmark (renderer);
+    }
+
+  gthree_renderer_set_clustered_lighting (renderer, clustered);
+
+  return FALSE;
+}
+
+static gboolean
+tick (GtkWidget     *widget,
+      GdkFrameClock *frame_clock,
+      gpointer       user_data)
+{
+  move_lights ();
+
+  gtk_widget_queue_draw (widget);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+resize_area (GthreeArea *area,
+             gint width,
+             gint height,
+             GthreePerspectiveCamera *camera)
+{
+  gthree_perspective_camera_set_aspect (camera, (float)width / (float)(height));
+}
+
+static void
+clustered_toggled (GtkToggleButton *button)
+{
+  clustered = gtk_toggle_button_get_active (button);
+}
+
+static void
+n_lights_changed (GtkSpinButton *spin)
+{
+  set_n_lights (gtk_spin_button_get_value_as_int (spin));
+}
+
+static void
+benchmark_clicked (GtkButton *button,
+                   GtkWidget *area)
+{
+  run_benchmark = TRUE;
+  gtk_widget_queue_draw (area);
+}
+
+int
+main (int argc, char *argv[])
+{
+  GtkWidget *window, *box, *hbox, *button, *area, *spin, *check;
+  GthreeScene *scene;
+  graphene_point3d_t pos;
+
+  gtk_init (&argc, &argv);
+
+  window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  gtk_window_set_title (GTK_WINDOW (window), "Clustered lights");
+  gtk_window_set_default_size (GTK_WINDOW (window), 800, 600);
+  gtk_container_set_border_width (GTK_CONTAINER (window), 12);
+  g_signal_connect (window, "destroy", G_CALLBACK (gtk_main_quit), NULL);
+
+  box = gtk_box_new (GTK_ORIENTATION_VERTICAL, FALSE);
+  gtk_box_set_spacing (GTK_BOX (box), 6);
+  gtk_container_add (GTK_CONTAINER (window), box);
+  gtk_widget_show (box);
+
+  scene = init_scene ();
+  set_n_lights (n_lights);
+
+  camera = gthree_perspective_camera_new (45, 1, 10, 5000);
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (camera));
+
+  gthree_object_set_position_point3d (GTHREE_OBJECT (camera),
+                                      graphene_point3d_init (&pos, 0, 900, 1400));
+  gthree_object_look_at (GTHREE_OBJECT (camera),
+                         graphene_point3d_init (&pos, 0, 0, 0));
+
+  area = gthree_area_new (scene, GTHREE_CAMERA (camera));
+  g_signal_connect (area, "resize", G_CALLBACK (resize_area), camera);
+  g_signal_connect (area, "render", G_CALLBACK (render_area), NULL);
+  gtk_widget_set_hexpand (area, TRUE);
+  gtk_widget_set_vexpand (area, TRUE);
+  gtk_container_add (GTK_CONTAINER (box), area);
+  gtk_widget_show (area);
+
+  gtk_widget_add_tick_callback (GTK_WIDGET (area), tick, area, NULL);
+
+  hbox = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, FALSE);
+  gtk_box_set_spacing (GTK_BOX (hbox), 6);
+  gtk_container_add (GTK_CONTAINER (box), hbox);
+  gtk_widget_show (hbox);
+
+  check = gtk_check_button_new_with_label ("Clustered");
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (check), clustered);
+  g_signal_connect (check, "toggled", G_CALLBACK (clustered_toggled), NULL);
+  gtk_container_add (GTK_CONTAINER (hbox), check);
+  gtk_widget_show (check);
+
+  spin = gtk_spin_button_new_with_range (1, MAX_LIGHTS, 1);
+  gtk_spin_button_set_value (GTK_SPIN_BUTTON (spin), n_lights);
+  g_signal_connect (spin, "value-changed", G_CALLBACK (n_lights_changed), NULL);
+  gtk_container_add (GTK_CONTAINER (hbox), spin);
+  gtk_widget_show (spin);
+
+  button = gtk_button_new_with_label ("Benchmark");
+  g_signal_connect (button, "clicked", G_CALLBACK (benchmark_clicked), area);
+  gtk_container_add (GTK_CONTAINER (hbox), button);
+  gtk_widget_show (button);
+
+  button = gtk_button_new_with_label ("Quit");
+  gtk_widget_set_hexpand (button, TRUE);
+  gtk_container_add (GTK_CONTAINER (box), button);
+  g_signal_connect_swapped (button, "clicked", G_CALLBACK (gtk_widget_destroy), window);
+  gtk_widget_show (button);
+
+  gtk_widget_show (window);
+
+  gtk_main ();
+
+  return EXIT_SUCCESS;
+}
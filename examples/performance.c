@@ -12,6 +12,15 @@ GthreePerspectiveCamera *camera;
 GList *objects;
 float pointer_x, pointer_y;
 
+/* Pass the number of threads to use for culling as the argument, the
+   time gthree_renderer_render() takes on the calling thread is printed
+   every 100 frames */
+#define N_TIMED_FRAMES 100
+
+int n_threads = 1;
+gint64 render_time;
+int n_frames;
+
 GthreeScene *
 init_scene (void)
 {
@@ -92,6 +101,27 @@ tick (GtkWidget     *widget,
   return G_SOURCE_CONTINUE;
 }
 
+static gboolean
+render_area (GtkGLArea    *area,
+             GdkGLContext *context)
+{
+  GthreeRenderer *renderer = gthree_area_get_renderer (GTHREE_AREA (area));
+  gint64 start = g_get_monotonic_time ();
+
+  gthree_renderer_render (renderer, scene, GTHREE_CAMERA (camera));
+
+  render_time += g_get_monotonic_time () - start;
+  if (++n_frames == N_TIMED_FRAMES)
+    {
+      g_print ("%d threads: %.3f ms per frame\n", n_threads,
+               render_time / 1000.0 / N_TIMED_FRAMES);
+      render_time = 0;
+      n_frames = 0;
+    }
+
+  return TRUE;
+}
+
 static void
 resize_area (GthreeArea *area,
              gint width,
@@ -114,11 +144,13 @@ int
 main (int argc, char *argv[])
 {
   GtkWidget *window, *box, *hbox, *button, *area;
-  GthreeScene *scene;
   graphene_point3d_t pos;
 
   gtk_init (&argc, &argv);
 
+  if (argc > 1)
+    n_threads = atoi (argv[1]);
+
   window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
   gtk_window_set_title (GTK_WINDOW (window), "Performance");
   gtk_window_set_default_size (GTK_WINDOW (window), 800, 600);
@@ -135,7 +167,7 @@ main (int argc, char *argv[])
   gtk_container_add (GTK_CONTAINER (box), hbox);
   gtk_widget_show (hbox);
 
-  scene = init_scene ();
+  init_scene ();
   camera = gthree_perspective_camera_new (60, 1, 1, 10000);
   gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (camera));
 
@@ -144,6 +176,8 @@ main (int argc, char *argv[])
 
   area = gthree_area_new (scene, GTHREE_CAMERA (camera));
   g_signal_connect (area, "resize", G_CALLBACK (resize_area), camera);
+  g_signal_connect (area, "render", G_CALLBACK (render_area), NULL);
+  gthree_renderer_set_n_threads (gthree_area_get_renderer (GTHREE_AREA (area)), n_threads);
   gtk_widget_add_events (GTK_WIDGET (area), GDK_POINTER_MOTION_MASK);
   g_signal_connect (area, "motion-notify-event", G_CALLBACK (motion_event), NULL);
   gtk_widget_set_hexpand (area, TRUE);
@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <gtk/gtk.h>
+
+#include <epoxy/gl.h>
+
+#include <gthree/gthree.h>
+#include "utils.h"
+
+/* Creates 64 program variants of the same material by changing the
+ * number of lights and clipping planes, and prints how long it took,
+ * waiting for every program to be linked. The first pass processes
+ * every shader source, the second one creates the same variants again
+ * and gets all the processed sources from the cache, so the difference
+ * is the string processing cost. The variants fit in the source cache
+ * of the renderer, so the second pass only has hits. The on-disk
+ * shader caches of the drivers are disabled, as they would otherwise
+ * make the second pass skip the compiles too.
+ *
+ * The first pass still uses the faster string processing that came
+ * with the cache. For the numbers from before it, run this example
+ * built against gthree from before the source cache was added, it
+ * only uses API that existed then. */
+
+#define N_DIR_LIGHTS 4
+#define N_POINT_LIGHTS 4
+#define N_CLIPPING_PLANES 4
+#define N_VARIANTS (N_DIR_LIGHTS * N_POINT_LIGHTS * N_CLIPPING_PLANES)
+
+GthreeScene *scene;
+GthreePerspectiveCamera *camera;
+GthreeGroup *lights;
+GthreeMesh *mesh;
+gboolean benchmarked;
+
+GthreeScene *
+init_scene (void)
+{
+  GthreeMeshPhongMaterial *material;
+  GthreeGeometry *geometry;
+  GthreeDirectionalLight *light;
+  graphene_vec3_t white;
+  graphene_point3d_t pos;
+
+  scene = gthree_scene_new ();
+
+  geometry = gthree_geometry_new_sphere (40, 32, 16);
+  material = gthree_mesh_phong_material_new ();
+
+  mesh = gthree_mesh_new (geometry, GTHREE_MATERIAL (material));
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (mesh));
+
+  lights = gthree_group_new ();
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (lights));
+
+  light = gthree_directional_light_new (graphene_vec3_init (&white, 1, 1, 1), 1);
+  gthree_object_set_position_point3d (GTHREE_OBJECT (light),
+                                      graphene_point3d_init (&pos, 1, 1, 1));
+  gthree_object_add_child (GTHREE_OBJECT (lights), GTHREE_OBJECT (light));
+
+  g_object_unref (material);
+  g_object_unref (geometry);
+
+  return scene;
+}
+
+static void
+set_variant (GthreeRenderer *renderer,
+             int             n_dir,
+             int             n_point,
+             int             n_planes)
+{
+  graphene_vec3_t white, normal;
+  graphene_plane_t plane;
+  int i;
+
+  gthree_object_destroy_all_children (GTHREE_OBJECT (lights));
+
+  graphene_vec3_init (&white, 1, 1, 1);
+  for (i = 0; i < n_dir + n_point; i++)
+    {
+      GthreeObject *light;
+
+      if (i < n_dir)
+        light = GTHREE_OBJECT (gthree_directional_light_new (&white, 0.2));
+      else
+        light = GTHREE_OBJECT (gthree_point_light_new (&white, 0.2, 0));
+
+      gthree_object_add_child (GTHREE_OBJECT (lights), light);
+      g_object_unref (light);
+    }
+
+  gthree_renderer_remove_all_clipping_planes (renderer);
+  for (i = 0; i < n_planes; i++)
+    {
+      graphene_plane_init (&plane, graphene_vec3_init (&normal, 0, 0, -1), 100 + i);
+      gthree_renderer_add_clipping_plane (renderer, &plane);
+    }
+}
+
+static double
+create_variants (GthreeRenderer *renderer)
+{
+  gint64 start = g_get_monotonic_time ();
+  int d, p, c;
+
+  for (d = 0; d < N_DIR_LIGHTS; d++)
+    for (p = 0; p < N_POINT_LIGHTS; p++)
+      for (c = 0; c < N_CLIPPING_PLANES; c++)
+        {
+          set_variant (renderer, d, p, c);
+          /* Programs from the previous call are released here */
+          gthree_renderer_compile (renderer, scene, GTHREE_CAMERA (camera));
+
+          /* With parallel compilation this only submitted them */
+          while (gthree_renderer_get_n_pending_programs (renderer) > 0)
+            g_usleep (100);
+        }
+
+  glFinish ();
+
+  return (g_get_monotonic_time () - start) / 1000.0;
+}
+
+static gboolean
+render_area (GtkGLArea *area,
+             GdkGLContext *context)
+{
+  GthreeRenderer *renderer = gthree_area_get_renderer (GTHREE_AREA (area));
+  double cold, warm;
+
+  if (benchmarked)
+    return FALSE;
+
+  benchmarked = TRUE;
+
+  cold = create_variants (renderer);
+  warm = create_variants (renderer);
+
+  g_print ("Creating %d program variants:\n", N_VARIANTS);
+  g_print ("  uncached sources: %8.2f ms (%.3f ms per program)\n", cold, cold / N_VARIANTS);
+  g_print ("  cached sources:   %8.2f ms (%.3f ms per program)\n", warm, warm / N_VARIANTS);
+
+  set_variant (renderer, 1, 1, 0);
+
+  return FALSE;
+}
+
+static void
+resize_area (GthreeArea *area,
+             gint width,
+             gint height,
+             GthreePerspectiveCamera *camera)
+{
+  gthree_perspective_camera_set_aspect (camera, (float)width / (float)(height));
+}
+
+int
+main (int argc, char *argv[])
+{
+  GtkWidget *window, *box, *hbox, *button, *area;
+  graphene_point3d_t pos;
+
+  g_setenv ("MESA_SHADER_CACHE_DISABLE", "true", TRUE);
+  g_setenv ("__GL_SHADER_DISK_CACHE", "0", TRUE);
+
+  gtk_init (&argc, &argv);
+
+  window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  gtk_window_set_title (GTK_WINDOW (window), "Programs");
+  gtk_window_set_default_size (GTK_WINDOW (window), 800, 600);
+  gtk_container_set_border_width (GTK_CONTAINER (window), 12);
+  g_signal_connect (window, "destroy", G_CALLBACK (gtk_main_quit), NULL);
+
+  box = gtk_box_new (GTK_ORIENTATION_VERTICAL, FALSE);
+  gtk_box_set_spacing (GTK_BOX (box), 6);
+  gtk_container_add (GTK_CONTAINER (window), box);
+  gtk_widget_show (box);
+
+  hbox = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, FALSE);
+  gtk_box_set_spacing (GTK_BOX (hbox), 6);
+  gtk_container_add (GTK_CONTAINER (box), hbox);
+  gtk_widget_show (hbox);
+
+  init_scene ();
+  camera = gthree_perspective_camera_new (30, 1, 1, 10000);
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (camera));
+
+  gthree_object_set_position_point3d (GTHREE_OBJECT (camera),
+                                      graphene_point3d_init (&pos, 0, 0, 400));
+
+  area = gthree_area_new (scene, GTHREE_CAMERA (camera));
+  g_signal_connect (area, "resize", G_CALLBACK (resize_area), camera);
+  g_signal_connect (area, "render", G_CALLBACK (render_area), NULL);
+  gtk_widget_set_hexpand (area, TRUE);
+  gtk_widget_set_vexpand (area, TRUE);
+  gtk_container_add (GTK_CONTAINER (hbox), area);
+  gtk_widget_show (area);
+
+  button = gtk_button_new_with_label ("Quit");
+  gtk_widget_set_hexpand (button, TRUE);
+  gtk_container_add (GTK_CONTAINER (box), button);
+  g_signal_connect_swapped (button, "clicked", G_CALLBACK (gtk_widget_destroy), window);
+  gtk_widget_show (button);
+
+  gtk_widget_show (window);
+
+  gtk_main ();
+
+  return EXIT_SUCCESS;
+}
@@ -95,6 +95,11 @@ init_scene (void)
   gthree_orthographic_camera_set_bottom (GTHREE_ORTHOGRAPHIC_CAMERA (shadow_camera), -500);
   gthree_camera_set_far (shadow_camera, 1000);
 
+  /* Used when split into cascades, the farthest one is only redrawn every 4th frame */
+  gthree_directional_light_shadow_set_max_distance (GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow), 2000);
+  gthree_directional_light_shadow_set_cascade_update_interval (GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow),
+                                                               GTHREE_MAX_SHADOW_CASCADES - 1, 4);
+
   particle_material = gthree_mesh_basic_material_new ();
   gthree_mesh_basic_material_set_color (particle_material, green ());
   dir_particle = gthree_mesh_new (particle_geometry, GTHREE_MATERIAL (particle_material));
@@ -181,6 +186,46 @@ resize_area (GthreeArea *area,
   gthree_perspective_camera_set_aspect (camera, (float)width / (float)(height));
 }
 
+static void
+cascades_changed (GtkSpinButton *spin)
+{
+  GthreeLightShadow *shadow = gthree_light_get_shadow (GTHREE_LIGHT (directional_light));
+
+  gthree_directional_light_shadow_set_n_cascades (GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow),
+                                                  gtk_spin_button_get_value_as_int (spin));
+}
+
+static void
+atlas_toggled (GtkToggleButton *button,
+               GthreeArea      *area)
+{
+  GthreeRenderer *renderer = gthree_area_get_renderer (area);
+
+  /* Room for all three lights, the point light takes 4x2 maps */
+  gthree_renderer_set_shadow_atlas_size (renderer,
+                                         gtk_toggle_button_get_active (button) ? 2048 : 0);
+}
+
+static void
+depth_compare_toggled (GtkToggleButton *button,
+                       GthreeArea      *area)
+{
+  GthreeRenderer *renderer = gthree_area_get_renderer (area);
+
+  gthree_renderer_set_shadow_map_depth_compare (renderer,
+                                                gtk_toggle_button_get_active (button));
+}
+
+static void
+layered_toggled (GtkToggleButton *button,
+                 GthreeArea      *area)
+{
+  GthreeRenderer *renderer = gthree_area_get_renderer (area);
+
+  gthree_renderer_set_shadow_map_layered (renderer,
+                                          gtk_toggle_button_get_active (button));
+}
+
 static void
 realize_area (GthreeArea *area)
 {
@@ -192,7 +237,7 @@ realize_area (GthreeArea *area)
 int
 main (int argc, char *argv[])
 {
-  GtkWidget *window, *box, *hbox, *button, *area;
+  GtkWidget *window, *box, *hbox, *button, *area, *label, *spin, *check;
 
   gtk_init (&argc, &argv);
 
@@ -223,6 +268,35 @@ main (int argc, char *argv[])
 
   gtk_widget_add_tick_callback (GTK_WIDGET (area), tick, area, NULL);
 
+  hbox = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, FALSE);
+  gtk_box_set_spacing (GTK_BOX (hbox), 6);
+  gtk_container_add (GTK_CONTAINER (box), hbox);
+  gtk_widget_show (hbox);
+
+  label = gtk_label_new ("Directional shadow cascades:");
+  gtk_container_add (GTK_CONTAINER (hbox), label);
+  gtk_widget_show (label);
+
+  spin = gtk_spin_button_new_with_range (1, GTHREE_MAX_SHADOW_CASCADES, 1);
+  g_signal_connect (spin, "value-changed", G_CALLBACK (cascades_changed), NULL);
+  gtk_container_add (GTK_CONTAINER (hbox), spin);
+  gtk_widget_show (spin);
+
+  check = gtk_check_button_new_with_label ("Shadow atlas");
+  g_signal_connect (check, "toggled", G_CALLBACK (atlas_toggled), area);
+  gtk_container_add (GTK_CONTAINER (hbox), check);
+  gtk_widget_show (check);
+
+  check = gtk_check_button_new_with_label ("Depth compare");
+  g_signal_connect (check, "toggled", G_CALLBACK (depth_compare_toggled), area);
+  gtk_container_add (GTK_CONTAINER (hbox), check);
+  gtk_widget_show (check);
+
+  check = gtk_check_button_new_with_label ("Layered point shadows");
+  g_signal_connect (check, "toggled", G_CALLBACK (layered_toggled), area);
+  gtk_container_add (GTK_CONTAINER (hbox), check);
+  gtk_widget_show (check);
+
   button = gtk_button_new_with_label ("Quit");
   gtk_widget_set_hexpand (button, TRUE);
   gtk_container_add (GTK_CONTAINER (box), button);
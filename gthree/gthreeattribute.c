@@ -575,6 +575,16 @@ gthree_attribute_array_get_vec4 (GthreeAttributeArray *array,
   graphene_vec4_init (vec4, x, y, z, w);
 }
 
+void
+gthree_attribute_array_set_matrix (GthreeAttributeArray    *array,
+                                   guint                    index,
+                                   guint                    offset,
+                                   const graphene_matrix_t *matrix)
+{
+  float *p = gthree_attribute_array_peek_float_at (array, index, offset);
+  graphene_matrix_to_float (matrix, p);
+}
+
 void
 gthree_attribute_array_get_matrix (GthreeAttributeArray *array,
                                    guint                 index,
@@ -943,6 +953,7 @@ struct _GthreeAttribute {
   int item_offset;  /* typically 0, but not if interleaved or stacked */
   int count;        /* May be smaller than the entire array if stacking */
   gboolean normalized;
+  int mesh_per_attribute; /* Instance divisor, 0 if not instanced */
 };
 
 typedef struct {
@@ -1029,6 +1040,8 @@ gthree_attribute_copy (const char           *name,
 
   gthree_attribute_array_unref (array);
 
+  attribute->mesh_per_attribute = source->mesh_per_attribute;
+
   gthree_attribute_copy_at (attribute, 0, source, 0, source->count);
 
   return attribute;
@@ -1149,6 +1162,14 @@ void
 gthree_attribute_set_needs_update (GthreeAttribute *attribute)
 {
   attribute->array->dirty = TRUE;
+  attribute->array->version++;
+}
+
+/* Changes whenever the contents are marked as modified */
+int
+gthree_attribute_get_version (GthreeAttribute *attribute)
+{
+  return attribute->array->version;
 }
 
 void
@@ -1212,6 +1233,21 @@ gthree_attribute_set_dynamic (GthreeAttribute *attribute,
   attribute->array->dynamic = !!dynamic;
 }
 
+int
+gthree_attribute_get_mesh_per_attribute (GthreeAttribute *attribute)
+{
+  return attribute->mesh_per_attribute;
+}
+
+/* A non-zero value makes this a per-instance attribute, advancing once
+ * every mesh_per_attribute instances instead of once per vertex. */
+void
+gthree_attribute_set_mesh_per_attribute (GthreeAttribute *attribute,
+                                         int              mesh_per_attribute)
+{
+  attribute->mesh_per_attribute = MAX (mesh_per_attribute, 0);
+}
+
 void
 gthree_attribute_copy_at (GthreeAttribute      *attribute,
                           guint                 index,
@@ -1545,6 +1581,15 @@ gthree_attribute_get_vec4 (GthreeAttribute      *attribute,
   gthree_attribute_array_get_vec4  (attribute->array, index, attribute->item_offset, vec4);
 }
 
+void
+gthree_attribute_set_matrix (GthreeAttribute         *attribute,
+                             guint                    index,
+                             const graphene_matrix_t *matrix)
+{
+  g_assert (attribute->array);
+  gthree_attribute_array_set_matrix  (attribute->array, index, attribute->item_offset, matrix);
+}
+
 void
 gthree_attribute_get_matrix (GthreeAttribute      *attribute,
                              guint                 index,
@@ -1634,6 +1679,11 @@ gthree_attribute_get_point3d (GthreeAttribute      *attribute,
 void
 gthree_attribute_update (GthreeAttribute *attribute, gint buffer_type)
 {
+  /* The element array binding is part of the vertex array object state, so
+     upload via a target that isn't to not disturb whatever vao is bound */
+  if (buffer_type == GL_ELEMENT_ARRAY_BUFFER)
+    buffer_type = GL_COPY_WRITE_BUFFER;
+
   if (attribute->array->gl_buffer == 0)
     {
       gthree_resource_set_realized_for (GTHREE_RESOURCE (attribute), gdk_gl_context_get_current ());
@@ -233,6 +233,11 @@ void                  gthree_attribute_array_get_vec4           (GthreeAttribute
                                                                  guint                 offset,
                                                                  graphene_vec4_t      *vec4);
 GTHREE_API
+void                  gthree_attribute_array_set_matrix         (GthreeAttributeArray *array,
+                                                                 guint                 index,
+                                                                 guint                 offset,
+                                                                 const graphene_matrix_t *matrix);
+GTHREE_API
 void                  gthree_attribute_array_get_matrix         (GthreeAttributeArray *array,
                                                                  guint                 index,
                                                                  guint                 offset,
@@ -368,6 +373,11 @@ GTHREE_API
 void                  gthree_attribute_set_dynamic        (GthreeAttribute      *attribute,
                                                            gboolean              dynamic);
 GTHREE_API
+int                   gthree_attribute_get_mesh_per_attribute (GthreeAttribute  *attribute);
+GTHREE_API
+void                  gthree_attribute_set_mesh_per_attribute (GthreeAttribute  *attribute,
+                                                               int               mesh_per_attribute);
+GTHREE_API
 void                  gthree_attribute_copy_at            (GthreeAttribute      *attribute,
                                                            guint                 index,
                                                            GthreeAttribute      *source,
@@ -497,6 +507,10 @@ void                  gthree_attribute_get_vec4           (GthreeAttribute
                                                            guint                 index,
                                                            graphene_vec4_t      *vec4);
 GTHREE_API
+void                  gthree_attribute_set_matrix         (GthreeAttribute      *attribute,
+                                                           guint                 index,
+                                                           const graphene_matrix_t *matrix);
+GTHREE_API
 void                  gthree_attribute_get_matrix         (GthreeAttribute      *attribute,
                                                            guint                 index,
                                                            graphene_matrix_t    *matrix);
@@ -52,6 +52,13 @@ gthree_cube_texture_new_from_array (GdkPixbuf *pixbufs[6])
   return gthree_cube_texture_new (pixbufs[0], pixbufs[1], pixbufs[2], pixbufs[3], pixbufs[4], pixbufs[5]);
 }
 
+/* Without images, for rendering into */
+GthreeCubeTexture *
+gthree_cube_texture_new_empty (void)
+{
+  return g_object_new (gthree_cube_texture_get_type (), NULL);
+}
+
 static void
 gthree_cube_texture_init (GthreeCubeTexture *cube)
 {
@@ -75,7 +82,7 @@ gthree_cube_texture_real_load (GthreeTexture *texture, int slot)
 
   gthree_texture_bind (texture, slot, GL_TEXTURE_CUBE_MAP);
 
-  if (gthree_texture_get_needs_update (texture))
+  if (gthree_texture_get_needs_update (texture) && priv->pixbufs[0] != NULL)
     {
       guint width, height;
       gboolean is_compressed = FALSE; //texture instanceof THREE.CompressedTexture;
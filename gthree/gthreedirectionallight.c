@@ -39,6 +39,7 @@ static int i0 = 0;
 static float f0 = 0.0;
 static float f1 = 1.0;
 static float zerov2[2] = { 0, 0 };
+static float unit_rect[4] = { 0, 0, 1, 1 };
 
 static GthreeUniformsDefinition light_uniforms[] = {
   {"direction", GTHREE_UNIFORM_TYPE_VECTOR3, &zerov3},
@@ -47,6 +48,8 @@ static GthreeUniformsDefinition light_uniforms[] = {
   {"shadowBias", GTHREE_UNIFORM_TYPE_FLOAT, &f0 },
   {"shadowRadius", GTHREE_UNIFORM_TYPE_FLOAT, &f1 },
   {"shadowMapSize", GTHREE_UNIFORM_TYPE_VECTOR2, &zerov2 },
+  {"shadowMapRect", GTHREE_UNIFORM_TYPE_VECTOR4, &unit_rect },
+  {"shadowCascades", GTHREE_UNIFORM_TYPE_INT, &i0 },
 };
 
 static void
@@ -112,6 +115,8 @@ gthree_directional_light_real_setup (GthreeLight *light,
   const graphene_matrix_t *view_matrix = gthree_camera_get_world_inverse_matrix (camera);
   GthreeTexture *shadow_map_texture = NULL;
   graphene_matrix_t shadow_matrix;
+  GthreeShadowCascadeState *cascade_state = NULL;
+  int n_cascades = 0;
 
   graphene_vec3_scale (gthree_light_get_color (light), intensity, &color);
   gthree_uniforms_set_vec3 (priv->uniforms, "color", &color);
@@ -130,25 +135,76 @@ gthree_directional_light_real_setup (GthreeLight *light,
   if (gthree_object_get_cast_shadow (GTHREE_OBJECT (light)))
     {
       GthreeLightShadow *shadow = gthree_light_get_shadow (light);
+      GthreeDirectionalLightShadow *directional_shadow = GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow);
+      int columns, rows;
       graphene_vec2_t size;
+      graphene_vec4_t rect;
 
       gthree_uniforms_set_float (priv->uniforms, "shadowBias", gthree_light_shadow_get_bias (shadow));
       gthree_uniforms_set_float (priv->uniforms, "shadowRadius", gthree_light_shadow_get_radius (shadow));
 
-      graphene_vec2_init (&size,
-                          gthree_light_shadow_get_map_width (shadow),
-                          gthree_light_shadow_get_map_height (shadow));
+      /* The size of the whole map, as that is what the filtering steps over */
+      if (gthree_light_shadow_get_map (shadow))
+        gthree_light_shadow_get_map_size (shadow, &size);
+      else
+        {
+          gthree_directional_light_shadow_get_atlas_layout (directional_shadow, &columns, &rows);
+          graphene_vec2_init (&size,
+                              gthree_light_shadow_get_map_width (shadow) * columns,
+                              gthree_light_shadow_get_map_height (shadow) * rows);
+        }
       gthree_uniforms_set_vec2 (priv->uniforms, "shadowMapSize", &size);
 
-      GthreeRenderTarget *shadow_map = gthree_light_shadow_get_map (shadow);
-      if (shadow_map)
-        shadow_map_texture = gthree_render_target_get_texture (shadow_map);
+      gthree_light_shadow_get_map_rect (shadow, &rect);
+      gthree_uniforms_set_vec4 (priv->uniforms, "shadowMapRect", &rect);
 
+      shadow_map_texture = gthree_light_shadow_get_map_texture (shadow);
+
+      /* For cascades this is the light space, see render_shadow_map() */
       shadow_matrix = *gthree_light_shadow_get_matrix (shadow);
+
+      n_cascades = gthree_directional_light_shadow_get_n_cascades (directional_shadow);
+      if (n_cascades > 1)
+        cascade_state = gthree_directional_light_shadow_get_cascade_state (directional_shadow);
     }
   else
     graphene_matrix_init_identity (&shadow_matrix);
 
+  gthree_uniforms_set_int (priv->uniforms, "shadowCascades", cascade_state ? n_cascades : 0);
+
+  {
+    float splits[4] = { 0 };
+    float scale[16] = { 0 };
+    float offset[16] = { 0 };
+    graphene_matrix_t m;
+    int i;
+
+    /* A row per cascade, which is a column in the shader */
+    for (i = 0; cascade_state && i < n_cascades; i++)
+      {
+        splits[i] = cascade_state->cascades[i].split;
+        memcpy (&scale[4 * i], cascade_state->cascades[i].scale, 4 * sizeof (float));
+        memcpy (&offset[4 * i], cascade_state->cascades[i].offset, 4 * sizeof (float));
+      }
+
+    g_array_append_vals (setup->directional_cascade_splits, splits, 4);
+    graphene_matrix_init_from_float (&m, scale);
+    g_array_append_val (setup->directional_cascade_scale, m);
+    graphene_matrix_init_from_float (&m, offset);
+    g_array_append_val (setup->directional_cascade_offset, m);
+
+    if (cascade_state)
+      setup->hash.num_cascaded++;
+  }
+
+  {
+    GthreeDirectionalLightBlock block = { { 0 } };
+
+    graphene_vec3_to_float (&direction, block.direction);
+    graphene_vec3_to_float (&color, block.color);
+    g_array_append_val (setup->directional_data, block);
+  }
+
   g_ptr_array_add (setup->directional, priv->uniforms);
   g_ptr_array_add (setup->directional_shadow_map, shadow_map_texture);
   g_array_append_val (setup->directional_shadow_map_matrix, shadow_matrix);
@@ -7,7 +7,13 @@
 #include "gthreeprivate.h"
 
 typedef struct {
-  int dummy;
+  int n_cascades;
+  float split_lambda;
+  float max_distance;
+  int update_interval[GTHREE_MAX_SHADOW_CASCADES];
+
+  GthreeCamera *cascade_camera;
+  GthreeShadowCascadeState cascade_state;
 } GthreeDirectionalLightShadowPrivate;
 
 
@@ -22,15 +28,26 @@ gthree_directional_light_shadow_new (void)
 static void
 gthree_directional_light_shadow_init (GthreeDirectionalLightShadow *directional)
 {
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (directional);
   g_autoptr(GthreeOrthographicCamera) camera = NULL;
+  int i;
 
   camera = gthree_orthographic_camera_new (-5, 5, 5, -5, 0.5, 500);
   gthree_light_shadow_set_camera (GTHREE_LIGHT_SHADOW (directional), GTHREE_CAMERA (camera));
+
+  priv->n_cascades = 1;
+  priv->split_lambda = 0.5;
+  for (i = 0; i < GTHREE_MAX_SHADOW_CASCADES; i++)
+    priv->update_interval[i] = 1;
 }
 
 static void
 gthree_directional_light_shadow_finalize (GObject *obj)
 {
+  GthreeDirectionalLightShadow *directional = GTHREE_DIRECTIONAL_LIGHT_SHADOW (obj);
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (directional);
+
+  g_clear_object (&priv->cascade_camera);
 
   G_OBJECT_CLASS (gthree_directional_light_shadow_parent_class)->finalize (obj);
 }
@@ -42,3 +59,164 @@ gthree_directional_light_shadow_class_init (GthreeDirectionalLightShadowClass *k
 
   gobject_class->finalize = gthree_directional_light_shadow_finalize;
 }
+
+static void
+invalidate_cascades (GthreeDirectionalLightShadow *shadow)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+  int i;
+
+  for (i = 0; i < GTHREE_MAX_SHADOW_CASCADES; i++)
+    priv->cascade_state.cascades[i].valid = FALSE;
+}
+
+/**
+ * gthree_directional_light_shadow_set_n_cascades:
+ * @shadow: a #GthreeDirectionalLightShadow
+ * @n_cascades: the number of cascades, from 1 to %GTHREE_MAX_SHADOW_CASCADES
+ *
+ * Splits the view frustum of the rendering camera into @n_cascades
+ * slices, each with its own orthographic shadow camera fitted to the
+ * slice. The cascades are rendered side by side into one shadow map,
+ * each at the map size of the shadow. With one cascade the shadow camera
+ * of the shadow is used as is.
+ */
+void
+gthree_directional_light_shadow_set_n_cascades (GthreeDirectionalLightShadow *shadow,
+                                                int                           n_cascades)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  n_cascades = CLAMP (n_cascades, 1, GTHREE_MAX_SHADOW_CASCADES);
+  if (priv->n_cascades == n_cascades)
+    return;
+
+  priv->n_cascades = n_cascades;
+  invalidate_cascades (shadow);
+}
+
+int
+gthree_directional_light_shadow_get_n_cascades (GthreeDirectionalLightShadow *shadow)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  return priv->n_cascades;
+}
+
+/**
+ * gthree_directional_light_shadow_set_split_lambda:
+ * @shadow: a #GthreeDirectionalLightShadow
+ * @lambda: blend between uniform (0) and logarithmic (1) splits
+ *
+ * Sets how the view depth is divided between the cascades. Logarithmic
+ * splits give the near cascades more resolution, uniform splits spread
+ * it evenly. The default is 0.5.
+ */
+void
+gthree_directional_light_shadow_set_split_lambda (GthreeDirectionalLightShadow *shadow,
+                                                  float                         lambda)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  priv->split_lambda = CLAMP (lambda, 0, 1);
+  invalidate_cascades (shadow);
+}
+
+float
+gthree_directional_light_shadow_get_split_lambda (GthreeDirectionalLightShadow *shadow)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  return priv->split_lambda;
+}
+
+/**
+ * gthree_directional_light_shadow_set_max_distance:
+ * @shadow: a #GthreeDirectionalLightShadow
+ * @distance: the view depth covered by the cascades, or 0
+ *
+ * Limits the cascades to @distance from the camera, nothing further
+ * away is shadowed. If 0, the default, the cascades reach the far plane
+ * of the camera.
+ */
+void
+gthree_directional_light_shadow_set_max_distance (GthreeDirectionalLightShadow *shadow,
+                                                  float                         distance)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  priv->max_distance = MAX (distance, 0);
+  invalidate_cascades (shadow);
+}
+
+float
+gthree_directional_light_shadow_get_max_distance (GthreeDirectionalLightShadow *shadow)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  return priv->max_distance;
+}
+
+/**
+ * gthree_directional_light_shadow_set_cascade_update_interval:
+ * @shadow: a #GthreeDirectionalLightShadow
+ * @cascade: the index of the cascade, 0 being the nearest
+ * @frames: render the cascade every this many shadow map updates
+ *
+ * Lets far cascades, where movement is hard to see, be rendered less
+ * often than the near ones. In between they keep the fit and contents
+ * of their last update. The default is 1, every update.
+ */
+void
+gthree_directional_light_shadow_set_cascade_update_interval (GthreeDirectionalLightShadow *shadow,
+                                                             int                           cascade,
+                                                             int                           frames)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  g_return_if_fail (cascade >= 0 && cascade < GTHREE_MAX_SHADOW_CASCADES);
+
+  priv->update_interval[cascade] = MAX (frames, 1);
+}
+
+int
+gthree_directional_light_shadow_get_cascade_update_interval (GthreeDirectionalLightShadow *shadow,
+                                                             int                           cascade)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  g_return_val_if_fail (cascade >= 0 && cascade < GTHREE_MAX_SHADOW_CASCADES, 1);
+
+  return priv->update_interval[cascade];
+}
+
+/* The cascades are laid out in rows of two, so up to four fit in a square */
+void
+gthree_directional_light_shadow_get_atlas_layout (GthreeDirectionalLightShadow *shadow,
+                                                  int                          *columns,
+                                                  int                          *rows)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  *columns = priv->n_cascades > 1 ? 2 : 1;
+  *rows = (priv->n_cascades + 1) / 2;
+}
+
+GthreeCamera *
+gthree_directional_light_shadow_get_cascade_camera (GthreeDirectionalLightShadow *shadow)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  if (priv->cascade_camera == NULL)
+    priv->cascade_camera = GTHREE_CAMERA (gthree_orthographic_camera_new (-1, 1, 1, -1, -1, 1));
+
+  return priv->cascade_camera;
+}
+
+GthreeShadowCascadeState *
+gthree_directional_light_shadow_get_cascade_state (GthreeDirectionalLightShadow *shadow)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  return &priv->cascade_state;
+}
@@ -9,6 +9,7 @@
 
 G_BEGIN_DECLS
 
+#define GTHREE_MAX_SHADOW_CASCADES 4
 
 #define GTHREE_TYPE_DIRECTIONAL_LIGHT_SHADOW      (gthree_directional_light_shadow_get_type ())
 #define GTHREE_DIRECTIONAL_LIGHT_SHADOW(inst)     (G_TYPE_CHECK_INSTANCE_CAST ((inst), \
@@ -31,6 +32,29 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (GthreeDirectionalLightShadow, g_object_unref)
 GTHREE_API
 GType gthree_directional_light_shadow_get_type (void) G_GNUC_CONST;
 
+GTHREE_API
+void  gthree_directional_light_shadow_set_n_cascades              (GthreeDirectionalLightShadow *shadow,
+                                                                   int                           n_cascades);
+GTHREE_API
+int   gthree_directional_light_shadow_get_n_cascades              (GthreeDirectionalLightShadow *shadow);
+GTHREE_API
+void  gthree_directional_light_shadow_set_split_lambda            (GthreeDirectionalLightShadow *shadow,
+                                                                   float                         lambda);
+GTHREE_API
+float gthree_directional_light_shadow_get_split_lambda            (GthreeDirectionalLightShadow *shadow);
+GTHREE_API
+void  gthree_directional_light_shadow_set_max_distance            (GthreeDirectionalLightShadow *shadow,
+                                                                   float                         distance);
+GTHREE_API
+float gthree_directional_light_shadow_get_max_distance            (GthreeDirectionalLightShadow *shadow);
+GTHREE_API
+void  gthree_directional_light_shadow_set_cascade_update_interval (GthreeDirectionalLightShadow *shadow,
+                                                                   int                           cascade,
+                                                                   int                           frames);
+GTHREE_API
+int   gthree_directional_light_shadow_get_cascade_update_interval (GthreeDirectionalLightShadow *shadow,
+                                                                   int                           cascade);
+
 G_END_DECLS
 
 #endif /* __GTHREE_DIRECTIONALLIGHT_H__ */
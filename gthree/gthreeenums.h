@@ -96,11 +96,13 @@ typedef enum {
 typedef enum {
   GTHREE_TEXTURE_FORMAT_RGBA,
   GTHREE_TEXTURE_FORMAT_RGB,
+  GTHREE_TEXTURE_FORMAT_DEPTH,
 } GthreeTextureFormat;
 
 typedef enum {
   GTHREE_DATA_TYPE_UNSIGNED_BYTE,
   GTHREE_DATA_TYPE_BYTE,
+  GTHREE_DATA_TYPE_UNSIGNED_INT,
 } GthreeDataType;
 
 typedef enum {
@@ -155,6 +157,11 @@ typedef enum {
  GTHREE_SHADOW_MAP_TYPE_PCF_SOFT,
 } GthreeShadowMapType;
 
+typedef enum {
+ GTHREE_OPAQUE_SORT_DEPTH,
+ GTHREE_OPAQUE_SORT_STATE,
+} GthreeOpaqueSort;
+
 G_END_DECLS
 
 #endif /* __GTHREE_ENUM_H__ */
@@ -25,6 +25,13 @@ typedef struct {
 
   gint draw_range_start;
   gint draw_range_count;
+
+  // Bumped whenever the set of attributes (or index) changes
+  guint attributes_version;
+
+  // The objects drawing us, not owned, told when the bounds change
+  GHashTable *users;
+  guint id;
 } GthreeGeometryPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeGeometry, gthree_geometry, G_TYPE_OBJECT);
@@ -36,6 +43,28 @@ drop_attribute (GthreeAttribute *attribute)
     g_object_unref (attribute);
 }
 
+static guint next_geometry_id = 1;
+
+static void
+bounds_changed (GthreeGeometry *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+  GHashTableIter iter;
+  gpointer object;
+
+  if (priv->users == NULL)
+    return;
+
+  g_hash_table_iter_init (&iter, priv->users);
+  while (g_hash_table_iter_next (&iter, &object, NULL))
+    {
+      if (GTHREE_IS_INSTANCED_MESH (object))
+        gthree_instanced_mesh_invalidate_bounding_sphere (object);
+      else
+        gthree_object_invalidate_bounds (object);
+    }
+}
+
 static void
 gthree_geometry_init (GthreeGeometry *geometry)
 {
@@ -46,6 +75,16 @@ gthree_geometry_init (GthreeGeometry *geometry)
 
   priv->draw_range_start = 0;
   priv->draw_range_count = -1;
+
+  priv->id = next_geometry_id++;
+}
+
+guint
+gthree_geometry_get_id (GthreeGeometry *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+
+  return priv->id;
 }
 
 static void
@@ -60,6 +99,8 @@ gthree_geometry_finalize (GObject *obj)
   if (priv->morph_attributes)
     g_hash_table_unref (priv->morph_attributes);
   g_array_unref (priv->groups);
+  if (priv->users)
+    g_hash_table_unref (priv->users);
 
   if (geometry->influences)
     g_array_unref (geometry->influences);
@@ -93,7 +134,11 @@ gthree_geometry_add_attribute (GthreeGeometry  *geometry,
 
   name = g_intern_string (name);
 
+  if (g_hash_table_lookup (priv->attributes, name) == attribute)
+    return attribute;
+
   g_hash_table_insert (priv->attributes, (char *)name, g_object_ref (attribute));
+  priv->attributes_version++;
 
   return attribute;
 }
@@ -105,6 +150,31 @@ gthree_geometry_invalidate_bounds (GthreeGeometry  *geometry)
 
   priv->bounding_box_set = FALSE;
   priv->bounding_sphere_set = FALSE;
+  bounds_changed (geometry);
+}
+
+/* Objects register while they draw the geometry, so that their world
+   bounds follow changes of the geometry bounds */
+void
+gthree_geometry_add_user (GthreeGeometry *geometry,
+                          GthreeObject   *object)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+
+  if (priv->users == NULL)
+    priv->users = g_hash_table_new (NULL, NULL);
+
+  g_hash_table_add (priv->users, object);
+}
+
+void
+gthree_geometry_remove_user (GthreeGeometry *geometry,
+                             GthreeObject   *object)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+
+  if (priv->users)
+    g_hash_table_remove (priv->users, object);
 }
 
 void
@@ -113,7 +183,54 @@ gthree_geometry_remove_attribute (GthreeGeometry  *geometry,
 {
   GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
 
-  g_hash_table_remove (priv->attributes, name);
+  if (g_hash_table_remove (priv->attributes, name))
+    priv->attributes_version++;
+}
+
+guint
+gthree_geometry_get_attributes_version (GthreeGeometry *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+
+  return priv->attributes_version;
+}
+
+GList *
+gthree_geometry_get_attributes_names (GthreeGeometry  *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+
+  return g_hash_table_get_keys (priv->attributes);
+}
+
+/* Describes the attributes and their types, geometries with the same
+ * layout can be concatenated. Returns NULL if the geometry has no
+ * positions or has morph attributes. */
+char *
+gthree_geometry_get_layout (GthreeGeometry  *geometry)
+{
+  g_autoptr(GList) names = NULL;
+  GString *layout;
+  GList *l;
+
+  if (gthree_geometry_get_position (geometry) == NULL ||
+      gthree_geometry_has_morph_attributes (geometry))
+    return NULL;
+
+  names = g_list_sort (gthree_geometry_get_attributes_names (geometry), (GCompareFunc)strcmp);
+
+  layout = g_string_new ("");
+  for (l = names; l != NULL; l = l->next)
+    {
+      GthreeAttribute *attribute = gthree_geometry_get_attribute (geometry, l->data);
+
+      g_string_append_printf (layout, "%s:%d:%d:%d;", (char *)l->data,
+                              gthree_attribute_get_attribute_type (attribute),
+                              gthree_attribute_get_item_size (attribute),
+                              gthree_attribute_get_normalized (attribute));
+    }
+
+  return g_string_free (layout, FALSE);
 }
 
 GthreeAttribute *
@@ -191,6 +308,7 @@ gthree_geometry_set_index (GthreeGeometry  *geometry,
   g_clear_object (&priv->index);
   g_clear_object (&priv->wireframe_index);
   priv->index = index;
+  priv->attributes_version++;
 }
 
 GthreeAttribute *
@@ -492,6 +610,7 @@ gthree_geometry_set_bounding_sphere  (GthreeGeometry          *geometry,
 
   priv->bounding_sphere_set = TRUE;
   priv->bounding_sphere = *sphere;
+  bounds_changed (geometry);
 }
 
 const graphene_box_t *
@@ -535,6 +654,7 @@ gthree_geometry_set_bounding_box  (GthreeGeometry       *geometry,
 
   priv->bounding_box = *box;
   priv->bounding_box_set = TRUE;
+  bounds_changed (geometry);
 }
 
 void
@@ -0,0 +1,444 @@
+#include <math.h>
+#include <epoxy/gl.h>
+
+#include "gthreeinstancedmesh.h"
+#include "gthreeobjectprivate.h"
+#include "gthreeprivate.h"
+#include "gthreeraycaster.h"
+
+typedef struct {
+  int count;
+  int max_count;
+
+  GthreeAttribute *instance_matrix;
+  GthreeAttribute *instance_color;
+
+  /* Union of the geometry bounding sphere over all instances, in object space */
+  graphene_sphere_t bounding_sphere;
+  guint bounding_sphere_dirty : 1;
+} GthreeInstancedMeshPrivate;
+
+enum {
+  PROP_0,
+
+  PROP_COUNT,
+
+  N_PROPS
+};
+
+static GParamSpec *obj_props[N_PROPS] = { NULL, };
+
+G_DEFINE_TYPE_WITH_PRIVATE (GthreeInstancedMesh, gthree_instanced_mesh, GTHREE_TYPE_MESH)
+
+GthreeInstancedMesh *
+gthree_instanced_mesh_new (GthreeGeometry *geometry,
+                           GthreeMaterial *material,
+                           int             count)
+{
+  g_autoptr(GPtrArray) materials = g_ptr_array_new_with_free_func (g_object_unref);
+
+  if (material)
+    g_ptr_array_add (materials, g_object_ref (material));
+
+  return g_object_new (gthree_instanced_mesh_get_type (),
+                       "geometry", geometry,
+                       "materials", materials,
+                       "count", count,
+                       NULL);
+}
+
+static void
+gthree_instanced_mesh_init (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  priv->bounding_sphere_dirty = TRUE;
+}
+
+static void
+gthree_instanced_mesh_constructed (GObject *obj)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (obj);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+  graphene_matrix_t identity;
+  int i;
+
+  G_OBJECT_CLASS (gthree_instanced_mesh_parent_class)->constructed (obj);
+
+  priv->instance_matrix = gthree_attribute_new ("instanceMatrix", GTHREE_ATTRIBUTE_TYPE_FLOAT,
+                                                MAX (priv->max_count, 1), 16, FALSE);
+  gthree_attribute_set_mesh_per_attribute (priv->instance_matrix, 1);
+  gthree_attribute_set_dynamic (priv->instance_matrix, TRUE);
+
+  graphene_matrix_init_identity (&identity);
+  for (i = 0; i < priv->max_count; i++)
+    gthree_attribute_set_matrix (priv->instance_matrix, i, &identity);
+}
+
+static void
+gthree_instanced_mesh_finalize (GObject *obj)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (obj);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_clear_object (&priv->instance_matrix);
+  g_clear_object (&priv->instance_color);
+
+  G_OBJECT_CLASS (gthree_instanced_mesh_parent_class)->finalize (obj);
+}
+
+static void
+gthree_instanced_mesh_update (GthreeObject *object)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (object);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  GTHREE_OBJECT_CLASS (gthree_instanced_mesh_parent_class)->update (object);
+
+  gthree_attribute_update (priv->instance_matrix, GL_ARRAY_BUFFER);
+  if (priv->instance_color)
+    gthree_attribute_update (priv->instance_color, GL_ARRAY_BUFFER);
+}
+
+static float
+matrix_get_max_scale (const graphene_matrix_t *m)
+{
+  float max_scale = 0;
+  int i;
+
+  for (i = 0; i < 3; i++)
+    {
+      graphene_vec4_t row;
+      graphene_vec3_t axis;
+
+      graphene_matrix_get_row (m, i, &row);
+      graphene_vec4_get_xyz (&row, &axis);
+      max_scale = MAX (max_scale, graphene_vec3_length (&axis));
+    }
+
+  return max_scale;
+}
+
+static const graphene_sphere_t *
+gthree_instanced_mesh_get_bounding_sphere (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+  GthreeGeometry *geometry;
+  const graphene_sphere_t *geometry_sphere;
+  graphene_point3d_t center;
+  graphene_box_t box;
+  float radius;
+  int i;
+
+  if (!priv->bounding_sphere_dirty)
+    return &priv->bounding_sphere;
+
+  geometry = gthree_mesh_get_geometry (GTHREE_MESH (mesh));
+  geometry_sphere = gthree_geometry_get_bounding_sphere (geometry);
+  graphene_sphere_get_center (geometry_sphere, &center);
+  radius = graphene_sphere_get_radius (geometry_sphere);
+
+  graphene_box_init_from_box (&box, graphene_box_empty ());
+
+  for (i = 0; i < priv->count; i++)
+    {
+      graphene_matrix_t m;
+      graphene_point3d_t c, p;
+      float r;
+
+      gthree_attribute_get_matrix (priv->instance_matrix, i, &m);
+      graphene_matrix_transform_point3d (&m, &center, &c);
+      r = radius * matrix_get_max_scale (&m);
+
+      graphene_box_expand (&box, graphene_point3d_init (&p, c.x - r, c.y - r, c.z - r), &box);
+      graphene_box_expand (&box, graphene_point3d_init (&p, c.x + r, c.y + r, c.z + r), &box);
+    }
+
+  if (priv->count > 0)
+    graphene_box_get_bounding_sphere (&box, &priv->bounding_sphere);
+  else
+    graphene_sphere_init (&priv->bounding_sphere, NULL, 0);
+
+  priv->bounding_sphere_dirty = FALSE;
+
+  return &priv->bounding_sphere;
+}
+
+/* Called when the bounds of the geometry changed */
+void
+gthree_instanced_mesh_invalidate_bounding_sphere (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  priv->bounding_sphere_dirty = TRUE;
+  gthree_object_invalidate_bounds (GTHREE_OBJECT (mesh));
+}
+
+static gboolean
+gthree_instanced_mesh_get_world_bounding_sphere (GthreeObject *object,
+                                                 graphene_sphere_t *sphere)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (object);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  if (priv->count == 0 || gthree_mesh_get_geometry (GTHREE_MESH (mesh)) == NULL)
+    return FALSE;
+
+  graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object),
+                                    gthree_instanced_mesh_get_bounding_sphere (mesh),
+                                    sphere);
+  return TRUE;
+}
+
+static gboolean
+gthree_instanced_mesh_in_frustum (GthreeObject *object,
+                                  const graphene_frustum_t *frustum)
+{
+  graphene_sphere_t sphere;
+
+  if (!gthree_instanced_mesh_get_world_bounding_sphere (object, &sphere))
+    return FALSE;
+
+  return graphene_frustum_intersects_sphere (frustum, &sphere);
+}
+
+static void
+gthree_instanced_mesh_raycast (GthreeObject *object,
+                               GthreeRaycaster *raycaster,
+                               GPtrArray *intersections)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (object);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+  const graphene_ray_t *world_ray;
+  graphene_matrix_t world_matrix;
+  graphene_sphere_t world_sphere;
+  graphene_point3d_t center;
+  int i, j;
+
+  if (priv->count == 0 || gthree_mesh_get_geometry (GTHREE_MESH (mesh)) == NULL)
+    return;
+
+  world_matrix = *gthree_object_get_world_matrix (object);
+  world_ray = gthree_raycaster_get_ray (raycaster);
+
+  // Reject the whole batch if the ray misses all the instances
+  graphene_matrix_transform_sphere (&world_matrix,
+                                    gthree_instanced_mesh_get_bounding_sphere (mesh),
+                                    &world_sphere);
+  graphene_sphere_get_center (&world_sphere, &center);
+  if (graphene_ray_get_distance_to_point (world_ray, &center) > graphene_sphere_get_radius (&world_sphere))
+    return;
+
+  /* Test each instance as a regular mesh placed with the instance transform,
+     without touching the world matrix of the object */
+  for (i = 0; i < priv->count; i++)
+    {
+      graphene_matrix_t instance_matrix, instance_world_matrix;
+      guint first = intersections->len;
+
+      gthree_attribute_get_matrix (priv->instance_matrix, i, &instance_matrix);
+      graphene_matrix_multiply (&instance_matrix, &world_matrix, &instance_world_matrix);
+
+      gthree_mesh_raycast_with_matrix (GTHREE_MESH (mesh), raycaster, &instance_world_matrix, intersections);
+
+      for (j = first; j < intersections->len; j++)
+        {
+          GthreeRayIntersection *intersection = g_ptr_array_index (intersections, j);
+          intersection->instance_id = i;
+        }
+    }
+}
+
+static void
+gthree_instanced_mesh_set_property (GObject *obj,
+                                    guint prop_id,
+                                    const GValue *value,
+                                    GParamSpec *pspec)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (obj);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  switch (prop_id)
+    {
+    case PROP_COUNT:
+      priv->max_count = g_value_get_int (value);
+      priv->count = priv->max_count;
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+    }
+}
+
+static void
+gthree_instanced_mesh_get_property (GObject *obj,
+                                    guint prop_id,
+                                    GValue *value,
+                                    GParamSpec *pspec)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (obj);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  switch (prop_id)
+    {
+    case PROP_COUNT:
+      g_value_set_int (value, priv->max_count);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+    }
+}
+
+static void
+gthree_instanced_mesh_class_init (GthreeInstancedMeshClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GthreeObjectClass *object_class = GTHREE_OBJECT_CLASS (klass);
+
+  gobject_class->set_property = gthree_instanced_mesh_set_property;
+  gobject_class->get_property = gthree_instanced_mesh_get_property;
+  gobject_class->constructed = gthree_instanced_mesh_constructed;
+  gobject_class->finalize = gthree_instanced_mesh_finalize;
+
+  object_class->in_frustum = gthree_instanced_mesh_in_frustum;
+  object_class->get_world_bounding_sphere = gthree_instanced_mesh_get_world_bounding_sphere;
+  object_class->update = gthree_instanced_mesh_update;
+  object_class->raycast = gthree_instanced_mesh_raycast;
+
+  obj_props[PROP_COUNT] =
+    g_param_spec_int ("count", "Count", "Number of allocated instances",
+                      0, G_MAXINT, 0,
+                      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (gobject_class, N_PROPS, obj_props);
+}
+
+int
+gthree_instanced_mesh_get_count (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->count;
+}
+
+/* Limits the number of drawn instances, up to the count given at construction */
+void
+gthree_instanced_mesh_set_count (GthreeInstancedMesh *mesh,
+                                 int                  count)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  count = CLAMP (count, 0, priv->max_count);
+  if (count == priv->count)
+    return;
+
+  priv->count = count;
+  priv->bounding_sphere_dirty = TRUE;
+  gthree_object_invalidate_bounds (GTHREE_OBJECT (mesh));
+}
+
+int
+gthree_instanced_mesh_get_max_count (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->max_count;
+}
+
+void
+gthree_instanced_mesh_set_matrix_at (GthreeInstancedMesh     *mesh,
+                                     int                      index,
+                                     const graphene_matrix_t *matrix)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  gthree_attribute_set_matrix (priv->instance_matrix, index, matrix);
+  gthree_attribute_set_needs_update (priv->instance_matrix);
+  priv->bounding_sphere_dirty = TRUE;
+  gthree_object_invalidate_bounds (GTHREE_OBJECT (mesh));
+}
+
+void
+gthree_instanced_mesh_get_matrix_at (GthreeInstancedMesh *mesh,
+                                     int                  index,
+                                     graphene_matrix_t   *matrix)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  gthree_attribute_get_matrix (priv->instance_matrix, index, matrix);
+}
+
+void
+gthree_instanced_mesh_set_color_at (GthreeInstancedMesh   *mesh,
+                                    int                    index,
+                                    const graphene_vec3_t *color)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  if (priv->instance_color == NULL)
+    {
+      int i;
+
+      priv->instance_color = gthree_attribute_new ("instanceColor", GTHREE_ATTRIBUTE_TYPE_FLOAT,
+                                                   priv->max_count, 3, FALSE);
+      gthree_attribute_set_mesh_per_attribute (priv->instance_color, 1);
+      gthree_attribute_set_dynamic (priv->instance_color, TRUE);
+
+      for (i = 0; i < priv->max_count; i++)
+        gthree_attribute_set_xyz (priv->instance_color, i, 1, 1, 1);
+    }
+
+  gthree_attribute_set_vec3 (priv->instance_color, index, color);
+  gthree_attribute_set_needs_update (priv->instance_color);
+}
+
+void
+gthree_instanced_mesh_get_color_at (GthreeInstancedMesh *mesh,
+                                    int                  index,
+                                    graphene_vec3_t     *color)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  if (priv->instance_color == NULL)
+    graphene_vec3_init (color, 1, 1, 1);
+  else
+    gthree_attribute_get_vec3 (priv->instance_color, index, color);
+}
+
+GthreeAttribute *
+gthree_instanced_mesh_get_instance_matrix (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->instance_matrix;
+}
+
+GthreeAttribute *
+gthree_instanced_mesh_get_instance_color (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->instance_color;
+}
+
+/* Call this after modifying the instance attributes directly */
+void
+gthree_instanced_mesh_set_needs_update (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  gthree_attribute_set_needs_update (priv->instance_matrix);
+  if (priv->instance_color)
+    gthree_attribute_set_needs_update (priv->instance_color);
+  priv->bounding_sphere_dirty = TRUE;
+  gthree_object_invalidate_bounds (GTHREE_OBJECT (mesh));
+}
@@ -5,19 +5,6 @@
 #include "gthreelight.h"
 #include "gthreeprivate.h"
 
-gboolean
-gthree_light_setup_hash_equal (GthreeLightSetupHash *a,
-                               GthreeLightSetupHash *b)
-{
-  return
-    a->num_directional == b->num_directional &&
-    a->num_point == b->num_point &&
-    a->num_spot == b->num_spot &&
-    a->num_shadow == b->num_shadow &&
-    a->obj_receive_shadow == b->obj_receive_shadow;
-}
-
-
 typedef struct {
   graphene_vec3_t color;
   float   intensity;
@@ -15,6 +15,8 @@ typedef struct {
   GthreeRenderTarget *map;
 
   graphene_matrix_t matrix;
+
+  GthreeLightShadowCache cache;
 } GthreeLightShadowPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeLightShadow, gthree_light_shadow, G_TYPE_OBJECT);
@@ -41,6 +43,7 @@ gthree_light_shadow_finalize (GObject *obj)
 
   g_clear_object (&priv->camera);
   g_clear_object (&priv->map);
+  g_clear_object (&priv->cache.static_map);
 
   G_OBJECT_CLASS (gthree_light_shadow_parent_class)->finalize (obj);
 }
@@ -127,6 +130,22 @@ gthree_light_shadow_set_map (GthreeLightShadow *shadow,
   g_set_object (&priv->map, map);
 }
 
+/* The texture the lights sample, which is the depth texture for maps
+   rendered for depth comparison */
+GthreeTexture *
+gthree_light_shadow_get_map_texture (GthreeLightShadow *shadow)
+{
+  GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
+
+  if (priv->map == NULL)
+    return NULL;
+
+  if (gthree_render_target_get_depth_texture (priv->map))
+    return gthree_render_target_get_depth_texture (priv->map);
+
+  return gthree_render_target_get_texture (priv->map);
+}
+
 graphene_matrix_t *
 gthree_light_shadow_get_matrix (GthreeLightShadow *shadow)
 {
@@ -168,3 +187,70 @@ gthree_light_shadow_set_radius (GthreeLightShadow *shadow,
 
   priv->radius = radius;
 }
+
+GthreeLightShadowCache *
+gthree_light_shadow_get_cache (GthreeLightShadow *shadow)
+{
+  GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
+
+  return &priv->cache;
+}
+
+/* The part of the map that this shadow uses, as offset and scale in
+ * texture coordinates. This is all of it unless the map is the shared
+ * shadow atlas. */
+void
+gthree_light_shadow_get_map_rect (GthreeLightShadow *shadow,
+                                  graphene_vec4_t   *rect)
+{
+  GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
+  int width, height;
+
+  if (priv->map == NULL || priv->cache.area[2] == 0 || priv->cache.area[3] == 0)
+    {
+      graphene_vec4_init (rect, 0, 0, 1, 1);
+      return;
+    }
+
+  width = gthree_render_target_get_width (priv->map);
+  height = gthree_render_target_get_height (priv->map);
+
+  graphene_vec4_init (rect,
+                      (float) priv->cache.area[0] / width,
+                      (float) priv->cache.area[1] / height,
+                      (float) priv->cache.area[2] / width,
+                      (float) priv->cache.area[3] / height);
+}
+
+/* The size of the texture that is sampled, which is larger than the
+ * configured map size for atlases and cascades */
+void
+gthree_light_shadow_get_map_size (GthreeLightShadow *shadow,
+                                  graphene_vec2_t   *size)
+{
+  GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
+
+  if (priv->map)
+    graphene_vec2_init (size,
+                        gthree_render_target_get_width (priv->map),
+                        gthree_render_target_get_height (priv->map));
+  else
+    graphene_vec2_init (size, priv->map_width, priv->map_height);
+}
+
+/**
+ * gthree_light_shadow_set_needs_update:
+ * @shadow: a #GthreeLightShadow
+ *
+ * Makes the renderer re-render this shadow map on the next frame when
+ * shadow map caching is enabled, for changes that it can't detect, like
+ * modifying a vertex attribute without calling
+ * gthree_attribute_set_needs_update().
+ */
+void
+gthree_light_shadow_set_needs_update (GthreeLightShadow *shadow)
+{
+  GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
+
+  priv->cache.valid = FALSE;
+}
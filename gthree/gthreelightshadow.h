@@ -54,6 +54,8 @@ float gthree_light_shadow_get_radius (GthreeLightShadow *shadow);
 GTHREE_API
 void gthree_light_shadow_set_radius (GthreeLightShadow *shadow,
                                      float radiuso);
+GTHREE_API
+void gthree_light_shadow_set_needs_update (GthreeLightShadow *shadow);
 
 
 G_END_DECLS
@@ -46,6 +46,8 @@ gthree_line_segments_finalize (GObject *obj)
   GthreeLineSegments *line_segments = GTHREE_LINE_SEGMENTS (obj);
   GthreeLineSegmentsPrivate *priv = gthree_line_segments_get_instance_private (line_segments);
 
+  if (priv->geometry)
+    gthree_geometry_remove_user (priv->geometry, GTHREE_OBJECT (obj));
   g_clear_object (&priv->geometry);
   g_clear_object (&priv->material);
 
@@ -75,6 +77,22 @@ gthree_line_segments_fill_render_list (GthreeObject   *object,
   gthree_geometry_fill_render_list (priv->geometry, list, priv->material, NULL, object);
 }
 
+static gboolean
+gthree_line_segments_get_world_bounding_sphere (GthreeObject *object,
+                                                graphene_sphere_t *sphere)
+{
+  GthreeLineSegments *line_segments = GTHREE_LINE_SEGMENTS (object);
+  GthreeLineSegmentsPrivate *priv = gthree_line_segments_get_instance_private (line_segments);
+
+  if (!priv->geometry)
+    return FALSE;
+
+  graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object),
+                                    gthree_geometry_get_bounding_sphere (priv->geometry),
+                                    sphere);
+  return TRUE;
+}
+
 static gboolean
 gthree_line_segments_in_frustum (GthreeObject *object,
                                  const graphene_frustum_t *frustum)
@@ -106,6 +124,8 @@ gthree_line_segments_set_property (GObject *obj,
     {
     case PROP_GEOMETRY:
       g_set_object (&priv->geometry, g_value_get_object (value));
+      if (priv->geometry)
+        gthree_geometry_add_user (priv->geometry, GTHREE_OBJECT (obj));
       break;
 
     case PROP_MATERIAL:
@@ -141,6 +161,14 @@ gthree_line_segments_get_property (GObject *obj,
     }
 }
 
+GthreeGeometry *
+gthree_line_segments_get_geometry (GthreeLineSegments *line_segments)
+{
+  GthreeLineSegmentsPrivate *priv = gthree_line_segments_get_instance_private (line_segments);
+
+  return priv->geometry;
+}
+
 static void
 gthree_line_segments_class_init (GthreeLineSegmentsClass *klass)
 {
@@ -152,6 +180,7 @@ gthree_line_segments_class_init (GthreeLineSegmentsClass *klass)
   gobject_class->finalize = gthree_line_segments_finalize;
 
   object_class->in_frustum = gthree_line_segments_in_frustum;
+  object_class->get_world_bounding_sphere = gthree_line_segments_get_world_bounding_sphere;
   object_class->update = gthree_line_segments_update;
   object_class->fill_render_list = gthree_line_segments_fill_render_list;
 
@@ -33,6 +33,8 @@ GType gthree_line_segments_get_type (void) G_GNUC_CONST;
 GTHREE_API
 GthreeLineSegments *gthree_line_segments_new (GthreeGeometry *geometry,
                                               GthreeMaterial *material);
+GTHREE_API
+GthreeGeometry *gthree_line_segments_get_geometry (GthreeLineSegments *line_segments);
 
 G_END_DECLS
 
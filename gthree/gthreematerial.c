@@ -72,6 +72,8 @@ gthree_material_clone (GthreeMaterial *material)
   return clone;
 }
 
+static guint next_material_id = 1;
+
 static void
 gthree_material_init (GthreeMaterial *material)
 {
@@ -96,7 +98,8 @@ gthree_material_init (GthreeMaterial *material)
   priv->alpha_test = 0;
   priv->side = GTHREE_SIDE_FRONT;
 
-  priv->properties.light_hash.num_point = -1; // Ensure we fill it once
+  priv->properties.key.light_hash.num_point = -1; // Ensure we fill it once
+  priv->properties.id = next_material_id++;
 }
 
 static void
@@ -106,6 +109,7 @@ gthree_material_finalize (GObject *obj)
   GthreeMaterialPrivate *priv = gthree_material_get_instance_private (material);
 
   g_clear_object (&priv->properties.program);
+  gthree_material_properties_clear_variants (&priv->properties);
 
   G_OBJECT_CLASS (gthree_material_parent_class)->finalize (obj);
 }
@@ -574,3 +578,18 @@ gthree_material_get_properties (GthreeMaterial  *material)
   GthreeMaterialPrivate *priv = gthree_material_get_instance_private (material);
   return &priv->properties;
 }
+
+void
+gthree_material_properties_clear_variants (GthreeMaterialProperties *properties)
+{
+  int i;
+
+  for (i = 0; i < properties->n_variants; i++)
+    {
+      g_clear_object (&properties->variants[i].program);
+      g_clear_pointer (&properties->variants[i].locations, g_array_unref);
+    }
+
+  properties->n_variants = 0;
+  properties->next_variant = 0;
+}
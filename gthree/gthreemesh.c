@@ -332,6 +332,8 @@ gthree_mesh_finalize (GObject *obj)
   GthreeMesh *mesh = GTHREE_MESH (obj);
   GthreeMeshPrivate *priv = gthree_mesh_get_instance_private (mesh);
 
+  if (priv->geometry)
+    gthree_geometry_remove_user (priv->geometry, GTHREE_OBJECT (obj));
   g_clear_object (&priv->geometry);
   g_ptr_array_unref (priv->materials);
 
@@ -433,6 +435,22 @@ gthree_mesh_fill_render_list (GthreeObject   *object,
   gthree_geometry_fill_render_list (priv->geometry, list, NULL, priv->materials, object);
 }
 
+static gboolean
+gthree_mesh_get_world_bounding_sphere (GthreeObject *object,
+                                       graphene_sphere_t *sphere)
+{
+  GthreeMesh *mesh = GTHREE_MESH (object);
+  GthreeMeshPrivate *priv = gthree_mesh_get_instance_private (mesh);
+
+  if (!priv->geometry)
+    return FALSE;
+
+  graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object),
+                                    gthree_geometry_get_bounding_sphere (priv->geometry),
+                                    sphere);
+  return TRUE;
+}
+
 static gboolean
 gthree_mesh_in_frustum (GthreeObject *object,
                         const graphene_frustum_t *frustum)
@@ -455,6 +473,7 @@ static GthreeRayIntersection *
 check_intersection (GthreeObject *object,
                     GthreeMaterial *material,
                     GthreeRaycaster *raycaster,
+                    const graphene_matrix_t *world_matrix,
                     const graphene_ray_t *local_ray,
                     const graphene_vec3_t *vA,
                     const graphene_vec3_t *vB,
@@ -491,7 +510,7 @@ check_intersection (GthreeObject *object,
 
   graphene_ray_get_position_at (local_ray, t, &local_intersection_point);
 
-  graphene_matrix_transform_point3d (gthree_object_get_world_matrix (object),
+  graphene_matrix_transform_point3d (world_matrix,
                                      &local_intersection_point, &world_intersection_point);
 
   graphene_ray_get_origin (gthree_raycaster_get_ray (raycaster), &world_origin);
@@ -514,6 +533,7 @@ static void
 do_geometry_intersection (GthreeObject *object,
                           GthreeMaterial *material,
                           GthreeRaycaster *raycaster,
+                          const graphene_matrix_t *world_matrix,
                           const graphene_ray_t *local_ray,
                           GthreeAttribute *position,
                           GPtrArray *morph_position,
@@ -577,7 +597,7 @@ do_geometry_intersection (GthreeObject *object,
       graphene_vec3_add (&vC, &morphC, &vC);
     }
 
-  intersection = check_intersection (object, material, raycaster, local_ray, &vA, &vB, &vC);
+  intersection = check_intersection (object, material, raycaster, world_matrix, local_ray, &vA, &vB, &vC);
   if (intersection)
     {
       intersection->face_index = face_index;
@@ -601,12 +621,15 @@ do_geometry_intersection (GthreeObject *object,
     }
 }
 
-static void
-gthree_mesh_raycast (GthreeObject *object,
-                     GthreeRaycaster *raycaster,
-                     GPtrArray *intersections)
+/* Intersects the geometry as if it was placed with world_matrix, rather
+   than the world matrix of the mesh, e.g. for one of its instances */
+void
+gthree_mesh_raycast_with_matrix (GthreeMesh *mesh,
+                                 GthreeRaycaster *raycaster,
+                                 const graphene_matrix_t *world_matrix,
+                                 GPtrArray *intersections)
 {
-  GthreeMesh *mesh = GTHREE_MESH (object);
+  GthreeObject *object = GTHREE_OBJECT (mesh);
   GthreeMeshPrivate *priv = gthree_mesh_get_instance_private (mesh);
   graphene_sphere_t world_sphere;
   const graphene_ray_t *world_ray;
@@ -624,7 +647,7 @@ gthree_mesh_raycast (GthreeObject *object,
 
   // Checking boundingSphere distance to ray
 
-  graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object),
+  graphene_matrix_transform_sphere (world_matrix,
                                     gthree_geometry_get_bounding_sphere (priv->geometry),
                                     &world_sphere);
 
@@ -632,7 +655,7 @@ gthree_mesh_raycast (GthreeObject *object,
   if (!ray_intersects_sphere (world_ray, &world_sphere))
     return;
 
-  graphene_matrix_inverse (gthree_object_get_world_matrix (object), &inverse_matrix);
+  graphene_matrix_inverse (world_matrix, &inverse_matrix);
   graphene_matrix_transform_ray (&inverse_matrix, world_ray, &local_ray);
 
   // Check boundingBox before continuing
@@ -677,7 +700,7 @@ gthree_mesh_raycast (GthreeObject *object,
                   int b = gthree_attribute_get_uint (index, j + 1);
                   int c = gthree_attribute_get_uint (index, j + 2);
 
-                  do_geometry_intersection (object, material, raycaster, &local_ray,
+                  do_geometry_intersection (object, material, raycaster, world_matrix, &local_ray,
                                             position, morph_position, uv, intersections,
                                             a, b, c, j / 3, i);
                 }
@@ -694,7 +717,7 @@ gthree_mesh_raycast (GthreeObject *object,
               int b = gthree_attribute_get_uint (index, j + 1);
               int c = gthree_attribute_get_uint (index, j + 2);
 
-              do_geometry_intersection (object, material, raycaster, &local_ray,
+              do_geometry_intersection (object, material, raycaster, world_matrix, &local_ray,
                                         position, morph_position, uv, intersections,
                                         a, b, c, j / 3, 0);
             }
@@ -720,7 +743,7 @@ gthree_mesh_raycast (GthreeObject *object,
                   int b = j + 1;
                   int c = j + 2;
 
-                  do_geometry_intersection (object, material, raycaster, &local_ray,
+                  do_geometry_intersection (object, material, raycaster, world_matrix, &local_ray,
                                             position, morph_position, uv, intersections,
                                             a, b, c, j / 3, i);
                 }
@@ -740,7 +763,7 @@ gthree_mesh_raycast (GthreeObject *object,
                   int b = j + 1;
                   int c = j + 2;
 
-                  do_geometry_intersection (object, material, raycaster, &local_ray,
+                  do_geometry_intersection (object, material, raycaster, world_matrix, &local_ray,
                                             position, morph_position, uv, intersections,
                                             a, b, c, j / 3, 0);
             }
@@ -748,6 +771,16 @@ gthree_mesh_raycast (GthreeObject *object,
     }
 }
 
+static void
+gthree_mesh_raycast (GthreeObject *object,
+                     GthreeRaycaster *raycaster,
+                     GPtrArray *intersections)
+{
+  gthree_mesh_raycast_with_matrix (GTHREE_MESH (object), raycaster,
+                                   gthree_object_get_world_matrix (object),
+                                   intersections);
+}
+
 static void
 gthree_mesh_set_property (GObject *obj,
                           guint prop_id,
@@ -761,6 +794,8 @@ gthree_mesh_set_property (GObject *obj,
     {
     case PROP_GEOMETRY:
       g_set_object (&priv->geometry, g_value_get_object (value));
+      if (priv->geometry)
+        gthree_geometry_add_user (priv->geometry, GTHREE_OBJECT (obj));
       break;
 
     case PROP_MATERIALS:
@@ -877,6 +912,7 @@ gthree_mesh_class_init (GthreeMeshClass *klass)
   gobject_class->finalize = gthree_mesh_finalize;
 
   object_class->in_frustum = gthree_mesh_in_frustum;
+  object_class->get_world_bounding_sphere = gthree_mesh_get_world_bounding_sphere;
   object_class->update = gthree_mesh_update;
   object_class->fill_render_list = gthree_mesh_fill_render_list;
   object_class->raycast = gthree_mesh_raycast;
@@ -10,6 +10,9 @@ typedef struct {
   float nearDistance;
   float farDistance;
 
+  /* Renders all faces of a layered cube map in one pass, see distanceRGBA_geom.glsl */
+  gboolean cube_layers;
+
   // TODO: Support displacement map and alpha map
 
 } GthreeMeshDistanceMaterialPrivate;
@@ -54,6 +57,11 @@ static void
 gthree_mesh_distance_material_real_set_params (GthreeMaterial *material,
                                                GthreeProgramParameters *params)
 {
+  GthreeMeshDistanceMaterial *distance = GTHREE_MESH_DISTANCE_MATERIAL (material);
+  GthreeMeshDistanceMaterialPrivate *priv = gthree_mesh_distance_material_get_instance_private (distance);
+
+  params->shadow_cube_layers = priv->cube_layers;
+
   GTHREE_MATERIAL_CLASS (gthree_mesh_distance_material_parent_class)->set_params (material, params);
 }
 
@@ -125,6 +133,15 @@ gthree_mesh_distance_material_set_far_distance   (GthreeMeshDistanceMaterial  *d
   priv->farDistance = far_distance;
 }
 
+void
+gthree_mesh_distance_material_set_cube_layers (GthreeMeshDistanceMaterial  *distance,
+                                               gboolean                     cube_layers)
+{
+  GthreeMeshDistanceMaterialPrivate *priv = gthree_mesh_distance_material_get_instance_private (distance);
+
+  priv->cube_layers = !!cube_layers;
+}
+
 static void
 gthree_mesh_distance_material_class_init (GthreeMeshDistanceMaterialClass *klass)
 {
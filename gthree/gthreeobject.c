@@ -1,8 +1,11 @@
 #include <math.h>
+#include <string.h>
 #include <epoxy/gl.h>
 
 #include "gthreeobjectprivate.h"
 #include "gthreemesh.h"
+#include "gthreegroup.h"
+#include "gthreeprivate.h"
 
 #include <graphene.h>
 
@@ -21,6 +24,10 @@ static GQuark q_normalMatrix;
 
 static guint object_signals[LAST_SIGNAL] = { 0, };
 
+/* World matrix versions are unique across objects, so a version also
+   identifies the object it was taken from */
+static guint last_world_matrix_version;
+
 typedef struct {
   char *name;
   char *uuid;
@@ -31,11 +38,27 @@ typedef struct {
   graphene_vec3_t scale;
   graphene_vec3_t up;
 
-  graphene_matrix_t matrix;
-  graphene_matrix_t world_matrix;
-
+  /* Point to own_matrix and own_world_matrix, or into the transforms
+     of the scene we're in */
+  graphene_matrix_t *matrix;
+  graphene_matrix_t *world_matrix;
+  graphene_matrix_t own_matrix;
+  graphene_matrix_t own_world_matrix;
+  GthreeTransforms *transforms;
+  int transform_index;
+  GthreeTransforms *root_transforms; /* Set if we are the root of the transforms */
+
+  guint world_matrix_version; /* Bumped whenever the world matrix changes */
+
+  /* Computed when first asked for, and kept while the camera matrix
+     and the world matrix stay the same */
+  graphene_matrix_t view_matrix;
   graphene_matrix_t model_view_matrix;
-  graphene_matrix_t normal_matrix;
+  float normal_matrix[9];
+  guint model_view_world_matrix_version;
+  guint view_matrix_set : 1;
+  guint model_view_valid : 1;
+  guint normal_matrix_valid : 1;
 
   gboolean visible;
   gboolean cast_shadow;
@@ -44,6 +67,17 @@ typedef struct {
 
   GthreeBeforeRenderCallback before_render_cb;
 
+  /* Set on meshes created by gthree_object_bake_static() */
+  GArray *baked_sources;
+
+  /* Not owned, the index of the scene we're in, if it has one */
+  GthreeSpatialIndex *spatial_index;
+  int spatial_index_leaf;
+
+  /* World bounds of this object and all its descendants, only valid
+     if subtree_bounds_valid. If a node is invalid so are its ancestors. */
+  graphene_box_t subtree_box;
+
   /* object graph */
   GthreeObject *parent;
   GthreeObject *prev_sibling;
@@ -53,6 +87,9 @@ typedef struct {
 
   gint n_children;
   gint age;
+  /* Only meaningful on the root, bumped when anything affecting what gets rendered
+     in the graph changes (children, visibility, layers, shadow casting) */
+  guint graph_age;
 
   guint realized : 1;
   guint in_destruction : 1;
@@ -62,6 +99,8 @@ typedef struct {
   guint matrix_need_update : 1;
 
   guint frustum_culled : 1;
+  guint subtree_bounds_valid : 1;
+  guint subtree_has_bounds : 1;
 } GthreeObjectPrivate;
 
 enum
@@ -85,12 +124,42 @@ G_DEFINE_TYPE_WITH_PRIVATE (GthreeObject, gthree_object, G_TYPE_OBJECT);
 
 #define PRIV(_o) ((GthreeObjectPrivate*)gthree_object_get_instance_private (_o))
 
+static void
+graph_changed (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  while (priv->parent != NULL)
+    priv = gthree_object_get_instance_private (priv->parent);
+
+  priv->graph_age++;
+}
+
+guint
+gthree_object_get_graph_age (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  while (priv->parent != NULL)
+    priv = gthree_object_get_instance_private (priv->parent);
+
+  return priv->graph_age;
+}
+
 static gboolean gthree_object_real_update_matrix_world (GthreeObject *object,
                                                         gboolean force);
 static void gthree_object_real_set_direct_uniforms  (GthreeObject *object,
                                                      GthreeProgram *program,
                                                      GthreeRenderer *renderer);
 
+/* Tells the transforms we're in that the world matrix needs to be updated */
+static void
+transform_changed (GthreeObjectPrivate *priv)
+{
+  if (priv->transforms)
+    gthree_transforms_mark_dirty (priv->transforms, priv->transform_index);
+}
+
 GthreeObject *
 gthree_object_new ()
 {
@@ -134,8 +203,11 @@ gthree_object_init (GthreeObject *object)
   priv->layer_mask = 1;
   priv->frustum_culled = TRUE;
 
-  graphene_matrix_init_identity (&priv->matrix);
-  graphene_matrix_init_identity (&priv->world_matrix);
+  priv->matrix = &priv->own_matrix;
+  priv->world_matrix = &priv->own_world_matrix;
+  priv->transform_index = -1;
+  graphene_matrix_init_identity (priv->matrix);
+  graphene_matrix_init_identity (priv->world_matrix);
   graphene_quaternion_init_identity (&priv->quaternion);
   graphene_vec3_init (&priv->scale, 1, 1, 1);
   graphene_vec3_init (&priv->up, 0, 1, 0);
@@ -181,6 +253,8 @@ gthree_object_finalize (GObject *obj)
 
   g_free (priv->uuid);
   g_free (priv->name);
+  if (priv->baked_sources)
+    g_array_unref (priv->baked_sources);
 
   G_OBJECT_CLASS (gthree_object_parent_class)->finalize (obj);
 }
@@ -375,6 +449,7 @@ gthree_object_set_visible (GthreeObject *object,
     return;
 
   priv->visible = visible;
+  graph_changed (object);
 
   g_object_notify_by_pspec (G_OBJECT (object), obj_props[PROP_VISIBLE]);
 }
@@ -397,6 +472,7 @@ gthree_object_set_cast_shadow (GthreeObject *object,
     return;
 
   priv->cast_shadow = cast_shadow;
+  graph_changed (object);
 }
 
 gboolean
@@ -446,6 +522,7 @@ gthree_object_set_layer (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->layer_mask = 1 << layer;
+  graph_changed (object);
 }
 
 void
@@ -455,6 +532,7 @@ gthree_object_enable_layer (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->layer_mask |= 1 << layer;
+  graph_changed (object);
 }
 
 void
@@ -464,6 +542,7 @@ gthree_object_disable_layer (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->layer_mask &= ~ (1 << layer);
+  graph_changed (object);
 }
 
 void
@@ -473,6 +552,7 @@ gthree_object_toggle_layer (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->layer_mask ^= ~ 1 << layer;
+  graph_changed (object);
 }
 
 gboolean
@@ -504,6 +584,99 @@ gthree_object_is_in_frustum (GthreeObject *object,
   return TRUE;
 }
 
+/**
+ * gthree_object_get_world_bounding_sphere:
+ * @object: a #GthreeObject
+ * @sphere: (out caller-allocates): return location for the sphere
+ *
+ * Gets a sphere around what @object draws, in world space, using the
+ * world matrix from the last update. Children are not included.
+ *
+ * Returns: %TRUE if @object has bounds, %FALSE if it draws nothing or
+ * its bounds are unknown
+ */
+gboolean
+gthree_object_get_world_bounding_sphere (GthreeObject      *object,
+                                         graphene_sphere_t *sphere)
+{
+  GthreeObjectClass *class = GTHREE_OBJECT_GET_CLASS(object);
+
+  if (class->get_world_bounding_sphere)
+    return class->get_world_bounding_sphere (object, sphere);
+
+  return FALSE;
+}
+
+/* Called when the world bounds of object may have changed, because it
+   moved or what it draws changed */
+void
+gthree_object_invalidate_bounds (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  if (priv->spatial_index)
+    gthree_spatial_index_mark_dirty (priv->spatial_index, priv->spatial_index_leaf);
+
+  for (; priv != NULL && priv->subtree_bounds_valid;
+       priv = priv->parent ? gthree_object_get_instance_private (priv->parent) : NULL)
+    priv->subtree_bounds_valid = FALSE;
+}
+
+/**
+ * gthree_object_get_subtree_bounding_box:
+ * @object: a #GthreeObject
+ * @box: (out caller-allocates): return location for the box
+ *
+ * Gets a box around what @object and all its descendants draw, in
+ * world space, using the world matrices from the last update. This is
+ * cached, and only recomputed for the parts of the graph that moved
+ * or whose geometry bounds changed.
+ *
+ * Returns: %TRUE if anything in the subtree has bounds
+ */
+gboolean
+gthree_object_get_subtree_bounding_box (GthreeObject   *object,
+                                        graphene_box_t *box)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  if (!priv->subtree_bounds_valid)
+    {
+      graphene_sphere_t sphere;
+      graphene_box_t child_box;
+      GthreeObject *child;
+      gboolean has_bounds = FALSE;
+
+      if (gthree_object_get_world_bounding_sphere (object, &sphere))
+        {
+          graphene_sphere_get_bounding_box (&sphere, &priv->subtree_box);
+          has_bounds = TRUE;
+        }
+
+      for (child = priv->first_child;
+           child != NULL;
+           child = PRIV (child)->next_sibling)
+        {
+          if (!gthree_object_get_subtree_bounding_box (child, &child_box))
+            continue;
+
+          if (has_bounds)
+            graphene_box_union (&priv->subtree_box, &child_box, &priv->subtree_box);
+          else
+            priv->subtree_box = child_box;
+          has_bounds = TRUE;
+        }
+
+      priv->subtree_has_bounds = has_bounds;
+      priv->subtree_bounds_valid = TRUE;
+    }
+
+  if (priv->subtree_has_bounds)
+    *box = priv->subtree_box;
+
+  return priv->subtree_has_bounds;
+}
+
 void
 gthree_object_raycast (GthreeObject                *object,
                        GthreeRaycaster             *raycaster,
@@ -544,6 +717,7 @@ gthree_object_look_at (GthreeObject *object,
   graphene_matrix_init_look_at (&m, &priv->position, &vec, &priv->up);
   graphene_quaternion_init_from_matrix (&priv->quaternion, &m);
   priv->matrix_need_update = TRUE;
+  transform_changed (priv);
   priv->euler_valid = FALSE;
 }
 
@@ -555,6 +729,7 @@ gthree_object_set_position (GthreeObject *object,
 
   priv->position = *vec;
   priv->matrix_need_update = TRUE;
+  transform_changed (priv);
 }
 
 void
@@ -584,6 +759,7 @@ gthree_object_translate_on_axis (GthreeObject                *object,
   graphene_vec3_scale (&rotated_axis, distance, &rotated_axis);
   graphene_vec3_add (&priv->position, &rotated_axis, &priv->position);
   priv->matrix_need_update = TRUE;
+  transform_changed (priv);
 }
 
 void
@@ -624,6 +800,7 @@ gthree_object_set_scale (GthreeObject             *object,
 
   priv->scale = *scale;
   priv->matrix_need_update = TRUE;
+  transform_changed (priv);
 }
 
 void
@@ -644,6 +821,7 @@ gthree_object_set_quaternion (GthreeObject *object,
   graphene_quaternion_init_from_quaternion (&priv->quaternion, q);
   priv->euler_valid = FALSE;
   priv->matrix_need_update = TRUE;
+  transform_changed (priv);
 }
 
 const graphene_quaternion_t *
@@ -664,6 +842,7 @@ gthree_object_set_rotation (GthreeObject *object,
   priv->euler_valid = TRUE;
   graphene_quaternion_init_from_euler (&priv->quaternion, rot);
   priv->matrix_need_update = TRUE;
+  transform_changed (priv);
 }
 
 const graphene_euler_t *
@@ -694,7 +873,7 @@ gthree_object_get_matrix (GthreeObject *object)
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  return &priv->matrix;
+  return priv->matrix;
 }
 
 static void
@@ -704,7 +883,7 @@ gthree_object_decompose_matrix (GthreeObject                *object)
   graphene_vec3_t shear;
   graphene_vec4_t perspective;
 
-  if (!graphene_matrix_decompose (&priv->matrix,
+  if (!graphene_matrix_decompose (priv->matrix,
                                   &priv->position,
                                   &priv->scale,
                                   &priv->quaternion,
@@ -712,7 +891,7 @@ gthree_object_decompose_matrix (GthreeObject                *object)
     {
       // If this fails, at least get the position
       graphene_vec4_t transl;
-      graphene_matrix_get_row (&priv->matrix, 3, &transl);
+      graphene_matrix_get_row (priv->matrix, 3, &transl);
       graphene_vec4_get_xyz (&transl, &priv->position);
     }
 }
@@ -724,11 +903,13 @@ gthree_object_set_matrix (GthreeObject                *object,
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  graphene_matrix_init_from_matrix  (&priv->matrix, matrix);
+  graphene_matrix_init_from_matrix  (priv->matrix, matrix);
 
   gthree_object_decompose_matrix (object);
 
   priv->world_matrix_need_update = TRUE;
+
+  transform_changed (priv);
   priv->matrix_need_update = FALSE;
 }
 
@@ -742,12 +923,14 @@ gthree_object_apply_matrix (GthreeObject                *object,
     gthree_object_update_matrix (object);
 
   graphene_matrix_multiply (matrix,
-                            &priv->matrix,
-                            &priv->matrix);
+                            priv->matrix,
+                            priv->matrix);
 
   gthree_object_decompose_matrix (object);
 
   priv->world_matrix_need_update = TRUE;
+
+  transform_changed (priv);
   priv->matrix_need_update = FALSE;
 }
 
@@ -760,24 +943,47 @@ gthree_object_update_matrix (GthreeObject *object)
   if (priv->matrix_need_update)
     {
       priv->matrix_need_update = FALSE;
-      graphene_matrix_init_scale (&priv->matrix,
+      graphene_matrix_init_scale (priv->matrix,
                                   graphene_vec3_get_x (&priv->scale),
                                   graphene_vec3_get_y (&priv->scale),
                                   graphene_vec3_get_z (&priv->scale));
-      graphene_matrix_rotate_quaternion (&priv->matrix, &priv->quaternion);
+      graphene_matrix_rotate_quaternion (priv->matrix, &priv->quaternion);
       graphene_point3d_init_from_vec3 (&pos, &priv->position);
-      graphene_matrix_translate  (&priv->matrix, &pos);
+      graphene_matrix_translate  (priv->matrix, &pos);
 
       priv->world_matrix_need_update = TRUE;
+
+      transform_changed (priv);
     }
 }
 
+void
+gthree_object_set_spatial_index (GthreeObject *object,
+                                 GthreeSpatialIndex *index,
+                                 int leaf)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  priv->spatial_index = index;
+  priv->spatial_index_leaf = leaf;
+}
+
+GthreeSpatialIndex *
+gthree_object_get_spatial_index (GthreeObject *object,
+                                 int *leaf)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  *leaf = priv->spatial_index_leaf;
+  return priv->spatial_index;
+}
+
 const graphene_matrix_t *
 gthree_object_get_world_matrix (GthreeObject *object)
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  return &priv->world_matrix;
+  return priv->world_matrix;
 }
 
 /* This is a bit special, it overrides the *world* matrix, which is
@@ -789,8 +995,11 @@ gthree_object_set_world_matrix (GthreeObject *object, const graphene_matrix_t *m
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  priv->world_matrix = *matrix;
+  *priv->world_matrix = *matrix;
   priv->world_matrix_need_update = FALSE;
+  priv->world_matrix_version = ++last_world_matrix_version;
+
+  gthree_object_invalidate_bounds (object);
 
   // TODO: decompose matrix into position, quat, scale
 }
@@ -807,14 +1016,17 @@ gthree_object_real_update_matrix_world (GthreeObject *object,
   if (priv->world_matrix_need_update || force)
     {
       if (priv->parent == NULL)
-        priv->world_matrix = priv->matrix;
+        *priv->world_matrix = *priv->matrix;
       else
-        graphene_matrix_multiply (&priv->matrix,
-                                  &PRIV (priv->parent)->world_matrix,
-                                  &priv->world_matrix);
+        graphene_matrix_multiply (priv->matrix,
+                                  PRIV (priv->parent)->world_matrix,
+                                  priv->world_matrix);
 
       priv->world_matrix_need_update = FALSE;
+      priv->world_matrix_version = ++last_world_matrix_version;
       force = TRUE;
+
+      gthree_object_invalidate_bounds (object);
     }
 
   return force;
@@ -828,6 +1040,12 @@ gthree_object_update_matrix_world (GthreeObject *object,
   GthreeObjectClass *class = GTHREE_OBJECT_GET_CLASS(object);
   GthreeObject *child;
 
+  if (priv->root_transforms)
+    {
+      gthree_transforms_update (priv->root_transforms, force);
+      return;
+    }
+
   force = class->update_matrix_world (object, force);
 
   for (child = priv->first_child;
@@ -837,16 +1055,136 @@ gthree_object_update_matrix_world (GthreeObject *object,
 }
 
 
+void
+gthree_object_set_root_transforms (GthreeObject *object,
+                                   GthreeTransforms *transforms)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  priv->root_transforms = transforms;
+}
+
+/* Points the matrices of object into the arrays of transforms, or back
+   to its own storage if transforms is NULL, keeping their values */
+void
+gthree_object_bind_transforms (GthreeObject *object,
+                               GthreeTransforms *transforms,
+                               int index,
+                               graphene_matrix_t *matrix,
+                               graphene_matrix_t *world_matrix)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  if (transforms == NULL)
+    {
+      matrix = &priv->own_matrix;
+      world_matrix = &priv->own_world_matrix;
+    }
+
+  if (matrix != priv->matrix)
+    *matrix = *priv->matrix;
+  if (world_matrix != priv->world_matrix)
+    *world_matrix = *priv->world_matrix;
+
+  priv->matrix = matrix;
+  priv->world_matrix = world_matrix;
+  priv->transforms = transforms;
+  priv->transform_index = index;
+}
+
+GthreeTransforms *
+gthree_object_get_transforms (GthreeObject *object,
+                              int *index)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  *index = priv->transform_index;
+  return priv->transforms;
+}
+
+gboolean
+gthree_object_has_custom_update_matrix_world (GthreeObject *object)
+{
+  return GTHREE_OBJECT_GET_CLASS (object)->update_matrix_world != gthree_object_real_update_matrix_world;
+}
+
+gboolean
+gthree_object_get_transform_need_update (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->matrix_need_update || priv->world_matrix_need_update;
+}
+
+/* The update_matrix_world() of just this object, without the children */
+gboolean
+gthree_object_update_matrix_world_node (GthreeObject *object,
+                                        gboolean force)
+{
+  return GTHREE_OBJECT_GET_CLASS (object)->update_matrix_world (object, force);
+}
+
+/* Brings the local matrix up to date, returns whether the world matrix
+   needs to be updated */
+gboolean
+gthree_object_prepare_world_matrix (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  if (priv->matrix_auto_update)
+    gthree_object_update_matrix (object);
+
+  return priv->world_matrix_need_update;
+}
+
+/* Called after the transforms wrote a new world matrix */
+void
+gthree_object_world_matrix_updated (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  priv->world_matrix_need_update = FALSE;
+  priv->world_matrix_version = ++last_world_matrix_version;
+  gthree_object_invalidate_bounds (object);
+}
+
+guint
+gthree_object_get_world_matrix_version (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->world_matrix_version;
+}
+
+/* This only records the camera matrix, the model view and normal
+   matrices are computed when they are used. Passes that use the same
+   camera again get the ones computed the first time. */
 void
 gthree_object_update_matrix_view (GthreeObject *object,
                                   const graphene_matrix_t *camera_matrix)
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  graphene_matrix_multiply (&priv->world_matrix, camera_matrix, &priv->model_view_matrix);
+  if (priv->view_matrix_set &&
+      memcmp (&priv->view_matrix, camera_matrix, sizeof (graphene_matrix_t)) == 0)
+    return;
 
-  graphene_matrix_inverse (&priv->model_view_matrix, &priv->normal_matrix);
-  graphene_matrix_transpose (&priv->normal_matrix, &priv->normal_matrix);
+  priv->view_matrix = *camera_matrix;
+  priv->view_matrix_set = TRUE;
+  priv->model_view_valid = FALSE;
+}
+
+static void
+ensure_model_view_matrix (GthreeObjectPrivate *priv)
+{
+  if (priv->model_view_valid &&
+      priv->model_view_world_matrix_version == priv->world_matrix_version)
+    return;
+
+  graphene_matrix_multiply (priv->world_matrix, &priv->view_matrix, &priv->model_view_matrix);
+  priv->model_view_world_matrix_version = priv->world_matrix_version;
+  priv->model_view_valid = TRUE;
+  priv->normal_matrix_valid = FALSE;
 }
 
 void
@@ -855,21 +1193,63 @@ gthree_object_get_model_view_matrix_floats (GthreeObject *object,
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
+  ensure_model_view_matrix (priv);
+
   graphene_matrix_to_float (&priv->model_view_matrix, dest);
 }
 
+/* The shaders only use the upper 3x3 of the inverse transpose of the
+   model view matrix, which is the cofactor matrix of its upper 3x3
+   over the determinant, so there is no need for a 4x4 inverse */
+static void
+ensure_normal_matrix (GthreeObjectPrivate *priv)
+{
+  float m[16], c[9], det;
+  int i;
+
+  ensure_model_view_matrix (priv);
+
+  if (priv->normal_matrix_valid)
+    return;
+
+  graphene_matrix_to_float (&priv->model_view_matrix, m);
+
+  c[0] = m[5] * m[10] - m[6] * m[9];
+  c[1] = m[6] * m[8] - m[4] * m[10];
+  c[2] = m[4] * m[9] - m[5] * m[8];
+  c[3] = m[2] * m[9] - m[1] * m[10];
+  c[4] = m[0] * m[10] - m[2] * m[8];
+  c[5] = m[1] * m[8] - m[0] * m[9];
+  c[6] = m[1] * m[6] - m[2] * m[5];
+  c[7] = m[2] * m[4] - m[0] * m[6];
+  c[8] = m[0] * m[5] - m[1] * m[4];
+
+  det = m[0] * c[0] + m[1] * c[1] + m[2] * c[2];
+
+  /* Scaled to nothing, so nothing to light either */
+  if (det == 0.f)
+    {
+      memset (priv->normal_matrix, 0, sizeof (priv->normal_matrix));
+      priv->normal_matrix[0] = priv->normal_matrix[4] = priv->normal_matrix[8] = 1;
+    }
+  else
+    {
+      for (i = 0; i < 9; i++)
+        priv->normal_matrix[i] = c[i] / det;
+    }
+
+  priv->normal_matrix_valid = TRUE;
+}
+
 void
 gthree_object_get_normal_matrix3_floats (GthreeObject *object,
                                          float *dest)
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
-  float dest4[16];
 
-  graphene_matrix_to_float (&priv->normal_matrix, dest4);
+  ensure_normal_matrix (priv);
 
-  dest[0] = dest4[0];  dest[1] = dest4[1]; dest[2] = dest4[2];
-  dest[3] = dest4[4];  dest[4] = dest4[5]; dest[5] = dest4[6];
-  dest[6] = dest4[8];  dest[7] = dest4[9]; dest[8] = dest4[10];
+  memcpy (dest, priv->normal_matrix, sizeof (priv->normal_matrix));
 }
 
 void
@@ -878,7 +1258,7 @@ gthree_object_get_world_matrix_floats (GthreeObject *object,
 {
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
-  graphene_matrix_to_float (&priv->world_matrix, dest);
+  graphene_matrix_to_float (priv->world_matrix, dest);
 }
 
 
@@ -938,6 +1318,8 @@ gthree_object_add_child (GthreeObject              *object,
   priv->n_children += 1;
 
   priv->age += 1;
+  graph_changed (object);
+  gthree_object_invalidate_bounds (object);
 
   g_signal_emit (child, object_signals[PARENT_SET], 0, NULL);
 
@@ -984,6 +1366,8 @@ gthree_object_remove_child (GthreeObject                 *object,
   priv->n_children -= 1;
 
   priv->age += 1;
+  graph_changed (object);
+  gthree_object_invalidate_bounds (object);
 
   g_signal_emit (child, object_signals[PARENT_SET], 0, object);
 
@@ -1112,8 +1496,11 @@ gthree_object_real_set_direct_uniforms  (GthreeObject *object,
   int nm_location = gthree_program_lookup_uniform_location (program, q_normalMatrix);
   int mm_location;
 
-  gthree_object_get_model_view_matrix_floats (object, matrix);
-  glUniformMatrix4fv (mvm_location, 1, FALSE, matrix);
+  if (mvm_location >= 0)
+    {
+      gthree_object_get_model_view_matrix_floats (object, matrix);
+      glUniformMatrix4fv (mvm_location, 1, FALSE, matrix);
+    }
 
   if (nm_location >= 0)
     {
@@ -1508,3 +1895,491 @@ gthree_object_get_mesh_extents (GthreeObject *object,
   graphene_box_init_from_box (box, graphene_box_empty ());
   _gthree_object_get_mesh_extents (object, box);
 }
+
+/* The faces of a baked mesh starting at first_face, up to the next
+   range, come from source */
+typedef struct {
+  int first_face;
+  GthreeObject *source;
+} GthreeBakedSource;
+
+static void
+baked_source_clear (GthreeBakedSource *baked)
+{
+  g_object_unref (baked->source);
+}
+
+typedef struct {
+  GPtrArray *meshes;
+  GPtrArray *materials;
+} GthreeBakeBucket;
+
+static void
+bake_bucket_free (GthreeBakeBucket *bucket)
+{
+  g_ptr_array_unref (bucket->meshes);
+  g_ptr_array_unref (bucket->materials);
+  g_free (bucket);
+}
+
+static gboolean
+attribute_is_vec3 (GthreeAttribute *attribute)
+{
+  return
+    attribute == NULL ||
+    (gthree_attribute_get_attribute_type (attribute) == GTHREE_ATTRIBUTE_TYPE_FLOAT &&
+     gthree_attribute_get_item_size (attribute) == 3);
+}
+
+static gboolean
+attribute_is_vec4 (GthreeAttribute *attribute)
+{
+  return
+    attribute == NULL ||
+    (gthree_attribute_get_attribute_type (attribute) == GTHREE_ATTRIBUTE_TYPE_FLOAT &&
+     gthree_attribute_get_item_size (attribute) == 4);
+}
+
+static gboolean
+can_bake_mesh (GthreeObject *object)
+{
+  GthreeMesh *mesh;
+  GthreeGeometry *geometry;
+
+  /* Subclasses like skinned and instanced meshes need their own object */
+  if (G_OBJECT_TYPE (object) != GTHREE_TYPE_MESH)
+    return FALSE;
+
+  mesh = GTHREE_MESH (object);
+  geometry = gthree_mesh_get_geometry (mesh);
+
+  return
+    PRIV (object)->n_children == 0 &&
+    PRIV (object)->visible &&
+    PRIV (object)->before_render_cb == NULL &&
+    geometry != NULL &&
+    gthree_mesh_get_n_materials (mesh) > 0 &&
+    gthree_mesh_get_draw_mode (mesh) == GTHREE_DRAW_MODE_TRIANGLES &&
+    !gthree_mesh_has_morph_targets (mesh) &&
+    gthree_geometry_get_position (geometry) != NULL &&
+    attribute_is_vec3 (gthree_geometry_get_position (geometry)) &&
+    attribute_is_vec3 (gthree_geometry_get_attribute (geometry, "normal")) &&
+    attribute_is_vec4 (gthree_geometry_get_attribute (geometry, "tangent"));
+}
+
+static void
+collect_bake_buckets (GthreeObject *object,
+                      GHashTable   *buckets)
+{
+  GthreeObjectIter iter;
+  GthreeObject *child;
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    {
+      g_autofree char *layout = NULL;
+      GthreeBakeBucket *bucket;
+      char *key;
+
+      if (!can_bake_mesh (child))
+        {
+          collect_bake_buckets (child, buckets);
+          continue;
+        }
+
+      layout = gthree_geometry_get_layout (gthree_mesh_get_geometry (GTHREE_MESH (child)));
+      if (layout == NULL)
+        continue;
+
+      /* Everything that is per object rather than per material must match */
+      key = g_strdup_printf ("%s|%d|%d|%u|%d", layout,
+                             PRIV (child)->cast_shadow,
+                             PRIV (child)->receive_shadow,
+                             PRIV (child)->layer_mask,
+                             PRIV (child)->frustum_culled);
+
+      bucket = g_hash_table_lookup (buckets, key);
+      if (bucket == NULL)
+        {
+          bucket = g_new0 (GthreeBakeBucket, 1);
+          bucket->meshes = g_ptr_array_new_with_free_func (g_object_unref);
+          bucket->materials = g_ptr_array_new_with_free_func (g_object_unref);
+          g_hash_table_insert (buckets, key, bucket);
+        }
+      else
+        g_free (key);
+
+      g_ptr_array_add (bucket->meshes, g_object_ref (child));
+    }
+}
+
+static int
+bake_bucket_add_material (GthreeBakeBucket *bucket,
+                          GthreeMaterial   *material)
+{
+  int i;
+
+  for (i = 0; i < bucket->materials->len; i++)
+    {
+      if (g_ptr_array_index (bucket->materials, i) == material)
+        return i;
+    }
+
+  g_ptr_array_add (bucket->materials, g_object_ref (material));
+  return bucket->materials->len - 1;
+}
+
+/* Appends the indexes of the parts of mesh that use material */
+static void
+bake_mesh_indexes (GthreeMesh      *mesh,
+                   GthreeMaterial  *material,
+                   int              base_vertex,
+                   gboolean         flip,
+                   GthreeAttribute *dest,
+                   int             *n_indexes)
+{
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (mesh);
+  GthreeAttribute *index = gthree_geometry_get_index (geometry);
+  int n_groups = gthree_geometry_get_n_groups (geometry);
+  int data_count, range_start, range_end;
+  int i, j;
+
+  data_count = index ? gthree_attribute_get_count (index) : gthree_geometry_get_position_count (geometry);
+
+  range_start = gthree_geometry_get_draw_range_start (geometry);
+  range_end = gthree_geometry_get_draw_range_count (geometry);
+  range_end = range_end < 0 ? data_count : MIN (data_count, range_start + range_end);
+
+  for (i = 0; i < MAX (n_groups, 1); i++)
+    {
+      int start = range_start, end = range_end;
+
+      if (n_groups > 0)
+        {
+          GthreeGeometryGroup *group = gthree_geometry_get_group (geometry, i);
+
+          if (group->material_index >= gthree_mesh_get_n_materials (mesh) ||
+              gthree_mesh_get_material (mesh, group->material_index) != material)
+            continue;
+
+          start = MAX (start, group->start);
+          end = MIN (end, group->start + group->count);
+        }
+      else if (gthree_mesh_get_material (mesh, 0) != material)
+        continue;
+
+      /* Only whole triangles */
+      end = start + MAX (0, end - start) / 3 * 3;
+
+      for (j = start; j < end; j++)
+        {
+          int k = j;
+
+          /* Mirroring transforms flip the winding */
+          if (flip && (j - start) % 3 != 0)
+            k = (j - start) % 3 == 1 ? j + 1 : j - 1;
+
+          gthree_attribute_set_uint (dest, (*n_indexes)++,
+                                     base_vertex + (index ? gthree_attribute_get_uint (index, k) : k));
+        }
+    }
+}
+
+static GthreeMesh *
+bake_bucket (GthreeObject     *root,
+             GthreeBakeBucket *bucket)
+{
+  GthreeObjectPrivate *root_priv = gthree_object_get_instance_private (root);
+  g_autoptr(GList) names = NULL;
+  g_autoptr(GthreeGeometry) geometry = NULL;
+  g_autoptr(GthreeAttribute) index = NULL;
+  g_autofree int *base_vertexes = NULL;
+  g_autofree gboolean *flips = NULL;
+  g_autofree graphene_matrix_t *matrices = NULL;
+  graphene_matrix_t root_inverse;
+  GthreeObjectPrivate *priv;
+  GthreeGeometry *first;
+  GthreeMesh *mesh;
+  GList *l;
+  int n_vertexes = 0, n_indexes = 0, n_faces = 0;
+  int i, j, m;
+
+  if (!graphene_matrix_inverse (root_priv->world_matrix, &root_inverse))
+    graphene_matrix_init_identity (&root_inverse);
+
+  base_vertexes = g_new (int, bucket->meshes->len);
+  flips = g_new (gboolean, bucket->meshes->len);
+  matrices = g_new (graphene_matrix_t, bucket->meshes->len);
+
+  for (i = 0; i < bucket->meshes->len; i++)
+    {
+      GthreeMesh *source = g_ptr_array_index (bucket->meshes, i);
+      GthreeGeometry *source_geometry = gthree_mesh_get_geometry (source);
+      GthreeAttribute *source_index = gthree_geometry_get_index (source_geometry);
+
+      for (j = 0; j < gthree_mesh_get_n_materials (source); j++)
+        {
+          GthreeMaterial *material = gthree_mesh_get_material (source, j);
+          if (material)
+            bake_bucket_add_material (bucket, material);
+        }
+
+      /* Vertices end up relative to root, which keeps the merged mesh movable */
+      graphene_matrix_multiply (PRIV (GTHREE_OBJECT (source))->world_matrix, &root_inverse, &matrices[i]);
+      flips[i] = graphene_matrix_determinant (&matrices[i]) < 0;
+
+      base_vertexes[i] = n_vertexes;
+      n_vertexes += gthree_geometry_get_position_count (source_geometry);
+      n_indexes += source_index ? gthree_attribute_get_count (source_index) : gthree_geometry_get_position_count (source_geometry);
+    }
+
+  first = gthree_mesh_get_geometry (g_ptr_array_index (bucket->meshes, 0));
+  geometry = gthree_geometry_new ();
+
+  names = gthree_geometry_get_attributes_names (first);
+  for (l = names; l != NULL; l = l->next)
+    {
+      const char *name = l->data;
+      GthreeAttribute *first_attribute = gthree_geometry_get_attribute (first, name);
+      g_autoptr(GthreeAttribute) attribute = NULL;
+
+      attribute = gthree_attribute_new (name,
+                                        gthree_attribute_get_attribute_type (first_attribute),
+                                        n_vertexes,
+                                        gthree_attribute_get_item_size (first_attribute),
+                                        gthree_attribute_get_normalized (first_attribute));
+
+      for (i = 0; i < bucket->meshes->len; i++)
+        {
+          GthreeGeometry *source_geometry = gthree_mesh_get_geometry (g_ptr_array_index (bucket->meshes, i));
+          GthreeAttribute *source = gthree_geometry_get_attribute (source_geometry, name);
+          int count = MIN (gthree_attribute_get_count (source), gthree_geometry_get_position_count (source_geometry));
+          graphene_matrix_t normal_matrix;
+
+          gthree_attribute_copy_at (attribute, base_vertexes[i], source, 0, count);
+
+          if (strcmp (name, "position") == 0)
+            {
+              for (j = 0; j < count; j++)
+                {
+                  graphene_point3d_t point;
+
+                  gthree_attribute_get_point3d (attribute, base_vertexes[i] + j, &point);
+                  graphene_matrix_transform_point3d (&matrices[i], &point, &point);
+                  gthree_attribute_set_point3d (attribute, base_vertexes[i] + j, &point);
+                }
+            }
+          else if (strcmp (name, "normal") == 0)
+            {
+              if (!graphene_matrix_inverse (&matrices[i], &normal_matrix))
+                graphene_matrix_init_identity (&normal_matrix);
+              graphene_matrix_transpose (&normal_matrix, &normal_matrix);
+
+              for (j = 0; j < count; j++)
+                {
+                  graphene_vec3_t normal;
+
+                  gthree_attribute_get_vec3 (attribute, base_vertexes[i] + j, &normal);
+                  graphene_matrix_transform_vec3 (&normal_matrix, &normal, &normal);
+                  graphene_vec3_normalize (&normal, &normal);
+                  gthree_attribute_set_vec3 (attribute, base_vertexes[i] + j, &normal);
+                }
+            }
+          else if (strcmp (name, "tangent") == 0)
+            {
+              /* Tangents follow the surface, so they use the model matrix
+                 itself. The sign in w is the handedness, which mirroring flips */
+              for (j = 0; j < count; j++)
+                {
+                  graphene_vec4_t tangent;
+                  graphene_vec3_t dir;
+                  float w;
+
+                  gthree_attribute_get_vec4 (attribute, base_vertexes[i] + j, &tangent);
+                  graphene_vec4_get_xyz (&tangent, &dir);
+                  w = graphene_vec4_get_w (&tangent);
+                  graphene_matrix_transform_vec3 (&matrices[i], &dir, &dir);
+                  graphene_vec3_normalize (&dir, &dir);
+                  graphene_vec4_init_from_vec3 (&tangent, &dir, flips[i] ? -w : w);
+                  gthree_attribute_set_vec4 (attribute, base_vertexes[i] + j, &tangent);
+                }
+            }
+        }
+
+      gthree_geometry_add_attribute (geometry, name, attribute);
+    }
+
+  index = gthree_attribute_new ("index",
+                                n_vertexes > 65535 ? GTHREE_ATTRIBUTE_TYPE_UINT32 : GTHREE_ATTRIBUTE_TYPE_UINT16,
+                                n_indexes, 1, FALSE);
+
+  mesh = gthree_mesh_new (geometry, NULL);
+  gthree_mesh_set_materials (mesh, bucket->materials);
+
+  priv = PRIV (GTHREE_OBJECT (mesh));
+  priv->baked_sources = g_array_new (FALSE, FALSE, sizeof (GthreeBakedSource));
+  g_array_set_clear_func (priv->baked_sources, (GDestroyNotify)baked_source_clear);
+
+  /* One group per material, so each material is still one draw */
+  n_indexes = 0;
+  for (m = 0; m < bucket->materials->len; m++)
+    {
+      int group_start = n_indexes;
+
+      for (i = 0; i < bucket->meshes->len; i++)
+        {
+          GthreeMesh *source = g_ptr_array_index (bucket->meshes, i);
+          GthreeBakedSource baked;
+
+          bake_mesh_indexes (source, g_ptr_array_index (bucket->materials, m),
+                             base_vertexes[i], flips[i], index, &n_indexes);
+
+          if (n_indexes / 3 == n_faces)
+            continue;
+
+          baked.first_face = n_faces;
+          baked.source = g_object_ref (GTHREE_OBJECT (source));
+          g_array_append_val (priv->baked_sources, baked);
+          n_faces = n_indexes / 3;
+        }
+
+      if (n_indexes > group_start)
+        gthree_geometry_add_group (geometry, group_start, n_indexes - group_start, m);
+    }
+
+  gthree_geometry_set_index (geometry, index);
+
+  priv->cast_shadow = PRIV (g_ptr_array_index (bucket->meshes, 0))->cast_shadow;
+  priv->receive_shadow = PRIV (g_ptr_array_index (bucket->meshes, 0))->receive_shadow;
+  priv->layer_mask = PRIV (g_ptr_array_index (bucket->meshes, 0))->layer_mask;
+  priv->frustum_culled = PRIV (g_ptr_array_index (bucket->meshes, 0))->frustum_culled;
+
+  return mesh;
+}
+
+/* Removes the plain groups below root that baking left without children */
+static void
+remove_empty_groups (GthreeObject *root,
+                     GthreeObject *object)
+{
+  while (object != NULL && object != root &&
+         G_OBJECT_TYPE (object) == GTHREE_TYPE_GROUP &&
+         PRIV (object)->n_children == 0)
+    {
+      GthreeObject *parent = PRIV (object)->parent;
+
+      if (parent == NULL)
+        break;
+
+      gthree_object_remove_child (parent, object);
+      object = parent;
+    }
+}
+
+/**
+ * gthree_object_bake_static:
+ * @root: a #GthreeObject
+ *
+ * Merges the meshes below @root that don't move relative to it into
+ * as few meshes as possible. Meshes with the same vertex layout are
+ * transformed into the coordinate system of @root and concatenated into
+ * one geometry, with a group for each material, so they are drawn with
+ * one call per material instead of one per mesh.
+ *
+ * The merged meshes are added as children of @root and the original
+ * meshes are removed from the tree, along with any #GthreeGroup that
+ * is left empty by that. Meshes that have children, custom
+ * render callbacks, morph targets or are of a subclass such as
+ * #GthreeSkinnedMesh are left alone. Use gthree_object_get_baked_source()
+ * to map raycast hits on the merged meshes back to the originals.
+ *
+ * This must be called again if any of the baked meshes change.
+ */
+void
+gthree_object_bake_static (GthreeObject *root)
+{
+  g_autoptr(GHashTable) buckets = NULL;
+  g_autoptr(GList) keys = NULL;
+  GList *l;
+  int i;
+
+  g_return_if_fail (GTHREE_IS_OBJECT (root));
+
+  gthree_object_update_matrix_world (root, FALSE);
+
+  buckets = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   g_free, (GDestroyNotify)bake_bucket_free);
+  collect_bake_buckets (root, buckets);
+
+  /* Sort for a stable child order */
+  keys = g_list_sort (g_hash_table_get_keys (buckets), (GCompareFunc)strcmp);
+  for (l = keys; l != NULL; l = l->next)
+    {
+      GthreeBakeBucket *bucket = g_hash_table_lookup (buckets, l->data);
+      g_autoptr(GthreeMesh) mesh = NULL;
+
+      /* Nothing to gain from a single mesh */
+      if (bucket->meshes->len < 2)
+        continue;
+
+      mesh = bake_bucket (root, bucket);
+
+      for (i = 0; i < bucket->meshes->len; i++)
+        {
+          GthreeObject *source = g_ptr_array_index (bucket->meshes, i);
+          GthreeObject *parent = PRIV (source)->parent;
+
+          gthree_object_remove_child (parent, source);
+          remove_empty_groups (root, parent);
+        }
+
+      gthree_object_add_child (root, GTHREE_OBJECT (mesh));
+    }
+}
+
+static int
+baked_source_compare (gconstpointer a,
+                      gconstpointer b)
+{
+  const GthreeBakedSource *baked_a = a;
+  const GthreeBakedSource *baked_b = b;
+
+  return baked_a->first_face - baked_b->first_face;
+}
+
+/**
+ * gthree_object_get_baked_source:
+ * @object: a mesh created by gthree_object_bake_static()
+ * @face_index: a face index, as in #GthreeRayIntersection
+ *
+ * Finds the mesh that a face of a baked mesh came from.
+ *
+ * Returns: (transfer none) (nullable): the original mesh, or %NULL
+ *   if @object is not a baked mesh.
+ */
+GthreeObject *
+gthree_object_get_baked_source (GthreeObject *object,
+                                int           face_index)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+  GthreeBakedSource key = { face_index, NULL };
+  int low, high;
+
+  if (priv->baked_sources == NULL || priv->baked_sources->len == 0 || face_index < 0)
+    return NULL;
+
+  /* Last range starting at or before face_index */
+  low = 0;
+  high = priv->baked_sources->len;
+  while (high - low > 1)
+    {
+      int mid = (low + high) / 2;
+
+      if (baked_source_compare (&g_array_index (priv->baked_sources, GthreeBakedSource, mid), &key) <= 0)
+        low = mid;
+      else
+        high = mid;
+    }
+
+  return g_array_index (priv->baked_sources, GthreeBakedSource, low).source;
+}
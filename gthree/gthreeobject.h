@@ -31,6 +31,9 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (GthreeObject, g_object_unref)
 typedef struct {
   GObjectClass parent_class;
 
+  /* Called from the renderer's worker threads when it has more than
+     one, see gthree_renderer_set_n_threads(). Must only read the object,
+     as must get_world_bounding_sphere. */
   gboolean (* in_frustum)       (GthreeObject             *object,
                                  const graphene_frustum_t *frustum);
 
@@ -51,8 +54,10 @@ typedef struct {
   void (* raycast)               (GthreeObject          *object,
                                   GthreeRaycaster       *raycaster,
                                   GPtrArray             *intersections);
+  gboolean (* get_world_bounding_sphere) (GthreeObject       *object,
+                                          graphene_sphere_t  *sphere);
 
-  gpointer padding[8];
+  gpointer padding[7];
 } GthreeObjectClass;
 
 GTHREE_API
@@ -207,6 +212,12 @@ GTHREE_API
 gboolean                     gthree_object_is_in_frustum                (GthreeObject                *object,
                                                                          const graphene_frustum_t    *frustum);
 GTHREE_API
+gboolean                     gthree_object_get_world_bounding_sphere    (GthreeObject                *object,
+                                                                         graphene_sphere_t           *sphere);
+GTHREE_API
+gboolean                     gthree_object_get_subtree_bounding_box     (GthreeObject                *object,
+                                                                         graphene_box_t              *box);
+GTHREE_API
 void                         gthree_object_add_child                    (GthreeObject                *object,
                                                                          GthreeObject                *child);
 GTHREE_API
@@ -237,6 +248,11 @@ GTHREE_API
 void                         gthree_object_get_mesh_extents             (GthreeObject                *object,
                                                                          graphene_box_t              *box);
 GTHREE_API
+void                         gthree_object_bake_static                  (GthreeObject                *root);
+GTHREE_API
+GthreeObject *               gthree_object_get_baked_source             (GthreeObject                *object,
+                                                                         int                          face_index);
+GTHREE_API
 void                         gthree_object_traverse                     (GthreeObject                *object,
                                                                          GthreeTraverseCallback       callback,
                                                                          gpointer                     user_data);
@@ -14,6 +14,8 @@ void       gthree_object_fill_render_list (GthreeObject   *object,
 void       gthree_object_call_before_render_callback (GthreeObject   *object,
                                                       GthreeScene    *scene,
                                                       GthreeCamera   *camera);
+guint      gthree_object_get_graph_age (GthreeObject   *object);
+void       gthree_object_invalidate_bounds (GthreeObject   *object);
 
 G_END_DECLS
 
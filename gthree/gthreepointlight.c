@@ -43,6 +43,7 @@ static float f0 = 0.0;
 static float f1 = 1.0;
 static float f1000 = 1000.0;
 static float zerov2[2] = { 0, 0 };
+static float unit_rect[4] = { 0, 0, 1, 1 };
 
 static GthreeUniformsDefinition light_uniforms[] = {
   {"position", GTHREE_UNIFORM_TYPE_VECTOR3, &zerov3},
@@ -53,6 +54,7 @@ static GthreeUniformsDefinition light_uniforms[] = {
   {"shadowBias", GTHREE_UNIFORM_TYPE_FLOAT, &f0 },
   {"shadowRadius", GTHREE_UNIFORM_TYPE_FLOAT, &f1 },
   {"shadowMapSize", GTHREE_UNIFORM_TYPE_VECTOR2, &zerov2 },
+  {"shadowMapRect", GTHREE_UNIFORM_TYPE_VECTOR4, &unit_rect },
   {"shadowCameraNear", GTHREE_UNIFORM_TYPE_FLOAT, &f1 },
   {"shadowCameraFar", GTHREE_UNIFORM_TYPE_FLOAT, &f1000 },
 };
@@ -117,6 +119,7 @@ gthree_point_light_real_setup (GthreeLight *light,
       GthreeLightShadow *shadow = gthree_light_get_shadow (light);
       GthreeCamera *shadow_camera = gthree_light_shadow_get_camera (shadow);
       graphene_vec2_t size;
+      graphene_vec4_t rect;
 
       gthree_uniforms_set_float (priv->uniforms, "shadowBias", gthree_light_shadow_get_bias (shadow));
       gthree_uniforms_set_float (priv->uniforms, "shadowRadius", gthree_light_shadow_get_radius (shadow));
@@ -126,18 +129,30 @@ gthree_point_light_real_setup (GthreeLight *light,
                           gthree_light_shadow_get_map_height (shadow));
       gthree_uniforms_set_vec2 (priv->uniforms, "shadowMapSize", &size);
 
+      /* The cube layout is packed as one block, so the face size stays */
+      gthree_light_shadow_get_map_rect (shadow, &rect);
+      gthree_uniforms_set_vec4 (priv->uniforms, "shadowMapRect", &rect);
+
       gthree_uniforms_set_float (priv->uniforms, "shadowCameraNear", gthree_camera_get_near (shadow_camera));
       gthree_uniforms_set_float (priv->uniforms, "shadowCameraFar", gthree_camera_get_far (shadow_camera));
 
-      GthreeRenderTarget *shadow_map = gthree_light_shadow_get_map (shadow);
-      if (shadow_map)
-        shadow_map_texture = gthree_render_target_get_texture (shadow_map);
+      shadow_map_texture = gthree_light_shadow_get_map_texture (shadow);
 
       shadow_matrix = *gthree_light_shadow_get_matrix (shadow);
     }
   else
     graphene_matrix_init_identity (&shadow_matrix);
 
+  {
+    GthreePointLightBlock block;
+
+    graphene_vec3_to_float (&light_pos3, block.position);
+    block.position[3] = priv->distance;
+    graphene_vec3_to_float (&color, block.color);
+    block.color[3] = priv->decay;
+    g_array_append_val (setup->point_data, block);
+  }
+
   g_ptr_array_add (setup->point, priv->uniforms);
   g_ptr_array_add (setup->point_shadow_map, shadow_map_texture);
   g_array_append_val (setup->point_shadow_map_matrix, shadow_matrix);
@@ -60,6 +60,8 @@ gthree_points_finalize (GObject *obj)
   GthreePoints *points = GTHREE_POINTS (obj);
   GthreePointsPrivate *priv = gthree_points_get_instance_private (points);
 
+  if (priv->geometry)
+    gthree_geometry_remove_user (priv->geometry, GTHREE_OBJECT (obj));
   g_clear_object (&priv->geometry);
   g_clear_object (&priv->material);
 
@@ -89,6 +91,22 @@ gthree_points_fill_render_list (GthreeObject   *object,
   gthree_geometry_fill_render_list (priv->geometry, list, priv->material, NULL, object);
 }
 
+static gboolean
+gthree_points_get_world_bounding_sphere (GthreeObject *object,
+                                         graphene_sphere_t *sphere)
+{
+  GthreePoints *points = GTHREE_POINTS (object);
+  GthreePointsPrivate *priv = gthree_points_get_instance_private (points);
+
+  if (!priv->geometry)
+    return FALSE;
+
+  graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object),
+                                    gthree_geometry_get_bounding_sphere (priv->geometry),
+                                    sphere);
+  return TRUE;
+}
+
 static gboolean
 gthree_points_in_frustum (GthreeObject *object,
                           const graphene_frustum_t *frustum)
@@ -120,6 +138,8 @@ gthree_points_set_property (GObject *obj,
     {
      case PROP_GEOMETRY:
       g_set_object (&priv->geometry, g_value_get_object (value));
+      if (priv->geometry)
+        gthree_geometry_add_user (priv->geometry, GTHREE_OBJECT (obj));
       break;
 
    case PROP_MATERIAL:
@@ -192,6 +212,7 @@ gthree_points_class_init (GthreePointsClass *klass)
   gobject_class->finalize = gthree_points_finalize;
 
   object_class->in_frustum = gthree_points_in_frustum;
+  object_class->get_world_bounding_sphere = gthree_points_get_world_bounding_sphere;
   object_class->update = gthree_points_update;
   object_class->fill_render_list = gthree_points_fill_render_list;
 
@@ -8,10 +8,13 @@
 #include <gthree/gthreekeyframetrack.h>
 #include <gthree/gthreerendertarget.h>
 #include <gthree/gthreemesh.h>
+#include <gthree/gthreeinstancedmesh.h>
 #include <gthree/gthreesprite.h>
 #include <gthree/gthreelightshadow.h>
 #include <gthree/gthreedirectionallightshadow.h>
 #include <gthree/gthreespotlightshadow.h>
+#include <gthree/gthreemeshdistancematerial.h>
+#include <gthree/gthreecubetexture.h>
 #include <json-glib/json-glib.h>
 
 //#define DEBUG_LABELS
@@ -23,9 +26,55 @@ typedef struct {
   guint8 num_point;
   guint8 num_spot;
   guint8 num_shadow;
+  guint8 num_cascaded; /* Directional shadows split into cascades */
   guint8 obj_receive_shadow;
 } GthreeLightSetupHash;
 
+/* Binding point of the GthreeLights uniform block, see shader_chunks/lights_pars_begin.glsl */
+#define GTHREE_LIGHTS_UNIFORMS_BINDING 1
+#define GTHREE_MAX_BLOCK_LIGHTS 16
+
+/* Froxel grid used for clustered point and spot lights */
+#define GTHREE_CLUSTERS_X 16
+#define GTHREE_CLUSTERS_Y 9
+#define GTHREE_CLUSTERS_Z 24
+#define GTHREE_CLUSTER_INDICES_WIDTH 1024
+
+/* Fixed texture units for the cluster textures, above the ones
+   materials get from gthree_renderer_allocate_texture_unit() */
+#define GTHREE_CLUSTER_LIGHTS_TEXTURE_UNIT 13
+#define GTHREE_CLUSTER_GRID_TEXTURE_UNIT 14
+#define GTHREE_CLUSTER_INDICES_TEXTURE_UNIT 15
+
+/* std140 layouts of the light structs in the GthreeLights block */
+typedef struct {
+  float direction[4];
+  float color[4];
+} GthreeDirectionalLightBlock;
+
+typedef struct {
+  float position[4]; /* w is distance */
+  float color[4]; /* w is decay */
+} GthreePointLightBlock;
+
+typedef struct {
+  float position[4]; /* w is distance */
+  float direction[4]; /* w is decay */
+  float color[4];
+  float cone[4]; /* x is coneCos, y is penumbraCos */
+} GthreeSpotLightBlock;
+
+typedef struct {
+  float ambient[4];
+  gint32 counts[4]; /* directional, point, spot */
+  float cluster_viewport[4]; /* x, y offset and 1 / width, 1 / height in pixels */
+  float cluster_depth[4]; /* Scale and bias from log (view depth) to slice */
+  gint32 cluster_size[4]; /* Clusters in x, y and z, number of point lights */
+  GthreeDirectionalLightBlock directional[GTHREE_MAX_BLOCK_LIGHTS];
+  GthreePointLightBlock point[GTHREE_MAX_BLOCK_LIGHTS];
+  GthreeSpotLightBlock spot[GTHREE_MAX_BLOCK_LIGHTS];
+} GthreeLightsUniforms;
+
 struct _GthreeLightSetup
 {
   graphene_vec3_t ambient;
@@ -42,14 +91,65 @@ struct _GthreeLightSetup
   GArray *spot_shadow_map_matrix;
   GPtrArray *shadow;
 
+  /* Per directional light, zero unless its shadow has cascades */
+  GArray *directional_cascade_splits; /* One vec4 of far view depths */
+  GArray *directional_cascade_scale; /* Matrices with a row per cascade */
+  GArray *directional_cascade_offset;
+
+  /* The same lights, packed for the uniform block or light clusters */
+  GArray *directional_data; /* GthreeDirectionalLightBlock */
+  GArray *point_data; /* GthreePointLightBlock */
+  GArray *spot_data; /* GthreeSpotLightBlock */
+
   GthreeLightSetupHash hash;
 };
 
+/* Binding point of the GthreeFrame uniform block, see shader_chunks/frame_pars.glsl */
+#define GTHREE_FRAME_UNIFORMS_BINDING 0
+/* Passed to the shaders as MAX_FRAME_CLIPPING_PLANES */
+#define GTHREE_MAX_FRAME_CLIPPING_PLANES 8
+
+/* Binding point of the GthreeCubeFaces uniform block, see shader_lib/distanceRGBA_geom.glsl */
+#define GTHREE_CUBE_FACES_UNIFORMS_BINDING 2
+
+/* Everything outside the material that selects its program. Compared
+   as raw memory, so clear it before filling it in. */
+typedef struct {
+  GthreeLightSetupHash light_hash;
+  guint8 light_block;
+  guint8 clustered_lights;
+  guint8 shadow_depth_compare;
+  guint8 shadow_point_cube;
+  guint8 instancing;
+  guint8 instancing_color;
+  guint8 num_clipping_planes;
+  guint16 max_bones;
+} GthreeMaterialVariantKey;
+
+typedef struct {
+  GthreeMaterialVariantKey key;
+  GthreeProgram *program;
+  int num_supported_morph_targets;
+  int num_supported_morph_normals;
+  GArray *locations; /* Uniform locations in program, saved by the shader */
+  guint locations_layout; /* The uniforms_layout they were saved for */
+} GthreeMaterialVariant;
+
+/* Materials shared by different kinds of objects switch between these
+   instead of re-initializing */
+#define GTHREE_MAX_MATERIAL_VARIANTS 4
+
 /* Keep track of what state the material is wired up for */
 struct _GthreeMaterialProperties
 {
+  guint id; /* Unique per material, used for state sorting */
   GthreeProgram *program;
-  GthreeLightSetupHash light_hash;
+  GthreeMaterialVariantKey key; /* What program was initialized for */
+  GthreeMaterialVariant variants[GTHREE_MAX_MATERIAL_VARIANTS];
+  int n_variants;
+  int next_variant; /* Replaced next when full */
+  GthreeLightSetupHash uniforms_light_hash; /* Light counts the uniforms are laid out for */
+  guint uniforms_layout; /* Bumped when uniforms are added or laid out differently */
 };
 
 struct  _GthreeProgramParameters {
@@ -79,6 +179,8 @@ struct  _GthreeProgramParameters {
   guint combine : 1;
   guint vertex_colors : 1;
   guint vertex_tangents : 1;
+  guint instancing : 1;
+  guint instancing_color : 1;
   guint fog : 1;
   guint use_fog : 1;
   guint fog_exp : 1;
@@ -94,6 +196,12 @@ struct  _GthreeProgramParameters {
   guint shadow_map_type : 2;
   guint tone_mapping : 1;
   guint physically_correct_lights : 1;
+  guint light_block : 1;
+  guint clustered_lights : 1;
+  guint shadow_cascades : 1;
+  guint shadow_depth_compare : 1;
+  guint shadow_point_cube : 1;
+  guint shadow_cube_layers : 1;
   guint double_sided : 1;
   guint flip_sided : 1;
   guint depth_packing : 2;
@@ -125,10 +233,14 @@ void gthree_render_list_push (GthreeRenderList *list,
                               GthreeGeometry *geometry,
                               GthreeMaterial *material,
                               GthreeGeometryGroup *group);
-void gthree_render_list_sort (GthreeRenderList *list);
+void gthree_render_list_sort (GthreeRenderList *list,
+                              GthreeOpaqueSort  opaque_sort,
+                              gboolean          statistics);
 
 
 guint gthree_renderer_allocate_texture_unit (GthreeRenderer *renderer);
+void  gthree_renderer_note_program_binary   (GthreeRenderer *renderer,
+                                            gboolean        hit);
 
 int gthree_texture_get_internal_gl_format (guint gl_format,
                                            guint gl_type);
@@ -154,6 +266,13 @@ void     gthree_texture_realize          (GthreeTexture *texture);
 void     gthree_texture_bind             (GthreeTexture *texture,
                                           int            slot,
                                           int            target);
+void     gthree_texture_set_compare      (GthreeTexture *texture,
+                                          gboolean       compare);
+gboolean gthree_texture_get_compare      (GthreeTexture *texture);
+void     gthree_texture_setup_cube_framebuffer (GthreeTexture *texture,
+                                                int            size,
+                                                guint          framebuffer,
+                                                int            attachment);
 void     gthree_texture_set_parameters (guint texture_type,
                                         GthreeTexture *texture,
                                         gboolean is_image_power_of_two);
@@ -161,18 +280,27 @@ void     gthree_texture_set_parameters (guint texture_type,
 guint gthree_render_target_get_gl_framebuffer (GthreeRenderTarget *target);
 void gthree_render_target_realize (GthreeRenderTarget *target);
 const graphene_rect_t * gthree_render_target_get_viewport (GthreeRenderTarget *target);
+gboolean gthree_render_target_get_color_buffer (GthreeRenderTarget *target);
+void gthree_render_target_set_color_buffer (GthreeRenderTarget *target,
+                                            gboolean            color_buffer);
 
 
 GthreeGeometry *gthree_geometry_parse_json (JsonObject *object);
 void gthree_geometry_update           (GthreeGeometry   *geometry);
+guint gthree_geometry_get_attributes_version (GthreeGeometry *geometry);
+GList *gthree_geometry_get_attributes_names (GthreeGeometry *geometry);
+char *gthree_geometry_get_layout (GthreeGeometry *geometry);
+guint gthree_geometry_get_id (GthreeGeometry *geometry);
+void gthree_geometry_add_user (GthreeGeometry *geometry,
+                               GthreeObject   *object);
+void gthree_geometry_remove_user (GthreeGeometry *geometry,
+                                  GthreeObject   *object);
 void gthree_geometry_fill_render_list (GthreeGeometry   *geometry,
                                        GthreeRenderList *list,
                                        GthreeMaterial   *material,
                                        GPtrArray        *materials,
                                        GthreeObject     *object);
 
-gboolean gthree_light_setup_hash_equal (GthreeLightSetupHash *a,
-                                        GthreeLightSetupHash *b);
 void gthree_light_set_shadow (GthreeLight   *light,
                               GthreeLightShadow *shadow);
 
@@ -189,15 +317,62 @@ void gthree_light_shadow_set_camera (GthreeLightShadow *shadow,
 GthreeRenderTarget * gthree_light_shadow_get_map (GthreeLightShadow *shadow);
 void gthree_light_shadow_set_map (GthreeLightShadow *shadow,
                                   GthreeRenderTarget *map);
+GthreeTexture * gthree_light_shadow_get_map_texture (GthreeLightShadow *shadow);
 graphene_matrix_t * gthree_light_shadow_get_matrix (GthreeLightShadow *shadow);
 
+/* What the shadow map was last rendered with, see render_shadow_map() */
+typedef struct {
+  gboolean valid;
+  guint64 static_signature; /* The light and the static casters it reaches */
+  gboolean has_dynamic; /* The map also has dynamic casters drawn into it */
+  GthreeRenderTarget *static_map; /* Only the static casters, used as a base for the dynamic ones */
+  int area[4]; /* x, y, width and height of the part of the map used */
+  gboolean shared; /* The map is the shadow atlas of the renderer */
+} GthreeLightShadowCache;
+
+GthreeLightShadowCache *gthree_light_shadow_get_cache (GthreeLightShadow *shadow);
+void gthree_light_shadow_get_map_rect (GthreeLightShadow *shadow,
+                                       graphene_vec4_t   *rect);
+void gthree_light_shadow_get_map_size (GthreeLightShadow *shadow,
+                                       graphene_vec2_t   *size);
+
 GthreeDirectionalLightShadow *gthree_directional_light_shadow_new (void);
 
+/* One slice of the view frustum, as last rendered into the shadow map */
+typedef struct {
+  gboolean valid;
+  guint updated_frame;
+  float split; /* Far view depth of the slice */
+  float scale[4]; /* Light space to shadow coordinates in the cascade tile */
+  float offset[4];
+} GthreeShadowCascade;
+
+typedef struct {
+  graphene_matrix_t light_view; /* World to light space, rotation only */
+  GthreeShadowCascade cascades[GTHREE_MAX_SHADOW_CASCADES];
+} GthreeShadowCascadeState;
+
+void gthree_directional_light_shadow_get_atlas_layout (GthreeDirectionalLightShadow *shadow,
+                                                       int                          *columns,
+                                                       int                          *rows);
+GthreeCamera *gthree_directional_light_shadow_get_cascade_camera (GthreeDirectionalLightShadow *shadow);
+GthreeShadowCascadeState *gthree_directional_light_shadow_get_cascade_state (GthreeDirectionalLightShadow *shadow);
+
 GthreeSpotLightShadow *gthree_spot_light_shadow_new (void);
 void gthree_spot_light_shadow_update (GthreeSpotLightShadow *shadow,
                                       GthreeSpotLight *light);
 
+void gthree_mesh_distance_material_set_cube_layers (GthreeMeshDistanceMaterial *distance,
+                                                    gboolean                    cube_layers);
+
+GthreeCubeTexture *gthree_cube_texture_new_empty (void);
+
 GthreeMaterialProperties *gthree_material_get_properties (GthreeMaterial  *material);
+void gthree_material_properties_clear_variants (GthreeMaterialProperties *properties);
+
+GArray * gthree_shader_save_uniform_locations    (GthreeShader *shader);
+gboolean gthree_shader_restore_uniform_locations (GthreeShader *shader,
+                                                  GArray       *locations);
 
 graphene_matrix_t *gthree_camera_get_projection_matrix_for_write (GthreeCamera *camera);
 
@@ -211,6 +386,8 @@ int gthree_attribute_get_gl_buffer            (GthreeAttribute *attribute);
 int gthree_attribute_get_gl_type              (GthreeAttribute *attribute);
 int gthree_attribute_get_gl_bytes_per_element (GthreeAttribute *attribute);
 
+int gthree_attribute_get_version (GthreeAttribute *attribute);
+
 GthreeInterpolant *gthree_interpolant_create (GType type,
                                               GthreeAttributeArray *parameter_positions,
                                               GthreeAttributeArray *sample_values);
@@ -279,6 +456,11 @@ void gthree_mesh_material_set_num_supported_morph_targets (GthreeMeshMaterial *m
 void gthree_mesh_material_set_num_supported_morph_normals (GthreeMeshMaterial *material,
                                                            int num_supported);
 
+void gthree_mesh_raycast_with_matrix (GthreeMesh              *mesh,
+                                      GthreeRaycaster         *raycaster,
+                                      const graphene_matrix_t *world_matrix,
+                                      GPtrArray               *intersections);
+
 
 typedef enum {
   GTHREE_RESOURCE_KIND_TEXTURE,
@@ -292,5 +474,66 @@ void gthree_resource_lazy_delete (GthreeResource *resource,
                                   guint           id);
 
 GthreeGeometry *gthree_sprite_get_geometry (GthreeSprite *sprite);
+void gthree_instanced_mesh_invalidate_bounding_sphere (GthreeInstancedMesh *mesh);
+
+typedef struct _GthreeSpatialIndex GthreeSpatialIndex;
+
+GthreeSpatialIndex *gthree_spatial_index_new                 (void);
+void                gthree_spatial_index_free                (GthreeSpatialIndex       *index);
+void                gthree_spatial_index_sync                (GthreeSpatialIndex       *index,
+                                                              GthreeObject             *root);
+void                gthree_spatial_index_remove              (GthreeSpatialIndex       *index,
+                                                              GthreeObject             *object);
+void                gthree_spatial_index_mark_dirty          (GthreeSpatialIndex       *index,
+                                                              int                       leaf);
+gboolean            gthree_spatial_index_is_indexed_type     (GthreeObject             *object);
+gboolean            gthree_spatial_index_get_bounding_sphere (GthreeSpatialIndex       *index,
+                                                              GthreeObject             *object,
+                                                              graphene_sphere_t        *sphere);
+void                gthree_spatial_index_query_frustum       (GthreeSpatialIndex       *index,
+                                                              const graphene_frustum_t *frustum,
+                                                              GPtrArray                *results);
+void                gthree_spatial_index_query_sphere        (GthreeSpatialIndex       *index,
+                                                              const graphene_sphere_t  *sphere,
+                                                              GPtrArray                *results);
+void                gthree_spatial_index_query_ray           (GthreeSpatialIndex       *index,
+                                                              const graphene_ray_t     *ray,
+                                                              float                     far,
+                                                              GPtrArray                *results);
+
+void                gthree_object_set_spatial_index          (GthreeObject             *object,
+                                                              GthreeSpatialIndex       *index,
+                                                              int                       leaf);
+GthreeSpatialIndex *gthree_object_get_spatial_index          (GthreeObject             *object,
+                                                              int                      *leaf);
+GthreeSpatialIndex *gthree_scene_update_spatial_index        (GthreeScene              *scene);
+
+typedef struct _GthreeTransforms GthreeTransforms;
+
+GthreeTransforms *gthree_transforms_new        (GthreeObject     *root);
+void              gthree_transforms_free       (GthreeTransforms *transforms);
+void              gthree_transforms_update     (GthreeTransforms *transforms,
+                                                gboolean          force);
+void              gthree_transforms_mark_dirty (GthreeTransforms *transforms,
+                                                int               index);
+void              gthree_transforms_remove     (GthreeTransforms *transforms,
+                                                int               index);
+
+void              gthree_object_set_root_transforms            (GthreeObject      *object,
+                                                                GthreeTransforms  *transforms);
+void              gthree_object_bind_transforms                (GthreeObject      *object,
+                                                                GthreeTransforms  *transforms,
+                                                                int                index,
+                                                                graphene_matrix_t *matrix,
+                                                                graphene_matrix_t *world_matrix);
+GthreeTransforms *gthree_object_get_transforms                 (GthreeObject      *object,
+                                                                int               *index);
+gboolean          gthree_object_has_custom_update_matrix_world (GthreeObject      *object);
+gboolean          gthree_object_get_transform_need_update      (GthreeObject      *object);
+gboolean          gthree_object_update_matrix_world_node       (GthreeObject      *object,
+                                                                gboolean           force);
+gboolean          gthree_object_prepare_world_matrix           (GthreeObject      *object);
+void              gthree_object_world_matrix_updated           (GthreeObject      *object);
+guint             gthree_object_get_world_matrix_version       (GthreeObject      *object);
 
 #endif /* __GTHREE_PRIVATE_H__ */
@@ -1,4 +1,5 @@
 #include <math.h>
+#include <errno.h>
 #include <epoxy/gl.h>
 
 #include "gthreeprogram.h"
@@ -12,6 +13,15 @@ typedef struct {
   GHashTable *attribute_locations;
 
   GLuint gl_program;
+  guint id;
+
+  /* Set until the link result has been checked, so drivers with
+     parallel compilation can work in the background */
+  gboolean link_pending;
+  GLuint gl_vertex_shader;
+  GLuint gl_geometry_shader;
+  GLuint gl_fragment_shader;
+  char *binary_path;
 
   /* Cache keys: */
   GthreeProgramCache *cache;
@@ -22,9 +32,33 @@ typedef struct {
 struct _GthreeProgramCache
 {
     GHashTable *hash;
+    GHashTable *sources; /* shader text -> GthreeSourceText */
+    GQueue sources_lru; /* GthreeSourceText, most recently used first */
 };
 
+/* The processed forms of one shader text, per set of counts */
+typedef struct {
+  char *text;
+  GHashTable *variants; /* counts -> GthreeSourceVariant */
+  GQueue variants_lru; /* GthreeSourceVariant, most recently used first */
+  GList link;
+} GthreeSourceText;
+
+typedef struct {
+  char *bounds;
+  char *processed;
+  GList link;
+} GthreeSourceVariant;
+
+/* Bounds for the processed shader texts kept by a cache, the least
+   recently used one is dropped when going over. An application
+   typically uses a handful of light and clipping plane counts, so this
+   is well above the working set. */
+#define MAX_CACHED_SOURCES 256
+#define MAX_CACHED_SOURCE_VARIANTS 64
+
 static void gthree_program_cache_remove (GthreeProgramCache *cache, GthreeProgram *program);
+static void finish_link (GthreeProgram *program);
 
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeProgram, gthree_program, G_TYPE_OBJECT);
 
@@ -57,11 +91,18 @@ GLuint
 create_shader (int type, const char *code)
 {
   GLuint shader = glCreateShader (type);
-  GLint status;
 
   glShaderSource (shader, 1, &code, NULL);
   glCompileShader (shader);
 
+  return shader;
+}
+
+static void
+check_shader (GLuint shader, int type)
+{
+  GLint status;
+
   glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
   if (status == GL_FALSE)
     {
@@ -78,8 +119,6 @@ create_shader (int type, const char *code)
 
       g_free (buffer);
     }
-
-  return shader;
 }
 
 static void
@@ -106,6 +145,8 @@ get_uniform_locations (GthreeProgram *program)
   GLint n, i, max_len;
   char *buffer;
 
+  finish_link (program);
+
   priv->uniform_locations = g_hash_table_new (g_direct_hash, g_direct_equal);
 
   glGetProgramiv (priv->gl_program,  GL_ACTIVE_UNIFORM_MAX_LENGTH,  &max_len);
@@ -133,18 +174,28 @@ string_replace (GString *string,
                 const gchar *find,
                 const gchar *replace)
 {
-  const gchar *at;
-  gssize pos;
+  gsize find_len = strlen (find);
+  const gchar *at, *start;
+  GString *res;
 
   at = strstr (string->str, find);
+  if (at == NULL)
+    return;
+
+  /* Build the result in one pass rather than moving the tail for each match */
+  res = g_string_sized_new (string->len);
+  start = string->str;
   while (at != NULL)
     {
-      pos = at - string->str;
-      g_string_erase (string, pos, strlen (find));
-      g_string_insert (string, pos, replace);
-
-      at = strstr (string->str, find);
+      g_string_append_len (res, start, at - start);
+      g_string_append (res, replace);
+      start = at + find_len;
+      at = strstr (start, find);
     }
+  g_string_append (res, start);
+
+  g_string_assign (string, res->str);
+  g_string_free (res, TRUE);
 }
 
 static void
@@ -203,18 +254,48 @@ unroll_replace_cb (const GMatchInfo *info,
 static char *
 unroll_loops (GString *str)
 {
-  g_autoptr(GRegex) regex = g_regex_new ("#pragma unroll_loop[\\s]+?for \\( int i \\= (\\d+)\\; i < (\\d+)\\; i \\+\\+ \\) \\{([\\s\\S]+?)(?=\\})\\}", 0, 0, NULL);
+  static GRegex *regex = NULL;
+
+  if (strstr (str->str, "#pragma unroll_loop") == NULL)
+    return g_strndup (str->str, str->len);
+
+  if (regex == NULL)
+    regex = g_regex_new ("#pragma unroll_loop[\\s]+?for \\( int i \\= (\\d+)\\; i < (\\d+)\\; i \\+\\+ \\) \\{([\\s\\S]+?)(?=\\})\\}", G_REGEX_OPTIMIZE, 0, NULL);
 
   return g_regex_replace_eval (regex, str->str, str->len, 0, 0, unroll_replace_cb, NULL, NULL);
 }
 
+/* Chunks are looked up once and kept for the lifetime of the process */
+static GBytes *
+lookup_chunk (const char *file)
+{
+  static GHashTable *chunks = NULL;
+  GBytes *bytes;
+
+  if (chunks == NULL)
+    chunks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_bytes_unref);
+
+  bytes = g_hash_table_lookup (chunks, file);
+  if (bytes == NULL)
+    {
+      g_autofree char *full_path = g_strconcat ("/org/gnome/gthree/shader_chunks/", file, ".glsl", NULL);
+
+      bytes = g_resources_lookup_data (full_path, 0, NULL);
+      if (bytes == NULL)
+        return NULL;
+
+      g_hash_table_insert (chunks, g_strdup (file), bytes);
+    }
+
+  return bytes;
+}
+
 static void
 parse_include (char *file,
                GString *s)
 {
   GBytes *bytes;
   char *end;
-  g_autofree char *full_path = NULL;
 
   while (*file != '<' && *file != 0)
     file++;
@@ -239,8 +320,7 @@ parse_include (char *file,
 
   *end = 0;
 
-  full_path = g_strconcat ("/org/gnome/gthree/shader_chunks/", file, ".glsl", NULL);
-  bytes = g_resources_lookup_data (full_path, 0, NULL);
+  bytes = lookup_chunk (file);
   if (bytes == NULL)
     {
       g_warning ("shader snipped %s not found", file);
@@ -252,7 +332,6 @@ parse_include (char *file,
                         g_bytes_get_data (bytes, NULL),
                         g_bytes_get_size (bytes));
   g_string_append_c (s, '\n');
-  g_bytes_unref (bytes);
 }
 
 static char *
@@ -262,6 +341,9 @@ parse_text_with_includes (const char *text)
   char **lines;
   int i;
 
+  if (strstr (text, "#include") == NULL)
+    return g_strdup (text);
+
   s = g_string_new ("");
 
   lines = g_strsplit (text, "\n", -1);
@@ -284,6 +366,116 @@ parse_text_with_includes (const char *text)
   return g_string_free (s, FALSE);
 }
 
+static char *
+process_source (const char *text,
+                GthreeProgramParameters *parameters)
+{
+  GString *s = g_string_new (text);
+  g_autofree char *unrolled = NULL;
+
+  replace_light_nums (s, parameters);
+  replace_clipping_plane_nums (s, parameters);
+  unrolled = unroll_loops (s);
+  g_string_free (s, TRUE);
+
+  return parse_text_with_includes (unrolled);
+}
+
+static void
+source_variant_free (GthreeSourceVariant *variant)
+{
+  g_free (variant->bounds);
+  g_free (variant->processed);
+  g_free (variant);
+}
+
+static void
+source_text_free (GthreeSourceText *source)
+{
+  g_hash_table_unref (source->variants);
+  g_free (source->text);
+  g_free (source);
+}
+
+/* Moves link to the front of lru, as the most recently used */
+static void
+touch_lru (GQueue *lru,
+           GList *link)
+{
+  g_queue_unlink (lru, link);
+  g_queue_push_head_link (lru, link);
+}
+
+/* Shader texts are shared by all the programs built from them, and only
+ * the light and clipping plane counts (which also are the loop bounds)
+ * change their processed form. So keep the result per text and counts
+ * in the program cache, if there is one. */
+static char *
+process_shader_source (GthreeProgramCache *cache,
+                       const char *text,
+                       GthreeProgramParameters *parameters)
+{
+  GthreeSourceText *source;
+  GthreeSourceVariant *variant;
+  g_autofree char *bounds = NULL;
+
+  if (cache == NULL)
+    return process_source (text, parameters);
+
+  source = g_hash_table_lookup (cache->sources, text);
+  if (source == NULL)
+    {
+      if (g_hash_table_size (cache->sources) >= MAX_CACHED_SOURCES)
+        {
+          GthreeSourceText *oldest = g_queue_peek_tail (&cache->sources_lru);
+
+          g_queue_unlink (&cache->sources_lru, &oldest->link);
+          g_hash_table_remove (cache->sources, oldest->text);
+        }
+
+      source = g_new0 (GthreeSourceText, 1);
+      source->text = g_strdup (text);
+      source->variants = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)source_variant_free);
+      source->link.data = source;
+      g_hash_table_insert (cache->sources, source->text, source);
+      g_queue_push_head_link (&cache->sources_lru, &source->link);
+    }
+  else
+    touch_lru (&cache->sources_lru, &source->link);
+
+  bounds = g_strdup_printf ("%d %d %d %d %d %d %d",
+                            parameters->num_dir_lights,
+                            parameters->num_spot_lights,
+                            parameters->num_rect_area_lights,
+                            parameters->num_point_lights,
+                            parameters->num_hemi_lights,
+                            parameters->num_clipping_planes,
+                            parameters->num_clip_intersection);
+
+  variant = g_hash_table_lookup (source->variants, bounds);
+  if (variant == NULL)
+    {
+      if (g_hash_table_size (source->variants) >= MAX_CACHED_SOURCE_VARIANTS)
+        {
+          GthreeSourceVariant *oldest = g_queue_peek_tail (&source->variants_lru);
+
+          g_queue_unlink (&source->variants_lru, &oldest->link);
+          g_hash_table_remove (source->variants, oldest->bounds);
+        }
+
+      variant = g_new0 (GthreeSourceVariant, 1);
+      variant->bounds = g_steal_pointer (&bounds);
+      variant->processed = process_source (text, parameters);
+      variant->link.data = variant;
+      g_hash_table_insert (source->variants, variant->bounds, variant);
+      g_queue_push_head_link (&source->variants_lru, &variant->link);
+    }
+  else
+    touch_lru (&source->variants_lru, &variant->link);
+
+  return g_strdup (variant->processed);
+}
+
 static void
 get_encoding_components (GthreeEncodingFormat encoding,
                          const char **type,
@@ -347,8 +539,248 @@ get_texel_encoding_function (GString *shader,
                           function_name, type, args);
 }
 
-GthreeProgram *
-gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, GthreeRenderer *renderer)
+#define PROGRAM_BINARY_MAGIC 0x47335042 /* "G3PB" */
+
+typedef struct {
+  guint32 magic;
+  guint32 format;
+} ProgramBinaryHeader;
+
+static gboolean
+program_binary_supported (void)
+{
+  static int supported = -1;
+
+  if (supported < 0)
+    {
+      GLint n_formats = 0;
+
+      supported = FALSE;
+      if (epoxy_gl_version () >= 41 ||
+          epoxy_has_gl_extension ("GL_ARB_get_program_binary"))
+        {
+          glGetIntegerv (GL_NUM_PROGRAM_BINARY_FORMATS, &n_formats);
+          supported = n_formats > 0;
+        }
+    }
+
+  return supported;
+}
+
+/* The key covers everything that can affect the binary: the final
+ * sources, the parameters they were generated from and the driver
+ * that produced it. */
+static char *
+program_binary_path (const char *cache_dir,
+                     const char *vertex_source,
+                     const char *geometry_source,
+                     const char *fragment_source,
+                     GthreeProgramParameters *parameters,
+                     const char *index0AttributeName)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *filename = NULL;
+  const char *driver[3];
+  int i;
+
+  driver[0] = (const char *)glGetString (GL_VENDOR);
+  driver[1] = (const char *)glGetString (GL_RENDERER);
+  driver[2] = (const char *)glGetString (GL_VERSION);
+
+  for (i = 0; i < G_N_ELEMENTS (driver); i++)
+    {
+      if (driver[i])
+        g_checksum_update (checksum, (const guchar *)driver[i], -1);
+      g_checksum_update (checksum, (const guchar *)"", 1);
+    }
+
+  g_checksum_update (checksum, (const guchar *)vertex_source, -1);
+  g_checksum_update (checksum, (const guchar *)"", 1);
+  if (geometry_source)
+    g_checksum_update (checksum, (const guchar *)geometry_source, -1);
+  g_checksum_update (checksum, (const guchar *)"", 1);
+  g_checksum_update (checksum, (const guchar *)fragment_source, -1);
+  g_checksum_update (checksum, (const guchar *)"", 1);
+  g_checksum_update (checksum, (const guchar *)parameters, sizeof (GthreeProgramParameters));
+  if (index0AttributeName)
+    g_checksum_update (checksum, (const guchar *)index0AttributeName, -1);
+
+  filename = g_strconcat (g_checksum_get_string (checksum), ".bin", NULL);
+  return g_build_filename (cache_dir, filename, NULL);
+}
+
+static gboolean
+load_program_binary (GLuint gl_program, const char *path)
+{
+  g_autofree char *contents = NULL;
+  ProgramBinaryHeader header;
+  gsize length;
+  GLint status;
+
+  if (!g_file_get_contents (path, &contents, &length, NULL))
+    return FALSE;
+
+  if (length <= sizeof (header))
+    return FALSE;
+
+  memcpy (&header, contents, sizeof (header));
+  if (header.magic != PROGRAM_BINARY_MAGIC)
+    return FALSE;
+
+  glProgramBinary (gl_program, header.format,
+                   contents + sizeof (header), length - sizeof (header));
+
+  /* A driver update or a different GPU makes the binary invalid, this
+   * is reported as a failed link rather than an error. */
+  glGetProgramiv (gl_program, GL_LINK_STATUS, &status);
+  return status == GL_TRUE;
+}
+
+static void
+save_program_binary (GLuint gl_program, const char *path)
+{
+  g_autofree char *contents = NULL;
+  g_autofree char *dir = NULL;
+  g_autoptr(GError) error = NULL;
+  ProgramBinaryHeader header;
+  GLint length = 0;
+  GLenum format;
+
+  glGetProgramiv (gl_program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+
+  contents = g_malloc (sizeof (header) + length);
+  glGetProgramBinary (gl_program, length, &length, &format, contents + sizeof (header));
+
+  header.magic = PROGRAM_BINARY_MAGIC;
+  header.format = format;
+  memcpy (contents, &header, sizeof (header));
+
+  dir = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dir, 0700) != 0 ||
+      !g_file_set_contents (path, contents, sizeof (header) + length, &error))
+    g_warning ("Failed to save program binary %s: %s", path,
+               error ? error->message : g_strerror (errno));
+}
+
+static gboolean
+parallel_compile_supported (void)
+{
+  static int supported = -1;
+
+  if (supported < 0)
+    supported =
+      epoxy_has_gl_extension ("GL_KHR_parallel_shader_compile") ||
+      epoxy_has_gl_extension ("GL_ARB_parallel_shader_compile");
+
+  return supported;
+}
+
+/* The cluster textures stay bound to fixed units for the whole frame,
+ * so the samplers only need to be pointed at them once. */
+static void
+set_cluster_samplers (GLuint gl_program)
+{
+  static const struct {
+    const char *name;
+    int unit;
+  } samplers[] = {
+    { "clusterLightData", GTHREE_CLUSTER_LIGHTS_TEXTURE_UNIT },
+    { "clusterGrid", GTHREE_CLUSTER_GRID_TEXTURE_UNIT },
+    { "clusterIndices", GTHREE_CLUSTER_INDICES_TEXTURE_UNIT },
+  };
+  GLint old_program;
+  int i;
+
+  glGetIntegerv (GL_CURRENT_PROGRAM, &old_program);
+  glUseProgram (gl_program);
+
+  for (i = 0; i < G_N_ELEMENTS (samplers); i++)
+    {
+      GLint location = glGetUniformLocation (gl_program, samplers[i].name);
+      if (location >= 0)
+        glUniform1i (location, samplers[i].unit);
+    }
+
+  glUseProgram (old_program);
+}
+
+/* Checks the result of the link started in gthree_program_new(). This
+ * waits for the driver if it is still compiling. */
+static void
+finish_link (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+  GLint status;
+
+  if (!priv->link_pending)
+    return;
+
+  priv->link_pending = FALSE;
+
+  glGetProgramiv (priv->gl_program, GL_LINK_STATUS, &status);
+  if (status == GL_FALSE)
+    {
+      GLint log_len;
+      char *buffer;
+
+      if (priv->gl_vertex_shader)
+        check_shader (priv->gl_vertex_shader, GL_VERTEX_SHADER);
+      if (priv->gl_geometry_shader)
+        check_shader (priv->gl_geometry_shader, GL_GEOMETRY_SHADER);
+      if (priv->gl_fragment_shader)
+        check_shader (priv->gl_fragment_shader, GL_FRAGMENT_SHADER);
+
+      glGetProgramiv (priv->gl_program, GL_INFO_LOG_LENGTH, &log_len);
+
+      buffer = g_malloc (log_len + 1);
+      glGetProgramInfoLog (priv->gl_program, log_len, NULL, buffer);
+      g_warning ("Linker failure: %s\n", buffer);
+      g_free (buffer);
+    }
+  else
+    {
+      GLuint frame_block, lights_block, cube_faces_block;
+
+      if (priv->binary_path)
+        save_program_binary (priv->gl_program, priv->binary_path);
+
+      frame_block = glGetUniformBlockIndex (priv->gl_program, "GthreeFrame");
+      if (frame_block != GL_INVALID_INDEX)
+        glUniformBlockBinding (priv->gl_program, frame_block, GTHREE_FRAME_UNIFORMS_BINDING);
+
+      lights_block = glGetUniformBlockIndex (priv->gl_program, "GthreeLights");
+      if (lights_block != GL_INVALID_INDEX)
+        glUniformBlockBinding (priv->gl_program, lights_block, GTHREE_LIGHTS_UNIFORMS_BINDING);
+
+      cube_faces_block = glGetUniformBlockIndex (priv->gl_program, "GthreeCubeFaces");
+      if (cube_faces_block != GL_INVALID_INDEX)
+        glUniformBlockBinding (priv->gl_program, cube_faces_block, GTHREE_CUBE_FACES_UNIFORMS_BINDING);
+
+      if (priv->params.clustered_lights)
+        set_cluster_samplers (priv->gl_program);
+    }
+
+  // clean up
+
+  if (priv->gl_vertex_shader)
+    glDeleteShader (priv->gl_vertex_shader);
+  if (priv->gl_geometry_shader)
+    glDeleteShader (priv->gl_geometry_shader);
+  if (priv->gl_fragment_shader)
+    glDeleteShader (priv->gl_fragment_shader);
+  priv->gl_vertex_shader = 0;
+  priv->gl_geometry_shader = 0;
+  priv->gl_fragment_shader = 0;
+  g_clear_pointer (&priv->binary_path, g_free);
+}
+
+static GthreeProgram *
+program_new (GthreeShader *shader,
+             GthreeProgramParameters *parameters,
+             GthreeRenderer *renderer,
+             GthreeProgramCache *cache)
 {
   GthreeProgram *program;
   GthreeProgramPrivate *priv;
@@ -362,13 +794,17 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
   float gamma_factor_define;
   GLuint gl_program;
   GString *vertex, *fragment;
-  g_autofree char *vertex_unrolled = NULL;
-  g_autofree char *fragment_unrolled = NULL;
+  g_autofree char *vertex_prefix = NULL;
+  g_autofree char *fragment_prefix = NULL;
   g_autofree char *vertex_expanded = NULL;
   g_autofree char *fragment_expanded = NULL;
+  g_autofree char *vertex_body = NULL;
+  g_autofree char *fragment_body = NULL;
+  g_autofree char *geometry_expanded = NULL;
   const char *shader_name;
-  GLuint glVertexShader, glFragmentShader;
-  GLint status;
+  GLuint glVertexShader, glGeometryShader = 0, glFragmentShader;
+  const char *cache_dir;
+  g_autofree char *binary_path = NULL;
   char formatd_buffer[G_ASCII_DTOSTR_BUF_SIZE];
 
   program = g_object_new (gthree_program_get_type (),
@@ -458,6 +894,7 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
   if (TRUE /*! material instanceof THREE.RawShaderMaterial */)
     {
       g_string_append (vertex, "#version 130\n");
+      g_string_append (vertex, "#extension GL_ARB_uniform_buffer_object : enable\n");
       g_string_append_printf (vertex, "precision %s float;\n", precision_to_string (parameters->precision));
       g_string_append_printf (vertex, "precision %s int;\n", precision_to_string (parameters->precision));
 
@@ -473,6 +910,7 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       g_string_append_printf (vertex, "#define GAMMA_FACTOR %s\n",
                               g_ascii_formatd (formatd_buffer, sizeof(formatd_buffer),
                                                "%f", gamma_factor_define));
+      g_string_append_printf (vertex, "#define MAX_FRAME_CLIPPING_PLANES %d\n", GTHREE_MAX_FRAME_CLIPPING_PLANES);
 
       g_string_append_printf (vertex,
                               "#define MAX_BONES %d\n",
@@ -515,6 +953,11 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       if (parameters->vertex_colors)
         g_string_append (vertex, "#define USE_COLOR\n");
 
+      if (parameters->instancing)
+        g_string_append (vertex, "#define USE_INSTANCING\n");
+      if (parameters->instancing_color)
+        g_string_append (vertex, "#define USE_INSTANCING_COLOR\n");
+
       if (parameters->flat_shading)
         g_string_append (vertex, "#define FLAT_SHADED\n");
 
@@ -538,6 +981,18 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
                                 "#define USE_SHADOWMAP\n"
                                 "#define %s\n",
                                 shadow_map_type_define);
+      if (parameters->shadow_cube_layers)
+        g_string_append (vertex, "#define SHADOWMAP_CUBE_LAYERS\n");
+      if (parameters->shadow_cascades)
+        g_string_append_printf (vertex,
+                                "#define USE_SHADOW_CASCADES\n"
+                                "#define MAX_SHADOW_CASCADES %d\n",
+                                GTHREE_MAX_SHADOW_CASCADES);
+
+      if (parameters->light_block)
+        g_string_append (vertex, "#define USE_LIGHT_BLOCK\n");
+      if (parameters->clustered_lights)
+        g_string_append (vertex, "#define USE_CLUSTERED_LIGHTS\n");
 
       if (parameters->size_attenuation)
         g_string_append (vertex, "#define USE_SIZEATTENUATION\n");
@@ -551,10 +1006,8 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
         g_string_append (vertex,
                          "uniform mat4 modelMatrix;\n"
                          "uniform mat4 modelViewMatrix;\n"
-                         "uniform mat4 projectionMatrix;\n"
-                         "uniform mat4 viewMatrix;\n"
                          "uniform mat3 normalMatrix;\n"
-                         "uniform vec3 cameraPosition;\n"
+                         "#include <frame_pars>\n"
 
                          "attribute vec3 position;\n"
                          "attribute vec3 normal;\n"
@@ -568,6 +1021,14 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
                          "	attribute vec3 color;\n"
                          "#endif\n"
 
+                         "#ifdef USE_INSTANCING\n"
+                         "	attribute mat4 instanceMatrix;\n"
+                         "#endif\n"
+
+                         "#ifdef USE_INSTANCING_COLOR\n"
+                         "	attribute vec3 instanceColor;\n"
+                         "#endif\n"
+
                          "#ifdef USE_MORPHTARGETS\n"
                          "	attribute vec3 morphTarget0;\n"
                          "	attribute vec3 morphTarget1;\n"
@@ -595,6 +1056,7 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       /* fragment shader prefix */
 
       g_string_append (fragment, "#version 130\n");
+      g_string_append (fragment, "#extension GL_ARB_uniform_buffer_object : enable\n");
       g_string_append_printf (fragment, "precision %s float;\n", precision_to_string (parameters->precision));
       g_string_append_printf (fragment, "precision %s int;\n", precision_to_string (parameters->precision));
 
@@ -614,6 +1076,7 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       g_string_append_printf (fragment, "#define GAMMA_FACTOR %s\n",
                               g_ascii_formatd (formatd_buffer, sizeof(formatd_buffer),
                                                "%f", gamma_factor_define));
+      g_string_append_printf (fragment, "#define MAX_FRAME_CLIPPING_PLANES %d\n", GTHREE_MAX_FRAME_CLIPPING_PLANES);
 
       if (parameters->map)
         g_string_append (fragment, "#define USE_MAP\n");
@@ -654,6 +1117,9 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       if (parameters->vertex_colors)
         g_string_append (fragment, "#define USE_COLOR\n");
 
+      if (parameters->instancing_color)
+        g_string_append (fragment, "#define USE_INSTANCING_COLOR\n");
+
       if (parameters->gradient_map)
         g_string_append (fragment, "#define USE_GRADIENTMAP\n");
 
@@ -670,6 +1136,17 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
                                 "#define USE_SHADOWMAP\n"
                                 "#define %s\n",
                                 shadow_map_type_define);
+      if (parameters->shadow_depth_compare)
+        g_string_append (fragment, "#define USE_SHADOWMAP_DEPTH_COMPARE\n");
+      if (parameters->shadow_point_cube)
+        g_string_append (fragment, "#define USE_SHADOWMAP_CUBE\n");
+      if (parameters->shadow_cube_layers)
+        g_string_append (fragment, "#define SHADOWMAP_CUBE_LAYERS\n");
+      if (parameters->shadow_cascades)
+        g_string_append_printf (fragment,
+                                "#define USE_SHADOW_CASCADES\n"
+                                "#define MAX_SHADOW_CASCADES %d\n",
+                                GTHREE_MAX_SHADOW_CASCADES);
 
       if (parameters->premultiplied_alpha)
         g_string_append (fragment, "#define PREMULTIPLIED_ALPHA\n");
@@ -677,6 +1154,11 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       if (parameters->physically_correct_lights)
         g_string_append (fragment, "#define PHYSICALLY_CORRECT_LIGHTS\n");
 
+      if (parameters->light_block)
+        g_string_append (fragment, "#define USE_LIGHT_BLOCK\n");
+      if (parameters->clustered_lights)
+        g_string_append (fragment, "#define USE_CLUSTERED_LIGHTS\n");
+
       if (parameters->logarithmic_depth_buffer)
         g_string_append (fragment, "#define USE_LOGDEPTHBUF\n");
 #if TODO
@@ -686,8 +1168,7 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
 #endif
 
         g_string_append (fragment,
-                         "uniform mat4 viewMatrix;\n"
-                         "uniform vec3 cameraPosition;\n");
+                         "#include <frame_pars>\n");
 #if TODO
       // ( parameters.toneMapping !== NoToneMapping ) ? '#define TONE_MAPPING' : '',
       // ( parameters.toneMapping !== NoToneMapping ) ? ShaderChunk[ 'tonemapping_pars_fragment' ] : '', // this code is required here because it is used by the toneMapping() function defined below
@@ -716,19 +1197,28 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
         }
   }
 
-  g_string_append (vertex, vertex_shader);
-  replace_light_nums (vertex, parameters);
-  replace_clipping_plane_nums (vertex, parameters);
+  /* The prefix depends on all the parameters and is short, so it is
+     processed each time, while the shader body comes from the cache */
+  vertex_prefix = process_source (vertex->str, parameters);
+  fragment_prefix = process_source (fragment->str, parameters);
 
-  g_string_append (fragment, fragment_shader);
-  replace_light_nums (fragment, parameters);
-  replace_clipping_plane_nums (fragment, parameters);
+  vertex_body = process_shader_source (cache, vertex_shader, parameters);
+  fragment_body = process_shader_source (cache, fragment_shader, parameters);
 
-  vertex_unrolled = unroll_loops (vertex);
-  fragment_unrolled = unroll_loops (fragment);
+  vertex_expanded = g_strconcat (vertex_prefix, vertex_body, NULL);
+  fragment_expanded = g_strconcat (fragment_prefix, fragment_body, NULL);
 
-  vertex_expanded = parse_text_with_includes (vertex_unrolled);
-  fragment_expanded = parse_text_with_includes (fragment_unrolled);
+  /* Geometry shaders need a newer GLSL than the other stages, which is
+     fine as it doesn't use any of the shader chunks */
+  if (parameters->shadow_cube_layers)
+    {
+      g_autoptr(GBytes) bytes = g_resources_lookup_data ("/org/gnome/gthree/shader_lib/distanceRGBA_geom.glsl", 0, NULL);
+
+      g_assert (bytes != NULL);
+      geometry_expanded = g_strdup_printf ("#version 150\n%.*s",
+                                           (int) g_bytes_get_size (bytes),
+                                           (const char *) g_bytes_get_data (bytes, NULL));
+    }
 
   if (0)
     {
@@ -738,15 +1228,44 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
                fragment_expanded);
     }
 
-  glVertexShader = create_shader (GL_VERTEX_SHADER, vertex_expanded);
-  glFragmentShader = create_shader (GL_FRAGMENT_SHADER, fragment_expanded);
-
   g_string_free (vertex, TRUE);
   g_string_free (fragment, TRUE);
 
+#ifdef DEBUG_LABELS
+  if (shader_name)
+    glObjectLabel (GL_PROGRAM, gl_program, strlen (shader_name), shader_name);
+#endif
+
+  priv->gl_program = gl_program;
+  priv->link_pending = TRUE;
+
+  cache_dir = gthree_renderer_get_program_cache_dir (renderer);
+  if (cache_dir != NULL && program_binary_supported ())
+    {
+      binary_path = program_binary_path (cache_dir, vertex_expanded, geometry_expanded, fragment_expanded,
+                                         parameters, index0AttributeName);
+      if (load_program_binary (gl_program, binary_path))
+        {
+          gthree_renderer_note_program_binary (renderer, TRUE);
+          return program;
+        }
+
+      gthree_renderer_note_program_binary (renderer, FALSE);
+      glProgramParameteri (gl_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+  glVertexShader = create_shader (GL_VERTEX_SHADER, vertex_expanded);
+  glFragmentShader = create_shader (GL_FRAGMENT_SHADER, fragment_expanded);
+
   glAttachShader (gl_program, glVertexShader);
   glAttachShader (gl_program, glFragmentShader);
 
+  if (geometry_expanded)
+    {
+      glGeometryShader = create_shader (GL_GEOMETRY_SHADER, geometry_expanded);
+      glAttachShader (gl_program, glGeometryShader);
+    }
+
 #ifdef DEBUG_LABELS
   if (shader_name)
     {
@@ -754,7 +1273,6 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       g_autofree char *flabel = g_strdup_printf ("%s.frag", shader_name);
       glObjectLabel (GL_SHADER, glVertexShader, strlen (vlabel), vlabel);
       glObjectLabel (GL_SHADER, glFragmentShader, strlen (flabel), flabel);
-      glObjectLabel (GL_PROGRAM, gl_program, strlen (shader_name), shader_name);
     }
 #endif
 
@@ -769,34 +1287,37 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
 
   glLinkProgram (gl_program);
 
-  glGetProgramiv (gl_program, GL_LINK_STATUS, &status);
-  if (status == GL_FALSE)
-    {
-      GLint log_len;
-      char *buffer;
-
-      glGetProgramiv (gl_program, GL_INFO_LOG_LENGTH, &log_len);
-
-      buffer = g_malloc (log_len + 1);
-      glGetProgramInfoLog (gl_program, log_len, NULL, buffer);
-      g_warning ("Linker failure: %s\n", buffer);
-      g_free (buffer);
-    }
-
-  // clean up
-
-  glDeleteShader (glVertexShader);
-  glDeleteShader (glFragmentShader);
-
-  priv->gl_program = gl_program;
+  /* Don't ask for the link status here, that would wait for the
+     compile to finish. It is checked by finish_link() on first use. */
+  priv->gl_vertex_shader = glVertexShader;
+  priv->gl_geometry_shader = glGeometryShader;
+  priv->gl_fragment_shader = glFragmentShader;
+  priv->binary_path = g_steal_pointer (&binary_path);
 
   return program;
 }
 
+GthreeProgram *
+gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, GthreeRenderer *renderer)
+{
+  return program_new (shader, parameters, renderer, NULL);
+}
+
 static void
 gthree_program_init (GthreeProgram *program)
 {
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+  static guint next_id = 1;
+
+  priv->id = next_id++;
+}
+
+guint
+gthree_program_get_id (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
 
+  return priv->id;
 }
 
 static void
@@ -805,6 +1326,14 @@ gthree_program_finalize (GObject *obj)
   GthreeProgram *program = GTHREE_PROGRAM (obj);
   GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
 
+  if (priv->gl_vertex_shader)
+    glDeleteShader (priv->gl_vertex_shader);
+  if (priv->gl_geometry_shader)
+    glDeleteShader (priv->gl_geometry_shader);
+  if (priv->gl_fragment_shader)
+    glDeleteShader (priv->gl_fragment_shader);
+  g_free (priv->binary_path);
+
   if (priv->gl_program)
     {
       glDeleteProgram (priv->gl_program);
@@ -833,9 +1362,31 @@ gthree_program_use (GthreeProgram *program)
 {
   GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
 
+  finish_link (program);
   glUseProgram (priv->gl_program);
 }
 
+/* Returns FALSE while the driver is still compiling the program in the
+ * background. Without KHR_parallel_shader_compile this can't be queried,
+ * so it waits for the compile and returns TRUE. */
+gboolean
+gthree_program_is_ready (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  if (priv->link_pending && parallel_compile_supported ())
+    {
+      GLint completed = GL_FALSE;
+
+      glGetProgramiv (priv->gl_program, GL_COMPLETION_STATUS_KHR, &completed);
+      if (!completed)
+        return FALSE;
+    }
+
+  finish_link (program);
+  return TRUE;
+}
+
 gint
 gthree_program_lookup_uniform_location (GthreeProgram *program,
                                         GQuark uniform)
@@ -890,6 +1441,8 @@ gthree_program_get_attribute_locations (GthreeProgram *program)
       GLint n, i, max_len;
       char *buffer;
 
+      finish_link (program);
+
       priv->attribute_locations = g_hash_table_new (g_direct_hash, g_direct_equal);
 
       glGetProgramiv (priv->gl_program,  GL_ACTIVE_ATTRIBUTE_MAX_LENGTH,  &max_len);
@@ -954,6 +1507,7 @@ gthree_program_cache_new (void)
   cache = g_new0 (GthreeProgramCache, 1);
 
   cache->hash = g_hash_table_new ((GHashFunc)gthree_program_priv_hash, (GEqualFunc)gthree_program_priv_equal);
+  cache->sources = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)source_text_free);
 
   return cache;
 }
@@ -980,7 +1534,7 @@ gthree_program_cache_get (GthreeProgramCache *cache, GthreeShader *shader, Gthre
   if (program)
     return g_object_ref (program);
 
-  program = gthree_program_new (shader, parameters, renderer);
+  program = program_new (shader, parameters, renderer, cache);
   priv = gthree_program_get_instance_private (program);
   priv->cache = cache;
 
@@ -1006,5 +1560,6 @@ gthree_program_cache_free (GthreeProgramCache *cache)
     }
 
   g_hash_table_destroy (cache->hash);
+  g_hash_table_destroy (cache->sources);
   g_free (cache);
 }
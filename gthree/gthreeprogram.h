@@ -38,6 +38,10 @@ GthreeProgram *gthree_program_new (GthreeShader *shader,
 GTHREE_API
 void gthree_program_use                                   (GthreeProgram *program);
 GTHREE_API
+guint gthree_program_get_id                               (GthreeProgram *program);
+GTHREE_API
+gboolean gthree_program_is_ready                          (GthreeProgram *program);
+GTHREE_API
 gint gthree_program_lookup_uniform_location               (GthreeProgram *program,
                                                            GQuark         uniform);
 GTHREE_API
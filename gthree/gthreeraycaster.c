@@ -1,6 +1,8 @@
 #include "gthreeraycaster.h"
 #include "gthreeperspectivecamera.h"
 #include "gthreeorthographiccamera.h"
+#include "gthreescene.h"
+#include "gthreeprivate.h"
 
 typedef struct {
   graphene_ray_t ray;
@@ -35,6 +37,7 @@ gthree_ray_intersection_new (GthreeObject *object)
 
   intersection->face_index = -1;
   intersection->material_index = -1;
+  intersection->instance_id = -1;
   if (object)
     intersection->object = g_object_ref (object);
 
@@ -200,6 +203,44 @@ intersect_object (GthreeRaycaster *raycaster,
     }
 }
 
+static gboolean
+is_visible_in (GthreeObject *object,
+               GthreeObject *root)
+{
+  for (; object != NULL; object = gthree_object_get_parent (object))
+    {
+      if (!gthree_object_get_visible (object))
+        return FALSE;
+      if (object == root)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Only raycasts the objects whose bounds the ray passes through,
+   instead of everything in the scene */
+static void
+intersect_indexed (GthreeRaycaster *raycaster,
+                   GthreeObject *scene,
+                   GthreeSpatialIndex *index,
+                   GPtrArray *intersections)
+{
+  GthreeRaycasterPrivate *priv = gthree_raycaster_get_instance_private (raycaster);
+  g_autoptr(GPtrArray) candidates = g_ptr_array_new ();
+  int i;
+
+  gthree_spatial_index_query_ray (index, &priv->ray, priv->far, candidates);
+
+  for (i = 0; i < candidates->len; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (candidates, i);
+
+      if (is_visible_in (object, scene))
+        gthree_object_raycast (object, raycaster, intersections);
+    }
+}
+
 GPtrArray *
 gthree_raycaster_intersect_objects (GthreeRaycaster *raycaster,
                                     GthreeObject **objects,
@@ -216,7 +257,17 @@ gthree_raycaster_intersect_objects (GthreeRaycaster *raycaster,
     target = g_ptr_array_new_with_free_func ((GDestroyNotify)gthree_ray_intersection_free);
 
   for (i = 0; i < n_objects; i++)
-    intersect_object (raycaster, objects[i], recurse, target);
+    {
+      GthreeSpatialIndex *index = NULL;
+
+      if (recurse && GTHREE_IS_SCENE (objects[i]))
+        index = gthree_scene_update_spatial_index (GTHREE_SCENE (objects[i]));
+
+      if (index)
+        intersect_indexed (raycaster, objects[i], index, target);
+      else
+        intersect_object (raycaster, objects[i], recurse, target);
+    }
 
   g_ptr_array_sort (target, compare_intersection);
 
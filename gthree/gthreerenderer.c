@@ -5,6 +5,7 @@
 #include "gthreeobjectprivate.h"
 #include "gthreemesh.h"
 #include "gthreeskinnedmesh.h"
+#include "gthreeinstancedmesh.h"
 #include "gthreelinesegments.h"
 #include "gthreeshader.h"
 #include "gthreematerial.h"
@@ -23,12 +24,21 @@
 #include "gthreepoints.h"
 #include "gthreespotlight.h"
 #include "gthreepointlight.h"
+#include "gthreedirectionallight.h"
+#include "gthreeorthographiccamera.h"
 
 #define MAX_MORPH_TARGETS 8
 #define MAX_MORPH_NORMALS 4
+#define MAX_VERTEX_ATTRIBUTES 16
+#define MAX_FRAME_UNIFORM_SLOTS 32
 
 static graphene_vec3_t cube_directions[6];
 static graphene_vec3_t cube_ups[6];
+/* In the order of the cube map faces, which are also the layers */
+static graphene_vec3_t cube_face_directions[6];
+static graphene_vec3_t cube_face_ups[6];
+
+typedef struct _GthreeBatch GthreeBatch;
 
 typedef struct {
   GthreeObject *object;
@@ -36,8 +46,134 @@ typedef struct {
   GthreeMaterial *material;
   GthreeGeometryGroup *group;
   float z;
+  GthreeBatch *batch; /* Set for the items that draw a whole batch */
 } GthreeRenderListItem;
 
+typedef struct {
+  guint64 key;
+  int index;
+} GthreeRenderListSortEntry;
+
+/* Matches the std140 layout of the GthreeFrame block in frame_pars.glsl */
+typedef struct {
+  float projection_matrix[16];
+  float view_matrix[16];
+  float camera_position[3];
+  float time;
+  float clipping_planes[GTHREE_MAX_FRAME_CLIPPING_PLANES * 4];
+} GthreeFrameUniforms;
+
+/* Matches the std140 layout of the GthreeCubeFaces block in distanceRGBA_geom.glsl */
+typedef struct {
+  float view_projection[6][16];
+} GthreeCubeFacesUniforms;
+
+/* Clusters touched by a light, inclusive, or x0 > x1 if none */
+typedef struct {
+  guint8 x0, x1;
+  guint8 y0, y1;
+  guint8 z0, z1;
+} GthreeClusterRange;
+
+/* Collected once per shadow map update and culled against each shadow
+   camera, instead of walking the scene for every light and cube face */
+typedef struct {
+  GthreeObject *object;
+  graphene_sphere_t sphere; /* World space */
+  guint64 signature; /* Only set with shadow map caching */
+  guint culled : 1; /* Frustum culled, and the sphere is valid */
+  guint dynamic : 1; /* Changed recently, drawn over the cached static casters */
+  guint draw_groups : 1; /* Multi-material mesh that needs a draw per group */
+  guint has_range : 1; /* Multi-material mesh drawn as the single range below */
+  GthreeGeometryGroup range;
+  int depth_variant; /* Of the depth and distance materials, the same for all lights */
+  GthreeMaterial *depth_materials[3]; /* Resolved on first use, per GthreeShadowPass */
+} GthreeShadowCaster;
+
+/* The kinds of passes that use different depth materials */
+typedef enum {
+  SHADOW_PASS_DEPTH,
+  SHADOW_PASS_DISTANCE,
+  SHADOW_PASS_CUBE_DISTANCE,
+} GthreeShadowPass;
+
+/* An object with children, and the range its subtree covers in the
+   renderables, so that the whole range can be culled at once using
+   the cached subtree bounds */
+typedef struct {
+  GthreeObject *object;
+  int first;
+  int end;
+  int next; /* The node after the ones for the subtree */
+  gboolean cullable; /* Nothing in the range is drawn outside its bounds */
+} GthreeCullNode;
+
+typedef struct {
+  int first;
+  int end;
+  gboolean inside; /* No need to test the objects in the range */
+} GthreeCullRange;
+
+/* A renderable to project, and the result of its visibility test */
+typedef struct {
+  GthreeObject *object;
+  gboolean cull;
+  gboolean visible;
+  float z;
+} GthreeProjectItem;
+
+/* A part of the renderables for a worker thread to cull. Unless inside
+   is set the cull nodes from node to node_end are tested, and then the
+   objects in the ranges they don't cull */
+typedef struct {
+  int node;
+  int node_end;
+  int first;
+  int end;
+  gboolean inside; /* Everything is in the frustum, no need to test */
+} GthreeProjectTask;
+
+/* Projection work shared with the worker threads. The items, or the
+   tasks if there are any, are handed out in chunks, so threads that
+   finish early take over the chunks the busy ones didn't get to */
+typedef struct {
+  GthreeRenderer *renderer;
+  GthreeProjectItem *items;
+  int n_items;
+  GthreeProjectTask *tasks; /* One per chunk, the items are per renderable */
+  int n_chunks;
+  int next_chunk; /* atomic */
+  int n_running; /* workers, protected by mutex */
+  GMutex mutex;
+  GCond cond;
+} GthreeProjectJob;
+
+#define PROJECT_CHUNK_SIZE 128
+
+/* Last seen state of a shadow caster, to tell static from dynamic ones */
+typedef struct {
+  guint64 signature;
+  guint changed_frame;
+  guint seen_frame;
+  gboolean changed;
+} GthreeShadowCasterState;
+
+typedef enum {
+  SHADOW_CASTERS_ALL,
+  SHADOW_CASTERS_STATIC,
+  SHADOW_CASTERS_DYNAMIC,
+} GthreeShadowCasterFilter;
+
+/* Casters that haven't changed for this many shadow updates are static */
+#define SHADOW_STATIC_FRAMES 30
+
+/* Where the map of a light goes in the shadow atlas */
+typedef struct {
+  int index; /* In priv->shadows */
+  int area[4];
+  gboolean packed;
+} GthreeShadowAtlasArea;
+
 struct _GthreeRenderList {
   float current_z;
   gboolean use_background;
@@ -45,6 +181,15 @@ struct _GthreeRenderList {
   GArray *opaque;
   GArray *transparent;
   GArray *background;
+
+  /* Scratch space for the radix sort */
+  GArray *sort_entries;
+  GArray *sort_tmp;
+
+  /* Switches avoided by the last state sort compared to depth order */
+  int saved_program_switches;
+  int saved_material_switches;
+  int saved_vao_switches;
 };
 
 typedef struct {
@@ -61,14 +206,30 @@ typedef struct {
   gboolean auto_clear_stencil;
   graphene_vec3_t clear_color;
   gboolean sort_objects;
+  GthreeOpaqueSort opaque_sort;
+  gboolean sort_statistics;
   float gamma_factor;
   gboolean physically_correct_lights;
   gboolean shadowmap_enabled;
   gboolean shadowmap_auto_update;
   gboolean shadowmap_needs_update;
   GthreeShadowMapType shadowmap_type;
+  gboolean shadowmap_caching;
+  GHashTable *shadow_caster_states; /* GthreeObject -> GthreeShadowCasterState */
+  guint shadow_frame;
+  int shadow_atlas_size;
+  GthreeRenderTarget *shadow_atlas;
+  GArray *shadow_atlas_areas; /* GthreeShadowAtlasArea, one per priv->shadows */
+  gboolean shadowmap_depth_compare;
   GPtrArray *shadowmap_depth_materials;
+  GPtrArray *shadowmap_depth_only_materials; /* For depth compare maps */
   GPtrArray *shadowmap_distance_materials;
+  gboolean shadowmap_layered;
+  gboolean supports_geometry_shaders;
+  GPtrArray *shadowmap_cube_distance_materials; /* For layered cube maps */
+  guint cube_faces_ubo;
+  gboolean shadow_cube_pass; /* Drawing the casters into all faces of a cube map */
+  int cube_face_mask;
 
   GArray *clipping_planes;
 
@@ -76,6 +237,11 @@ typedef struct {
 
   /* Render state */
   GthreeProgramCache *program_cache;
+  char *program_cache_dir;
+  guint program_binary_hits;
+  guint program_binary_misses;
+  GPtrArray *compiled_programs;
+  gboolean skip_pending_programs;
 
   graphene_frustum_t frustum;
   graphene_matrix_t proj_screen_matrix;
@@ -84,9 +250,39 @@ typedef struct {
   guint used_texture_units;
 
   GthreeLightSetup light_setup;
-  GList *lights;
-
-  GList *shadows;
+  GPtrArray *lights;
+  GPtrArray *shadows;
+
+  /* Objects that passed the visibility and layer checks in the last
+     traversal, reused while the scene graph is unchanged */
+  GPtrArray *renderables;
+  GArray *shadow_casters; /* GthreeShadowCaster */
+  GArray *cull_nodes; /* GthreeCullNode, in pre-order */
+  GArray *cull_ranges; /* GthreeCullRange */
+  int n_uncullable_renderables;
+  GArray *renderable_casters; /* Index of the first shadow caster at or after each renderable */
+  gboolean retained;
+  GthreeScene *retained_scene; /* weak pointer */
+  guint retained_graph_age;
+  guint32 retained_layer_mask;
+
+  /* Set during a render if the scene has a spatial index, which then
+     decides what is looked at for culling and shadow casters */
+  GthreeSpatialIndex *spatial_index;
+  GHashTable *renderable_lookup; /* GthreeObject -> index in renderables + 1 */
+  GArray *unindexed_renderables; /* Renderables the index doesn't cull */
+  gboolean renderable_lookup_dirty;
+  GHashTable *shadow_caster_lookup; /* GthreeObject -> index in shadow_casters + 1 */
+  GArray *unculled_shadow_casters;
+  GPtrArray *index_results;
+  GArray *index_hits;
+
+  /* Threads for the visibility tests when projecting, the pool is NULL
+     if everything runs on the calling thread */
+  int n_threads;
+  GThreadPool *thread_pool;
+  GArray *project_items; /* GthreeProjectItem, collected if there is a pool */
+  GArray *project_tasks; /* GthreeProjectTask */
 
   gboolean old_flip_sided;
   gboolean old_double_sided;
@@ -117,8 +313,9 @@ typedef struct {
 
   GthreeRenderList *current_render_list;
 
-  guint8 new_attributes[8];
-  guint8 enabled_attributes[8];
+  guint8 new_attributes[MAX_VERTEX_ATTRIBUTES];
+  guint8 enabled_attributes[MAX_VERTEX_ATTRIBUTES];
+  guint attribute_divisors[MAX_VERTEX_ATTRIBUTES];
 
   float morph_influences[8];
 
@@ -131,7 +328,42 @@ typedef struct {
   gboolean supports_vertex_textures;
   gboolean supports_bone_textures;
 
+  /* Bound whenever we're not drawing, so buffer uploads don't modify the cached vaos */
   guint vertex_array_object;
+  guint current_vertex_array;
+  GHashTable *vertex_arrays; /* GthreeVertexArrayKey -> GthreeVertexArray */
+  GHashTable *vertex_array_owners; /* Weakly referenced objects used in vertex_arrays keys */
+  GArray *vertex_array_deletes;
+
+  /* Lights in a uniform block, so programs don't depend on the light counts */
+  gboolean light_block_enabled;
+  guint lights_ubo;
+  GthreeLightsUniforms lights_block;
+
+  /* Point and spot lights binned into a froxel grid */
+  gboolean clustered_lighting;
+  guint cluster_textures[3]; /* light data, grid, indices */
+  GArray *cluster_light_data; /* 4 RGBA float texels per light */
+  GArray *cluster_ranges; /* GthreeClusterRange per light */
+  GArray *cluster_grid; /* guint32 first index and count per cluster */
+  GArray *cluster_indices; /* guint32 */
+
+  /* Batching of opaque meshes into multi draws */
+  gboolean batching;
+  gboolean supports_multi_draw_indirect;
+  GHashTable *batch_pools; /* layout -> GthreeBatchPool */
+  GHashTable *batch_ranges; /* Weakly referenced GthreeGeometry -> GthreeBatchRange */
+  GHashTable *batches; /* GthreeBatchKey -> GthreeBatch */
+  guint batch_frame;
+  int n_batches;
+  int n_batched_objects;
+
+  /* Per camera frame uniforms, one slot per camera used in the current frame */
+  guint frame_ubo;
+  gsize frame_ubo_stride;
+  GPtrArray *frame_cameras; /* index is the slot, NULL if the slot was invalidated */
+  GthreeCamera *frame_camera; /* camera of the currently bound slot */
+  gint64 start_time;
 
   /* Background */
   GthreeMesh *bg_box_mesh;
@@ -141,18 +373,17 @@ typedef struct {
 } GthreeRendererPrivate;
 
 static void gthree_set_default_gl_state (GthreeRenderer *renderer);
+static void project_worker (gpointer data,
+                            gpointer user_data);
 
 static GQuark q_position;
 static GQuark q_color;
 static GQuark q_uv;
 static GQuark q_uv2;
 static GQuark q_normal;
-static GQuark q_viewMatrix;
 static GQuark q_modelMatrix;
 static GQuark q_modelViewMatrix;
 static GQuark q_normalMatrix;
-static GQuark q_projectionMatrix;
-static GQuark q_cameraPosition;
 static GQuark q_clippingPlanes;
 static GQuark q_ambientLightColor;
 static GQuark q_directionalLights;
@@ -161,6 +392,9 @@ static GQuark q_spotLights;
 static GQuark q_bindMatrix;
 static GQuark q_bindMatrixInverse;
 static GQuark q_boneMatrices;
+static GQuark q_instanceMatrix;
+static GQuark q_instanceColor;
+static GQuark q_cubeFaceMask;
 
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeRenderer, gthree_renderer, G_TYPE_OBJECT);
 
@@ -221,1456 +455,5023 @@ gthree_renderer_new ()
   return renderer;
 }
 
-static void
-gthree_renderer_init (GthreeRenderer *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  GLint fbo_id = 0;
+typedef struct {
+  GthreeGeometry *geometry;
+  GthreeProgram *program;
+  GthreeObject *object; /* Only set for objects with their own attributes, like instanced meshes */
+  gboolean wireframe;
+} GthreeVertexArrayKey;
 
-  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &fbo_id);
-  priv->window_framebuffer = fbo_id;
-#ifdef DEBUG_LABELS
-  glObjectLabel (GL_FRAMEBUFFER, priv->window_framebuffer, strlen ("GthreeArea.FB"), "GthreeArea.FB");
-#endif
+typedef struct {
+  GQuark name;
+  GthreeAttribute *attribute;
+  guint gl_buffer;
+  gboolean from_object;
+} GthreeVertexArrayBinding;
 
-  priv->program_cache = gthree_program_cache_new ();
+typedef struct {
+  GQuark name;
+  int location;
+} GthreeVertexArrayDefault;
 
-  priv->auto_clear = TRUE;
-  priv->auto_clear_color = TRUE;
-  priv->auto_clear_depth = TRUE;
-  priv->auto_clear_stencil = TRUE;
-  priv->sort_objects = TRUE;
-  priv->width = 1;
-  priv->height = 1;
-  priv->pixel_ratio = 1;
-  priv->gamma_factor = 2.2; // Differs from three.js default 2.0
-  priv->physically_correct_lights = FALSE;
-  priv->shadowmap_type = GTHREE_SHADOW_MAP_TYPE_PCF;
-  priv->shadowmap_enabled = FALSE;
-  priv->shadowmap_auto_update = TRUE;
-  priv->shadowmap_needs_update = FALSE;
+typedef struct {
+  GthreeVertexArrayKey key;
+  guint vao;
+  guint geometry_version;
+  GthreeAttribute *index;
+  guint index_buffer;
+  GArray *bindings;
+  GArray *defaults; /* Default attribute values are not part of the vao state */
+} GthreeVertexArray;
+
+static guint
+vertex_array_key_hash (gconstpointer v)
+{
+  const GthreeVertexArrayKey *key = v;
 
-  priv->clipping_planes = g_array_new (FALSE, FALSE, sizeof (graphene_plane_t));
-  priv->clipping_state = g_array_new (FALSE, FALSE, sizeof (float));
+  return g_direct_hash (key->geometry) ^
+    (g_direct_hash (key->program) * 31) ^
+    (g_direct_hash (key->object) * 17) ^
+    key->wireframe;
+}
 
-  priv->current_framebuffer = 0;
+static gboolean
+vertex_array_key_equal (gconstpointer a,
+                        gconstpointer b)
+{
+  const GthreeVertexArrayKey *key_a = a;
+  const GthreeVertexArrayKey *key_b = b;
+
+  return
+    key_a->geometry == key_b->geometry &&
+    key_a->program == key_b->program &&
+    key_a->object == key_b->object &&
+    key_a->wireframe == key_b->wireframe;
+}
 
-  priv->light_setup.directional = g_ptr_array_new ();
-  priv->light_setup.directional_shadow_map = g_ptr_array_new ();
-  priv->light_setup.directional_shadow_map_matrix = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
-  priv->light_setup.point = g_ptr_array_new ();
-  priv->light_setup.point_shadow_map = g_ptr_array_new ();
-  priv->light_setup.point_shadow_map_matrix = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
-  priv->light_setup.spot = g_ptr_array_new ();
-  priv->light_setup.spot_shadow_map = g_ptr_array_new ();
-  priv->light_setup.spot_shadow_map_matrix = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
-  priv->light_setup.shadow = g_ptr_array_new ();
+static void
+vertex_array_free (GthreeVertexArray *va)
+{
+  g_array_unref (va->bindings);
+  g_array_unref (va->defaults);
+  g_free (va);
+}
 
-  priv->current_render_list = gthree_render_list_new ();
+static void
+vertex_array_owner_finalized (gpointer data,
+                              GObject *where_the_object_was)
+{
+  GthreeRenderer *renderer = data;
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GHashTableIter iter;
+  GthreeVertexArray *va;
 
-  priv->old_blending = -1;
-  priv->old_blend_equation = -1;
-  priv->old_blend_src = -1;
-  priv->old_blend_dst = -1;
-  priv->old_depth_write = -1;
-  priv->old_depth_test = -1;
+  g_hash_table_remove (priv->vertex_array_owners, where_the_object_was);
 
-  gthree_set_default_gl_state (renderer);
+  g_hash_table_iter_init (&iter, priv->vertex_arrays);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&va))
+    {
+      if ((gpointer)va->key.geometry == (gpointer)where_the_object_was ||
+          (gpointer)va->key.program == (gpointer)where_the_object_was ||
+          (gpointer)va->key.object == (gpointer)where_the_object_was)
+        {
+          /* The gl context might not be current, so delete on next render */
+          g_array_append_val (priv->vertex_array_deletes, va->vao);
+          g_hash_table_iter_remove (&iter);
+        }
+    }
+}
 
-  /* We only use one vao, so bind it here */
-  glGenVertexArrays (1, &priv->vertex_array_object);
-  glBindVertexArray (priv->vertex_array_object);
+static void
+vertex_array_add_owner (GthreeRenderer *renderer,
+                        gpointer owner)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  // GPU capabilities
-  glGetIntegerv (GL_MAX_TEXTURE_IMAGE_UNITS, &priv->max_textures);
-  glGetIntegerv (GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &priv->max_vertex_textures);
-  glGetIntegerv (GL_MAX_TEXTURE_SIZE, &priv->max_texture_size);
-  glGetIntegerv (GL_MAX_CUBE_MAP_TEXTURE_SIZE, &priv->max_cubemap_size);
+  if (owner == NULL || g_hash_table_contains (priv->vertex_array_owners, owner))
+    return;
 
-  priv->max_anisotropy = 0.0f;
-  if (epoxy_has_gl_extension("GL_EXT_texture_filter_anisotropic"))
-    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &priv->max_anisotropy);
+  g_hash_table_add (priv->vertex_array_owners, owner);
+  g_object_weak_ref (G_OBJECT (owner), vertex_array_owner_finalized, renderer);
+}
 
-  priv->supports_vertex_textures = priv->max_vertex_textures > 0;
-  priv->supports_bone_textures =
-    priv->supports_vertex_textures &&
-    epoxy_has_gl_extension("GL_ARB_texture_float");
+static void
+flush_vertex_array_deletes (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  //priv->compressed_texture_formats = _glExtensionCompressedTextureS3TC ? glGetParameter( _gl.COMPRESSED_TEXTURE_FORMATS ) : [];
+  if (priv->vertex_array_deletes->len == 0)
+    return;
 
+  glDeleteVertexArrays (priv->vertex_array_deletes->len, (guint *)priv->vertex_array_deletes->data);
+  g_array_set_size (priv->vertex_array_deletes, 0);
 }
 
 static void
-gthree_renderer_finalize (GObject *obj)
+free_vertex_arrays (GthreeRenderer *renderer)
 {
-  GthreeRenderer *renderer = GTHREE_RENDERER (obj);
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GHashTableIter iter;
+  GthreeVertexArray *va;
+  gpointer owner;
 
-  g_assert (gdk_gl_context_get_current () == priv->gl_context);
+  g_hash_table_iter_init (&iter, priv->vertex_array_owners);
+  while (g_hash_table_iter_next (&iter, &owner, NULL))
+    g_object_weak_unref (G_OBJECT (owner), vertex_array_owner_finalized, renderer);
 
-  g_clear_object (&priv->current_render_target);
+  g_hash_table_iter_init (&iter, priv->vertex_arrays);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&va))
+    g_array_append_val (priv->vertex_array_deletes, va->vao);
 
-  if (priv->shadowmap_depth_materials)
-    g_ptr_array_unref (priv->shadowmap_depth_materials);
-  if (priv->shadowmap_distance_materials)
-    g_ptr_array_unref (priv->shadowmap_distance_materials);
+  flush_vertex_array_deletes (renderer);
 
-  gthree_program_cache_free (priv->program_cache);
+  glDeleteVertexArrays (1, &priv->vertex_array_object);
 
-  g_array_free (priv->clipping_planes, TRUE);
-  g_array_free (priv->clipping_state, TRUE);
+  g_hash_table_unref (priv->vertex_arrays);
+  g_hash_table_unref (priv->vertex_array_owners);
+  g_array_unref (priv->vertex_array_deletes);
+}
 
-  g_list_free (priv->lights);
-  g_ptr_array_free (priv->light_setup.directional, TRUE);
-  g_ptr_array_free (priv->light_setup.directional_shadow_map, TRUE);
-  g_array_free (priv->light_setup.directional_shadow_map_matrix, TRUE);
-  g_ptr_array_free (priv->light_setup.point, TRUE);
-  g_ptr_array_free (priv->light_setup.point_shadow_map, TRUE);
-  g_array_free (priv->light_setup.point_shadow_map_matrix, TRUE);
-  g_ptr_array_free (priv->light_setup.spot, TRUE);
-  g_ptr_array_free (priv->light_setup.spot_shadow_map, TRUE);
-  g_array_free (priv->light_setup.spot_shadow_map_matrix, TRUE);
-  g_ptr_array_free (priv->light_setup.shadow, TRUE);
+/* Geometries with the same vertex layout, packed into one geometry so
+   that all of them can be drawn from the same buffers. New members are
+   appended to the end, the space of removed members is only reclaimed
+   when the pool is repacked. */
+typedef struct {
+  GPtrArray *names; /* interned attribute names */
+  GthreeGeometry *geometry; /* packed, NULL when empty */
+  GPtrArray *pending; /* member geometries not copied in yet */
+  int n_vertices; /* used, including freed space */
+  int n_indices;
+  int max_vertices; /* allocated in geometry */
+  int max_indices;
+  int free_vertices; /* held by removed members */
+  int free_indices;
+} GthreeBatchPool;
+
+/* Where a member geometry lives in its pool */
+typedef struct {
+  GthreeBatchPool *pool; /* NULL if the geometry can't be batched */
+  guint attributes_version;
+  guint frame; /* last frame it was batched */
+  gboolean packed;
+  int base_vertex;
+  int first_index;
+  int index_count;
+  int vertex_count;
+} GthreeBatchRange;
+
+/* Ranges not batched for this many frames are dropped */
+#define BATCH_RANGE_MAX_AGE 120
+
+/* Matches the layout glMultiDrawElementsIndirect expects */
+typedef struct {
+  guint count;
+  guint instance_count;
+  guint first_index;
+  gint base_vertex;
+  guint base_instance;
+} GthreeDrawElementsCommand;
 
-  gthree_render_list_free (priv->current_render_list);
+typedef struct {
+  GthreeBatchPool *pool;
+  GthreeMaterial *material;
+  gboolean receive_shadow;
+} GthreeBatchKey;
 
-  g_clear_object (&priv->bg_box_mesh);
-  g_clear_object (&priv->bg_plane_mesh);
-  g_clear_object (&priv->current_bg_texture);
+/* What was last uploaded to an instance of the batch mesh */
+typedef struct {
+  GthreeObject *object;
+  guint world_matrix_version;
+} GthreeBatchInstance;
+
+/* The members are drawn as instances of one instanced mesh, where the
+   base instance of each draw picks its model matrix */
+struct _GthreeBatch {
+  GthreeBatchKey key;
+  GthreeInstancedMesh *mesh;
+  GArray *members; /* indexes into the render list items */
+  GArray *commands;
+  GArray *instances;
+  guint indirect_buffer;
+  guint frame;
+};
 
-  g_clear_object (&priv->gl_context);
+static guint
+batch_key_hash (gconstpointer v)
+{
+  const GthreeBatchKey *key = v;
 
-  G_OBJECT_CLASS (gthree_renderer_parent_class)->finalize (obj);
+  return g_direct_hash (key->pool) ^
+    (g_direct_hash (key->material) * 31) ^
+    key->receive_shadow;
 }
 
-static void
-gthree_renderer_class_init (GthreeRendererClass *klass)
+static gboolean
+batch_key_equal (gconstpointer a,
+                 gconstpointer b)
 {
-  G_OBJECT_CLASS (klass)->finalize = gthree_renderer_finalize;
-
-#define INIT_QUARK(name) q_##name = g_quark_from_static_string (#name)
-  INIT_QUARK(position);
-  INIT_QUARK(color);
-  INIT_QUARK(uv);
-  INIT_QUARK(uv2);
-  INIT_QUARK(normal);
-  INIT_QUARK(viewMatrix);
-  INIT_QUARK(modelMatrix);
-  INIT_QUARK(modelViewMatrix);
-  INIT_QUARK(normalMatrix);
-  INIT_QUARK(projectionMatrix);
-  INIT_QUARK(cameraPosition);
-  INIT_QUARK(clippingPlanes);
-  INIT_QUARK(ambientLightColor);
-  INIT_QUARK(directionalLights);
-  INIT_QUARK(pointLights);
-  INIT_QUARK(spotLights);
-  INIT_QUARK(bindMatrix);
-  INIT_QUARK(bindMatrixInverse);
-  INIT_QUARK(boneMatrices);
-
-  graphene_vec3_init (&cube_directions[0],  1,  0,  0);
-  graphene_vec3_init (&cube_directions[1], -1,  0,  0);
-  graphene_vec3_init (&cube_directions[2],  0,  0,  1);
-  graphene_vec3_init (&cube_directions[3],  0,  0, -1);
-  graphene_vec3_init (&cube_directions[4],  0,  1,  0);
-  graphene_vec3_init (&cube_directions[5],  0, -1,  0);
-
-  graphene_vec3_init (&cube_ups[0],  0,  1,  0);
-  graphene_vec3_init (&cube_ups[1],  0,  1,  0);
-  graphene_vec3_init (&cube_ups[2],  0,  1,  0);
-  graphene_vec3_init (&cube_ups[3],  0,  1,  0);
-  graphene_vec3_init (&cube_ups[4],  0,  0,  1);
-  graphene_vec3_init (&cube_ups[5],  0,  0, -1);
+  const GthreeBatchKey *key_a = a;
+  const GthreeBatchKey *key_b = b;
 
+  return
+    key_a->pool == key_b->pool &&
+    key_a->material == key_b->material &&
+    key_a->receive_shadow == key_b->receive_shadow;
 }
 
-void
-gthree_renderer_set_viewport (GthreeRenderer *renderer,
-                              float           x,
-                              float           y,
-                              float           width,
-                              float           height)
+static void
+batch_free (GthreeBatch *batch)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  graphene_rect_init (&priv->viewport, x, y, width, height);
-  graphene_rect_init_from_rect (&priv->current_viewport, &priv->viewport);
-
-  glViewport (graphene_rect_get_x (&priv->current_viewport) * priv->pixel_ratio,
-              graphene_rect_get_y (&priv->current_viewport) * priv->pixel_ratio,
-              graphene_rect_get_width (&priv->current_viewport) * priv->pixel_ratio,
-              graphene_rect_get_height (&priv->current_viewport) * priv->pixel_ratio);
+  if (batch->indirect_buffer)
+    glDeleteBuffers (1, &batch->indirect_buffer);
+  g_clear_object (&batch->mesh);
+  g_array_unref (batch->members);
+  g_array_unref (batch->commands);
+  g_array_unref (batch->instances);
+  g_free (batch);
 }
 
-void
-gthree_renderer_set_size (GthreeRenderer *renderer,
-                          int             width,
-                          int             height)
+static void
+batch_pool_free (GthreeBatchPool *pool)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  priv->width = width;
-  priv->height = height;
-
-  gthree_renderer_set_viewport (renderer, 0, 0, width, height);
+  g_ptr_array_unref (pool->names);
+  g_ptr_array_unref (pool->pending);
+  g_clear_object (&pool->geometry);
+  g_free (pool);
 }
 
-void
-gthree_renderer_set_pixel_ratio (GthreeRenderer     *renderer,
-                                 int                 pixel_ratio)
+/* Takes the geometry out of its pool, the space it used stays
+   allocated until the next repack */
+static void
+batch_range_release (GthreeBatchRange *range,
+                     gpointer          geometry)
 {
- GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeBatchPool *pool = range->pool;
 
-  priv->pixel_ratio = pixel_ratio;
+  if (pool == NULL)
+    return;
 
-  gthree_renderer_set_size (renderer, priv->width, priv->height);
+  if (range->packed)
+    {
+      pool->free_vertices += range->vertex_count;
+      pool->free_indices += range->index_count;
+    }
+  else
+    g_ptr_array_remove_fast (pool->pending, geometry);
 
+  range->pool = NULL;
+  range->packed = FALSE;
 }
 
-int
-gthree_renderer_get_width (GthreeRenderer     *renderer)
+static void
+batch_geometry_finalized (gpointer data,
+                          GObject *where_the_object_was)
 {
+  GthreeRenderer *renderer = data;
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeBatchRange *range;
 
-  return priv->width;
+  range = g_hash_table_lookup (priv->batch_ranges, where_the_object_was);
+  if (range)
+    batch_range_release (range, where_the_object_was);
+
+  g_hash_table_remove (priv->batch_ranges, where_the_object_was);
 }
 
-int
-gthree_renderer_get_height (GthreeRenderer     *renderer)
+static void
+free_batches (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GHashTableIter iter;
+  gpointer geometry;
 
-  return priv->height;
+  g_hash_table_iter_init (&iter, priv->batch_ranges);
+  while (g_hash_table_iter_next (&iter, &geometry, NULL))
+    g_object_weak_unref (G_OBJECT (geometry), batch_geometry_finalized, renderer);
+
+  g_hash_table_unref (priv->batches);
+  g_hash_table_unref (priv->batch_ranges);
+  g_hash_table_unref (priv->batch_pools);
 }
 
-int
-gthree_renderer_get_pixel_ratio (GthreeRenderer     *renderer)
+/* Drops the ranges of geometries that have not been batched for a
+   while, so their space is reclaimed on the next repack */
+static void
+prune_batch_ranges (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeBatchRange *range;
+  GHashTableIter iter;
+  gpointer geometry;
 
-  return priv->pixel_ratio;
+  g_hash_table_iter_init (&iter, priv->batch_ranges);
+  while (g_hash_table_iter_next (&iter, &geometry, (gpointer *)&range))
+    {
+      if (priv->batch_frame - range->frame < BATCH_RANGE_MAX_AGE)
+        continue;
+
+      batch_range_release (range, geometry);
+      g_object_weak_unref (G_OBJECT (geometry), batch_geometry_finalized, renderer);
+      g_hash_table_iter_remove (&iter);
+    }
 }
 
-int
-gthree_renderer_get_drawing_buffer_width (GthreeRenderer     *renderer)
+static GthreeBatchRange *
+get_batch_range (GthreeRenderer *renderer,
+                 GthreeGeometry *geometry)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  guint version = gthree_geometry_get_attributes_version (geometry);
+  g_autofree char *layout = NULL;
+  GthreeBatchRange *range;
+  GthreeBatchPool *pool;
 
-  return priv->width * priv->pixel_ratio;
-}
-
-int
-gthree_renderer_get_drawing_buffer_height (GthreeRenderer     *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  return priv->height * priv->pixel_ratio;
-}
-
-void
-gthree_renderer_set_autoclear (GthreeRenderer *renderer,
-                               gboolean        auto_clear)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  range = g_hash_table_lookup (priv->batch_ranges, geometry);
+  if (range != NULL)
+    range->frame = priv->batch_frame;
 
-  priv->auto_clear = !!auto_clear;
-}
+  if (range != NULL && range->attributes_version == version)
+    return range->pool ? range : NULL;
 
-gboolean
-gthree_renderer_get_autoclear (GthreeRenderer *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  if (range == NULL)
+    {
+      range = g_new0 (GthreeBatchRange, 1);
+      range->frame = priv->batch_frame;
+      g_hash_table_insert (priv->batch_ranges, geometry, range);
+      g_object_weak_ref (G_OBJECT (geometry), batch_geometry_finalized, renderer);
+    }
+  else
+    batch_range_release (range, geometry);
 
-  return priv->auto_clear;
-}
+  range->attributes_version = version;
 
-void
-gthree_renderer_set_autoclear_color (GthreeRenderer *renderer,
-                                     gboolean        clear_color)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  /* Indexes are always converted to 32bit, so they are not part of the layout */
+  layout = gthree_geometry_get_layout (geometry);
+  if (layout == NULL)
+    return NULL;
 
-  priv->auto_clear_color = !!clear_color;
-}
+  pool = g_hash_table_lookup (priv->batch_pools, layout);
+  if (pool == NULL)
+    {
+      g_autoptr(GList) names = g_list_sort (gthree_geometry_get_attributes_names (geometry), (GCompareFunc)strcmp);
+      GList *l;
+
+      pool = g_new0 (GthreeBatchPool, 1);
+      pool->names = g_ptr_array_new ();
+      pool->pending = g_ptr_array_new ();
+      for (l = names; l != NULL; l = l->next)
+        g_ptr_array_add (pool->names, l->data);
+      g_hash_table_insert (priv->batch_pools, g_steal_pointer (&layout), pool);
+    }
 
-gboolean
-gthree_renderer_get_autoclear_color (GthreeRenderer *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  range->pool = pool;
+  range->packed = FALSE;
+  range->vertex_count = gthree_geometry_get_position_count (geometry);
+  range->index_count = gthree_geometry_get_index (geometry) ?
+    gthree_attribute_get_count (gthree_geometry_get_index (geometry)) : range->vertex_count;
+  g_ptr_array_add (pool->pending, geometry);
 
-  return priv->auto_clear_color;
+  return range;
 }
 
-void
-gthree_renderer_set_autoclear_depth (GthreeRenderer *renderer,
-                                     gboolean        clear_depth)
+/* Copies the member into the pool buffers at the current end */
+static void
+batch_pool_append (GthreeBatchPool  *pool,
+                   GthreeGeometry   *member,
+                   GthreeBatchRange *range)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeAttribute *member_index = gthree_geometry_get_index (member);
+  GthreeAttribute *index = gthree_geometry_get_index (pool->geometry);
+  int i, k;
 
-  priv->auto_clear_depth = !!clear_depth;
-}
+  range->base_vertex = pool->n_vertices;
+  range->first_index = pool->n_indices;
+  range->packed = TRUE;
 
-gboolean
-gthree_renderer_get_autoclear_depth (GthreeRenderer *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  for (i = 0; i < pool->names->len; i++)
+    {
+      const char *name = g_ptr_array_index (pool->names, i);
+      GthreeAttribute *source = gthree_geometry_get_attribute (member, name);
 
-  return priv->auto_clear_depth;
-}
+      gthree_attribute_copy_at (gthree_geometry_get_attribute (pool->geometry, name),
+                                range->base_vertex, source, 0,
+                                MIN (range->vertex_count, gthree_attribute_get_count (source)));
+    }
 
-void
-gthree_renderer_set_autoclear_stencil (GthreeRenderer *renderer,
-                                       gboolean        clear_stencil)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  /* Indexes stay relative to the member, the draw adds base_vertex */
+  for (k = 0; k < range->index_count; k++)
+    gthree_attribute_set_uint (index, range->first_index + k,
+                               member_index ? gthree_attribute_get_uint (member_index, k) : k);
 
-  priv->auto_clear_stencil = !!clear_stencil;
+  pool->n_vertices += range->vertex_count;
+  pool->n_indices += range->index_count;
 }
 
-gboolean
-gthree_renderer_get_autoclear_stencil (GthreeRenderer *renderer)
+/* Copies all member geometries into new shared buffers, with some room
+   left for members added later. Geometry contents are snapshotted, so
+   this is meant for static geometry. */
+static void
+batch_pool_repack (GthreeRenderer *renderer,
+                   GthreeBatchPool *pool)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  g_autoptr(GPtrArray) members = g_ptr_array_new ();
+  g_autoptr(GthreeAttribute) index = NULL;
+  GthreeBatchRange *range;
+  GthreeGeometry *member;
+  GHashTableIter iter;
+  int n_vertices = 0, n_indices = 0;
+  int i;
 
-  return priv->auto_clear_stencil;
-}
+  g_hash_table_iter_init (&iter, priv->batch_ranges);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&member, (gpointer *)&range))
+    {
+      if (range->pool != pool)
+        continue;
 
-void
-gthree_renderer_set_clear_color (GthreeRenderer *renderer,
-                                 const graphene_vec3_t *color)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+      n_vertices += range->vertex_count;
+      n_indices += range->index_count;
+      g_ptr_array_add (members, member);
+    }
 
-  priv->clear_color = *color;
-}
+  g_clear_object (&pool->geometry);
+  g_ptr_array_set_size (pool->pending, 0);
+  pool->n_vertices = 0;
+  pool->n_indices = 0;
+  pool->max_vertices = 0;
+  pool->max_indices = 0;
+  pool->free_vertices = 0;
+  pool->free_indices = 0;
 
-const graphene_vec3_t *
-gthree_renderer_get_clear_color  (GthreeRenderer     *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  if (members->len == 0)
+    return;
 
-  return &priv->clear_color;
-}
+  pool->max_vertices = n_vertices + n_vertices / 2;
+  pool->max_indices = n_indices + n_indices / 2;
+  pool->geometry = gthree_geometry_new ();
 
-void
-gthree_renderer_set_gamma_factor (GthreeRenderer *renderer,
-                                   float           factor)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  for (i = 0; i < pool->names->len; i++)
+    {
+      const char *name = g_ptr_array_index (pool->names, i);
+      GthreeAttribute *first = gthree_geometry_get_attribute (g_ptr_array_index (members, 0), name);
+      g_autoptr(GthreeAttribute) attribute = NULL;
+
+      attribute = gthree_attribute_new (name,
+                                        gthree_attribute_get_attribute_type (first),
+                                        pool->max_vertices,
+                                        gthree_attribute_get_item_size (first),
+                                        gthree_attribute_get_normalized (first));
+      gthree_geometry_add_attribute (pool->geometry, name, attribute);
+    }
 
-  priv->gamma_factor = factor;
-}
+  index = gthree_attribute_new ("index", GTHREE_ATTRIBUTE_TYPE_UINT32, pool->max_indices, 1, FALSE);
+  gthree_geometry_set_index (pool->geometry, index);
 
-float
-gthree_renderer_get_gamma_factor (GthreeRenderer *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  return priv->gamma_factor;
+  for (i = 0; i < members->len; i++)
+    {
+      member = g_ptr_array_index (members, i);
+      batch_pool_append (pool, member, g_hash_table_lookup (priv->batch_ranges, member));
+    }
 }
 
-gboolean
-gthree_renderer_get_shadow_map_enabled (GthreeRenderer     *renderer)
+/* Appends the pending members if they fit, and repacks if they don't
+   or if more than half of the used space belongs to removed members */
+static void
+batch_pool_update (GthreeRenderer *renderer,
+                   GthreeBatchPool *pool)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int n_vertices = 0, n_indices = 0;
+  int i;
 
-  return priv->shadowmap_enabled;
-}
+  if (pool->pending->len == 0 &&
+      pool->free_vertices <= pool->n_vertices / 2)
+    return;
 
-void
-gthree_renderer_set_shadow_map_enabled (GthreeRenderer     *renderer,
-                                        gboolean            enabled)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  for (i = 0; i < pool->pending->len; i++)
+    {
+      GthreeBatchRange *range = g_hash_table_lookup (priv->batch_ranges, g_ptr_array_index (pool->pending, i));
 
-  priv->shadowmap_enabled = enabled;
-}
+      n_vertices += range->vertex_count;
+      n_indices += range->index_count;
+    }
 
-gboolean
-gthree_renderer_get_shadow_map_auto_update (GthreeRenderer     *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  if (pool->geometry == NULL ||
+      pool->n_vertices + n_vertices > pool->max_vertices ||
+      pool->n_indices + n_indices > pool->max_indices ||
+      pool->free_vertices > pool->n_vertices / 2)
+    {
+      batch_pool_repack (renderer, pool);
+      return;
+    }
 
-  return priv->shadowmap_auto_update;
-}
+  for (i = 0; i < pool->pending->len; i++)
+    {
+      GthreeGeometry *member = g_ptr_array_index (pool->pending, i);
 
-void
-gthree_renderer_set_shadow_map_auto_update (GthreeRenderer     *renderer,
-                                            gboolean            auto_update)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+      batch_pool_append (pool, member, g_hash_table_lookup (priv->batch_ranges, member));
+    }
+  g_ptr_array_set_size (pool->pending, 0);
 
-  priv->shadowmap_auto_update = auto_update;
+  for (i = 0; i < pool->names->len; i++)
+    gthree_attribute_set_needs_update (gthree_geometry_get_attribute (pool->geometry, g_ptr_array_index (pool->names, i)));
+  gthree_attribute_set_needs_update (gthree_geometry_get_index (pool->geometry));
 }
 
-gboolean
-gthree_renderer_get_shadow_map_needs_update (GthreeRenderer     *renderer)
+static gboolean
+item_can_batch (GthreeRenderListItem *item)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  return priv->shadowmap_needs_update;
+  GthreeObject *object = item->object;
+  GthreeMaterial *material = item->material;
+  GthreeMeshMaterial *mesh_material;
+
+  if (!GTHREE_IS_MESH (object) ||
+      GTHREE_IS_INSTANCED_MESH (object) ||
+      GTHREE_IS_SKINNED_MESH (object) ||
+      gthree_mesh_has_morph_targets (GTHREE_MESH (object)) ||
+      gthree_mesh_get_draw_mode (GTHREE_MESH (object)) != GTHREE_DRAW_MODE_TRIANGLES)
+    return FALSE;
+
+  /* Mirroring transforms flip the winding, but a batch is drawn with
+     the face culling state of its first member */
+  if (graphene_matrix_determinant (gthree_object_get_world_matrix (object)) < 0)
+    return FALSE;
+
+  /* Custom shaders may not handle the instanceMatrix attribute */
+  if (material == NULL ||
+      !GTHREE_IS_MESH_MATERIAL (material) ||
+      GTHREE_IS_SHADER_MATERIAL (material))
+    return FALSE;
+
+  mesh_material = GTHREE_MESH_MATERIAL (material);
+  if (gthree_mesh_material_get_is_wireframe (mesh_material) ||
+      gthree_mesh_material_get_skinning (mesh_material) ||
+      gthree_mesh_material_get_morph_targets (mesh_material))
+    return FALSE;
+
+  return TRUE;
 }
 
-void
-gthree_renderer_set_shadow_map_needs_update (GthreeRenderer     *renderer,
-                                             gboolean            needs_update)
+/* Replaces runs of compatible opaque items with one item per batch,
+   drawn where the first member would have been drawn */
+static void
+batch_render_list (GthreeRenderer *renderer,
+                   GthreeRenderList *list)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GArray *opaque;
+  GHashTableIter iter;
+  GthreeBatch *batch;
+  int i;
 
-  priv->shadowmap_needs_update = needs_update;
-}
-
-int
-gthree_renderer_get_n_clipping_planes (GthreeRenderer *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  priv->n_batches = 0;
+  priv->n_batched_objects = 0;
 
-  return priv->clipping_planes->len;
-}
+  if (!priv->batching || !priv->supports_multi_draw_indirect)
+    return;
 
-GArray *
-gthree_renderer_get_clipping_planes (GthreeRenderer     *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  priv->batch_frame++;
 
-  return priv->clipping_planes;
-}
+  opaque = g_array_sized_new (FALSE, FALSE, sizeof (int), list->opaque->len);
 
-void
-gthree_renderer_set_clipping_planes (GthreeRenderer     *renderer,
-                                     GArray             *clipping_planes)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  for (i = 0; i < list->opaque->len; i++)
+    {
+      int index = g_array_index (list->opaque, int, i);
+      GthreeRenderListItem *item = &g_array_index (list->items, GthreeRenderListItem, index);
+      GthreeBatchRange *range;
+      GthreeBatchKey key;
 
-  if (clipping_planes)
-    g_array_ref (clipping_planes);
-  else
-    clipping_planes = g_array_new (FALSE, FALSE, sizeof (graphene_plane_t));
+      if (!item_can_batch (item) ||
+          (range = get_batch_range (renderer, item->geometry)) == NULL)
+        {
+          g_array_append_val (opaque, index);
+          continue;
+        }
 
-  g_array_unref (priv->clipping_planes);
-  priv->clipping_planes = clipping_planes;
-}
+      key.pool = range->pool;
+      key.material = item->material;
+      key.receive_shadow = gthree_object_get_receive_shadow (item->object);
 
-const graphene_plane_t *
-gthree_renderer_get_clipping_plane (GthreeRenderer     *renderer,
-                                    int                 index)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+      batch = g_hash_table_lookup (priv->batches, &key);
+      if (batch == NULL)
+        {
+          batch = g_new0 (GthreeBatch, 1);
+          batch->key = key;
+          batch->members = g_array_new (FALSE, FALSE, sizeof (int));
+          batch->commands = g_array_new (FALSE, FALSE, sizeof (GthreeDrawElementsCommand));
+          batch->instances = g_array_new (FALSE, TRUE, sizeof (GthreeBatchInstance));
+          g_hash_table_insert (priv->batches, &batch->key, batch);
+        }
 
-  if (index < 0 || index >= priv->clipping_planes->len)
-    return NULL;
+      if (batch->frame != priv->batch_frame)
+        {
+          GthreeRenderListItem batch_item = { NULL, NULL, item->material, NULL, item->z, batch };
+          int batch_index = list->items->len;
 
-  return &g_array_index (priv->clipping_planes, graphene_plane_t, index);
-}
+          batch->frame = priv->batch_frame;
+          g_array_set_size (batch->members, 0);
 
-void
-gthree_renderer_set_clipping_plane (GthreeRenderer     *renderer,
-                                    int                 index,
-                                    const graphene_plane_t *plane)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+          /* This may move the items */
+          g_array_append_val (list->items, batch_item);
+          g_array_append_val (opaque, batch_index);
+          priv->n_batches++;
+        }
 
-  if (index < 0 || index >= priv->clipping_planes->len)
-    return;
+      g_array_append_val (batch->members, index);
+      priv->n_batched_objects++;
+    }
 
-  g_array_index (priv->clipping_planes, graphene_plane_t, index) = *plane;
-}
+  g_array_unref (list->opaque);
+  list->opaque = opaque;
 
-void
-gthree_renderer_add_clipping_plane (GthreeRenderer     *renderer,
-                                    const graphene_plane_t *plane)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  /* Drop batches for materials or layouts that are not visible anymore */
+  g_hash_table_iter_init (&iter, priv->batches);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&batch))
+    {
+      if (batch->frame != priv->batch_frame)
+        g_hash_table_iter_remove (&iter);
+    }
 
-  g_array_append_val (priv->clipping_planes, *plane);
+  if (priv->batch_frame % BATCH_RANGE_MAX_AGE == 0)
+    prune_batch_ranges (renderer);
 }
 
-void
-gthree_renderer_remove_clipping_plane (GthreeRenderer *renderer,
-                                       int             index)
+static void
+gthree_renderer_init (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GLint fbo_id = 0;
 
-  if (index < 0 || index >= priv->clipping_planes->len)
-    return;
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &fbo_id);
+  priv->window_framebuffer = fbo_id;
+#ifdef DEBUG_LABELS
+  glObjectLabel (GL_FRAMEBUFFER, priv->window_framebuffer, strlen ("GthreeArea.FB"), "GthreeArea.FB");
+#endif
 
-  g_array_remove_index (priv->clipping_planes, index);
-}
+  priv->program_cache = gthree_program_cache_new ();
 
-void
-gthree_renderer_remove_all_clipping_planes (GthreeRenderer *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  priv->auto_clear = TRUE;
+  priv->auto_clear_color = TRUE;
+  priv->auto_clear_depth = TRUE;
+  priv->auto_clear_stencil = TRUE;
+  priv->sort_objects = TRUE;
+  priv->width = 1;
+  priv->height = 1;
+  priv->pixel_ratio = 1;
+  priv->gamma_factor = 2.2; // Differs from three.js default 2.0
+  priv->physically_correct_lights = FALSE;
+  priv->shadowmap_type = GTHREE_SHADOW_MAP_TYPE_PCF;
+  priv->shadowmap_enabled = FALSE;
+  priv->shadowmap_auto_update = TRUE;
+  priv->shadowmap_needs_update = FALSE;
 
-  g_array_set_size (priv->clipping_planes, 0);
-}
+  priv->clipping_planes = g_array_new (FALSE, FALSE, sizeof (graphene_plane_t));
+  priv->clipping_state = g_array_new (FALSE, FALSE, sizeof (float));
 
-GthreeRenderTarget *
-gthree_renderer_get_render_target (GthreeRenderer *renderer)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  priv->current_framebuffer = 0;
+
+  priv->light_setup.directional = g_ptr_array_new ();
+  priv->light_setup.directional_shadow_map = g_ptr_array_new ();
+  priv->light_setup.directional_shadow_map_matrix = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
+  priv->light_setup.point = g_ptr_array_new ();
+  priv->light_setup.point_shadow_map = g_ptr_array_new ();
+  priv->light_setup.point_shadow_map_matrix = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
+  priv->light_setup.spot = g_ptr_array_new ();
+  priv->light_setup.spot_shadow_map = g_ptr_array_new ();
+  priv->light_setup.spot_shadow_map_matrix = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
+  priv->light_setup.shadow = g_ptr_array_new ();
+  priv->light_setup.directional_cascade_splits = g_array_new (FALSE, FALSE, sizeof (float));
+  priv->light_setup.directional_cascade_scale = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
+  priv->light_setup.directional_cascade_offset = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
+  priv->light_setup.directional_data = g_array_new (FALSE, FALSE, sizeof (GthreeDirectionalLightBlock));
+  priv->light_setup.point_data = g_array_new (FALSE, FALSE, sizeof (GthreePointLightBlock));
+  priv->light_setup.spot_data = g_array_new (FALSE, FALSE, sizeof (GthreeSpotLightBlock));
+
+  priv->cluster_light_data = g_array_new (FALSE, FALSE, sizeof (float));
+  priv->cluster_ranges = g_array_new (FALSE, FALSE, sizeof (GthreeClusterRange));
+  priv->cluster_grid = g_array_new (FALSE, TRUE, sizeof (guint32));
+  priv->cluster_indices = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  priv->current_render_list = gthree_render_list_new ();
+
+  priv->lights = g_ptr_array_new ();
+  priv->shadows = g_ptr_array_new ();
+  priv->renderables = g_ptr_array_new ();
+  priv->shadow_casters = g_array_new (FALSE, FALSE, sizeof (GthreeShadowCaster));
+  priv->cull_nodes = g_array_new (FALSE, FALSE, sizeof (GthreeCullNode));
+  priv->cull_ranges = g_array_new (FALSE, FALSE, sizeof (GthreeCullRange));
+  priv->renderable_casters = g_array_new (FALSE, FALSE, sizeof (int));
+  priv->shadow_atlas_areas = g_array_new (FALSE, FALSE, sizeof (GthreeShadowAtlasArea));
+  priv->shadow_caster_states = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+  priv->renderable_lookup = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->unindexed_renderables = g_array_new (FALSE, FALSE, sizeof (int));
+  priv->shadow_caster_lookup = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->unculled_shadow_casters = g_array_new (FALSE, FALSE, sizeof (int));
+  priv->index_results = g_ptr_array_new ();
+  priv->index_hits = g_array_new (FALSE, FALSE, sizeof (int));
+  priv->n_threads = 1;
+  priv->project_items = g_array_new (FALSE, FALSE, sizeof (GthreeProjectItem));
+  priv->project_tasks = g_array_new (FALSE, FALSE, sizeof (GthreeProjectTask));
+  priv->compiled_programs = g_ptr_array_new_with_free_func (g_object_unref);
+
+  priv->old_blending = -1;
+  priv->old_blend_equation = -1;
+  priv->old_blend_src = -1;
+  priv->old_blend_dst = -1;
+  priv->old_depth_write = -1;
+  priv->old_depth_test = -1;
+
+  gthree_set_default_gl_state (renderer);
+
+  glGenVertexArrays (1, &priv->vertex_array_object);
+  glBindVertexArray (priv->vertex_array_object);
+  priv->current_vertex_array = priv->vertex_array_object;
+
+  priv->vertex_arrays = g_hash_table_new_full (vertex_array_key_hash, vertex_array_key_equal,
+                                               NULL, (GDestroyNotify)vertex_array_free);
+  priv->vertex_array_owners = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->vertex_array_deletes = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  priv->batch_pools = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, (GDestroyNotify)batch_pool_free);
+  priv->batch_ranges = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+  priv->batches = g_hash_table_new_full (batch_key_hash, batch_key_equal,
+                                         NULL, (GDestroyNotify)batch_free);
+
+  // GPU capabilities
+  glGetIntegerv (GL_MAX_TEXTURE_IMAGE_UNITS, &priv->max_textures);
+  glGetIntegerv (GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &priv->max_vertex_textures);
+  glGetIntegerv (GL_MAX_TEXTURE_SIZE, &priv->max_texture_size);
+  glGetIntegerv (GL_MAX_CUBE_MAP_TEXTURE_SIZE, &priv->max_cubemap_size);
+
+  priv->max_anisotropy = 0.0f;
+  if (epoxy_has_gl_extension("GL_EXT_texture_filter_anisotropic"))
+    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &priv->max_anisotropy);
+
+  /* Let the driver use as many compiler threads as it likes */
+  priv->supports_multi_draw_indirect =
+    epoxy_gl_version () >= 43 ||
+    (epoxy_has_gl_extension ("GL_ARB_multi_draw_indirect") &&
+     epoxy_has_gl_extension ("GL_ARB_base_instance"));
+
+  /* Layered rendering into cube maps, and filtering across their edges */
+  priv->supports_geometry_shaders = epoxy_gl_version () >= 32;
+  if (epoxy_gl_version () >= 32 || epoxy_has_gl_extension ("GL_ARB_seamless_cube_map"))
+    glEnable (GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+  if (epoxy_has_gl_extension ("GL_KHR_parallel_shader_compile"))
+    glMaxShaderCompilerThreadsKHR (0xffffffff);
+  else if (epoxy_has_gl_extension ("GL_ARB_parallel_shader_compile"))
+    glMaxShaderCompilerThreadsARB (0xffffffff);
+
+  {
+    GLint align;
+
+    glGetIntegerv (GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+    align = MAX (align, 1);
+    priv->frame_ubo_stride = (sizeof (GthreeFrameUniforms) + align - 1) / align * align;
+
+    glGenBuffers (1, &priv->frame_ubo);
+    glBindBuffer (GL_UNIFORM_BUFFER, priv->frame_ubo);
+    glBufferData (GL_UNIFORM_BUFFER, priv->frame_ubo_stride * MAX_FRAME_UNIFORM_SLOTS, NULL, GL_STREAM_DRAW);
+    priv->frame_cameras = g_ptr_array_new ();
+    priv->start_time = g_get_monotonic_time ();
+
+    glGenBuffers (1, &priv->lights_ubo);
+    glBindBuffer (GL_UNIFORM_BUFFER, priv->lights_ubo);
+    glBufferData (GL_UNIFORM_BUFFER, sizeof (GthreeLightsUniforms), NULL, GL_DYNAMIC_DRAW);
+
+    glGenBuffers (1, &priv->cube_faces_ubo);
+    glBindBuffer (GL_UNIFORM_BUFFER, priv->cube_faces_ubo);
+    glBufferData (GL_UNIFORM_BUFFER, sizeof (GthreeCubeFacesUniforms), NULL, GL_STREAM_DRAW);
+
+    glGenTextures (G_N_ELEMENTS (priv->cluster_textures), priv->cluster_textures);
+    for (int i = 0; i < G_N_ELEMENTS (priv->cluster_textures); i++)
+      {
+        /* Only read with texelFetch, but must be complete without mipmaps */
+        glBindTexture (GL_TEXTURE_2D, priv->cluster_textures[i]);
+        glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      }
+    glBindTexture (GL_TEXTURE_2D, 0);
+  }
+
+  priv->supports_vertex_textures = priv->max_vertex_textures > 0;
+  priv->supports_bone_textures =
+    priv->supports_vertex_textures &&
+    epoxy_has_gl_extension("GL_ARB_texture_float");
+
+  //priv->compressed_texture_formats = _glExtensionCompressedTextureS3TC ? glGetParameter( _gl.COMPRESSED_TEXTURE_FORMATS ) : [];
+
+}
+
+static void
+gthree_renderer_finalize (GObject *obj)
+{
+  GthreeRenderer *renderer = GTHREE_RENDERER (obj);
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_assert (gdk_gl_context_get_current () == priv->gl_context);
+
+  g_clear_object (&priv->current_render_target);
+
+  free_vertex_arrays (renderer);
+  free_batches (renderer);
+
+  glDeleteBuffers (1, &priv->frame_ubo);
+  glDeleteBuffers (1, &priv->lights_ubo);
+  glDeleteBuffers (1, &priv->cube_faces_ubo);
+  glDeleteTextures (G_N_ELEMENTS (priv->cluster_textures), priv->cluster_textures);
+  g_ptr_array_unref (priv->frame_cameras);
+
+  if (priv->shadowmap_depth_materials)
+    g_ptr_array_unref (priv->shadowmap_depth_materials);
+  if (priv->shadowmap_distance_materials)
+    g_ptr_array_unref (priv->shadowmap_distance_materials);
+  if (priv->shadowmap_cube_distance_materials)
+    g_ptr_array_unref (priv->shadowmap_cube_distance_materials);
+  if (priv->shadowmap_depth_only_materials)
+    g_ptr_array_unref (priv->shadowmap_depth_only_materials);
+
+  gthree_program_cache_free (priv->program_cache);
+  g_free (priv->program_cache_dir);
+
+  g_array_free (priv->clipping_planes, TRUE);
+  g_array_free (priv->clipping_state, TRUE);
+
+  if (priv->retained_scene)
+    g_object_remove_weak_pointer (G_OBJECT (priv->retained_scene), (gpointer *)&priv->retained_scene);
+  g_ptr_array_unref (priv->lights);
+  g_ptr_array_unref (priv->shadows);
+  g_ptr_array_unref (priv->renderables);
+  g_array_unref (priv->shadow_casters);
+  g_array_unref (priv->cull_nodes);
+  g_array_unref (priv->cull_ranges);
+  g_array_unref (priv->renderable_casters);
+  g_array_unref (priv->shadow_atlas_areas);
+  g_clear_object (&priv->shadow_atlas);
+  g_hash_table_unref (priv->shadow_caster_states);
+  g_hash_table_unref (priv->renderable_lookup);
+  g_array_unref (priv->unindexed_renderables);
+  g_hash_table_unref (priv->shadow_caster_lookup);
+  g_array_unref (priv->unculled_shadow_casters);
+  g_ptr_array_unref (priv->index_results);
+  g_array_unref (priv->index_hits);
+  if (priv->thread_pool)
+    g_thread_pool_free (priv->thread_pool, FALSE, TRUE);
+  g_array_unref (priv->project_items);
+  g_array_unref (priv->project_tasks);
+  g_ptr_array_unref (priv->compiled_programs);
+  g_ptr_array_free (priv->light_setup.directional, TRUE);
+  g_ptr_array_free (priv->light_setup.directional_shadow_map, TRUE);
+  g_array_free (priv->light_setup.directional_shadow_map_matrix, TRUE);
+  g_ptr_array_free (priv->light_setup.point, TRUE);
+  g_ptr_array_free (priv->light_setup.point_shadow_map, TRUE);
+  g_array_free (priv->light_setup.point_shadow_map_matrix, TRUE);
+  g_ptr_array_free (priv->light_setup.spot, TRUE);
+  g_ptr_array_free (priv->light_setup.spot_shadow_map, TRUE);
+  g_array_free (priv->light_setup.spot_shadow_map_matrix, TRUE);
+  g_ptr_array_free (priv->light_setup.shadow, TRUE);
+  g_array_free (priv->light_setup.directional_cascade_splits, TRUE);
+  g_array_free (priv->light_setup.directional_cascade_scale, TRUE);
+  g_array_free (priv->light_setup.directional_cascade_offset, TRUE);
+  g_array_free (priv->light_setup.directional_data, TRUE);
+  g_array_free (priv->light_setup.point_data, TRUE);
+  g_array_free (priv->light_setup.spot_data, TRUE);
+
+  g_array_free (priv->cluster_light_data, TRUE);
+  g_array_free (priv->cluster_ranges, TRUE);
+  g_array_free (priv->cluster_grid, TRUE);
+  g_array_free (priv->cluster_indices, TRUE);
+
+  gthree_render_list_free (priv->current_render_list);
+
+  g_clear_object (&priv->bg_box_mesh);
+  g_clear_object (&priv->bg_plane_mesh);
+  g_clear_object (&priv->current_bg_texture);
+
+  g_clear_object (&priv->gl_context);
+
+  G_OBJECT_CLASS (gthree_renderer_parent_class)->finalize (obj);
+}
+
+static void
+gthree_renderer_class_init (GthreeRendererClass *klass)
+{
+  G_OBJECT_CLASS (klass)->finalize = gthree_renderer_finalize;
+
+#define INIT_QUARK(name) q_##name = g_quark_from_static_string (#name)
+  INIT_QUARK(position);
+  INIT_QUARK(color);
+  INIT_QUARK(uv);
+  INIT_QUARK(uv2);
+  INIT_QUARK(normal);
+  INIT_QUARK(modelMatrix);
+  INIT_QUARK(modelViewMatrix);
+  INIT_QUARK(normalMatrix);
+  INIT_QUARK(clippingPlanes);
+  INIT_QUARK(ambientLightColor);
+  INIT_QUARK(directionalLights);
+  INIT_QUARK(pointLights);
+  INIT_QUARK(spotLights);
+  INIT_QUARK(bindMatrix);
+  INIT_QUARK(bindMatrixInverse);
+  INIT_QUARK(boneMatrices);
+  INIT_QUARK(instanceMatrix);
+  INIT_QUARK(instanceColor);
+  INIT_QUARK(cubeFaceMask);
+
+  graphene_vec3_init (&cube_directions[0],  1,  0,  0);
+  graphene_vec3_init (&cube_directions[1], -1,  0,  0);
+  graphene_vec3_init (&cube_directions[2],  0,  0,  1);
+  graphene_vec3_init (&cube_directions[3],  0,  0, -1);
+  graphene_vec3_init (&cube_directions[4],  0,  1,  0);
+  graphene_vec3_init (&cube_directions[5],  0, -1,  0);
+
+  graphene_vec3_init (&cube_ups[0],  0,  1,  0);
+  graphene_vec3_init (&cube_ups[1],  0,  1,  0);
+  graphene_vec3_init (&cube_ups[2],  0,  1,  0);
+  graphene_vec3_init (&cube_ups[3],  0,  1,  0);
+  graphene_vec3_init (&cube_ups[4],  0,  0,  1);
+  graphene_vec3_init (&cube_ups[5],  0,  0, -1);
+
+  graphene_vec3_init (&cube_face_directions[0],  1,  0,  0);
+  graphene_vec3_init (&cube_face_directions[1], -1,  0,  0);
+  graphene_vec3_init (&cube_face_directions[2],  0,  1,  0);
+  graphene_vec3_init (&cube_face_directions[3],  0, -1,  0);
+  graphene_vec3_init (&cube_face_directions[4],  0,  0,  1);
+  graphene_vec3_init (&cube_face_directions[5],  0,  0, -1);
+
+  graphene_vec3_init (&cube_face_ups[0],  0, -1,  0);
+  graphene_vec3_init (&cube_face_ups[1],  0, -1,  0);
+  graphene_vec3_init (&cube_face_ups[2],  0,  0,  1);
+  graphene_vec3_init (&cube_face_ups[3],  0,  0, -1);
+  graphene_vec3_init (&cube_face_ups[4],  0, -1,  0);
+  graphene_vec3_init (&cube_face_ups[5],  0, -1,  0);
+
+}
+
+void
+gthree_renderer_set_viewport (GthreeRenderer *renderer,
+                              float           x,
+                              float           y,
+                              float           width,
+                              float           height)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  graphene_rect_init (&priv->viewport, x, y, width, height);
+  graphene_rect_init_from_rect (&priv->current_viewport, &priv->viewport);
+
+  glViewport (graphene_rect_get_x (&priv->current_viewport) * priv->pixel_ratio,
+              graphene_rect_get_y (&priv->current_viewport) * priv->pixel_ratio,
+              graphene_rect_get_width (&priv->current_viewport) * priv->pixel_ratio,
+              graphene_rect_get_height (&priv->current_viewport) * priv->pixel_ratio);
+}
+
+void
+gthree_renderer_set_size (GthreeRenderer *renderer,
+                          int             width,
+                          int             height)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->width = width;
+  priv->height = height;
+
+  gthree_renderer_set_viewport (renderer, 0, 0, width, height);
+}
+
+void
+gthree_renderer_set_pixel_ratio (GthreeRenderer     *renderer,
+                                 int                 pixel_ratio)
+{
+ GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->pixel_ratio = pixel_ratio;
+
+  gthree_renderer_set_size (renderer, priv->width, priv->height);
+
+}
+
+int
+gthree_renderer_get_width (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->width;
+}
+
+int
+gthree_renderer_get_height (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->height;
+}
+
+int
+gthree_renderer_get_pixel_ratio (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->pixel_ratio;
+}
+
+int
+gthree_renderer_get_drawing_buffer_width (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->width * priv->pixel_ratio;
+}
+
+int
+gthree_renderer_get_drawing_buffer_height (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->height * priv->pixel_ratio;
+}
+
+void
+gthree_renderer_set_autoclear (GthreeRenderer *renderer,
+                               gboolean        auto_clear)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->auto_clear = !!auto_clear;
+}
+
+gboolean
+gthree_renderer_get_autoclear (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->auto_clear;
+}
+
+void
+gthree_renderer_set_autoclear_color (GthreeRenderer *renderer,
+                                     gboolean        clear_color)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->auto_clear_color = !!clear_color;
+}
+
+gboolean
+gthree_renderer_get_autoclear_color (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->auto_clear_color;
+}
+
+void
+gthree_renderer_set_autoclear_depth (GthreeRenderer *renderer,
+                                     gboolean        clear_depth)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->auto_clear_depth = !!clear_depth;
+}
+
+gboolean
+gthree_renderer_get_autoclear_depth (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->auto_clear_depth;
+}
+
+void
+gthree_renderer_set_autoclear_stencil (GthreeRenderer *renderer,
+                                       gboolean        clear_stencil)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->auto_clear_stencil = !!clear_stencil;
+}
+
+gboolean
+gthree_renderer_get_autoclear_stencil (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->auto_clear_stencil;
+}
+
+void
+gthree_renderer_set_clear_color (GthreeRenderer *renderer,
+                                 const graphene_vec3_t *color)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->clear_color = *color;
+}
+
+const graphene_vec3_t *
+gthree_renderer_get_clear_color  (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return &priv->clear_color;
+}
+
+void
+gthree_renderer_set_gamma_factor (GthreeRenderer *renderer,
+                                   float           factor)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->gamma_factor = factor;
+}
+
+float
+gthree_renderer_get_gamma_factor (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  return priv->gamma_factor;
+}
+
+gboolean
+gthree_renderer_get_shadow_map_enabled (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_enabled;
+}
+
+gboolean
+gthree_renderer_get_retained (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->retained;
+}
+
+/* In retained mode the list of visible objects and lights is kept between
+ * frames and only rebuilt when the scene graph reports a change to children,
+ * visibility, layers or shadow casting. Culling still runs every frame. */
+void
+gthree_renderer_set_retained (GthreeRenderer *renderer,
+                              gboolean        retained)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->retained = !!retained;
+}
+
+GthreeOpaqueSort
+gthree_renderer_get_opaque_sort (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->opaque_sort;
+}
+
+/* DEPTH draws opaque objects front to back, STATE groups them by
+ * program, material and geometry, and only then by coarse depth. */
+void
+gthree_renderer_set_opaque_sort (GthreeRenderer   *renderer,
+                                 GthreeOpaqueSort  opaque_sort)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->opaque_sort = opaque_sort;
+}
+
+/* Counting the switches needs a second, depth sorted, order of the
+ * opaque objects every frame, so it is off by default. */
+void
+gthree_renderer_set_sort_statistics_enabled (GthreeRenderer *renderer,
+                                             gboolean        enabled)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->sort_statistics = !!enabled;
+}
+
+gboolean
+gthree_renderer_get_sort_statistics_enabled (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->sort_statistics;
+}
+
+/* How many switches the last STATE sorted frame avoided compared
+ * to a depth sorted order of the same opaque objects. Always 0
+ * unless enabled with gthree_renderer_set_sort_statistics_enabled(). */
+void
+gthree_renderer_get_sort_statistics (GthreeRenderer *renderer,
+                                     int            *saved_program_switches,
+                                     int            *saved_material_switches,
+                                     int            *saved_vao_switches)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeRenderList *list = priv->current_render_list;
+
+  if (saved_program_switches)
+    *saved_program_switches = list->saved_program_switches;
+  if (saved_material_switches)
+    *saved_material_switches = list->saved_material_switches;
+  if (saved_vao_switches)
+    *saved_vao_switches = list->saved_vao_switches;
+}
+
+/* Linked programs are stored in @dir and reused by later runs with the
+ * same driver, skipping shader compilation. NULL disables the cache. */
+void
+gthree_renderer_set_program_cache_dir (GthreeRenderer *renderer,
+                                       const char     *dir)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_free (priv->program_cache_dir);
+  priv->program_cache_dir = g_strdup (dir);
+}
+
+const char *
+gthree_renderer_get_program_cache_dir (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->program_cache_dir;
+}
+
+void
+gthree_renderer_get_program_cache_stats (GthreeRenderer *renderer,
+                                         guint          *hits,
+                                         guint          *misses)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (hits)
+    *hits = priv->program_binary_hits;
+  if (misses)
+    *misses = priv->program_binary_misses;
+}
+
+/**
+ * gthree_renderer_set_light_block_enabled:
+ * @renderer: a #GthreeRenderer
+ * @enabled: whether to pass lights in a uniform block
+ *
+ * Makes the renderer upload the directional, point and spot lights
+ * into a uniform block once per frame, with the number of lights as
+ * part of the data. Programs then don't depend on the number of lights,
+ * so adding, removing or hiding lights doesn't compile new programs.
+ *
+ * Up to 16 lights of each type fit in the block. Objects that receive
+ * shadows, and scenes with more lights, still use programs compiled for
+ * the exact number of lights.
+ */
+void
+gthree_renderer_set_light_block_enabled (GthreeRenderer *renderer,
+                                         gboolean        enabled)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->light_block_enabled = !!enabled;
+}
+
+gboolean
+gthree_renderer_get_light_block_enabled (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->light_block_enabled;
+}
+
+/**
+ * gthree_renderer_set_clustered_lighting:
+ * @renderer: a #GthreeRenderer
+ * @clustered: whether to bin point and spot lights into clusters
+ *
+ * Splits the view frustum into a grid of clusters, 16×9 tiles on screen
+ * and 24 exponential depth slices, and assigns each point and spot light
+ * to the clusters its range overlaps. Each fragment then only evaluates
+ * the lights in its own cluster, so scenes can have hundreds of lights
+ * with a limited range (see gthree_point_light_set_distance()).
+ *
+ * This uses the light uniform block for the other lights, see
+ * gthree_renderer_set_light_block_enabled(), with the same limits.
+ * Lights with a distance of 0 reach every cluster, and clustered lights
+ * don't cast shadows.
+ *
+ * Objects that receive shadows are drawn with per light uniforms
+ * instead, as without clustering, so they evaluate every light. That
+ * is only done while there are at most 16 point and 16 spot lights.
+ * With more lights, shadow receivers are clustered too, and are drawn
+ * without shadows.
+ *
+ * The cluster textures use texture units 13 to 15, so materials are
+ * limited to 13 textures while this is enabled.
+ */
+void
+gthree_renderer_set_clustered_lighting (GthreeRenderer *renderer,
+                                        gboolean        clustered)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->clustered_lighting = !!clustered;
+}
+
+gboolean
+gthree_renderer_get_clustered_lighting (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->clustered_lighting;
+}
+
+/**
+ * gthree_renderer_set_batching:
+ * @renderer: a #GthreeRenderer
+ * @batching: whether to batch opaque meshes
+ *
+ * Enables drawing opaque meshes that share a material and vertex
+ * layout with a single multi draw call. The geometries of batched
+ * meshes are copied into shared buffers the first time they are
+ * drawn, so this is only useful for geometry that doesn't change.
+ * Batching needs OpenGL 4.3 or multi draw indirect support,
+ * otherwise it is silently ignored.
+ */
+void
+gthree_renderer_set_batching (GthreeRenderer *renderer,
+                              gboolean        batching)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->batching = !!batching;
+}
+
+gboolean
+gthree_renderer_get_batching (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->batching;
+}
+
+/**
+ * gthree_renderer_set_n_threads:
+ * @renderer: a #GthreeRenderer
+ * @n_threads: the number of threads, or 0 for one per processor
+ *
+ * Sets how many threads, including the one calling
+ * gthree_renderer_render(), are used to frustum cull the scene. With
+ * more than one the renderables are split into parts along the scene
+ * graph, and the worker threads cull the subtrees in their part using
+ * the cached subtree bounds, test the remaining objects and project
+ * them for sorting. The visible objects are then added to the render
+ * list in scene order on the calling thread, along with everything
+ * else that touches GL, so the result is the same as with a single
+ * thread, which is the default.
+ *
+ * The worker threads call the in_frustum and get_world_bounding_sphere
+ * vfuncs of #GthreeObjectClass, concurrently for different objects, so
+ * object subclasses overriding them must not modify any state there.
+ * Bounds that the built-in types compute lazily are filled in on the
+ * calling thread first. World matrix updates stay on the calling
+ * thread, as objects can override how they are done. With a spatial
+ * index on the scene its query stays there too, and only the tests of
+ * the objects it returns are spread over the threads.
+ */
+void
+gthree_renderer_set_n_threads (GthreeRenderer *renderer,
+                               int             n_threads)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (n_threads <= 0)
+    n_threads = g_get_num_processors ();
+
+  if (n_threads == priv->n_threads)
+    return;
+
+  priv->n_threads = n_threads;
+
+  if (priv->thread_pool)
+    {
+      g_thread_pool_free (priv->thread_pool, FALSE, TRUE);
+      priv->thread_pool = NULL;
+    }
+
+  if (n_threads > 1)
+    priv->thread_pool = g_thread_pool_new (project_worker, NULL, n_threads - 1, FALSE, NULL);
+}
+
+int
+gthree_renderer_get_n_threads (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->n_threads;
+}
+
+/**
+ * gthree_renderer_get_batch_statistics:
+ * @renderer: a #GthreeRenderer
+ * @n_batches: (out) (optional): return location for the number of batches
+ * @n_batched_objects: (out) (optional): return location for the number of objects in them
+ *
+ * Gets how many multi draw calls the last frame used, and how
+ * many objects were drawn by them.
+ */
+void
+gthree_renderer_get_batch_statistics (GthreeRenderer *renderer,
+                                      int            *n_batches,
+                                      int            *n_batched_objects)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (n_batches)
+    *n_batches = priv->n_batches;
+  if (n_batched_objects)
+    *n_batched_objects = priv->n_batched_objects;
+}
+
+void
+gthree_renderer_note_program_binary (GthreeRenderer *renderer,
+                                     gboolean        hit)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (hit)
+    priv->program_binary_hits++;
+  else
+    priv->program_binary_misses++;
+}
+
+void
+gthree_renderer_set_shadow_map_enabled (GthreeRenderer     *renderer,
+                                        gboolean            enabled)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->shadowmap_enabled = enabled;
+}
+
+gboolean
+gthree_renderer_get_shadow_map_auto_update (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_auto_update;
+}
+
+void
+gthree_renderer_set_shadow_map_auto_update (GthreeRenderer     *renderer,
+                                            gboolean            auto_update)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->shadowmap_auto_update = auto_update;
+}
+
+gboolean
+gthree_renderer_get_shadow_map_needs_update (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_needs_update;
+}
+
+void
+gthree_renderer_set_shadow_map_needs_update (GthreeRenderer     *renderer,
+                                             gboolean            needs_update)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->shadowmap_needs_update = needs_update;
+}
+
+/**
+ * gthree_renderer_set_shadow_map_caching:
+ * @renderer: a #GthreeRenderer
+ * @caching: whether to only re-render shadow maps that changed
+ *
+ * With automatic shadow map updates, only re-renders the shadow map of
+ * a light when the light moved, or when a shadow caster it can reach
+ * changed its transform, geometry, material or visibility.
+ *
+ * Casters that changed during the last few frames are considered
+ * dynamic. The other casters are rendered into a cached map once, and
+ * the dynamic ones are drawn over a copy of it each frame.
+ *
+ * Changes to vertex attributes are only noticed if they are marked with
+ * gthree_attribute_set_needs_update(). Use
+ * gthree_light_shadow_set_needs_update() or
+ * gthree_renderer_set_shadow_map_needs_update() for anything else.
+ */
+void
+gthree_renderer_set_shadow_map_caching (GthreeRenderer *renderer,
+                                        gboolean        caching)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->shadowmap_caching = !!caching;
+}
+
+gboolean
+gthree_renderer_get_shadow_map_caching (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_caching;
+}
+
+/**
+ * gthree_renderer_set_shadow_atlas_size:
+ * @renderer: a #GthreeRenderer
+ * @size: the width and height of the atlas, or 0 to disable it
+ *
+ * Renders the shadow maps of all lights into parts of one shared
+ * texture, so that each light is not its own render target. The
+ * largest maps are placed first, and the lights that don't fit in the
+ * atlas get their own map as usual.
+ *
+ * The maps of a point light stay together, so they need a free area
+ * of four times the map width and two times the map height.
+ */
+void
+gthree_renderer_set_shadow_atlas_size (GthreeRenderer *renderer,
+                                       int             size)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  size = MAX (size, 0);
+  if (priv->shadow_atlas_size == size)
+    return;
+
+  priv->shadow_atlas_size = size;
+  g_clear_object (&priv->shadow_atlas);
+}
+
+int
+gthree_renderer_get_shadow_atlas_size (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadow_atlas_size;
+}
+
+/**
+ * gthree_renderer_set_shadow_map_depth_compare:
+ * @renderer: a #GthreeRenderer
+ * @depth_compare: whether to use depth textures for shadow maps
+ *
+ * Renders the shadow maps of directional and spot lights into depth
+ * textures only, without a color buffer, and samples them with shadow
+ * samplers. The texture unit then does the depth comparison, and with
+ * %GTHREE_SHADOW_MAP_TYPE_PCF and %GTHREE_SHADOW_MAP_TYPE_PCF_SOFT each
+ * lookup is filtered over four texels, so fewer lookups are needed
+ * than with depth packed into RGBA colors.
+ *
+ * Point lights store the distance to the light and keep using RGBA
+ * maps, which are not placed in a shadow atlas in this mode.
+ */
+void
+gthree_renderer_set_shadow_map_depth_compare (GthreeRenderer *renderer,
+                                              gboolean        depth_compare)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  depth_compare = !!depth_compare;
+  if (priv->shadowmap_depth_compare == depth_compare)
+    return;
+
+  priv->shadowmap_depth_compare = depth_compare;
+  g_clear_object (&priv->shadow_atlas);
+}
+
+gboolean
+gthree_renderer_get_shadow_map_depth_compare (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_depth_compare;
+}
+
+/**
+ * gthree_renderer_set_shadow_map_layered:
+ * @renderer: a #GthreeRenderer
+ * @layered: whether to render point light shadows in a single pass
+ *
+ * Renders the shadow maps of point lights into depth cube maps, with
+ * all six faces drawn in one pass by a geometry shader that sends each
+ * triangle to the faces it may cover. The casters are culled against
+ * each face, and the maps are sampled with seamless cube map lookups.
+ *
+ * Layered maps are not placed in a shadow atlas, and are always fully
+ * redrawn when a caster changes. Clipping planes are not applied when
+ * drawing them, so parts of casters that are clipped away still cast
+ * shadows from point lights. Leave this disabled when that matters.
+ *
+ * This has no effect if the OpenGL version is older than 3.2, then
+ * the faces are rendered one by one into a 2D map as usual.
+ */
+void
+gthree_renderer_set_shadow_map_layered (GthreeRenderer *renderer,
+                                        gboolean        layered)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  layered = !!layered;
+  if (priv->shadowmap_layered == layered)
+    return;
+
+  priv->shadowmap_layered = layered;
+  g_clear_object (&priv->shadow_atlas);
+}
+
+gboolean
+gthree_renderer_get_shadow_map_layered (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_layered;
+}
+
+int
+gthree_renderer_get_n_clipping_planes (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->clipping_planes->len;
+}
+
+GArray *
+gthree_renderer_get_clipping_planes (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->clipping_planes;
+}
+
+void
+gthree_renderer_set_clipping_planes (GthreeRenderer     *renderer,
+                                     GArray             *clipping_planes)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (clipping_planes)
+    g_array_ref (clipping_planes);
+  else
+    clipping_planes = g_array_new (FALSE, FALSE, sizeof (graphene_plane_t));
+
+  g_array_unref (priv->clipping_planes);
+  priv->clipping_planes = clipping_planes;
+}
+
+const graphene_plane_t *
+gthree_renderer_get_clipping_plane (GthreeRenderer     *renderer,
+                                    int                 index)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (index < 0 || index >= priv->clipping_planes->len)
+    return NULL;
+
+  return &g_array_index (priv->clipping_planes, graphene_plane_t, index);
+}
+
+void
+gthree_renderer_set_clipping_plane (GthreeRenderer     *renderer,
+                                    int                 index,
+                                    const graphene_plane_t *plane)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (index < 0 || index >= priv->clipping_planes->len)
+    return;
+
+  g_array_index (priv->clipping_planes, graphene_plane_t, index) = *plane;
+}
+
+void
+gthree_renderer_add_clipping_plane (GthreeRenderer     *renderer,
+                                    const graphene_plane_t *plane)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_array_append_val (priv->clipping_planes, *plane);
+}
+
+void
+gthree_renderer_remove_clipping_plane (GthreeRenderer *renderer,
+                                       int             index)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (index < 0 || index >= priv->clipping_planes->len)
+    return;
+
+  g_array_remove_index (priv->clipping_planes, index);
+}
+
+void
+gthree_renderer_remove_all_clipping_planes (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_array_set_size (priv->clipping_planes, 0);
+}
+
+GthreeRenderTarget *
+gthree_renderer_get_render_target (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->current_render_target;
+}
+
+
+static void
+update_multisample_render_target (GthreeRenderer *renderer,
+                                  GthreeRenderTarget *render_target)
+{
+  // TODO
+}
+
+void
+gthree_renderer_set_render_target (GthreeRenderer *renderer,
+                                   GthreeRenderTarget *render_target,
+                                   int active_cube_target,
+                                   int active_mipmap_level)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  gboolean is_cube;
+  int framebuffer;
+  int pixel_ratio;
+
+  if (render_target)
+    g_object_ref (render_target);
+
+  g_clear_object (&priv->current_render_target);
+  priv->current_render_target = render_target;
+
+  if (render_target != NULL)
+    gthree_render_target_realize (render_target);
+
+  framebuffer = priv->window_framebuffer;
+  is_cube = FALSE;
+
+  if (render_target)
+    {
+#ifdef TODO
+      if ( renderTarget.isWebGLRenderTargetCube )
+        {
+          var __webglFramebuffer = properties.get( renderTarget ).__webglFramebuffer;
+          framebuffer = __webglFramebuffer[ activeCubeFace || 0 ];
+          isCube = true;
+        }
+      else if ( renderTarget.isWebGLMultisampleRenderTarget )
+        {
+          framebuffer = properties.get( renderTarget ).__webglMultisampledFramebuffer;
+        }
+      else
+#endif
+        {
+          framebuffer = gthree_render_target_get_gl_framebuffer (render_target);
+        }
+
+      graphene_rect_init_from_rect (&priv->current_viewport,
+                                    gthree_render_target_get_viewport (render_target));
+
+      pixel_ratio = 1;
+#ifdef TODO
+      _currentScissor.copy( renderTarget.scissor );
+      _currentScissorTest = renderTarget.scissorTest;
+#endif
+    }
+  else
+    {
+      graphene_rect_init_from_rect (&priv->current_viewport,
+                                    &priv->viewport);
+#ifdef TODO
+      _currentScissor.copy( _scissor ).multiplyScalar( _pixelRatio );
+      _currentScissorTest = _scissorTest;
+#endif
+      pixel_ratio = priv->pixel_ratio;
+    }
+
+  /* We always set the framebuffer, because something other than the renderer may have changed it
+     inbetween. For instance, a gthree_render_target_download() will do so */
+  glBindFramebuffer (GL_FRAMEBUFFER, framebuffer);
+  priv->current_framebuffer = framebuffer;
+
+  glViewport (graphene_rect_get_x (&priv->current_viewport) * pixel_ratio,
+              graphene_rect_get_y (&priv->current_viewport) * pixel_ratio,
+              graphene_rect_get_width (&priv->current_viewport) * pixel_ratio,
+              graphene_rect_get_height (&priv->current_viewport) * pixel_ratio);
+#ifdef TODO
+  state.scissor( _currentScissor );
+  state.setScissorTest( _currentScissorTest );
+#endif
+
+  if (is_cube)
+    {
+#ifdef TODO
+      var textureProperties = properties.get( renderTarget.texture );
+      _gl.framebufferTexture2D( _gl.FRAMEBUFFER, _gl.COLOR_ATTACHMENT0,
+                                _gl.TEXTURE_CUBE_MAP_POSITIVE_X + ( activeCubeFace || 0 ),
+                                textureProperties.__webglTexture,
+                                activeMipMapLevel || 0 );
+#endif
+    }
+}
+
+
+static void
+gthree_set_default_gl_state (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  glClearColor (0, 0, 0, 1);
+  graphene_vec4_init (&priv->old_clear_color, 0, 0, 0, 1);
+  glClearDepth (1);
+  glClearStencil (0);
+
+  glEnable (GL_VERTEX_PROGRAM_POINT_SIZE);
+
+  glEnable (GL_DEPTH_TEST);
+  glDepthFunc (GL_LEQUAL);
+
+  glFrontFace (GL_CCW);
+  glCullFace (GL_BACK);
+  glEnable (GL_CULL_FACE);
+
+  glEnable (GL_BLEND);
+  glBlendEquation (GL_FUNC_ADD);
+  glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  glViewport (graphene_rect_get_x (&priv->current_viewport) * priv->pixel_ratio,
+              graphene_rect_get_y (&priv->current_viewport) * priv->pixel_ratio,
+              graphene_rect_get_width (&priv->current_viewport) * priv->pixel_ratio,
+              graphene_rect_get_height (&priv->current_viewport) * priv->pixel_ratio);
+};
+
+void
+gthree_renderer_clear (GthreeRenderer *renderer,
+                       gboolean color,
+                       gboolean depth,
+                       gboolean stencil)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_assert (gdk_gl_context_get_current () == priv->gl_context);
+
+  if (color)
+    set_clear_color (renderer, &priv->clear_color, 1);
+
+  clear (color, depth, stencil);
+}
+
+void
+gthree_renderer_clear_depth (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_assert (gdk_gl_context_get_current () == priv->gl_context);
+
+  clear (FALSE, TRUE, FALSE);
+}
+
+void
+gthree_renderer_clear_color (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_assert (gdk_gl_context_get_current () == priv->gl_context);
+
+  set_clear_color (renderer, &priv->clear_color, 1);
+
+  clear (TRUE, FALSE, FALSE);
+}
+
+static void
+set_material_faces (GthreeRenderer *renderer,
+                    GthreeMaterial *material)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeSide side = gthree_material_get_side (material);
+  gboolean double_sided = side == GTHREE_SIDE_DOUBLE;
+  gboolean flip_sided = side == GTHREE_SIDE_BACK;
+
+  if (priv->old_double_sided != double_sided )
+    {
+      if (double_sided)
+        glDisable (GL_CULL_FACE);
+      else
+        glEnable (GL_CULL_FACE);
+
+      priv->old_double_sided = double_sided;
+    }
+
+  if (priv->old_flip_sided != flip_sided ) {
+    if (flip_sided)
+      glFrontFace (GL_CW);
+    else
+      glFrontFace (GL_CCW);
+
+    priv->old_flip_sided = flip_sided;
+  }
+}
+
+static void
+set_depth_test (GthreeRenderer *renderer,
+                gboolean depth_test)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->old_depth_test != depth_test)
+    {
+      if (depth_test)
+        glEnable (GL_DEPTH_TEST);
+      else
+        glDisable (GL_DEPTH_TEST);
+
+      priv->old_depth_test = depth_test;
+    }
+}
+
+static void
+set_depth_write (GthreeRenderer *renderer,
+                 gboolean depth_write)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->old_depth_write != depth_write)
+    {
+      glDepthMask (depth_write);
+      priv->old_depth_write = depth_write;
+    }
+}
+
+static void
+set_line_width (GthreeRenderer *renderer,
+                float line_width)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->old_line_width != line_width)
+    {
+      glLineWidth (line_width);
+      priv->old_line_width = line_width;
+    }
+}
+
+static void
+set_polygon_offset (GthreeRenderer *renderer,
+                    gboolean polygon_offset,
+                    float factor, float units)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->old_polygon_offset != polygon_offset)
+    {
+      if (polygon_offset)
+        glEnable (GL_POLYGON_OFFSET_FILL);
+      else
+        glDisable (GL_POLYGON_OFFSET_FILL);
+
+      priv->old_polygon_offset = polygon_offset;
+    }
+
+  if (polygon_offset && (priv->old_polygon_offset_factor != factor || priv->old_polygon_offset_units != units ))
+    {
+      glPolygonOffset (factor, units);
+      priv->old_polygon_offset_factor = factor;
+      priv->old_polygon_offset_units = units;
+    }
+}
+
+static void
+set_clear_color (GthreeRenderer *renderer,
+                 const graphene_vec3_t *color,
+                 float alpha)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  graphene_vec4_t c4;
+
+  graphene_vec4_init_from_vec3 (&c4, color, alpha);
+  if (!graphene_vec4_equal (&c4, &priv->old_clear_color))
+    {
+      glClearColor (graphene_vec4_get_x (&c4),
+                    graphene_vec4_get_y (&c4),
+                    graphene_vec4_get_z (&c4),
+                    graphene_vec4_get_w (&c4));
+      priv->old_clear_color = c4;
+    }
+}
+
+static void
+set_blending (GthreeRenderer *renderer,
+              GthreeBlendMode blending,
+              guint blend_equation,
+              guint blend_src,
+              guint blend_dst)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (blending != priv->old_blending)
+    {
+      switch (blending)
+        {
+        default:
+        case GTHREE_BLEND_NO:
+          glDisable (GL_BLEND);
+          break;
+
+        case GTHREE_BLEND_NORMAL:
+          glEnable (GL_BLEND);
+          glBlendEquationSeparate (GL_FUNC_ADD, GL_FUNC_ADD);
+          glBlendFuncSeparate (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+          break;
+
+        case GTHREE_BLEND_ADDITIVE:
+          glEnable (GL_BLEND);
+          glBlendEquation (GL_FUNC_ADD);
+          glBlendFunc (GL_SRC_ALPHA, GL_ONE);
+          break;
+
+        case GTHREE_BLEND_SUBTRACTIVE:
+          // TODO: Find blendFuncSeparate() combination
+          glEnable (GL_BLEND);
+          glBlendEquation (GL_FUNC_ADD);
+          glBlendFunc (GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+          break;
+
+        case GTHREE_BLEND_MULTIPLY:
+          // TODO: Find blendFuncSeparate() combination
+          glEnable (GL_BLEND);
+          glBlendEquation (GL_FUNC_ADD);
+          glBlendFunc (GL_ZERO, GL_SRC_COLOR);
+          break;
+
+        case GTHREE_BLEND_CUSTOM:
+          glEnable (GL_BLEND);
+          break;
+        }
+      priv->old_blending = blending;
+    }
+
+  if (blending == GTHREE_BLEND_CUSTOM)
+    {
+      if (blend_equation != priv->old_blend_equation)
+        {
+          glBlendEquation (blend_equation);
+          priv->old_blend_equation = blend_equation;
+        }
+
+      if (blend_src != priv->old_blend_src || blend_dst != priv->old_blend_dst)
+        {
+          glBlendFunc (blend_src, blend_dst);
+
+          priv->old_blend_src = blend_src;
+          priv->old_blend_dst = blend_dst;
+        }
+    }
+  else
+    {
+      priv->old_blend_equation = -1;
+      priv->old_blend_src = -1;
+      priv->old_blend_dst = -1;
+    }
+}
+
+static int
+compare_ints (gconstpointer a,
+              gconstpointer b)
+{
+  int ia = *(const int *)a;
+  int ib = *(const int *)b;
+
+  return (ia > ib) - (ia < ib);
+}
+
+/* Skinned meshes move their vertices away from their bounds, so they
+   keep the per object test, as does anything the index has no leaf
+   for, which queries would otherwise never return */
+static gboolean
+renderable_is_cullable (GthreeObject *object)
+{
+  return
+    gthree_object_get_is_frustum_culled (object) &&
+    !GTHREE_IS_SKINNED_MESH (object) &&
+    gthree_spatial_index_is_indexed_type (object);
+}
+
+static void
+collect_objects (GthreeRenderer *renderer,
+                 GthreeObject   *object,
+                 guint32         layer_mask)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeObject *child;
+  GthreeObjectIter iter;
+  GthreeCullNode *node;
+  int first, n_uncullable, node_index;
+
+  if (!gthree_object_get_visible (object))
+    return;
+
+  first = priv->renderables->len;
+  n_uncullable = priv->n_uncullable_renderables;
+
+  if (gthree_object_check_layer (object, layer_mask))
+    {
+      if (GTHREE_IS_GROUP (object))
+        {
+#if 0
+          groupOrder = object.renderOrder;
+#endif
+        }
+      else if (GTHREE_IS_LIGHT (object))
+        {
+          g_ptr_array_add (priv->lights, object);
+          if (gthree_object_get_cast_shadow (object))
+            g_ptr_array_add (priv->shadows, object);
+        }
+      else if (GTHREE_IS_MESH (object) || GTHREE_IS_LINE_SEGMENTS (object) || GTHREE_IS_SPRITE (object) || GTHREE_IS_POINTS (object))
+        {
+          g_ptr_array_add (priv->renderables, object);
+          if (!renderable_is_cullable (object))
+            priv->n_uncullable_renderables++;
+        }
+    }
+
+  if (gthree_object_get_first_child (object) == NULL)
+    return;
+
+  /* Filled in after the children, which come after it in pre-order */
+  node_index = priv->cull_nodes->len;
+  g_array_set_size (priv->cull_nodes, node_index + 1);
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    collect_objects (renderer, child, layer_mask);
+
+  /* Not worth a bounds test, and then there are no nodes below either */
+  if (priv->renderables->len - first < 2)
+    {
+      g_array_set_size (priv->cull_nodes, node_index);
+      return;
+    }
+
+  node = &g_array_index (priv->cull_nodes, GthreeCullNode, node_index);
+  node->object = object;
+  node->first = first;
+  node->end = priv->renderables->len;
+  node->next = priv->cull_nodes->len;
+  node->cullable = priv->n_uncullable_renderables == n_uncullable;
+}
+
+/* 1 if box is fully inside the frustum, or the sphere if frustum is NULL,
+   -1 if it is fully outside, 0 if it intersects */
+static int
+box_containment (const graphene_box_t *box,
+                 const graphene_frustum_t *frustum,
+                 const graphene_sphere_t *sphere)
+{
+  graphene_vec3_t vertices[8];
+  graphene_point3d_t center, p;
+  float radius = 0;
+  int i;
+
+  if (frustum)
+    {
+      if (!graphene_frustum_intersects_box (frustum, box))
+        return -1;
+    }
+  else
+    {
+      graphene_point3d_t min, max;
+      float dx, dy, dz;
+
+      graphene_sphere_get_center (sphere, &center);
+      radius = graphene_sphere_get_radius (sphere);
+
+      graphene_box_get_min (box, &min);
+      graphene_box_get_max (box, &max);
+      dx = MAX (MAX (min.x - center.x, 0), center.x - max.x);
+      dy = MAX (MAX (min.y - center.y, 0), center.y - max.y);
+      dz = MAX (MAX (min.z - center.z, 0), center.z - max.z);
+      if (dx * dx + dy * dy + dz * dz > radius * radius)
+        return -1;
+    }
+
+  graphene_box_get_vertices (box, vertices);
+  for (i = 0; i < 8; i++)
+    {
+      graphene_point3d_init_from_vec3 (&p, &vertices[i]);
+
+      if (frustum ? !graphene_frustum_contains_point (frustum, &p)
+                  : graphene_point3d_distance (&center, &p, NULL) > radius)
+        return 0;
+    }
+
+  return 1;
+}
+
+static void
+add_cull_range (GArray *ranges,
+                int first,
+                int end,
+                gboolean inside)
+{
+  GthreeCullRange range = { first, end, inside };
+
+  if (first == end)
+    return;
+
+  if (ranges->len > 0)
+    {
+      GthreeCullRange *last = &g_array_index (ranges, GthreeCullRange, ranges->len - 1);
+
+      if (last->end == first && last->inside == inside)
+        {
+          last->end = end;
+          return;
+        }
+    }
+
+  g_array_append_val (ranges, range);
+}
+
+/* Appends the cull ranges of the renderables from r to end, using the
+   cull nodes from n to n_end, which must cover the same renderables */
+static void
+append_cull_ranges (GthreeRenderer *renderer,
+                    const graphene_frustum_t *frustum,
+                    const graphene_sphere_t *sphere,
+                    int n,
+                    int n_end,
+                    int r,
+                    int end,
+                    GArray *ranges)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  while (n < n_end)
+    {
+      GthreeCullNode *node = &g_array_index (priv->cull_nodes, GthreeCullNode, n);
+      graphene_box_t box;
+      int containment;
+
+      if (!node->cullable || !gthree_object_get_subtree_bounding_box (node->object, &box))
+        {
+          n++;
+          continue;
+        }
+
+      containment = box_containment (&box, frustum, sphere);
+      if (containment == 0)
+        {
+          n++;
+          continue;
+        }
+
+      add_cull_range (ranges, r, node->first, FALSE);
+      if (containment > 0)
+        add_cull_range (ranges, node->first, node->end, TRUE);
+      r = node->end;
+      n = node->next;
+    }
+
+  add_cull_range (ranges, r, end, FALSE);
+}
+
+/* Splits the renderables into ranges that are fully inside the frustum
+   (or the sphere if frustum is NULL), and ranges whose objects need to
+   be tested one by one. Subtrees fully outside are left out. */
+static void
+get_cull_ranges (GthreeRenderer *renderer,
+                 const graphene_frustum_t *frustum,
+                 const graphene_sphere_t *sphere,
+                 GArray *ranges)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_array_set_size (ranges, 0);
+  append_cull_ranges (renderer, frustum, sphere,
+                      0, priv->cull_nodes->len,
+                      0, priv->renderables->len,
+                      ranges);
+}
+
+/* The part of projecting that only reads the object and the renderer,
+   so it can run on the worker threads */
+static void
+test_object (GthreeRenderer    *renderer,
+             GthreeProjectItem *item)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeObject *object = item->object;
+
+  item->z = 0;
+  item->visible = !item->cull || !gthree_object_get_is_frustum_culled (object) || gthree_object_is_in_frustum (object, &priv->frustum);
+
+  if (item->visible && priv->sort_objects)
+    {
+      graphene_vec4_t vector;
+
+      /* Get position */
+      graphene_matrix_get_row (gthree_object_get_world_matrix (object), 3, &vector);
+
+      /* project object position to screen */
+      graphene_matrix_transform_vec4 (&priv->proj_screen_matrix, &vector, &vector);
+
+      item->z = graphene_vec4_get_z (&vector) / graphene_vec4_get_w (&vector);
+    }
+}
+
+/* The rest, which updates buffers and the render list */
+static void
+add_object (GthreeRenderer    *renderer,
+            GthreeProjectItem *item)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeObject *object = item->object;
+
+  if (GTHREE_IS_SKINNED_MESH (object))
+    {
+      GthreeSkeleton *skeleton = gthree_skinned_mesh_get_skeleton (GTHREE_SKINNED_MESH (object));
+      if (skeleton)
+        gthree_skeleton_update (skeleton);
+    }
+
+  if (item->visible)
+    {
+      gthree_object_update (object);
+
+      priv->current_render_list->current_z = item->z;
+
+      gthree_object_fill_render_list (object, priv->current_render_list);
+    }
+}
+
+/* Fills in the bounds that the frustum test caches lazily, so that
+   the worker threads don't race on computing them */
+static void
+prepare_bounds (GthreeObject *object)
+{
+  GthreeGeometry *geometry = NULL;
+  graphene_sphere_t sphere;
+
+  if (GTHREE_IS_INSTANCED_MESH (object))
+    gthree_object_get_world_bounding_sphere (object, &sphere);
+  else if (GTHREE_IS_MESH (object))
+    geometry = gthree_mesh_get_geometry (GTHREE_MESH (object));
+  else if (GTHREE_IS_POINTS (object))
+    geometry = gthree_points_get_geometry (GTHREE_POINTS (object));
+  else if (GTHREE_IS_LINE_SEGMENTS (object))
+    geometry = gthree_line_segments_get_geometry (GTHREE_LINE_SEGMENTS (object));
+
+  if (geometry)
+    gthree_geometry_get_bounding_sphere (geometry);
+}
+
+static void
+project_object (GthreeRenderer *renderer,
+                GthreeObject   *object,
+                gboolean        cull)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeProjectItem item = { object, cull };
+
+  /* Tested on the worker threads later */
+  if (priv->thread_pool)
+    {
+      if (cull && gthree_object_get_is_frustum_culled (object))
+        prepare_bounds (object);
+      g_array_append_val (priv->project_items, item);
+      return;
+    }
+
+  test_object (renderer, &item);
+  add_object (renderer, &item);
+}
+
+static void
+test_renderable (GthreeProjectJob *job,
+                 int               index,
+                 gboolean          cull)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (job->renderer);
+  GthreeProjectItem *item = &job->items[index];
+
+  item->object = g_ptr_array_index (priv->renderables, index);
+  item->cull = cull;
+  test_object (job->renderer, item);
+}
+
+/* Culls the subtrees of the task using their cached bounds, and tests
+   the objects in what is left. Items for the culled subtrees stay empty. */
+static void
+run_project_task (GthreeProjectJob  *job,
+                  GthreeProjectTask *task,
+                  GArray            *ranges)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (job->renderer);
+  int i, j;
+
+  if (task->inside)
+    {
+      for (j = task->first; j < task->end; j++)
+        test_renderable (job, j, FALSE);
+      return;
+    }
+
+  g_array_set_size (ranges, 0);
+  append_cull_ranges (job->renderer, &priv->frustum, NULL,
+                      task->node, task->node_end,
+                      task->first, task->end,
+                      ranges);
+
+  for (i = 0; i < ranges->len; i++)
+    {
+      GthreeCullRange *range = &g_array_index (ranges, GthreeCullRange, i);
+
+      for (j = range->first; j < range->end; j++)
+        test_renderable (job, j, !range->inside);
+    }
+}
+
+static void
+run_project_chunks (GthreeProjectJob *job)
+{
+  GArray *ranges = NULL;
+  int chunk;
+
+  while ((chunk = g_atomic_int_add (&job->next_chunk, 1)) < job->n_chunks)
+    {
+      int end = MIN ((chunk + 1) * PROJECT_CHUNK_SIZE, job->n_items);
+      int i;
+
+      if (job->tasks)
+        {
+          if (ranges == NULL)
+            ranges = g_array_new (FALSE, FALSE, sizeof (GthreeCullRange));
+          run_project_task (job, &job->tasks[chunk], ranges);
+          continue;
+        }
+
+      for (i = chunk * PROJECT_CHUNK_SIZE; i < end; i++)
+        test_object (job->renderer, &job->items[i]);
+    }
+
+  if (ranges)
+    g_array_unref (ranges);
+}
+
+static void
+project_worker (gpointer data,
+                gpointer user_data)
+{
+  GthreeProjectJob *job = data;
+
+  run_project_chunks (job);
+
+  g_mutex_lock (&job->mutex);
+  if (--job->n_running == 0)
+    g_cond_signal (&job->cond);
+  g_mutex_unlock (&job->mutex);
+}
+
+/* Runs the chunks of job on the worker threads and the calling one */
+static void
+run_project_job (GthreeRenderer   *renderer,
+                 GthreeProjectJob *job)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int i, n_workers;
+
+  g_mutex_init (&job->mutex);
+  g_cond_init (&job->cond);
+
+  n_workers = MAX (MIN (priv->n_threads, job->n_chunks) - 1, 0);
+  job->n_running = n_workers;
+  for (i = 0; i < n_workers; i++)
+    g_thread_pool_push (priv->thread_pool, job, NULL);
+
+  run_project_chunks (job);
+
+  g_mutex_lock (&job->mutex);
+  while (job->n_running > 0)
+    g_cond_wait (&job->cond, &job->mutex);
+  g_mutex_unlock (&job->mutex);
+
+  g_mutex_clear (&job->mutex);
+  g_cond_clear (&job->cond);
+}
+
+/* Tests the collected items on the worker threads and the calling one,
+   then adds the visible ones in the order they were collected, so the
+   render list is the same as when projecting on a single thread */
+static void
+project_items (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GArray *items = priv->project_items;
+  GthreeProjectJob job = { NULL };
+  int i;
+
+  job.renderer = renderer;
+  job.items = (GthreeProjectItem *)items->data;
+  job.n_items = items->len;
+  job.n_chunks = (items->len + PROJECT_CHUNK_SIZE - 1) / PROJECT_CHUNK_SIZE;
+  run_project_job (renderer, &job);
+
+  for (i = 0; i < items->len; i++)
+    add_object (renderer, &g_array_index (items, GthreeProjectItem, i));
+
+  g_array_set_size (items, 0);
+}
+
+/* Adds tasks for the renderables from first to end, which have no cull
+   nodes, or don't need them when inside is set */
+static void
+add_project_span (GthreeRenderer *renderer,
+                  int             first,
+                  int             end,
+                  gboolean        inside)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int i;
+
+  for (i = first; i < end; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (priv->renderables, i);
+
+      if (!inside && gthree_object_get_is_frustum_culled (object))
+        prepare_bounds (object);
+    }
+
+  for (i = first; i < end; i += PROJECT_CHUNK_SIZE)
+    {
+      GthreeProjectTask task = { 0, 0, i, MIN (i + PROJECT_CHUNK_SIZE, end), inside };
+
+      g_array_append_val (priv->project_tasks, task);
+    }
+}
+
+/* Splits the renderables from r to end, covered by the cull nodes from
+   n to n_end, into tasks of at most about max_size renderables. The
+   boxes of subtrees that are too large for one task are tested here, so
+   the workers only see the parts that aren't culled. The subtree bounds
+   and the other bounds that are computed lazily are filled in here too,
+   so that the workers only read them. */
+static void
+add_project_tasks (GthreeRenderer *renderer,
+                   int             n,
+                   int             n_end,
+                   int             r,
+                   int             end,
+                   int             max_size)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  graphene_box_t box;
+  int i;
+
+  while (n < n_end)
+    {
+      GthreeCullNode *node = &g_array_index (priv->cull_nodes, GthreeCullNode, n);
+      int containment = 0;
+
+      add_project_span (renderer, r, node->first, FALSE);
+
+      if (node->end - node->first <= max_size)
+        {
+          GthreeProjectTask task = { n, node->next, node->first, node->end, FALSE };
+
+          for (i = n; i < node->next; i++)
+            {
+              GthreeCullNode *child = &g_array_index (priv->cull_nodes, GthreeCullNode, i);
+
+              if (child->cullable)
+                gthree_object_get_subtree_bounding_box (child->object, &box);
+            }
+
+          for (i = node->first; i < node->end; i++)
+            {
+              GthreeObject *object = g_ptr_array_index (priv->renderables, i);
+
+              if (gthree_object_get_is_frustum_culled (object))
+                prepare_bounds (object);
+            }
+
+          g_array_append_val (priv->project_tasks, task);
+        }
+      else
+        {
+          if (node->cullable && gthree_object_get_subtree_bounding_box (node->object, &box))
+            containment = box_containment (&box, &priv->frustum, NULL);
+
+          if (containment > 0)
+            add_project_span (renderer, node->first, node->end, TRUE);
+          else if (containment == 0)
+            add_project_tasks (renderer, n + 1, node->next, node->first, node->end, max_size);
+        }
+
+      r = node->end;
+      n = node->next;
+    }
+
+  add_project_span (renderer, r, end, FALSE);
+}
+
+/* Culls the subtrees and tests the objects on the worker threads, with
+   one item per renderable, then adds the visible ones in order. This
+   gives the same render list as get_cull_ranges() and project_object()
+   on a single thread. */
+static void
+project_tasks (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GArray *items = priv->project_items;
+  GArray *tasks = priv->project_tasks;
+  GthreeProjectJob job = { NULL };
+  int i, n = priv->renderables->len;
+
+  g_array_set_size (items, n);
+  memset (items->data, 0, n * sizeof (GthreeProjectItem));
+  g_array_set_size (tasks, 0);
+
+  add_project_tasks (renderer,
+                     0, priv->cull_nodes->len,
+                     0, n,
+                     MAX (PROJECT_CHUNK_SIZE, n / (priv->n_threads * 4)));
+
+  job.renderer = renderer;
+  job.items = (GthreeProjectItem *)items->data;
+  job.n_items = n;
+  job.tasks = (GthreeProjectTask *)tasks->data;
+  job.n_chunks = tasks->len;
+  run_project_job (renderer, &job);
+
+  for (i = 0; i < n; i++)
+    {
+      GthreeProjectItem *item = &g_array_index (items, GthreeProjectItem, i);
+
+      if (item->object != NULL)
+        add_object (renderer, item);
+    }
+
+  g_array_set_size (items, 0);
+}
+
+static void
+collect_scene (GthreeRenderer *renderer,
+               GthreeScene    *scene,
+               GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  guint32 layer_mask = gthree_object_get_layer_mask (GTHREE_OBJECT (camera));
+  guint graph_age = gthree_object_get_graph_age (GTHREE_OBJECT (scene));
+
+  /* Only walk the graph if something that affects what is visible changed,
+     transforms and materials are picked up from the cached objects below */
+  if (!priv->retained ||
+      priv->retained_scene != scene ||
+      priv->retained_graph_age != graph_age ||
+      priv->retained_layer_mask != layer_mask)
+    {
+      g_ptr_array_set_size (priv->lights, 0);
+      g_ptr_array_set_size (priv->shadows, 0);
+      g_ptr_array_set_size (priv->renderables, 0);
+      g_array_set_size (priv->cull_nodes, 0);
+      priv->n_uncullable_renderables = 0;
+
+      collect_objects (renderer, GTHREE_OBJECT (scene), layer_mask);
+      priv->renderable_lookup_dirty = TRUE;
+
+      if (priv->retained_scene != scene)
+        {
+          if (priv->retained_scene)
+            g_object_remove_weak_pointer (G_OBJECT (priv->retained_scene), (gpointer *)&priv->retained_scene);
+          priv->retained_scene = scene;
+          g_object_add_weak_pointer (G_OBJECT (scene), (gpointer *)&priv->retained_scene);
+        }
+      priv->retained_graph_age = graph_age;
+      priv->retained_layer_mask = layer_mask;
+    }
+}
+
+static void
+update_renderable_lookup (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int i;
+
+  g_hash_table_remove_all (priv->renderable_lookup);
+  g_array_set_size (priv->unindexed_renderables, 0);
+
+  for (i = 0; i < priv->renderables->len; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (priv->renderables, i);
+
+      g_hash_table_insert (priv->renderable_lookup, object, GINT_TO_POINTER (i + 1));
+      if (!renderable_is_cullable (object))
+        g_array_append_val (priv->unindexed_renderables, i);
+    }
+
+  priv->renderable_lookup_dirty = FALSE;
+}
+
+/* Only projects the renderables that the spatial index has in the
+   frustum, and the ones it can't cull. They are projected in the same
+   order as without the index, so the render list comes out the same. */
+static void
+project_indexed_renderables (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GArray *hits = priv->index_hits;
+  int i;
+
+  if (priv->renderable_lookup_dirty)
+    update_renderable_lookup (renderer);
+
+  g_ptr_array_set_size (priv->index_results, 0);
+  g_array_set_size (hits, 0);
+
+  gthree_spatial_index_query_frustum (priv->spatial_index, &priv->frustum, priv->index_results);
+
+  for (i = 0; i < priv->index_results->len; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (priv->index_results, i);
+      int index = GPOINTER_TO_INT (g_hash_table_lookup (priv->renderable_lookup, object)) - 1;
+
+      /* Hidden, outside the camera layers, or in unindexed_renderables */
+      if (index < 0 || !renderable_is_cullable (object))
+        continue;
+
+      g_array_append_val (hits, index);
+    }
+
+  g_array_append_vals (hits, priv->unindexed_renderables->data, priv->unindexed_renderables->len);
+  g_array_sort (hits, compare_ints);
+
+  for (i = 0; i < hits->len; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (priv->renderables, g_array_index (hits, int, i));
+      graphene_sphere_t sphere;
+      gboolean cull;
+
+      /* Objects without bounds come back from every query */
+      cull =
+        !renderable_is_cullable (object) ||
+        !gthree_spatial_index_get_bounding_sphere (priv->spatial_index, object, &sphere);
+
+      project_object (renderer, object, cull);
+    }
+}
+
+static void
+project_renderables (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int i;
+
+  if (priv->spatial_index)
+    {
+      project_indexed_renderables (renderer);
+      return;
+    }
+
+  if (priv->thread_pool)
+    {
+      project_tasks (renderer);
+      return;
+    }
+
+  if (priv->cull_nodes->len > 0)
+    {
+      get_cull_ranges (renderer, &priv->frustum, NULL, priv->cull_ranges);
+      for (i = 0; i < priv->cull_ranges->len; i++)
+        {
+          GthreeCullRange *range = &g_array_index (priv->cull_ranges, GthreeCullRange, i);
+          int j;
+
+          for (j = range->first; j < range->end; j++)
+            project_object (renderer, g_ptr_array_index (priv->renderables, j), !range->inside);
+        }
+      return;
+    }
+
+  for (i = 0; i < priv->renderables->len; i++)
+    project_object (renderer, g_ptr_array_index (priv->renderables, i), TRUE);
+}
 
-  return priv->current_render_target;
+static void
+project_scene (GthreeRenderer *renderer,
+               GthreeScene    *scene,
+               GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  collect_scene (renderer, scene, camera);
+
+  project_renderables (renderer);
+
+  if (priv->project_items->len > 0)
+    project_items (renderer);
+}
+
+static void
+set_float4_array (GthreeUniforms *uniforms,
+                  const char     *name,
+                  GArray         *array)
+{
+  GthreeUniform *uni = gthree_uniforms_lookup_from_string (uniforms, name);
+
+  if (uni)
+    gthree_uniform_set_float4_array (uni, array);
+}
+
+static void
+material_apply_light_setup (GthreeUniforms *m_uniforms,
+                            GthreeLightSetup *light_setup,
+                            gboolean update_only)
+{
+  gthree_uniforms_set_vec3 (m_uniforms, "ambientLightColor", &light_setup->ambient);
+
+  gthree_uniforms_set_uarray (m_uniforms, "directionalLights", light_setup->directional, update_only);
+  gthree_uniforms_set_uarray (m_uniforms, "pointLights", light_setup->point, update_only);
+  gthree_uniforms_set_uarray (m_uniforms, "spotLights", light_setup->spot, update_only);
+
+  gthree_uniforms_set_texture_array (m_uniforms, "directionalShadowMap", light_setup->directional_shadow_map);
+  gthree_uniforms_set_matrix4_array (m_uniforms, "directionalShadowMatrix", light_setup->directional_shadow_map_matrix);
+  set_float4_array (m_uniforms, "directionalCascadeSplits", light_setup->directional_cascade_splits);
+  gthree_uniforms_set_matrix4_array (m_uniforms, "directionalCascadeScale", light_setup->directional_cascade_scale);
+  gthree_uniforms_set_matrix4_array (m_uniforms, "directionalCascadeOffset", light_setup->directional_cascade_offset);
+
+  gthree_uniforms_set_texture_array (m_uniforms, "spotShadowMap", light_setup->spot_shadow_map);
+  gthree_uniforms_set_matrix4_array (m_uniforms, "spotShadowMatrix", light_setup->spot_shadow_map_matrix);
+
+  gthree_uniforms_set_texture_array (m_uniforms, "pointShadowMap", light_setup->point_shadow_map);
+  gthree_uniforms_set_matrix4_array (m_uniforms, "pointShadowMatrix", light_setup->point_shadow_map_matrix);
+}
+
+/* Lights are read from the GthreeLights block, unless the object needs
+   shadow maps, which are arrays of samplers sized by the light counts.
+   With clustered lighting the point and spot lights are in textures, so
+   there is no limit on those. Shadow receivers then only fall back to
+   per light uniforms while that stays within the block limits, with
+   more lights they are drawn clustered, without shadows. */
+static gboolean
+use_light_block (GthreeRenderer *renderer,
+                 GthreeObject *object)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  gboolean shadowed;
+
+  if (!priv->light_block_enabled && !priv->clustered_lighting)
+    return FALSE;
+
+  if (priv->light_setup.directional->len > GTHREE_MAX_BLOCK_LIGHTS)
+    return FALSE;
+
+  if (!priv->clustered_lighting &&
+      (priv->light_setup.point->len > GTHREE_MAX_BLOCK_LIGHTS ||
+       priv->light_setup.spot->len > GTHREE_MAX_BLOCK_LIGHTS))
+    return FALSE;
+
+  shadowed = priv->shadowmap_enabled && gthree_object_get_receive_shadow (object) && priv->shadows->len > 0;
+  if (!shadowed)
+    return TRUE;
+
+  return
+    priv->clustered_lighting &&
+    (priv->light_setup.point->len > GTHREE_MAX_BLOCK_LIGHTS ||
+     priv->light_setup.spot->len > GTHREE_MAX_BLOCK_LIGHTS);
+}
+
+/* Point light shadows rendered into depth cube maps in a single pass */
+static gboolean
+shadow_maps_layered (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_layered && priv->supports_geometry_shaders;
+}
+
+static void
+get_program_parameters (GthreeRenderer *renderer,
+                        GthreeMaterial *material,
+                        GthreeObject *object,
+                        GthreeProgramParameters *parameters)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int max_bones;
+
+  /* The parameters are hashed and compared as raw memory, so clear padding too */
+  memset (parameters, 0, sizeof (GthreeProgramParameters));
+
+  //material.addEventListener( 'dispose', onMaterialDispose );
+  //var u, a, identifiers, i, parameters, maxBones, maxShadows, shaderID;
+
+
+  parameters->precision = GTHREE_PRECISION_HIGH;
+  parameters->supports_vertex_textures = priv->supports_vertex_textures;
+  // TODO: Get encoding from currentRenderTarget if set
+  parameters->output_encoding = GTHREE_ENCODING_FORMAT_GAMMA;
+  parameters->physically_correct_lights = priv->physically_correct_lights;
+
+  gthree_material_set_params (material, parameters);
+  parameters->light_block = use_light_block (renderer, object);
+  parameters->clustered_lights = parameters->light_block && priv->clustered_lighting;
+  if (!parameters->light_block)
+    {
+      parameters->num_dir_lights = priv->light_setup.directional->len;
+      parameters->num_point_lights = priv->light_setup.point->len;
+      parameters->num_spot_lights = priv->light_setup.spot->len;
+    }
+
+  max_bones = 0;
+  if (GTHREE_IS_SKINNED_MESH (object))
+    {
+      GthreeSkeleton *skeleton = gthree_skinned_mesh_get_skeleton (GTHREE_SKINNED_MESH (object));
+      if (skeleton)
+        max_bones = gthree_skeleton_get_n_bones (skeleton);
+      // TODO: Limit max bones to GPU specs
+    }
+
+  parameters->max_bones = max_bones;
+  parameters->skinning = GTHREE_IS_MESH_MATERIAL (material) && gthree_mesh_material_get_skinning (GTHREE_MESH_MATERIAL (material));
+
+  parameters->morph_targets = GTHREE_IS_MESH_MATERIAL (material) && gthree_mesh_material_get_morph_targets (GTHREE_MESH_MATERIAL (material));
+  parameters->morph_normals = GTHREE_IS_MESH_MATERIAL (material) && gthree_mesh_material_get_morph_normals (GTHREE_MESH_MATERIAL (material));
+
+  parameters->instancing = GTHREE_IS_INSTANCED_MESH (object);
+  parameters->instancing_color = parameters->instancing &&
+    gthree_instanced_mesh_get_instance_color (GTHREE_INSTANCED_MESH (object)) != NULL;
+
+  parameters->num_clipping_planes = priv->num_clipping_planes;
+
+  parameters->shadow_map_enabled = priv->shadowmap_enabled && gthree_object_get_receive_shadow (object) && priv->shadows->len > 0;
+  parameters->shadow_map_type = priv->shadowmap_type;
+  parameters->shadow_cascades = parameters->shadow_map_enabled && priv->light_setup.hash.num_cascaded > 0;
+  parameters->shadow_depth_compare = parameters->shadow_map_enabled && priv->shadowmap_depth_compare;
+  parameters->shadow_point_cube = parameters->shadow_map_enabled && shadow_maps_layered (renderer);
+
+  /* The geometry shader only passes on the world position, so there is
+     no view position to clip with, see gthree_renderer_set_shadow_map_layered() */
+  if (parameters->shadow_cube_layers)
+    parameters->num_clipping_planes = 0;
+
+#ifdef TODO
+  parameters =
+    {
+    lightMap: !! material.lightMap,
+    bumpMap: !! material.bumpMap,
+    normalMap: !! material.normalMap,
+    specularMap: !! material.specularMap,
+    alphaMap: !! material.alphaMap,
+
+    fog: fog,
+    useFog: material.fog,
+    fogExp: fog instanceof THREE.FogExp2,
+
+    logarithmicDepthBuffer: _logarithmicDepthBuffer,
+
+    useVertexTexture: _supportsBoneTextures && object && object.skeleton && object.skeleton.useVertexTexture,
+    };
+#endif
+}
+
+static void
+get_material_variant_key (GthreeRenderer *renderer,
+                          GthreeObject *object,
+                          GthreeMaterialVariantKey *key)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  memset (key, 0, sizeof (GthreeMaterialVariantKey));
+
+  key->light_hash = priv->light_setup.hash;
+  key->light_hash.obj_receive_shadow = gthree_object_get_receive_shadow (object) && priv->shadowmap_enabled;
+  key->light_block = use_light_block (renderer, object);
+  key->clustered_lights = key->light_block && priv->clustered_lighting;
+  if (key->light_block)
+    {
+      key->light_hash.num_directional = 0;
+      key->light_hash.num_point = 0;
+      key->light_hash.num_spot = 0;
+    }
+  key->instancing = GTHREE_IS_INSTANCED_MESH (object);
+  key->instancing_color = key->instancing &&
+    gthree_instanced_mesh_get_instance_color (GTHREE_INSTANCED_MESH (object)) != NULL;
+  key->num_clipping_planes = priv->num_clipping_planes;
+  key->shadow_depth_compare = key->light_hash.obj_receive_shadow && priv->shadowmap_depth_compare;
+  key->shadow_point_cube = key->light_hash.obj_receive_shadow && shadow_maps_layered (renderer);
+
+  if (GTHREE_IS_SKINNED_MESH (object))
+    {
+      GthreeSkeleton *skeleton = gthree_skinned_mesh_get_skeleton (GTHREE_SKINNED_MESH (object));
+      if (skeleton)
+        key->max_bones = gthree_skeleton_get_n_bones (skeleton);
+    }
+}
+
+static GthreeMaterialVariant *
+find_material_variant (GthreeMaterialProperties *material_properties,
+                       const GthreeMaterialVariantKey *key)
+{
+  int i;
+
+  for (i = 0; i < material_properties->n_variants; i++)
+    {
+      GthreeMaterialVariant *variant = &material_properties->variants[i];
+
+      if (memcmp (&variant->key, key, sizeof (GthreeMaterialVariantKey)) == 0)
+        return variant;
+    }
+
+  return NULL;
+}
+
+static GthreeMaterialVariant *
+add_material_variant (GthreeMaterialProperties *material_properties,
+                      const GthreeMaterialVariantKey *key,
+                      GthreeProgram *program,
+                      int num_supported_morph_targets,
+                      int num_supported_morph_normals)
+{
+  GthreeMaterialVariant *variant;
+
+  if (material_properties->n_variants < GTHREE_MAX_MATERIAL_VARIANTS)
+    variant = &material_properties->variants[material_properties->n_variants++];
+  else
+    {
+      variant = &material_properties->variants[material_properties->next_variant];
+      material_properties->next_variant = (material_properties->next_variant + 1) % GTHREE_MAX_MATERIAL_VARIANTS;
+      g_clear_object (&variant->program);
+      g_clear_pointer (&variant->locations, g_array_unref);
+    }
+
+  variant->key = *key;
+  variant->program = g_object_ref (program);
+  variant->num_supported_morph_targets = num_supported_morph_targets;
+  variant->num_supported_morph_normals = num_supported_morph_normals;
+
+  return variant;
+}
+
+/* Lays out the light uniforms for the current light counts. This is
+   only needed when the counts changed, set_program() keeps the values
+   up to date. */
+static void
+material_layout_lights (GthreeRenderer *renderer,
+                        GthreeMaterialProperties *material_properties,
+                        GthreeUniforms *m_uniforms)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  material_apply_light_setup (m_uniforms, &priv->light_setup, FALSE);
+
+  if (memcmp (&material_properties->uniforms_light_hash, &priv->light_setup.hash, sizeof (GthreeLightSetupHash)) != 0)
+    {
+      material_properties->uniforms_light_hash = priv->light_setup.hash;
+      material_properties->uniforms_layout++;
+    }
+}
+
+/* Points the uniforms at the locations in the variant program, reusing
+   the ones saved the last time as long as the uniforms didn't change */
+static void
+material_variant_update_locations (GthreeMaterialProperties *material_properties,
+                                   GthreeShader *shader,
+                                   GthreeMaterialVariant *variant)
+{
+  if (variant->locations != NULL &&
+      variant->locations_layout == material_properties->uniforms_layout &&
+      gthree_shader_restore_uniform_locations (shader, variant->locations))
+    return;
+
+  gthree_shader_update_uniform_locations_for_program (shader, variant->program);
+
+  g_clear_pointer (&variant->locations, g_array_unref);
+  variant->locations = gthree_shader_save_uniform_locations (shader);
+  variant->locations_layout = material_properties->uniforms_layout;
+}
+
+/* Switches to a program that init_material() already set up */
+static void
+use_material_variant (GthreeRenderer *renderer,
+                      GthreeMaterial *material,
+                      GthreeMaterialVariant *variant)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
+  GthreeShader *shader = gthree_material_get_shader (material);
+
+  g_set_object (&material_properties->program, variant->program);
+  material_properties->key = variant->key;
+
+  if (GTHREE_IS_MESH_MATERIAL (material))
+    {
+      if (gthree_mesh_material_get_morph_targets (GTHREE_MESH_MATERIAL (material)))
+        gthree_mesh_material_set_num_supported_morph_targets (GTHREE_MESH_MATERIAL (material),
+                                                              variant->num_supported_morph_targets);
+      if (gthree_mesh_material_get_morph_normals (GTHREE_MESH_MATERIAL (material)))
+        gthree_mesh_material_set_num_supported_morph_normals (GTHREE_MESH_MATERIAL (material),
+                                                              variant->num_supported_morph_normals);
+    }
+
+  if (priv->lights->len > 0 && !variant->key.light_block &&
+      memcmp (&material_properties->uniforms_light_hash, &priv->light_setup.hash, sizeof (GthreeLightSetupHash)) != 0)
+    material_layout_lights (renderer, material_properties, gthree_shader_get_uniforms (shader));
+
+  material_variant_update_locations (material_properties, shader, variant);
+}
+
+static gboolean
+init_material (GthreeRenderer *renderer,
+               GthreeMaterial *material,
+               gpointer fog,
+               GthreeObject *object,
+               const GthreeMaterialVariantKey *key)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeProgram *program;
+  GthreeShader *shader;
+  GthreeProgramParameters parameters;
+  GthreeUniforms *m_uniforms;
+  GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
+  GthreeMaterialVariant *variant;
+  int num_supported_morph_targets = 0;
+  int num_supported_morph_normals = 0;
+
+  shader = gthree_material_get_shader (material);
+
+  get_program_parameters (renderer, material, object, &parameters);
+
+  program = gthree_program_cache_get (priv->program_cache, shader, &parameters, renderer);
+  g_clear_object (&material_properties->program);
+  material_properties->program = program;
+
+  /* Keep the material marked as needing an update so we check again next
+     frame, and make sure the key doesn't match the half initialized program */
+  if (priv->skip_pending_programs && !gthree_program_is_ready (program))
+    {
+      material_properties->key.light_hash.num_point = -1;
+      return FALSE;
+    }
+
+  // TODO: thee.js uses the lightstate current_hash and other stuff to avoid some stuff here?
+  // I think it caches the material uniforms we calculate here and avoid reloading if switching to a new program?
+
+  if (GTHREE_IS_MESH_MATERIAL (material) &&
+      gthree_mesh_material_get_morph_targets (GTHREE_MESH_MATERIAL (material)))
+    {
+      GHashTable *program_attributes = gthree_program_get_attribute_locations (program);
+
+      for (int i = 0; i < MAX_MORPH_TARGETS; i++ )
+        {
+          g_autofree char *attr = g_strdup_printf ("morphTarget%d", i);
+
+          if (g_hash_table_lookup (program_attributes, attr) != NULL)
+            num_supported_morph_targets++;
+        }
+      gthree_mesh_material_set_num_supported_morph_targets (GTHREE_MESH_MATERIAL (material),
+                                                            num_supported_morph_targets);
+    }
+
+  if (GTHREE_IS_MESH_MATERIAL (material) &&
+      gthree_mesh_material_get_morph_normals (GTHREE_MESH_MATERIAL (material)))
+    {
+      GHashTable *program_attributes = gthree_program_get_attribute_locations (program);
+
+      for (int i = 0; i < MAX_MORPH_NORMALS; i++ )
+        {
+          g_autofree char *attr = g_strdup_printf ("morphNormal%d", i);
+
+          if (g_hash_table_lookup (program_attributes, attr) != NULL)
+            num_supported_morph_normals++;
+        }
+
+      gthree_mesh_material_set_num_supported_morph_normals (GTHREE_MESH_MATERIAL (material),
+                                                            num_supported_morph_normals);
+    }
+
+  m_uniforms = gthree_shader_get_uniforms (shader);
+
+  // store the light setup it was created for
+  material_properties->key = *key;
+  variant = add_material_variant (material_properties, key, program,
+                                  num_supported_morph_targets, num_supported_morph_normals);
+
+  if (!GTHREE_IS_SHADER_MATERIAL (material)
+#ifdef TODO
+      || material.clipping === true
+#endif
+      )
+    {
+      GthreeUniform *uni =  gthree_uniforms_lookup (m_uniforms, q_clippingPlanes);
+      if (uni == NULL)
+        {
+          uni = gthree_uniform_newq (q_clippingPlanes, GTHREE_UNIFORM_TYPE_FLOAT4_ARRAY);
+          gthree_uniforms_add (m_uniforms, uni); // takes ownership
+          material_properties->uniforms_layout++;
+        }
+    }
+
+  if (priv->lights->len > 0 && !key->light_block)
+    material_layout_lights (renderer, material_properties, m_uniforms);
+
+  material_variant_update_locations (material_properties, shader, variant);
+
+  return TRUE;
+}
+
+#if 0
+static void
+print_matrix4 (float *s)
+{
+  int i,j;
+  for (i = 0; i < 4; i++)
+    {
+      if (i == 0)
+        g_print("[ ");
+      else
+        g_print("  ");
+      for (j = 0; j < 4; j++)
+        {
+          if (j != 0)
+            g_print (", ");
+          g_print ("%f", *s++);
+        }
+      if (i == 3)
+        g_print("]\n");
+      else
+        g_print("\n");
+    }
 }
+#endif
 
-
-static void
-update_multisample_render_target (GthreeRenderer *renderer,
-                                  GthreeRenderTarget *render_target)
+static int
+get_cluster_slice (const float *depth_params,
+                   float        depth)
 {
-  // TODO
+  int slice = floorf (logf (depth) * depth_params[0] + depth_params[1]);
+
+  return CLAMP (slice, 0, GTHREE_CLUSTERS_Z - 1);
 }
 
-void
-gthree_renderer_set_render_target (GthreeRenderer *renderer,
-                                   GthreeRenderTarget *render_target,
-                                   int active_cube_target,
-                                   int active_mipmap_level)
+/* Conservative range of clusters overlapped by the view space bounding
+   box of a light sphere. A radius of 0 means the light has no limit. */
+static void
+get_cluster_range (const float             *position,
+                   float                    radius,
+                   const graphene_matrix_t *projection,
+                   float                    near,
+                   float                    far,
+                   const float             *depth_params,
+                   GthreeClusterRange      *range)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  gboolean is_cube;
-  int framebuffer;
-  int pixel_ratio;
+  float min_depth, max_depth;
+  float min_x = 1, max_x = -1, min_y = 1, max_y = -1;
+  int i;
 
-  if (render_target)
-    g_object_ref (render_target);
+  range->x0 = 0;
+  range->x1 = GTHREE_CLUSTERS_X - 1;
+  range->y0 = 0;
+  range->y1 = GTHREE_CLUSTERS_Y - 1;
+  range->z0 = 0;
+  range->z1 = GTHREE_CLUSTERS_Z - 1;
 
-  g_clear_object (&priv->current_render_target);
-  priv->current_render_target = render_target;
+  if (radius <= 0)
+    return;
 
-  if (render_target != NULL)
-    gthree_render_target_realize (render_target);
+  /* View space looks down -z */
+  min_depth = -position[2] - radius;
+  max_depth = -position[2] + radius;
+  if (max_depth < near || min_depth > far)
+    goto culled;
 
-  framebuffer = priv->window_framebuffer;
-  is_cube = FALSE;
+  range->z0 = get_cluster_slice (depth_params, MAX (min_depth, near));
+  range->z1 = get_cluster_slice (depth_params, MIN (max_depth, far));
 
-  if (render_target)
+  /* Corners behind the camera don't project, so keep all tiles */
+  if (min_depth <= near)
+    return;
+
+  for (i = 0; i < 8; i++)
     {
-#ifdef TODO
-      if ( renderTarget.isWebGLRenderTargetCube )
-        {
-          var __webglFramebuffer = properties.get( renderTarget ).__webglFramebuffer;
-          framebuffer = __webglFramebuffer[ activeCubeFace || 0 ];
-          isCube = true;
-        }
-      else if ( renderTarget.isWebGLMultisampleRenderTarget )
+      graphene_vec4_t corner, clip;
+      float w;
+
+      graphene_vec4_init (&corner,
+                          position[0] + ((i & 1) ? radius : -radius),
+                          position[1] + ((i & 2) ? radius : -radius),
+                          position[2] + ((i & 4) ? radius : -radius),
+                          1);
+      graphene_matrix_transform_vec4 (projection, &corner, &clip);
+      w = graphene_vec4_get_w (&clip);
+
+      min_x = MIN (min_x, graphene_vec4_get_x (&clip) / w);
+      max_x = MAX (max_x, graphene_vec4_get_x (&clip) / w);
+      min_y = MIN (min_y, graphene_vec4_get_y (&clip) / w);
+      max_y = MAX (max_y, graphene_vec4_get_y (&clip) / w);
+    }
+
+  if (max_x < -1 || min_x > 1 || max_y < -1 || min_y > 1)
+    goto culled;
+
+  range->x0 = CLAMP ((int) floorf ((min_x * 0.5f + 0.5f) * GTHREE_CLUSTERS_X), 0, GTHREE_CLUSTERS_X - 1);
+  range->x1 = CLAMP ((int) floorf ((max_x * 0.5f + 0.5f) * GTHREE_CLUSTERS_X), 0, GTHREE_CLUSTERS_X - 1);
+  range->y0 = CLAMP ((int) floorf ((min_y * 0.5f + 0.5f) * GTHREE_CLUSTERS_Y), 0, GTHREE_CLUSTERS_Y - 1);
+  range->y1 = CLAMP ((int) floorf ((max_y * 0.5f + 0.5f) * GTHREE_CLUSTERS_Y), 0, GTHREE_CLUSTERS_Y - 1);
+  return;
+
+ culled:
+  range->x0 = 1;
+  range->x1 = 0;
+}
+
+static void
+upload_cluster_texture (guint        texture,
+                        int          unit,
+                        GLenum       internal_format,
+                        GLenum       format,
+                        GLenum       type,
+                        int          width,
+                        int          height,
+                        const void  *data)
+{
+  glActiveTexture (GL_TEXTURE0 + unit);
+  glBindTexture (GL_TEXTURE_2D, texture);
+  glTexImage2D (GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, data);
+}
+
+/* Bins the point and spot lights into the clusters of the current view
+ * and uploads the per cluster light lists. Lights are numbered with
+ * the point lights first, the shaders tell them apart by index. */
+static void
+setup_light_clusters (GthreeRenderer *renderer,
+                      GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeLightSetup *setup = &priv->light_setup;
+  GthreeLightsUniforms *block = &priv->lights_block;
+  const graphene_matrix_t *projection = gthree_camera_get_projection_matrix (camera);
+  int n_point = setup->point_data->len;
+  int n_lights = n_point + setup->spot_data->len;
+  int n_clusters = GTHREE_CLUSTERS_X * GTHREE_CLUSTERS_Y * GTHREE_CLUSTERS_Z;
+  guint32 *grid, *indices;
+  float *light_data;
+  float near, far, width, height, x, y;
+  guint32 n_indices;
+  int i, cx, cy, cz;
+
+  near = MAX (gthree_camera_get_near (camera), 0.01f);
+  far = MAX (gthree_camera_get_far (camera), near * 1.01f);
+
+  block->cluster_size[0] = GTHREE_CLUSTERS_X;
+  block->cluster_size[1] = GTHREE_CLUSTERS_Y;
+  block->cluster_size[2] = GTHREE_CLUSTERS_Z;
+  block->cluster_size[3] = n_point;
+  block->cluster_depth[0] = GTHREE_CLUSTERS_Z / logf (far / near);
+  block->cluster_depth[1] = -logf (near) * block->cluster_depth[0];
+
+  /* Same as what gthree_renderer_set_render_target() will pick */
+  if (priv->current_render_target)
+    {
+      const graphene_rect_t *viewport = gthree_render_target_get_viewport (priv->current_render_target);
+
+      x = graphene_rect_get_x (viewport);
+      y = graphene_rect_get_y (viewport);
+      width = graphene_rect_get_width (viewport);
+      height = graphene_rect_get_height (viewport);
+    }
+  else
+    {
+      x = graphene_rect_get_x (&priv->viewport) * priv->pixel_ratio;
+      y = graphene_rect_get_y (&priv->viewport) * priv->pixel_ratio;
+      width = graphene_rect_get_width (&priv->viewport) * priv->pixel_ratio;
+      height = graphene_rect_get_height (&priv->viewport) * priv->pixel_ratio;
+    }
+  block->cluster_viewport[0] = x;
+  block->cluster_viewport[1] = y;
+  block->cluster_viewport[2] = 1.0f / MAX (width, 1);
+  block->cluster_viewport[3] = 1.0f / MAX (height, 1);
+
+  /* Light data, one row of 4 texels per light */
+  g_array_set_size (priv->cluster_light_data, MAX (n_lights, 1) * 16);
+  light_data = (float *)priv->cluster_light_data->data;
+  memset (light_data, 0, priv->cluster_light_data->len * sizeof (float));
+  g_array_set_size (priv->cluster_ranges, n_lights);
+
+  for (i = 0; i < n_lights; i++)
+    {
+      GthreeClusterRange *range = &g_array_index (priv->cluster_ranges, GthreeClusterRange, i);
+      const float *position;
+
+      if (i < n_point)
         {
-          framebuffer = properties.get( renderTarget ).__webglMultisampledFramebuffer;
+          GthreePointLightBlock *light = &g_array_index (setup->point_data, GthreePointLightBlock, i);
+
+          memcpy (light_data + i * 16, light, sizeof (GthreePointLightBlock));
+          position = light->position;
         }
       else
-#endif
         {
-          framebuffer = gthree_render_target_get_gl_framebuffer (render_target);
-        }
+          GthreeSpotLightBlock *light = &g_array_index (setup->spot_data, GthreeSpotLightBlock, i - n_point);
 
-      graphene_rect_init_from_rect (&priv->current_viewport,
-                                    gthree_render_target_get_viewport (render_target));
+          memcpy (light_data + i * 16, light, sizeof (GthreeSpotLightBlock));
+          position = light->position;
+        }
 
-      pixel_ratio = 1;
-#ifdef TODO
-      _currentScissor.copy( renderTarget.scissor );
-      _currentScissorTest = renderTarget.scissorTest;
-#endif
+      /* Spot lights are binned by the sphere around the cone */
+      get_cluster_range (position, position[3], projection, near, far, block->cluster_depth, range);
     }
-  else
+
+  /* Count the lights per cluster, then turn the counts into offsets */
+  g_array_set_size (priv->cluster_grid, n_clusters * 2);
+  grid = (guint32 *)priv->cluster_grid->data;
+  memset (grid, 0, n_clusters * 2 * sizeof (guint32));
+
+  for (i = 0; i < n_lights; i++)
     {
-      graphene_rect_init_from_rect (&priv->current_viewport,
-                                    &priv->viewport);
-#ifdef TODO
-      _currentScissor.copy( _scissor ).multiplyScalar( _pixelRatio );
-      _currentScissorTest = _scissorTest;
-#endif
-      pixel_ratio = priv->pixel_ratio;
+      GthreeClusterRange *range = &g_array_index (priv->cluster_ranges, GthreeClusterRange, i);
+
+      for (cz = range->z0; cz <= range->z1; cz++)
+        for (cy = range->y0; cy <= range->y1; cy++)
+          for (cx = range->x0; cx <= range->x1; cx++)
+            grid[((cz * GTHREE_CLUSTERS_Y + cy) * GTHREE_CLUSTERS_X + cx) * 2 + 1]++;
     }
 
-  /* We always set the framebuffer, because something other than the renderer may have changed it
-     inbetween. For instance, a gthree_render_target_download() will do so */
-  glBindFramebuffer (GL_FRAMEBUFFER, framebuffer);
-  priv->current_framebuffer = framebuffer;
+  n_indices = 0;
+  for (i = 0; i < n_clusters; i++)
+    {
+      grid[i * 2] = n_indices;
+      n_indices += grid[i * 2 + 1];
+      grid[i * 2 + 1] = 0;
+    }
 
-  glViewport (graphene_rect_get_x (&priv->current_viewport) * pixel_ratio,
-              graphene_rect_get_y (&priv->current_viewport) * pixel_ratio,
-              graphene_rect_get_width (&priv->current_viewport) * pixel_ratio,
-              graphene_rect_get_height (&priv->current_viewport) * pixel_ratio);
-#ifdef TODO
-  state.scissor( _currentScissor );
-  state.setScissorTest( _currentScissorTest );
-#endif
+  g_array_set_size (priv->cluster_indices,
+                    MAX ((n_indices + GTHREE_CLUSTER_INDICES_WIDTH - 1) / GTHREE_CLUSTER_INDICES_WIDTH, 1) * GTHREE_CLUSTER_INDICES_WIDTH);
+  indices = (guint32 *)priv->cluster_indices->data;
 
-  if (is_cube)
+  for (i = 0; i < n_lights; i++)
     {
-#ifdef TODO
-      var textureProperties = properties.get( renderTarget.texture );
-      _gl.framebufferTexture2D( _gl.FRAMEBUFFER, _gl.COLOR_ATTACHMENT0,
-                                _gl.TEXTURE_CUBE_MAP_POSITIVE_X + ( activeCubeFace || 0 ),
-                                textureProperties.__webglTexture,
-                                activeMipMapLevel || 0 );
-#endif
+      GthreeClusterRange *range = &g_array_index (priv->cluster_ranges, GthreeClusterRange, i);
+
+      for (cz = range->z0; cz <= range->z1; cz++)
+        for (cy = range->y0; cy <= range->y1; cy++)
+          for (cx = range->x0; cx <= range->x1; cx++)
+            {
+              guint32 *cluster = &grid[((cz * GTHREE_CLUSTERS_Y + cy) * GTHREE_CLUSTERS_X + cx) * 2];
+
+              indices[cluster[0] + cluster[1]++] = i;
+            }
     }
-}
 
+  upload_cluster_texture (priv->cluster_textures[0], GTHREE_CLUSTER_LIGHTS_TEXTURE_UNIT,
+                          GL_RGBA32F, GL_RGBA, GL_FLOAT,
+                          4, MAX (n_lights, 1), light_data);
+  upload_cluster_texture (priv->cluster_textures[1], GTHREE_CLUSTER_GRID_TEXTURE_UNIT,
+                          GL_RG32UI, GL_RG_INTEGER, GL_UNSIGNED_INT,
+                          GTHREE_CLUSTERS_X * GTHREE_CLUSTERS_Y, GTHREE_CLUSTERS_Z, grid);
+  upload_cluster_texture (priv->cluster_textures[2], GTHREE_CLUSTER_INDICES_TEXTURE_UNIT,
+                          GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT,
+                          GTHREE_CLUSTER_INDICES_WIDTH, priv->cluster_indices->len / GTHREE_CLUSTER_INDICES_WIDTH,
+                          indices);
+
+  /* Texture uploads elsewhere assume they can use the active unit */
+  glActiveTexture (GL_TEXTURE0);
+}
 
 static void
-gthree_set_default_gl_state (GthreeRenderer *renderer)
+setup_lights (GthreeRenderer *renderer, GthreeCamera *camera)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeLightSetup *setup = &priv->light_setup;
+  int i;
 
-  glClearColor (0, 0, 0, 1);
-  graphene_vec4_init (&priv->old_clear_color, 0, 0, 0, 1);
-  glClearDepth (1);
-  glClearStencil (0);
+  graphene_vec3_init (&setup->ambient, 0, 0, 0);
 
-  glEnable (GL_VERTEX_PROGRAM_POINT_SIZE);
+  g_ptr_array_set_size (setup->directional, 0);
+  g_ptr_array_set_size (setup->directional_shadow_map, 0);
+  g_array_set_size (setup->directional_shadow_map_matrix, 0);
+  g_ptr_array_set_size (setup->point, 0);
+  g_ptr_array_set_size (setup->point_shadow_map, 0);
+  g_array_set_size (setup->point_shadow_map_matrix, 0);
+  g_ptr_array_set_size (setup->spot, 0);
+  g_ptr_array_set_size (setup->spot_shadow_map, 0);
+  g_array_set_size (setup->spot_shadow_map_matrix, 0);
+  g_array_set_size (setup->directional_cascade_splits, 0);
+  g_array_set_size (setup->directional_cascade_scale, 0);
+  g_array_set_size (setup->directional_cascade_offset, 0);
+  g_array_set_size (setup->directional_data, 0);
+  g_array_set_size (setup->point_data, 0);
+  g_array_set_size (setup->spot_data, 0);
+  setup->hash.num_cascaded = 0;
+
+  for (i = 0; i < priv->lights->len; i++)
+    {
+      GthreeLight *light = g_ptr_array_index (priv->lights, i);
 
-  glEnable (GL_DEPTH_TEST);
-  glDepthFunc (GL_LEQUAL);
+      gthree_light_setup (light, camera, setup);
+    }
 
-  glFrontFace (GL_CCW);
-  glCullFace (GL_BACK);
-  glEnable (GL_CULL_FACE);
+  setup->hash.num_directional = setup->directional->len;
+  setup->hash.num_point = setup->point->len;
+  setup->hash.num_spot = setup->spot->len;
+  setup->hash.num_shadow = setup->shadow->len;
 
-  glEnable (GL_BLEND);
-  glBlendEquation (GL_FUNC_ADD);
-  glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  if (priv->light_block_enabled || priv->clustered_lighting)
+    {
+      GthreeLightsUniforms *block = &priv->lights_block;
 
-  glViewport (graphene_rect_get_x (&priv->current_viewport) * priv->pixel_ratio,
-              graphene_rect_get_y (&priv->current_viewport) * priv->pixel_ratio,
-              graphene_rect_get_width (&priv->current_viewport) * priv->pixel_ratio,
-              graphene_rect_get_height (&priv->current_viewport) * priv->pixel_ratio);
-};
+      graphene_vec3_to_float (&setup->ambient, block->ambient);
+      block->counts[0] = MIN (setup->directional_data->len, GTHREE_MAX_BLOCK_LIGHTS);
+      memcpy (block->directional, setup->directional_data->data,
+              block->counts[0] * sizeof (GthreeDirectionalLightBlock));
 
-void
-gthree_renderer_clear (GthreeRenderer *renderer,
-                       gboolean color,
-                       gboolean depth,
-                       gboolean stencil)
+      if (priv->clustered_lighting)
+        {
+          block->counts[1] = 0;
+          block->counts[2] = 0;
+          setup_light_clusters (renderer, camera);
+        }
+      else
+        {
+          block->counts[1] = MIN (setup->point_data->len, GTHREE_MAX_BLOCK_LIGHTS);
+          block->counts[2] = MIN (setup->spot_data->len, GTHREE_MAX_BLOCK_LIGHTS);
+          memcpy (block->point, setup->point_data->data,
+                  block->counts[1] * sizeof (GthreePointLightBlock));
+          memcpy (block->spot, setup->spot_data->data,
+                  block->counts[2] * sizeof (GthreeSpotLightBlock));
+        }
+
+      glBindBuffer (GL_UNIFORM_BUFFER, priv->lights_ubo);
+      glBufferSubData (GL_UNIFORM_BUFFER, 0, sizeof (GthreeLightsUniforms), block);
+      glBindBufferBase (GL_UNIFORM_BUFFER, GTHREE_LIGHTS_UNIFORMS_BINDING, priv->lights_ubo);
+    }
+}
+
+static void *
+project_planes (GthreeRenderer *renderer,
+                const graphene_plane_t *planes,
+                int n_planes,
+                GthreeCamera *camera,
+                int dst_offset,
+                gboolean skip_transform)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-  g_assert (gdk_gl_context_get_current () == priv->gl_context);
+  if (n_planes != 0)
+    {
+      guint flat_size = dst_offset + n_planes * 4;
+      graphene_matrix_t viewNormalMatrix;
+      float *dst_array;
 
-  if (color)
-    set_clear_color (renderer, &priv->clear_color, 1);
+      g_array_set_size (priv->clipping_state, flat_size);
+      dst_array = (float *)priv->clipping_state->data;
+
+      if (!skip_transform)
+        {
+          const graphene_matrix_t *viewMatrix = gthree_camera_get_world_inverse_matrix (camera);
+
+          /* Get normal matrix */
+          graphene_matrix_inverse (viewMatrix, &viewNormalMatrix);
+          graphene_matrix_transpose (&viewNormalMatrix, &viewNormalMatrix);
+
+          for (int i = 0, i4 = dst_offset; i != n_planes; i++, i4 += 4)
+            {
+              graphene_plane_t transformed_plane;
+              graphene_vec3_t normal;
+
+              graphene_plane_transform (&planes[i], viewMatrix, &viewNormalMatrix, &transformed_plane);
+              graphene_plane_get_normal (&transformed_plane, &normal);
+
+              dst_array[i4+0] = graphene_vec3_get_x (&normal);
+              dst_array[i4+1] = graphene_vec3_get_y (&normal);
+              dst_array[i4+2] = graphene_vec3_get_z (&normal);
+              dst_array[i4+3] = graphene_plane_get_constant (&transformed_plane);
+            }
+        }
+      else
+        {
+          for (int i = 0, i4 = dst_offset; i != n_planes; i++, i4 += 4)
+            {
+              graphene_vec3_t normal;
+              float constant;
+
+              graphene_plane_get_normal (&planes[i], &normal);
+              constant = graphene_plane_get_constant (&planes[i]);
+
+              dst_array[i4+0] = graphene_vec3_get_x (&normal);
+              dst_array[i4+1] = graphene_vec3_get_y (&normal);
+              dst_array[i4+2] = graphene_vec3_get_z (&normal);
+              dst_array[i4+3] = constant;
+            }
+        }
+    }
+
+  priv->num_clipping_planes = n_planes;
+
+  return NULL;
+}
+
+static gboolean
+clipping_init (GthreeRenderer *renderer,
+               GthreeCamera *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  gboolean enabled;
+
+  enabled =
+    priv->clipping_planes->len != 0 ||
+    // enable state of previous frame - the clipping code has to
+    // run another frame in order to reset the state:
+    priv->old_num_global_planes != 0;
+
+  project_planes (renderer,
+                  (const graphene_plane_t *)priv->clipping_planes->data,
+                  priv->clipping_planes->len,
+                  camera,
+                  0, FALSE);
+
+  priv->old_num_global_planes = priv->clipping_planes->len;
 
-  clear (color, depth, stencil);
+  return enabled;
 }
 
-void
-gthree_renderer_clear_depth (GthreeRenderer *renderer)
+static void
+clipping_begin_shadows (GthreeRenderer *renderer)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  g_assert (gdk_gl_context_get_current () == priv->gl_context);
+  // TODO
+}
 
-  clear (FALSE, TRUE, FALSE);
+static void
+clipping_end_shadows (GthreeRenderer *renderer)
+{
+  // TODO
 }
 
-void
-gthree_renderer_clear_color (GthreeRenderer *renderer)
+#define SHADER_MAP_MORPHING_FLAG (1<<0)
+#define SHADER_MAP_SKINNING_FLAG (1<<1)
+#define SHADER_MAP_INSTANCING_FLAG (1<<2)
+
+/* Which of the depth material variants an object needs, this only
+   depends on the object so it is picked once per shadow update */
+static int
+get_depth_material_variant (GthreeObject *object,
+                            GthreeGeometry *geometry,
+                            GthreeMaterial *material)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  gboolean useMorphing = FALSE;
+  gboolean useSkinning = FALSE;
+  int variantIndex = 0;
 
-  g_assert (gdk_gl_context_get_current () == priv->gl_context);
+#ifdef TODO
+  if (material.morphTargets && geometry)
+    useMorphing = geometry.morphAttributes && geometry.morphAttributes.position && geometry.morphAttributes.position.length > 0;
+#endif
 
-  set_clear_color (renderer, &priv->clear_color, 1);
+#ifdef TODO
+  if (GTHREE_IS_SKINNED_MESH (object) && material.skinning === false ) {
+    console.warn( 'THREE.WebGLShadowMap: THREE.SkinnedMesh with material.skinning set to false:', object );
+  }
+#endif
 
-  clear (TRUE, FALSE, FALSE);
+#ifdef TODO
+  useSkinning = object.isSkinnedMesh && material.skinning;
+#endif
+
+  if (useMorphing)
+    variantIndex |= SHADER_MAP_MORPHING_FLAG;
+  if (useSkinning)
+    variantIndex |= SHADER_MAP_SKINNING_FLAG;
+  if (GTHREE_IS_INSTANCED_MESH (object))
+    variantIndex |= SHADER_MAP_INSTANCING_FLAG;
+
+  return variantIndex;
 }
 
 static void
-set_material_faces (GthreeRenderer *renderer,
-                    GthreeMaterial *material)
+ensure_depth_materials (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  GthreeSide side = gthree_material_get_side (material);
-  gboolean double_sided = side == GTHREE_SIDE_DOUBLE;
-  gboolean flip_sided = side == GTHREE_SIDE_BACK;
 
-  if (priv->old_double_sided != double_sided )
+  if (priv->shadowmap_depth_materials == NULL)
     {
-      if (double_sided)
-        glDisable (GL_CULL_FACE);
-      else
-        glEnable (GL_CULL_FACE);
+      priv->shadowmap_depth_materials = g_ptr_array_new_with_free_func (g_object_unref);
+      priv->shadowmap_distance_materials = g_ptr_array_new_with_free_func (g_object_unref);
+      priv->shadowmap_cube_distance_materials = g_ptr_array_new_with_free_func (g_object_unref);
+      priv->shadowmap_depth_only_materials = g_ptr_array_new_with_free_func (g_object_unref);
 
-      priv->old_double_sided = double_sided;
-    }
+      /* The instancing variants are configured identically, they only exist so
+         that instanced and plain meshes don't keep rebuilding each others program */
+      for (int i = 0; i < 8; i++)
+        {
+          gboolean useMorphing = (i & SHADER_MAP_MORPHING_FLAG) != 0;
+          gboolean useSkinning = (i & SHADER_MAP_SKINNING_FLAG) != 0;
 
-  if (priv->old_flip_sided != flip_sided ) {
-    if (flip_sided)
-      glFrontFace (GL_CW);
-    else
-      glFrontFace (GL_CCW);
+          GthreeMeshDepthMaterial *m = gthree_mesh_depth_material_new ();
+          gthree_mesh_depth_material_set_depth_packing_format (m, GTHREE_DEPTH_PACKING_FORMAT_RGBA);
 
-    priv->old_flip_sided = flip_sided;
-  }
+          gthree_mesh_material_set_morph_targets (GTHREE_MESH_MATERIAL (m), useMorphing);
+          gthree_mesh_material_set_skinning (GTHREE_MESH_MATERIAL (m), useSkinning);
+          g_ptr_array_add (priv->shadowmap_depth_materials, m);
+
+          GthreeMeshDistanceMaterial *m2 = gthree_mesh_distance_material_new ();
+          gthree_mesh_material_set_morph_targets (GTHREE_MESH_MATERIAL (m2), useMorphing);
+          gthree_mesh_material_set_skinning (GTHREE_MESH_MATERIAL (m2), useSkinning);
+          g_ptr_array_add (priv->shadowmap_distance_materials, m2);
+
+          GthreeMeshDistanceMaterial *m4 = gthree_mesh_distance_material_new ();
+          gthree_mesh_distance_material_set_cube_layers (m4, TRUE);
+          gthree_mesh_material_set_morph_targets (GTHREE_MESH_MATERIAL (m4), useMorphing);
+          gthree_mesh_material_set_skinning (GTHREE_MESH_MATERIAL (m4), useSkinning);
+          g_ptr_array_add (priv->shadowmap_cube_distance_materials, m4);
+
+          /* Only the depth buffer is kept for depth compare maps, so don't pack the color */
+          GthreeMeshDepthMaterial *m3 = gthree_mesh_depth_material_new ();
+          gthree_mesh_depth_material_set_depth_packing_format (m3, GTHREE_DEPTH_PACKING_FORMAT_BASIC);
+          gthree_mesh_material_set_morph_targets (GTHREE_MESH_MATERIAL (m3), useMorphing);
+          gthree_mesh_material_set_skinning (GTHREE_MESH_MATERIAL (m3), useSkinning);
+          g_ptr_array_add (priv->shadowmap_depth_only_materials, m3);
+        }
+    }
 }
 
-static void
-set_depth_test (GthreeRenderer *renderer,
-                gboolean depth_test)
+/* Picks the depth material for a pass, the state that depends on the
+   light is set once per light by update_distance_materials() */
+static GthreeMaterial *
+getDepthMaterial (GthreeRenderer *renderer,
+                  GthreeObject *object,
+                  int variantIndex,
+                  gboolean isPointLight)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeMaterial *result = NULL;
+  GthreeMaterial *customMaterial = NULL;
+  GPtrArray *materialVariants = NULL;
 
-  if (priv->old_depth_test != depth_test)
+  ensure_depth_materials (renderer);
+
+  materialVariants = priv->shadowmap_depth_materials;
+  if (priv->shadowmap_depth_compare)
+    materialVariants = priv->shadowmap_depth_only_materials;
+#ifdef TODO
+  var customMaterial = object.customDepthMaterial;
+#endif
+
+  if (isPointLight)
     {
-      if (depth_test)
-        glEnable (GL_DEPTH_TEST);
-      else
-        glDisable (GL_DEPTH_TEST);
+      materialVariants = priv->shadowmap_distance_materials;
+      if (priv->shadow_cube_pass)
+        materialVariants = priv->shadowmap_cube_distance_materials;
+#ifdef TODO
+      customMaterial = object.customDistanceMaterial;
+#endif
+    }
 
-      priv->old_depth_test = depth_test;
+  if (!customMaterial)
+    {
+      result = g_ptr_array_index (materialVariants, variantIndex);
+    }
+  else
+    {
+      result = customMaterial;
     }
-}
 
-static void
-set_depth_write (GthreeRenderer *renderer,
-                 gboolean depth_write)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+#ifdef TODO
+  if ( _renderer.localClippingEnabled &&
+       material.clipShadows === true &&
+       material.clippingPlanes.length !== 0 ) {
+    // in this case we need a unique material instance reflecting the
+    // appropriate state
 
-  if (priv->old_depth_write != depth_write)
-    {
-      glDepthMask (depth_write);
-      priv->old_depth_write = depth_write;
+    var keyA = result.uuid, keyB = material.uuid;
+    var materialsForVariant = _materialCache[ keyA ];
+
+    if ( materialsForVariant === undefined ) {
+      materialsForVariant = {};
+      _materialCache[ keyA ] = materialsForVariant;
+    }
+
+    var cachedMaterial = materialsForVariant[ keyB ];
+    if ( cachedMaterial === undefined ) {
+      cachedMaterial = result.clone();
+      materialsForVariant[ keyB ] = cachedMaterial;
     }
+
+    result = cachedMaterial;
+  }
+#endif
+
+#ifdef TODO
+  result.side = ( material.shadowSide != null ) ? material.shadowSide : shadowSide[ material.side ];
+#endif
+
+#ifdef TODO
+  result.clipShadows = material.clipShadows;
+  result.clippingPlanes = material.clippingPlanes;
+  result.clipIntersection = material.clipIntersection;
+#endif
+
+#ifdef TODO
+  result.wireframeLinewidth = material.wireframeLinewidth;
+  result.linewidth = material.linewidth;
+#endif
+
+  return result;
 }
 
+/* The depth materials are shared by all casters, so only touch them
+   when they differ, as changing them makes them initialize again */
 static void
-set_line_width (GthreeRenderer *renderer,
-                float line_width)
+depth_material_copy_state (GthreeMaterial *result,
+                           GthreeMaterial *material)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  if (priv->old_line_width != line_width)
-    {
-      glLineWidth (line_width);
-      priv->old_line_width = line_width;
-    }
+  if (gthree_material_get_is_visible (result) != gthree_material_get_is_visible (material))
+    gthree_material_set_is_visible (result, gthree_material_get_is_visible (material));
+  if (GTHREE_IS_MESH_MATERIAL (material))
+    gthree_mesh_material_set_is_wireframe (GTHREE_MESH_MATERIAL (result),
+                                           gthree_mesh_material_get_is_wireframe (GTHREE_MESH_MATERIAL (material)));
 }
 
+/* Sets the per light uniforms of the distance materials, once for all
+   the casters of a point light */
 static void
-set_polygon_offset (GthreeRenderer *renderer,
-                    gboolean polygon_offset,
-                    float factor, float units)
+update_distance_materials (GthreeRenderer *renderer,
+                           const graphene_vec3_t *lightPositionWorld,
+                           float shadowCameraNear,
+                           float shadowCameraFar)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GPtrArray *arrays[2];
+  int i, j;
 
-  if (priv->old_polygon_offset != polygon_offset)
-    {
-      if (polygon_offset)
-        glEnable (GL_POLYGON_OFFSET_FILL);
-      else
-        glDisable (GL_POLYGON_OFFSET_FILL);
+  ensure_depth_materials (renderer);
 
-      priv->old_polygon_offset = polygon_offset;
-    }
+  arrays[0] = priv->shadowmap_distance_materials;
+  arrays[1] = priv->shadowmap_cube_distance_materials;
 
-  if (polygon_offset && (priv->old_polygon_offset_factor != factor || priv->old_polygon_offset_units != units ))
+  for (i = 0; i < G_N_ELEMENTS (arrays); i++)
+    for (j = 0; j < arrays[i]->len; j++)
+      {
+        GthreeMeshDistanceMaterial *distance = g_ptr_array_index (arrays[i], j);
+
+        gthree_mesh_distance_material_set_reference_point (distance, lightPositionWorld);
+        gthree_mesh_distance_material_set_near_distance (distance, shadowCameraNear);
+        gthree_mesh_distance_material_set_far_distance (distance, shadowCameraFar);
+      }
+}
+
+#define SIGNATURE_SEED G_GUINT64_CONSTANT (14695981039346656037)
+
+/* FNV-1a */
+static guint64
+hash_bytes (guint64     hash,
+            const void *data,
+            gsize       size)
+{
+  const guint8 *p = data;
+  gsize i;
+
+  for (i = 0; i < size; i++)
     {
-      glPolygonOffset (factor, units);
-      priv->old_polygon_offset_factor = factor;
-      priv->old_polygon_offset_units = units;
+      hash ^= p[i];
+      hash *= G_GUINT64_CONSTANT (1099511628211);
     }
+
+  return hash;
 }
 
-static void
-set_clear_color (GthreeRenderer *renderer,
-                 const graphene_vec3_t *color,
-                 float alpha)
+static guint64
+hash_matrix (guint64                  hash,
+             const graphene_matrix_t *matrix)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  graphene_vec4_t c4;
+  float m[16];
 
-  graphene_vec4_init_from_vec3 (&c4, color, alpha);
-  if (!graphene_vec4_equal (&c4, &priv->old_clear_color))
+  graphene_matrix_to_float (matrix, m);
+  return hash_bytes (hash, m, sizeof (m));
+}
+
+static guint64
+hash_attribute (guint64          hash,
+                GthreeAttribute *attribute)
+{
+  GthreeAttributeArray *array = NULL;
+  int version = 0;
+
+  if (attribute)
     {
-      glClearColor (graphene_vec4_get_x (&c4),
-                    graphene_vec4_get_y (&c4),
-                    graphene_vec4_get_z (&c4),
-                    graphene_vec4_get_w (&c4));
-      priv->old_clear_color = c4;
+      array = gthree_attribute_get_array (attribute);
+      version = gthree_attribute_get_version (attribute);
     }
+
+  hash = hash_bytes (hash, &array, sizeof (array));
+  return hash_bytes (hash, &version, sizeof (version));
 }
 
-static void
-set_blending (GthreeRenderer *renderer,
-              GthreeBlendMode blending,
-              guint blend_equation,
-              guint blend_src,
-              guint blend_dst)
+static guint64
+hash_caster_material (guint64         hash,
+                      GthreeMaterial *material)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  if (blending != priv->old_blending)
+  hash = hash_bytes (hash, &material, sizeof (material));
+  if (material)
     {
-      switch (blending)
-        {
-        default:
-        case GTHREE_BLEND_NO:
-          glDisable (GL_BLEND);
-          break;
+      int state[3] = {
+        gthree_material_get_is_visible (material),
+        gthree_material_get_side (material),
+        GTHREE_IS_MESH_MATERIAL (material) &&
+        gthree_mesh_material_get_is_wireframe (GTHREE_MESH_MATERIAL (material)),
+      };
+
+      hash = hash_bytes (hash, state, sizeof (state));
+    }
 
-        case GTHREE_BLEND_NORMAL:
-          glEnable (GL_BLEND);
-          glBlendEquationSeparate (GL_FUNC_ADD, GL_FUNC_ADD);
-          glBlendFuncSeparate (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-          break;
+  return hash;
+}
 
-        case GTHREE_BLEND_ADDITIVE:
-          glEnable (GL_BLEND);
-          glBlendEquation (GL_FUNC_ADD);
-          glBlendFunc (GL_SRC_ALPHA, GL_ONE);
-          break;
+/* Everything about a mesh that affects its depth in a shadow map */
+static guint64
+get_shadow_caster_signature (GthreeObject *object)
+{
+  GthreeMesh *mesh = GTHREE_MESH (object);
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (mesh);
+  guint64 hash = SIGNATURE_SEED;
+  int n_groups = 0, i;
 
-        case GTHREE_BLEND_SUBTRACTIVE:
-          // TODO: Find blendFuncSeparate() combination
-          glEnable (GL_BLEND);
-          glBlendEquation (GL_FUNC_ADD);
-          glBlendFunc (GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
-          break;
+  hash = hash_bytes (hash, &object, sizeof (object));
+  hash = hash_matrix (hash, gthree_object_get_world_matrix (object));
 
-        case GTHREE_BLEND_MULTIPLY:
-          // TODO: Find blendFuncSeparate() combination
-          glEnable (GL_BLEND);
-          glBlendEquation (GL_FUNC_ADD);
-          glBlendFunc (GL_ZERO, GL_SRC_COLOR);
-          break;
+  hash = hash_bytes (hash, &geometry, sizeof (geometry));
+  if (geometry)
+    {
+      int range[2] = {
+        gthree_geometry_get_draw_range_start (geometry),
+        gthree_geometry_get_draw_range_count (geometry),
+      };
 
-        case GTHREE_BLEND_CUSTOM:
-          glEnable (GL_BLEND);
-          break;
-        }
-      priv->old_blending = blending;
+      hash = hash_attribute (hash, gthree_geometry_get_position (geometry));
+      hash = hash_attribute (hash, gthree_geometry_get_index (geometry));
+      hash = hash_bytes (hash, range, sizeof (range));
+
+      n_groups = gthree_geometry_get_n_groups (geometry);
     }
 
-  if (blending == GTHREE_BLEND_CUSTOM)
+  /* Multi-material casters draw the material of each group */
+  if (n_groups > 0 && gthree_mesh_get_n_materials (mesh) > 1)
     {
-      if (blend_equation != priv->old_blend_equation)
-        {
-          glBlendEquation (blend_equation);
-          priv->old_blend_equation = blend_equation;
-        }
+      GthreeGeometryGroup *groups = gthree_geometry_peek_groups (geometry);
 
-      if (blend_src != priv->old_blend_src || blend_dst != priv->old_blend_dst)
+      for (i = 0; i < n_groups; i++)
         {
-          glBlendFunc (blend_src, blend_dst);
-
-          priv->old_blend_src = blend_src;
-          priv->old_blend_dst = blend_dst;
+          hash = hash_bytes (hash, &groups[i], sizeof (GthreeGeometryGroup));
+          hash = hash_caster_material (hash, gthree_mesh_get_material (mesh, groups[i].material_index));
         }
     }
   else
+    hash = hash_caster_material (hash, gthree_mesh_get_material (mesh, 0));
+
+  if (GTHREE_IS_INSTANCED_MESH (object))
     {
-      priv->old_blend_equation = -1;
-      priv->old_blend_src = -1;
-      priv->old_blend_dst = -1;
+      int count = gthree_instanced_mesh_get_count (GTHREE_INSTANCED_MESH (object));
+
+      hash = hash_attribute (hash, gthree_instanced_mesh_get_instance_matrix (GTHREE_INSTANCED_MESH (object)));
+      hash = hash_bytes (hash, &count, sizeof (count));
     }
+
+  return hash;
+}
+
+static gboolean
+remove_unseen_caster_state (gpointer key,
+                            gpointer value,
+                            gpointer user_data)
+{
+  GthreeShadowCasterState *state = value;
+
+  return state->seen_frame != GPOINTER_TO_UINT (user_data);
 }
 
+/* Compares the casters to the last shadow update to find the dynamic ones */
 static void
-project_object (GthreeRenderer *renderer,
-                GthreeScene    *scene,
-                GthreeObject   *object,
-                GthreeCamera   *camera)
+update_shadow_caster_state (GthreeRenderer     *renderer,
+                            GthreeShadowCaster *caster)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  GthreeObject *child;
-  GthreeObjectIter iter;
-  float z = 0;
+  GthreeObject *object = caster->object;
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (GTHREE_MESH (object));
+  GthreeShadowCasterState *state;
 
-  if (!gthree_object_get_visible (object))
-    return;
+  caster->signature = get_shadow_caster_signature (object);
 
-  if (gthree_object_check_layer (object, gthree_object_get_layer_mask (GTHREE_OBJECT (camera))))
+  state = g_hash_table_lookup (priv->shadow_caster_states, object);
+  if (state == NULL)
     {
-      if (GTHREE_IS_GROUP (object))
-        {
-#if 0
-          groupOrder = object.renderOrder;
-#endif
-        }
-      else if (GTHREE_IS_LIGHT (object))
-        {
-          priv->lights = g_list_append (priv->lights, object);
-          if (gthree_object_get_cast_shadow (object))
-            priv->shadows = g_list_append (priv->shadows, object);
-        }
-      else if (GTHREE_IS_MESH (object) || GTHREE_IS_LINE_SEGMENTS (object) || GTHREE_IS_SPRITE (object) || GTHREE_IS_POINTS (object))
-        {
-          if (GTHREE_IS_SKINNED_MESH (object))
-            {
-              GthreeSkeleton *skeleton = gthree_skinned_mesh_get_skeleton (GTHREE_SKINNED_MESH (object));
-              if (skeleton)
-                gthree_skeleton_update (skeleton);
-            }
+      /* New casters start out static */
+      state = g_new0 (GthreeShadowCasterState, 1);
+      state->signature = caster->signature;
+      g_hash_table_insert (priv->shadow_caster_states, object, state);
+    }
+  else if (state->signature != caster->signature)
+    {
+      state->signature = caster->signature;
+      state->changed_frame = priv->shadow_frame;
+      state->changed = TRUE;
+    }
+  state->seen_frame = priv->shadow_frame;
 
-          if (!gthree_object_get_is_frustum_culled (object) || gthree_object_is_in_frustum (object, &priv->frustum))
-            {
-              gthree_object_update (object);
+  /* Bones and morph targets move vertices without changing the signature */
+  caster->dynamic =
+    GTHREE_IS_SKINNED_MESH (object) ||
+    (geometry != NULL && gthree_geometry_has_morph_attributes (geometry)) ||
+    (state->changed && priv->shadow_frame - state->changed_frame < SHADOW_STATIC_FRAMES);
+}
 
-              if (priv->sort_objects)
-                {
-                  graphene_vec4_t vector;
+/* Depth only passes don't care which material a group uses, so a
+   multi-material mesh whose groups are laid out back to back can be
+   drawn as one range. With use_group_materials the group materials are
+   used for the depth variant too, so they must agree on what affects
+   depth (visibility and wireframe). The depth materials don't do alpha
+   testing, so that doesn't split the range. */
+static gboolean
+get_groups_range (GthreeMesh *mesh,
+                  GthreeGeometry *geometry,
+                  gboolean use_group_materials,
+                  GthreeGeometryGroup *range)
+{
+  GthreeGeometryGroup *groups;
+  GthreeMaterial *first_material = NULL;
+  int n_groups, end, i;
 
-                  /* Get position */
-                  graphene_matrix_get_row (gthree_object_get_world_matrix (object), 3, &vector);
+  n_groups = gthree_geometry_get_n_groups (geometry);
+  if (n_groups == 0)
+    return FALSE;
 
-                  /* project object position to screen */
-                  graphene_matrix_transform_vec4 (&priv->proj_screen_matrix, &vector, &vector);
+  groups = gthree_geometry_peek_groups (geometry);
+  end = groups[0].start;
 
-                  z = graphene_vec4_get_z (&vector) / graphene_vec4_get_w (&vector);
-                }
+  for (i = 0; i < n_groups; i++)
+    {
+      GthreeGeometryGroup *group = &groups[i];
+      GthreeMaterial *material = gthree_mesh_get_material (mesh, group->material_index);
 
-              priv->current_render_list->current_z = z;
+      if (group->start != end || material == NULL)
+        return FALSE;
 
-              gthree_object_fill_render_list (object, priv->current_render_list);
-            }
+      if (use_group_materials)
+        {
+          if (!gthree_material_get_is_visible (material))
+            return FALSE;
+
+          if (first_material == NULL)
+            first_material = material;
+          else if (GTHREE_IS_MESH_MATERIAL (material) != GTHREE_IS_MESH_MATERIAL (first_material) ||
+                   (GTHREE_IS_MESH_MATERIAL (material) &&
+                    gthree_mesh_material_get_is_wireframe (GTHREE_MESH_MATERIAL (material)) !=
+                    gthree_mesh_material_get_is_wireframe (GTHREE_MESH_MATERIAL (first_material))))
+            return FALSE;
+        }
+
+      if (group->count < 0)
+        {
+          /* Runs to the end of the geometry, so must be the last one */
+          if (i != n_groups - 1)
+            return FALSE;
+          end = -1;
         }
+      else
+        end = group->start + group->count;
     }
 
-  gthree_object_iter_init (&iter, object);
-  while (gthree_object_iter_next (&iter, &child))
-    project_object (renderer, scene, child, camera);
+  range->start = groups[0].start;
+  range->count = end < 0 ? -1 : end - range->start;
+  range->material_index = groups[0].material_index;
+
+  return TRUE;
 }
 
+/* The renderables are already filtered by visibility and the camera
+   layers, so this only needs to pick the meshes that cast shadows */
 static void
-material_apply_light_setup (GthreeUniforms *m_uniforms,
-                            GthreeLightSetup *light_setup,
-                            gboolean update_only)
+collect_shadow_casters (GthreeRenderer *renderer)
 {
-  gthree_uniforms_set_vec3 (m_uniforms, "ambientLightColor", &light_setup->ambient);
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int i;
 
-  gthree_uniforms_set_uarray (m_uniforms, "directionalLights", light_setup->directional, update_only);
-  gthree_uniforms_set_uarray (m_uniforms, "pointLights", light_setup->point, update_only);
-  gthree_uniforms_set_uarray (m_uniforms, "spotLights", light_setup->spot, update_only);
+  g_array_set_size (priv->shadow_casters, 0);
+  priv->shadow_frame++;
 
-  gthree_uniforms_set_texture_array (m_uniforms, "directionalShadowMap", light_setup->directional_shadow_map);
-  gthree_uniforms_set_matrix4_array (m_uniforms, "directionalShadowMatrix", light_setup->directional_shadow_map_matrix);
+  if (priv->spatial_index)
+    {
+      g_hash_table_remove_all (priv->shadow_caster_lookup);
+      g_array_set_size (priv->unculled_shadow_casters, 0);
+    }
 
-  gthree_uniforms_set_texture_array (m_uniforms, "spotShadowMap", light_setup->spot_shadow_map);
-  gthree_uniforms_set_matrix4_array (m_uniforms, "spotShadowMatrix", light_setup->spot_shadow_map_matrix);
+  g_array_set_size (priv->renderable_casters, priv->renderables->len + 1);
 
-  gthree_uniforms_set_texture_array (m_uniforms, "pointShadowMap", light_setup->point_shadow_map);
-  gthree_uniforms_set_matrix4_array (m_uniforms, "pointShadowMatrix", light_setup->point_shadow_map_matrix);
-}
+  for (i = 0; i < priv->renderables->len; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (priv->renderables, i);
+      GthreeShadowCaster caster;
 
-static GthreeProgram *
-init_material (GthreeRenderer *renderer,
-               GthreeMaterial *material,
-               gpointer fog,
-               GthreeObject *object)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  GthreeProgram *program;
-  GthreeShader *shader;
-  GthreeProgramParameters parameters = {0};
-  GthreeUniforms *m_uniforms;
-  int max_bones;
-  GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
+      g_array_index (priv->renderable_casters, int, i) = priv->shadow_casters->len;
 
-  shader = gthree_material_get_shader (material);
+      if (!gthree_object_get_cast_shadow (object))
+        continue;
 
-  //material.addEventListener( 'dispose', onMaterialDispose );
-  //var u, a, identifiers, i, parameters, maxBones, maxShadows, shaderID;
+      if (!GTHREE_IS_MESH (object))
+        {
+          if (GTHREE_IS_LINE_SEGMENTS (object) || GTHREE_IS_POINTS (object))
+            g_warning ("Unsupported object type for shadows: %s", g_type_name_from_instance ((gpointer)object));
+          continue;
+        }
 
+      caster.object = object;
+      caster.signature = 0;
+      caster.culled = FALSE;
+      caster.dynamic = FALSE;
+      caster.draw_groups = FALSE;
+      caster.has_range = FALSE;
+      memset (caster.depth_materials, 0, sizeof (caster.depth_materials));
+      caster.range.material_index = 0;
+      if (gthree_mesh_get_n_materials (GTHREE_MESH (object)) > 1)
+        {
+          GthreeGeometry *geometry = gthree_mesh_get_geometry (GTHREE_MESH (object));
 
-  parameters.precision = GTHREE_PRECISION_HIGH;
-  parameters.supports_vertex_textures = priv->supports_vertex_textures;
-  // TODO: Get encoding from currentRenderTarget if set
-  parameters.output_encoding = GTHREE_ENCODING_FORMAT_GAMMA;
-  parameters.physically_correct_lights = priv->physically_correct_lights;
+          if (get_groups_range (GTHREE_MESH (object), geometry, TRUE, &caster.range))
+            caster.has_range = TRUE;
+          else
+            caster.draw_groups = gthree_geometry_get_n_groups (geometry) > 0;
+        }
+      caster.depth_variant =
+        get_depth_material_variant (object, gthree_mesh_get_geometry (GTHREE_MESH (object)),
+                                    gthree_mesh_get_material (GTHREE_MESH (object), caster.range.material_index));
+      if (gthree_object_get_is_frustum_culled (object))
+        {
+          gboolean has_bounds;
 
-  gthree_material_set_params (material, &parameters);
-  parameters.num_dir_lights = priv->light_setup.directional->len;
-  parameters.num_point_lights = priv->light_setup.point->len;
-  parameters.num_spot_lights = priv->light_setup.spot->len;
+          if (priv->spatial_index)
+            has_bounds = gthree_spatial_index_get_bounding_sphere (priv->spatial_index, object, &caster.sphere);
+          else
+            has_bounds = gthree_object_get_world_bounding_sphere (object, &caster.sphere);
 
-  max_bones = 0;
-  if (GTHREE_IS_SKINNED_MESH (object))
-    {
-      GthreeSkeleton *skeleton = gthree_skinned_mesh_get_skeleton (GTHREE_SKINNED_MESH (object));
-      if (skeleton)
-        max_bones = gthree_skeleton_get_n_bones (skeleton);
-      // TODO: Limit max bones to GPU specs
-    }
+          /* No geometry, nothing to draw */
+          if (!has_bounds)
+            continue;
+          caster.culled = TRUE;
+        }
 
-  parameters.max_bones = max_bones;
-  parameters.skinning = GTHREE_IS_MESH_MATERIAL (material) && gthree_mesh_material_get_skinning (GTHREE_MESH_MATERIAL (material));
+      gthree_object_update (object);
 
-  parameters.morph_targets = GTHREE_IS_MESH_MATERIAL (material) && gthree_mesh_material_get_morph_targets (GTHREE_MESH_MATERIAL (material));
-  parameters.morph_normals = GTHREE_IS_MESH_MATERIAL (material) && gthree_mesh_material_get_morph_normals (GTHREE_MESH_MATERIAL (material));
+      if (priv->shadowmap_caching)
+        update_shadow_caster_state (renderer, &caster);
 
-  parameters.num_clipping_planes = priv->num_clipping_planes;
+      if (priv->spatial_index)
+        {
+          int index = priv->shadow_casters->len;
 
-  parameters.shadow_map_enabled = priv->shadowmap_enabled && gthree_object_get_receive_shadow (object) && priv->shadows != NULL;
-  parameters.shadow_map_type = priv->shadowmap_type;
+          g_hash_table_insert (priv->shadow_caster_lookup, object, GINT_TO_POINTER (index + 1));
+          if (!caster.culled)
+            g_array_append_val (priv->unculled_shadow_casters, index);
+        }
 
-#ifdef TODO
-  parameters =
-    {
-    lightMap: !! material.lightMap,
-    bumpMap: !! material.bumpMap,
-    normalMap: !! material.normalMap,
-    specularMap: !! material.specularMap,
-    alphaMap: !! material.alphaMap,
+      g_array_append_val (priv->shadow_casters, caster);
+    }
 
-    fog: fog,
-    useFog: material.fog,
-    fogExp: fog instanceof THREE.FogExp2,
+  g_array_index (priv->renderable_casters, int, priv->renderables->len) = priv->shadow_casters->len;
 
-    logarithmicDepthBuffer: _logarithmicDepthBuffer,
+  if (priv->shadowmap_caching)
+    g_hash_table_foreach_remove (priv->shadow_caster_states, remove_unseen_caster_state,
+                                 GUINT_TO_POINTER (priv->shadow_frame));
+}
 
-    useVertexTexture: _supportsBoneTextures && object && object.skeleton && object.skeleton.useVertexTexture,
-    };
-#endif
+static gboolean
+shadow_caster_in_reach (GthreeShadowCaster *caster,
+                        const graphene_frustum_t *frustum,
+                        const graphene_sphere_t *sphere)
+{
+  graphene_point3d_t center, caster_center;
 
-  program = gthree_program_cache_get (priv->program_cache, shader, &parameters, renderer);
-  g_clear_object (&material_properties->program);
-  material_properties->program = program;
+  if (!caster->culled)
+    return TRUE;
 
-  // TODO: thee.js uses the lightstate current_hash and other stuff to avoid some stuff here?
-  // I think it caches the material uniforms we calculate here and avoid reloading if switching to a new program?
+  if (frustum)
+    return graphene_frustum_intersects_sphere (frustum, &caster->sphere);
 
-  if (GTHREE_IS_MESH_MATERIAL (material) &&
-      gthree_mesh_material_get_morph_targets (GTHREE_MESH_MATERIAL (material)))
+  graphene_sphere_get_center (sphere, &center);
+  graphene_sphere_get_center (&caster->sphere, &caster_center);
+  return graphene_point3d_distance (&center, &caster_center, NULL) <=
+    graphene_sphere_get_radius (sphere) + graphene_sphere_get_radius (&caster->sphere);
+}
+
+/* Uses the subtree bounds to skip or accept whole groups of casters */
+static void
+query_shadow_caster_ranges (GthreeRenderer *renderer,
+                            const graphene_frustum_t *frustum,
+                            const graphene_sphere_t *sphere,
+                            GArray *hits)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int i, j;
+
+  get_cull_ranges (renderer, frustum, sphere, priv->cull_ranges);
+
+  for (i = 0; i < priv->cull_ranges->len; i++)
     {
-      GHashTable *program_attributes = gthree_program_get_attribute_locations (program);
-      int num_supported = 0;
+      GthreeCullRange *range = &g_array_index (priv->cull_ranges, GthreeCullRange, i);
+      int first = g_array_index (priv->renderable_casters, int, range->first);
+      int end = g_array_index (priv->renderable_casters, int, range->end);
 
-      for (int i = 0; i < MAX_MORPH_TARGETS; i++ )
+      for (j = first; j < end; j++)
         {
-          g_autofree char *attr = g_strdup_printf ("morphTarget%d", i);
-
-          if (g_hash_table_lookup (program_attributes, attr) != NULL)
-            num_supported++;
+          if (range->inside ||
+              shadow_caster_in_reach (&g_array_index (priv->shadow_casters, GthreeShadowCaster, j),
+                                      frustum, sphere))
+            g_array_append_val (hits, j);
         }
-      gthree_mesh_material_set_num_supported_morph_targets (GTHREE_MESH_MATERIAL (material),
-                                                            num_supported);
     }
+}
 
-  if (GTHREE_IS_MESH_MATERIAL (material) &&
-      gthree_mesh_material_get_morph_normals (GTHREE_MESH_MATERIAL (material)))
+/* With a spatial index the casters in reach of a light are looked up in
+   it, and without one whole subtrees are culled using their bounds,
+   instead of testing every caster. Returns the indexes of the casters
+   in reach, in caster order, or NULL if the caller has to test each
+   caster itself. The sphere is used for point lights, if frustum is
+   NULL. */
+static GArray *
+query_shadow_casters (GthreeRenderer *renderer,
+                      const graphene_frustum_t *frustum,
+                      const graphene_sphere_t *sphere)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GArray *hits = priv->index_hits;
+  int i;
+
+  if (priv->spatial_index == NULL && priv->cull_nodes->len == 0)
+    return NULL;
+
+  g_ptr_array_set_size (priv->index_results, 0);
+  g_array_set_size (hits, 0);
+
+  if (priv->spatial_index == NULL)
     {
-      GHashTable *program_attributes = gthree_program_get_attribute_locations (program);
-      int num_supported = 0;
+      query_shadow_caster_ranges (renderer, frustum, sphere, hits);
+      return hits;
+    }
 
-      for (int i = 0; i < MAX_MORPH_NORMALS; i++ )
-        {
-          g_autofree char *attr = g_strdup_printf ("morphNormal%d", i);
+  if (frustum)
+    gthree_spatial_index_query_frustum (priv->spatial_index, frustum, priv->index_results);
+  else
+    gthree_spatial_index_query_sphere (priv->spatial_index, sphere, priv->index_results);
 
-          if (g_hash_table_lookup (program_attributes, attr) != NULL)
-            num_supported++;
-        }
+  for (i = 0; i < priv->index_results->len; i++)
+    {
+      int index = GPOINTER_TO_INT (g_hash_table_lookup (priv->shadow_caster_lookup,
+                                                        g_ptr_array_index (priv->index_results, i))) - 1;
 
-      gthree_mesh_material_set_num_supported_morph_normals (GTHREE_MESH_MATERIAL (material),
-                                                            num_supported);
+      /* Not a caster, or in unculled_shadow_casters */
+      if (index < 0 || !g_array_index (priv->shadow_casters, GthreeShadowCaster, index).culled)
+        continue;
+
+      g_array_append_val (hits, index);
     }
 
-  m_uniforms = gthree_shader_get_uniforms (shader);
+  g_array_append_vals (hits, priv->unculled_shadow_casters->data, priv->unculled_shadow_casters->len);
+  g_array_sort (hits, compare_ints);
 
-  // store the light setup it was created for
-  material_properties->light_hash = priv->light_setup.hash;
+  return hits;
+}
 
-  if (!GTHREE_IS_SHADER_MATERIAL (material)
-#ifdef TODO
-      || material.clipping === true
-#endif
-      )
+/* Hashes the light and the static casters in its reach, and counts the
+   dynamic ones. Point lights reach a sphere, the others the frustum of
+   the already positioned shadow camera. */
+static guint64
+get_shadow_signature (GthreeRenderer        *renderer,
+                      GthreeCamera          *shadow_camera,
+                      const graphene_vec3_t *light_position,
+                      gboolean               is_point_light,
+                      int                    map_width,
+                      int                    map_height,
+                      int                   *n_dynamic)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  graphene_frustum_t frustum;
+  graphene_point3d_t center;
+  graphene_sphere_t reach;
+  float far = gthree_camera_get_far (shadow_camera);
+  float light_pos[3];
+  int size[2] = { map_width, map_height };
+  guint64 hash = SIGNATURE_SEED;
+  GArray *hits;
+  int i, n;
+
+  graphene_vec3_to_float (light_position, light_pos);
+  hash = hash_bytes (hash, light_pos, sizeof (light_pos));
+  hash = hash_bytes (hash, size, sizeof (size));
+  hash = hash_matrix (hash, gthree_camera_get_projection_matrix (shadow_camera));
+
+  if (is_point_light)
+    graphene_point3d_init_from_vec3 (&center, light_position);
+  else
     {
-      GthreeUniform *uni =  gthree_uniforms_lookup (m_uniforms, q_clippingPlanes);
-      if (uni == NULL)
-        {
-          uni = gthree_uniform_newq (q_clippingPlanes, GTHREE_UNIFORM_TYPE_FLOAT4_ARRAY);
-          gthree_uniforms_add (m_uniforms, uni); // takes ownership
-        }
+      graphene_matrix_t proj_screen_matrix;
+
+      hash = hash_matrix (hash, gthree_camera_get_world_inverse_matrix (shadow_camera));
+      gthree_camera_get_proj_screen_matrix (shadow_camera, &proj_screen_matrix);
+      graphene_frustum_init_from_matrix (&frustum, &proj_screen_matrix);
     }
 
-  if (priv->lights)
-    material_apply_light_setup (m_uniforms, &priv->light_setup, FALSE);
+  if (is_point_light)
+    graphene_sphere_init (&reach, &center, far);
+  hits = query_shadow_casters (renderer, is_point_light ? NULL : &frustum, &reach);
 
-  gthree_shader_update_uniform_locations_for_program (shader, program);
+  *n_dynamic = 0;
+  n = hits ? hits->len : priv->shadow_casters->len;
+  for (i = 0; i < n; i++)
+    {
+      GthreeShadowCaster *caster = &g_array_index (priv->shadow_casters, GthreeShadowCaster,
+                                                   hits ? g_array_index (hits, int, i) : i);
 
-  return NULL;
+      if (hits == NULL && !shadow_caster_in_reach (caster, is_point_light ? NULL : &frustum, &reach))
+        continue;
+
+      if (caster->dynamic)
+        (*n_dynamic)++;
+      else
+        hash = hash_bytes (hash, &caster->signature, sizeof (caster->signature));
+    }
+
+  return hash;
 }
 
-#if 0
 static void
-print_matrix4 (float *s)
+render_shadow_caster_group (GthreeRenderer *renderer,
+                            GthreeShadowCaster *caster,
+                            GthreeCamera *shadow_camera,
+                            gboolean is_point_light,
+                            GthreeGeometry *geometry,
+                            GthreeMaterial *material,
+                            GthreeGeometryGroup *group)
 {
-  int i,j;
-  for (i = 0; i < 4; i++)
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeMaterial *depthMaterial;
+  GthreeShadowPass pass;
+
+  if (material == NULL || !gthree_material_get_is_visible (material))
+    return;
+
+  if (!is_point_light)
+    pass = SHADOW_PASS_DEPTH;
+  else if (priv->shadow_cube_pass)
+    pass = SHADOW_PASS_CUBE_DISTANCE;
+  else
+    pass = SHADOW_PASS_DISTANCE;
+
+  depthMaterial = caster->depth_materials[pass];
+  if (depthMaterial == NULL)
     {
-      if (i == 0)
-        g_print("[ ");
-      else
-        g_print("  ");
-      for (j = 0; j < 4; j++)
-        {
-          if (j != 0)
-            g_print (", ");
-          g_print ("%f", *s++);
-        }
-      if (i == 3)
-        g_print("]\n");
-      else
-        g_print("\n");
+      depthMaterial = getDepthMaterial (renderer, caster->object, caster->depth_variant, is_point_light);
+      caster->depth_materials[pass] = depthMaterial;
     }
+
+  depth_material_copy_state (depthMaterial, material);
+
+  GthreeRenderListItem item = { caster->object, geometry, depthMaterial, group, 0.0 };
+  render_item (renderer, shadow_camera, FALSE, depthMaterial, &item);
 }
-#endif
 
 static void
-setup_lights (GthreeRenderer *renderer, GthreeCamera *camera)
+render_shadow_caster (GthreeRenderer *renderer,
+                      GthreeShadowCaster *caster,
+                      GthreeCamera *shadow_camera,
+                      gboolean is_point_light)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  GthreeLightSetup *setup = &priv->light_setup;
-  GList *l;
+  GthreeObject *object = caster->object;
+  GthreeMesh *mesh = GTHREE_MESH (object);
+  GthreeGeometry *geometry;
 
-  graphene_vec3_init (&setup->ambient, 0, 0, 0);
+  gthree_object_update_matrix_view (object, gthree_camera_get_world_inverse_matrix (shadow_camera));
 
-  g_ptr_array_set_size (setup->directional, 0);
-  g_ptr_array_set_size (setup->directional_shadow_map, 0);
-  g_array_set_size (setup->directional_shadow_map_matrix, 0);
-  g_ptr_array_set_size (setup->point, 0);
-  g_ptr_array_set_size (setup->point_shadow_map, 0);
-  g_array_set_size (setup->point_shadow_map_matrix, 0);
-  g_ptr_array_set_size (setup->spot, 0);
-  g_ptr_array_set_size (setup->spot_shadow_map, 0);
-  g_array_set_size (setup->spot_shadow_map_matrix, 0);
+  geometry = gthree_mesh_get_geometry (mesh);
+
+  if (caster->draw_groups)
+    {
+      GthreeGeometryGroup *groups = gthree_geometry_peek_groups (geometry);
+      int n_groups = gthree_geometry_get_n_groups (geometry);
+      int k;
+
+      for (k = 0; k < n_groups; k++)
+        render_shadow_caster_group (renderer, caster, shadow_camera, is_point_light,
+                                    geometry, gthree_mesh_get_material (mesh, groups[k].material_index), &groups[k]);
+    }
+  else
+    render_shadow_caster_group (renderer, caster, shadow_camera, is_point_light,
+                                geometry, gthree_mesh_get_material (mesh, caster->range.material_index),
+                                caster->has_range ? &caster->range : NULL);
+}
+
+static gboolean
+shadow_caster_filtered (GthreeShadowCaster *caster,
+                        GthreeShadowCasterFilter filter)
+{
+  return
+    (filter == SHADOW_CASTERS_STATIC && caster->dynamic) ||
+    (filter == SHADOW_CASTERS_DYNAMIC && !caster->dynamic);
+}
 
-  for (l = priv->lights; l != NULL; l = l->next)
+static void
+render_shadow_casters (GthreeRenderer *renderer,
+                       const graphene_frustum_t *frustum,
+                       GthreeCamera *shadow_camera,
+                       gboolean is_point_light,
+                       GthreeShadowCasterFilter filter)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GArray *hits = query_shadow_casters (renderer, frustum, NULL);
+  int i, n;
+
+  n = hits ? hits->len : priv->shadow_casters->len;
+  for (i = 0; i < n; i++)
     {
-      GthreeLight *light = l->data;
+      GthreeShadowCaster *caster = &g_array_index (priv->shadow_casters, GthreeShadowCaster,
+                                                   hits ? g_array_index (hits, int, i) : i);
 
-      gthree_light_setup (light, camera, setup);
+      if (shadow_caster_filtered (caster, filter))
+        continue;
+
+      if (caster->culled && hits == NULL && !graphene_frustum_intersects_sphere (frustum, &caster->sphere))
+        continue;
+
+      render_shadow_caster (renderer, caster, shadow_camera, is_point_light);
     }
+}
 
-  setup->hash.num_directional = setup->directional->len;
-  setup->hash.num_point = setup->point->len;
-  setup->hash.num_spot = setup->spot->len;
-  setup->hash.num_shadow = setup->shadow->len;
+static void
+clear_shadow_area (GthreeRenderer *renderer,
+                   const int *area)
+{
+  glScissor (area[0], area[1], area[2], area[3]);
+  glEnable (GL_SCISSOR_TEST);
+  gthree_renderer_clear (renderer, TRUE, TRUE, TRUE);
+  glDisable (GL_SCISSOR_TEST);
 }
 
-static void *
-project_planes (GthreeRenderer *renderer,
-                const graphene_plane_t *planes,
-                int n_planes,
-                GthreeCamera *camera,
-                int dst_offset,
-                gboolean skip_transform)
+/* Renders all faces of a layered depth cube map in one pass. The
+   geometry shader sends each triangle to the faces in cubeFaceMask,
+   using the view projections in the GthreeCubeFaces block, so the
+   casters only need to be culled against each face here. */
+static void
+render_shadow_cube_layers (GthreeRenderer *renderer,
+                           GthreeCamera *shadow_camera,
+                           const int *area,
+                           const graphene_vec3_t *_lightPositionWorld,
+                           GthreeShadowCasterFilter filter)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-
-  if (n_planes != 0)
+  GthreeCubeFacesUniforms faces;
+  graphene_frustum_t frustums[6];
+  graphene_point3d_t light_center;
+  graphene_sphere_t reach;
+  GArray *hits;
+  int face, i, n;
+
+  for (face = 0; face < 6; face++)
     {
-      guint flat_size = dst_offset + n_planes * 4;
-      graphene_matrix_t viewNormalMatrix;
-      float *dst_array;
+      graphene_matrix_t view_projection;
+      graphene_point3d_t p;
+      graphene_vec3_t target;
+
+      graphene_vec3_add (_lightPositionWorld, &cube_face_directions[face], &target);
+      gthree_object_set_up (GTHREE_OBJECT (shadow_camera), &cube_face_ups[face]);
+      gthree_object_look_at (GTHREE_OBJECT (shadow_camera),
+                             graphene_point3d_init_from_vec3 (&p, &target));
+      gthree_object_update_matrix_world (GTHREE_OBJECT (shadow_camera), FALSE);
+      gthree_camera_update_matrix (shadow_camera);
+
+      gthree_camera_get_proj_screen_matrix (shadow_camera, &view_projection);
+      graphene_frustum_init_from_matrix (&frustums[face], &view_projection);
+      graphene_matrix_to_float (&view_projection, faces.view_projection[face]);
+    }
 
-      g_array_set_size (priv->clipping_state, flat_size);
-      dst_array = (float *)priv->clipping_state->data;
+  invalidate_frame_uniforms (renderer, shadow_camera);
 
-      if (!skip_transform)
-        {
-          const graphene_matrix_t *viewMatrix = gthree_camera_get_world_inverse_matrix (camera);
+  glBindBuffer (GL_UNIFORM_BUFFER, priv->cube_faces_ubo);
+  glBufferData (GL_UNIFORM_BUFFER, sizeof (GthreeCubeFacesUniforms), &faces, GL_STREAM_DRAW);
+  glBindBufferBase (GL_UNIFORM_BUFFER, GTHREE_CUBE_FACES_UNIFORMS_BINDING, priv->cube_faces_ubo);
 
-          /* Get normal matrix */
-          graphene_matrix_inverse (viewMatrix, &viewNormalMatrix);
-          graphene_matrix_transpose (&viewNormalMatrix, &viewNormalMatrix);
+  glViewport (area[0], area[1], area[2], area[3]);
 
-          for (int i = 0, i4 = dst_offset; i != n_planes; i++, i4 += 4)
-            {
-              graphene_plane_t transformed_plane;
-              graphene_vec3_t normal;
+  priv->shadow_cube_pass = TRUE;
 
-              graphene_plane_transform (&planes[i], viewMatrix, &viewNormalMatrix, &transformed_plane);
-              graphene_plane_get_normal (&transformed_plane, &normal);
+  graphene_point3d_init_from_vec3 (&light_center, _lightPositionWorld);
+  graphene_sphere_init (&reach, &light_center, gthree_camera_get_far (shadow_camera));
+  hits = query_shadow_casters (renderer, NULL, &reach);
 
-              dst_array[i4+0] = graphene_vec3_get_x (&normal);
-              dst_array[i4+1] = graphene_vec3_get_y (&normal);
-              dst_array[i4+2] = graphene_vec3_get_z (&normal);
-              dst_array[i4+3] = graphene_plane_get_constant (&transformed_plane);
-            }
-        }
-      else
-        {
-          for (int i = 0, i4 = dst_offset; i != n_planes; i++, i4 += 4)
-            {
-              graphene_vec3_t normal;
-              float constant;
+  n = hits ? hits->len : priv->shadow_casters->len;
+  for (i = 0; i < n; i++)
+    {
+      GthreeShadowCaster *caster = &g_array_index (priv->shadow_casters, GthreeShadowCaster,
+                                                   hits ? g_array_index (hits, int, i) : i);
+      int mask = 0x3f;
 
-              graphene_plane_get_normal (&planes[i], &normal);
-              constant = graphene_plane_get_constant (&planes[i]);
+      if (shadow_caster_filtered (caster, filter))
+        continue;
 
-              dst_array[i4+0] = graphene_vec3_get_x (&normal);
-              dst_array[i4+1] = graphene_vec3_get_y (&normal);
-              dst_array[i4+2] = graphene_vec3_get_z (&normal);
-              dst_array[i4+3] = constant;
+      if (caster->culled)
+        {
+          mask = 0;
+          for (face = 0; face < 6; face++)
+            {
+              if (graphene_frustum_intersects_sphere (&frustums[face], &caster->sphere))
+                mask |= 1 << face;
             }
+
+          if (mask == 0)
+            continue;
         }
-    }
 
-  priv->num_clipping_planes = n_planes;
+      priv->cube_face_mask = mask;
+      render_shadow_caster (renderer, caster, shadow_camera, TRUE);
+    }
 
-  return NULL;
+  priv->shadow_cube_pass = FALSE;
 }
 
-static gboolean
-clipping_init (GthreeRenderer *renderer,
-               GthreeCamera *camera)
+/* The faces are drawn into area of the current render target, which is
+   all of it unless it is the shadow atlas */
+static void
+render_shadow_faces (GthreeRenderer *renderer,
+                     GthreeCamera *shadow_camera,
+                     const graphene_vec4_t *cube2DViewPorts,
+                     const int *area,
+                     int faceCount,
+                     const graphene_vec3_t *_lightPositionWorld,
+                     gboolean is_point_light,
+                     gboolean layered,
+                     GthreeShadowCasterFilter filter)
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  gboolean enabled;
+  if (is_point_light)
+    update_distance_materials (renderer, _lightPositionWorld,
+                               gthree_camera_get_near (shadow_camera),
+                               gthree_camera_get_far (shadow_camera));
 
-  enabled =
-    priv->clipping_planes->len != 0 ||
-    // enable state of previous frame - the clipping code has to
-    // run another frame in order to reset the state:
-    priv->old_num_global_planes != 0;
+  if (layered)
+    {
+      render_shadow_cube_layers (renderer, shadow_camera, area, _lightPositionWorld, filter);
+      return;
+    }
 
-  project_planes (renderer,
-                  (const graphene_plane_t *)priv->clipping_planes->data,
-                  priv->clipping_planes->len,
-                  camera,
-                  0, FALSE);
+  // render shadow map for each cube face (if omni-directional) or
+  // run a single pass if not
+  for (int face = 0; face < faceCount; face++)
+    {
+      if (is_point_light)
+        {
+          graphene_point3d_t p;
+          graphene_vec3_t _lookTarget;
+          graphene_vec3_add (gthree_object_get_position (GTHREE_OBJECT (shadow_camera)),
+                             &cube_directions[face], &_lookTarget);
 
-  priv->old_num_global_planes = priv->clipping_planes->len;
+          gthree_object_set_up (GTHREE_OBJECT (shadow_camera), &cube_ups[face]);
+          gthree_object_look_at (GTHREE_OBJECT (shadow_camera),
+                                 graphene_point3d_init (&p,
+                                                        graphene_vec3_get_x (&_lookTarget),
+                                                        graphene_vec3_get_y (&_lookTarget),
+                                                        graphene_vec3_get_z (&_lookTarget)));
 
-  return enabled;
-}
+          gthree_object_update_matrix_world (GTHREE_OBJECT (shadow_camera), FALSE);
+          gthree_camera_update_matrix (shadow_camera);
+          invalidate_frame_uniforms (renderer, shadow_camera);
 
-static void
-clipping_begin_shadows (GthreeRenderer *renderer)
-{
-  // TODO
+          const graphene_vec4_t *vpDimensions = &cube2DViewPorts[face];
+
+          glViewport (area[0] + graphene_vec4_get_x (vpDimensions),
+                      area[1] + graphene_vec4_get_y (vpDimensions),
+                      graphene_vec4_get_z (vpDimensions),
+                      graphene_vec4_get_w (vpDimensions));
+        }
+      else
+        glViewport (area[0], area[1], area[2], area[3]);
+
+      // update camera matrices and frustum
+      graphene_matrix_t _projScreenMatrix;
+      graphene_frustum_t frustum;
+
+      gthree_camera_get_proj_screen_matrix (shadow_camera, &_projScreenMatrix);
+      graphene_frustum_init_from_matrix (&frustum, &_projScreenMatrix);
+
+      // set object matrices & frustum culling
+      render_shadow_casters (renderer, &frustum, shadow_camera,
+                             is_point_light, filter);
+    }
 }
 
+/* Cascaded shadows fit an orthographic camera around each depth slice
+   of the view frustum, and render it into its own tile of the map. All
+   cascade cameras share the orientation of the light, so each cascade
+   is a scale and offset from one light space, and the shaders pick the
+   cascade by view depth. The cascade centers are snapped to whole
+   texels in light space, and the sizes only depend on the projection,
+   so the shadow edges don't shimmer as the camera moves. */
 static void
-clipping_end_shadows (GthreeRenderer *renderer)
+render_shadow_cascades (GthreeRenderer *renderer,
+                        GthreeCamera *camera,
+                        GthreeDirectionalLight *light,
+                        GthreeDirectionalLightShadow *shadow,
+                        const int *area,
+                        int tile_width,
+                        int tile_height,
+                        gboolean force_update)
 {
-  // TODO
-}
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeShadowCascadeState *state = gthree_directional_light_shadow_get_cascade_state (shadow);
+  GthreeCamera *cascade_camera = gthree_directional_light_shadow_get_cascade_camera (shadow);
+  GthreeOrthographicCamera *ortho = GTHREE_ORTHOGRAPHIC_CAMERA (cascade_camera);
+  int n_cascades = gthree_directional_light_shadow_get_n_cascades (shadow);
+  float lambda = gthree_directional_light_shadow_get_split_lambda (shadow);
+  float max_distance = gthree_directional_light_shadow_get_max_distance (shadow);
+  /* Casters up to this far towards the light from a slice are drawn */
+  float reach = gthree_camera_get_far (gthree_light_shadow_get_camera (GTHREE_LIGHT_SHADOW (shadow)));
+  float near = gthree_camera_get_near (camera);
+  float far = gthree_camera_get_far (camera);
+  float split_near, split_far;
+  graphene_vec4_t corners[8];
+  graphene_vec4_t light_pos, target_pos;
+  graphene_vec3_t direction;
+  graphene_matrix_t proj_inverse, light_view, light_world, bias;
+  graphene_point3d_t p;
+  float old_view[16], new_view[16];
+  int columns, rows, c, k;
+
+  gthree_directional_light_shadow_get_atlas_layout (shadow, &columns, &rows);
+
+  graphene_matrix_get_row (gthree_object_get_world_matrix (GTHREE_OBJECT (light)), 3, &light_pos);
+  graphene_matrix_get_row (gthree_object_get_world_matrix (gthree_directional_light_get_target (light)), 3, &target_pos);
+  graphene_vec4_subtract (&target_pos, &light_pos, &target_pos);
+  graphene_vec4_get_xyz (&target_pos, &direction);
+
+  /* Light space is the cascade camera at the origin, looking along the light */
+  gthree_object_set_position (GTHREE_OBJECT (cascade_camera), graphene_vec3_zero ());
+  gthree_object_look_at (GTHREE_OBJECT (cascade_camera),
+                         graphene_point3d_init_from_vec3 (&p, &direction));
+  gthree_object_update_matrix_world (GTHREE_OBJECT (cascade_camera), FALSE);
+  gthree_camera_update_matrix (cascade_camera);
+  light_view = *gthree_camera_get_world_inverse_matrix (cascade_camera);
+  light_world = *gthree_object_get_world_matrix (GTHREE_OBJECT (cascade_camera));
+
+  /* Cascades that are not rendered now still refer to the old light space */
+  graphene_matrix_to_float (&state->light_view, old_view);
+  graphene_matrix_to_float (&light_view, new_view);
+  if (memcmp (old_view, new_view, sizeof (old_view)) != 0)
+    force_update = TRUE;
+
+  /* Frustum corners in view space, the near ones first */
+  graphene_matrix_inverse (gthree_camera_get_projection_matrix (camera), &proj_inverse);
+  for (k = 0; k < 8; k++)
+    {
+      graphene_vec4_init (&corners[k], (k & 1) ? 1 : -1, (k & 2) ? 1 : -1, (k & 4) ? 1 : -1, 1);
+      graphene_matrix_transform_vec4 (&proj_inverse, &corners[k], &corners[k]);
+      graphene_vec4_scale (&corners[k], 1.0f / graphene_vec4_get_w (&corners[k]), &corners[k]);
+    }
 
-#define SHADER_MAP_MORPHING_FLAG (1<<0)
-#define SHADER_MAP_SKINNING_FLAG (1<<1)
+  if (max_distance > 0)
+    far = MIN (far, max_distance);
 
-static GthreeMaterial *
-getDepthMaterial (GthreeRenderer *renderer,
-                  GthreeObject *object,
-                  GthreeGeometry *geometry,
-                  GthreeMaterial *material,
-                  gboolean isPointLight,
-                  const graphene_vec3_t *lightPositionWorld,
-                  float shadowCameraNear,
-                  float shadowCameraFar)
-{
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  GthreeMaterial *result = NULL;
-  GthreeMaterial *customMaterial = NULL;
-  GPtrArray *materialVariants = NULL;
+  graphene_matrix_init_scale (&bias, 0.5, 0.5, 0.5);
+  graphene_matrix_translate (&bias, graphene_point3d_init (&p, 0.5, 0.5, 0.5));
 
-  if (priv->shadowmap_depth_materials == NULL)
+  split_near = near;
+  for (c = 0; c < n_cascades; c++)
     {
-      priv->shadowmap_depth_materials = g_ptr_array_new_with_free_func (g_object_unref);
-      priv->shadowmap_distance_materials = g_ptr_array_new_with_free_func (g_object_unref);
+      GthreeShadowCascade *cascade = &state->cascades[c];
+      int interval = gthree_directional_light_shadow_get_cascade_update_interval (shadow, c);
+      float f = (float) (c + 1) / n_cascades;
+      float camera_far = gthree_camera_get_far (camera);
+      graphene_vec4_t center, slice[8];
+      graphene_vec3_t q;
+      graphene_matrix_t m, proj_screen_matrix;
+      graphene_frustum_t frustum;
+      float radius = 0, texel_x, texel_y;
+      int tile[4];
+
+      /* Blend of logarithmic and uniform splits */
+      split_far = (1 - lambda) * (near + (far - near) * f);
+      if (near > 0)
+        split_far += lambda * near * powf (far / near, f);
+      else
+        split_far += lambda * (near + (far - near) * f);
 
-      for (int i = 0; i < 4; i++)
+      cascade->split = split_far;
+
+      if (!force_update && cascade->valid &&
+          priv->shadow_frame - cascade->updated_frame < interval)
         {
-          gboolean useMorphing = (i & SHADER_MAP_MORPHING_FLAG) != 0;
-          gboolean useSkinning = (i & SHADER_MAP_SKINNING_FLAG) != 0;
+          split_near = split_far;
+          continue;
+        }
 
-          GthreeMeshDepthMaterial *m = gthree_mesh_depth_material_new ();
-          gthree_mesh_depth_material_set_depth_packing_format (m, GTHREE_DEPTH_PACKING_FORMAT_RGBA);
+      /* Bounding sphere of the slice, using the mean so it does not
+         depend on the rotation */
+      graphene_vec4_init (&center, 0, 0, 0, 0);
+      for (k = 0; k < 4; k++)
+        {
+          graphene_vec4_interpolate (&corners[k], &corners[k + 4],
+                                     (split_near - near) / (camera_far - near), &slice[k]);
+          graphene_vec4_interpolate (&corners[k], &corners[k + 4],
+                                     (split_far - near) / (camera_far - near), &slice[k + 4]);
+          graphene_vec4_add (&center, &slice[k], &center);
+          graphene_vec4_add (&center, &slice[k + 4], &center);
+        }
+      graphene_vec4_scale (&center, 1.0f / 8, &center);
+      for (k = 0; k < 8; k++)
+        {
+          graphene_vec4_t d;
 
-          gthree_mesh_material_set_morph_targets (GTHREE_MESH_MATERIAL (m), useMorphing);
-          gthree_mesh_material_set_skinning (GTHREE_MESH_MATERIAL (m), useSkinning);
-          g_ptr_array_add (priv->shadowmap_depth_materials, m);
+          graphene_vec4_subtract (&slice[k], &center, &d);
+          radius = MAX (radius, graphene_vec4_length (&d));
+        }
 
-          GthreeMeshDistanceMaterial *m2 = gthree_mesh_distance_material_new ();
-          gthree_mesh_material_set_morph_targets (GTHREE_MESH_MATERIAL (m2), useMorphing);
-          gthree_mesh_material_set_skinning (GTHREE_MESH_MATERIAL (m2), useSkinning);
-          g_ptr_array_add (priv->shadowmap_distance_materials, m2);
+      /* Into world and then light space, with the center snapped to a texel */
+      graphene_matrix_transform_vec4 (gthree_object_get_world_matrix (GTHREE_OBJECT (camera)), &center, &center);
+      graphene_matrix_transform_vec4 (&light_view, &center, &center);
+      texel_x = 2 * radius / tile_width;
+      texel_y = 2 * radius / tile_height;
+      graphene_vec3_init (&q,
+                          floorf (graphene_vec4_get_x (&center) / texel_x) * texel_x,
+                          floorf (graphene_vec4_get_y (&center) / texel_y) * texel_y,
+                          graphene_vec4_get_z (&center));
+
+      graphene_vec4_init_from_vec3 (&center, &q, 1);
+      graphene_matrix_transform_vec4 (&light_world, &center, &center);
+      gthree_object_set_position_point3d (GTHREE_OBJECT (cascade_camera),
+                                          graphene_point3d_init (&p,
+                                                                 graphene_vec4_get_x (&center),
+                                                                 graphene_vec4_get_y (&center),
+                                                                 graphene_vec4_get_z (&center)));
+      gthree_object_update_matrix_world (GTHREE_OBJECT (cascade_camera), FALSE);
+      gthree_camera_update_matrix (cascade_camera);
+
+      gthree_orthographic_camera_set_left (ortho, -radius);
+      gthree_orthographic_camera_set_right (ortho, radius);
+      gthree_orthographic_camera_set_top (ortho, radius);
+      gthree_orthographic_camera_set_bottom (ortho, -radius);
+      gthree_camera_set_near (cascade_camera, -MAX (reach, radius));
+      gthree_camera_set_far (cascade_camera, radius);
+      invalidate_frame_uniforms (renderer, cascade_camera);
+
+      /* Light space to tile coordinates, which is axis aligned */
+      graphene_matrix_init_translate (&m, graphene_point3d_init (&p,
+                                                                 -graphene_vec3_get_x (&q),
+                                                                 -graphene_vec3_get_y (&q),
+                                                                 -graphene_vec3_get_z (&q)));
+      graphene_matrix_multiply (&m, gthree_camera_get_projection_matrix (cascade_camera), &m);
+      graphene_matrix_multiply (&m, &bias, &m);
+      for (k = 0; k < 3; k++)
+        {
+          cascade->scale[k] = graphene_matrix_get_value (&m, k, k);
+          cascade->offset[k] = graphene_matrix_get_value (&m, 3, k);
         }
+
+      tile[0] = area[0] + (c % columns) * tile_width;
+      tile[1] = area[1] + (c / columns) * tile_height;
+      tile[2] = tile_width;
+      tile[3] = tile_height;
+      glViewport (tile[0], tile[1], tile[2], tile[3]);
+      clear_shadow_area (renderer, tile);
+
+      gthree_camera_get_proj_screen_matrix (cascade_camera, &proj_screen_matrix);
+      graphene_frustum_init_from_matrix (&frustum, &proj_screen_matrix);
+      render_shadow_casters (renderer, &frustum, cascade_camera,
+                             FALSE, SHADOW_CASTERS_ALL);
+
+      cascade->valid = TRUE;
+      cascade->updated_frame = priv->shadow_frame;
+      split_near = split_far;
     }
 
-  materialVariants = priv->shadowmap_depth_materials;
-#ifdef TODO
-  var customMaterial = object.customDepthMaterial;
-#endif
+  state->light_view = light_view;
+  *gthree_light_shadow_get_matrix (GTHREE_LIGHT_SHADOW (shadow)) = light_view;
+}
 
-  if (isPointLight)
-    {
-      materialVariants = priv->shadowmap_distance_materials;
-#ifdef TODO
-      customMaterial = object.customDistanceMaterial;
-#endif
-    }
+static gboolean
+shadow_map_is_layered (GthreeRenderer *renderer,
+                       GthreeLight *light)
+{
+  return shadow_maps_layered (renderer) && GTHREE_IS_POINT_LIGHT (light);
+}
 
-  if (!customMaterial)
-    {
-      gboolean useMorphing = FALSE;
-      gboolean useSkinning = FALSE;
-      int variantIndex = 0;
+/* Point lights need the distance packed into colors, unless it is the
+   depth of a layered cube map. The other lights can use a depth texture */
+static gboolean
+shadow_map_is_depth_only (GthreeRenderer *renderer,
+                          GthreeLight *light)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
-#ifdef TODO
-      if (material.morphTargets && geometry)
-        useMorphing = geometry.morphAttributes && geometry.morphAttributes.position && geometry.morphAttributes.position.length > 0;
-#endif
+  if (GTHREE_IS_POINT_LIGHT (light))
+    return shadow_map_is_layered (renderer, light);
 
-#ifdef TODO
-      if (GTHREE_IS_SKINNED_MESH (object) && material.skinning === false ) {
-        console.warn( 'THREE.WebGLShadowMap: THREE.SkinnedMesh with material.skinning set to false:', object );
-      }
-#endif
+  return priv->shadowmap_depth_compare;
+}
 
-#ifdef TODO
-      useSkinning = object.isSkinnedMesh && material.skinning;
-#endif
+static gboolean
+shadow_map_get_layered (GthreeRenderTarget *map)
+{
+  GthreeTexture *depth_texture = gthree_render_target_get_depth_texture (map);
+
+  return depth_texture != NULL && GTHREE_IS_CUBE_TEXTURE (depth_texture);
+}
 
-      if (useMorphing)
-        variantIndex |= SHADER_MAP_MORPHING_FLAG;
-      if (useSkinning)
-        variantIndex |= SHADER_MAP_SKINNING_FLAG;
+static GthreeRenderTarget *
+shadow_map_target_new (GthreeRenderer *renderer,
+                       int width,
+                       int height,
+                       gboolean depth_only,
+                       gboolean layered)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeRenderTarget *target = gthree_render_target_new (width, height);
+  GthreeTexture *texture = gthree_render_target_get_texture (target);
 
-      result = g_ptr_array_index (materialVariants, variantIndex);
+  if (depth_only)
+    {
+      g_autoptr(GthreeTexture) depth_texture = NULL;
+      GthreeFilter filter = GTHREE_FILTER_LINEAR;
+
+      if (layered)
+        depth_texture = GTHREE_TEXTURE (gthree_cube_texture_new_empty ());
+      else
+        depth_texture = gthree_texture_new (NULL);
+
+      /* Linear filtering makes each compare a 2x2 PCF lookup */
+      if (priv->shadowmap_type == GTHREE_SHADOW_MAP_TYPE_BASIC)
+        filter = GTHREE_FILTER_NEAREST;
+
+      gthree_texture_set_format (depth_texture, GTHREE_TEXTURE_FORMAT_DEPTH);
+      gthree_texture_set_data_type (depth_texture, GTHREE_DATA_TYPE_UNSIGNED_INT);
+      gthree_texture_set_generate_mipmaps (depth_texture, FALSE);
+      gthree_texture_set_mag_filter (depth_texture, filter);
+      gthree_texture_set_min_filter (depth_texture, filter);
+      gthree_texture_set_compare (depth_texture, TRUE);
+
+      gthree_render_target_set_color_buffer (target, FALSE);
+      gthree_render_target_set_stencil_buffer (target, FALSE);
+      gthree_render_target_set_depth_texture (target, depth_texture);
     }
   else
     {
-      result = customMaterial;
+      gthree_texture_set_mag_filter (texture, GTHREE_FILTER_NEAREST);
+      gthree_texture_set_min_filter (texture, GTHREE_FILTER_NEAREST);
     }
 
-#ifdef TODO
-  if ( _renderer.localClippingEnabled &&
-       material.clipShadows === true &&
-       material.clippingPlanes.length !== 0 ) {
-    // in this case we need a unique material instance reflecting the
-    // appropriate state
-
-    var keyA = result.uuid, keyB = material.uuid;
-    var materialsForVariant = _materialCache[ keyA ];
+  return target;
+}
 
-    if ( materialsForVariant === undefined ) {
-      materialsForVariant = {};
-      _materialCache[ keyA ] = materialsForVariant;
-    }
+/* The size of the whole map of a light, and of the part that one cube
+   face or cascade is rendered to */
+static void
+get_shadow_map_size (GthreeRenderer *renderer,
+                     GthreeLight *light,
+                     GthreeLightShadow *shadow,
+                     int *width,
+                     int *height,
+                     int *tile_width,
+                     int *tile_height)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int columns = 1, rows = 1;
 
-    var cachedMaterial = materialsForVariant[ keyB ];
-    if ( cachedMaterial === undefined ) {
-      cachedMaterial = result.clone();
-      materialsForVariant[ keyB ] = cachedMaterial;
-    }
+  if (GTHREE_IS_DIRECTIONAL_LIGHT_SHADOW (shadow) &&
+      gthree_directional_light_shadow_get_n_cascades (GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow)) > 1)
+    gthree_directional_light_shadow_get_atlas_layout (GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow), &columns, &rows);
 
-    result = cachedMaterial;
-  }
-#endif
+  *tile_width = MIN (gthree_light_shadow_get_map_width (shadow), priv->max_texture_size / columns);
+  *tile_height = MIN (gthree_light_shadow_get_map_height (shadow), priv->max_texture_size / rows);
+  *width = *tile_width * columns;
+  *height = *tile_height * rows;
 
-  gthree_material_set_is_visible (result, gthree_material_get_is_visible (material));
-  if (GTHREE_MESH_MATERIAL (material))
-    gthree_mesh_material_set_is_wireframe (GTHREE_MESH_MATERIAL (result),
-                                           gthree_mesh_material_get_is_wireframe (GTHREE_MESH_MATERIAL (material)));
+  /* The faces of a cube map are square */
+  if (shadow_map_is_layered (renderer, light))
+    {
+      *tile_width = MIN (MIN (*tile_width, *tile_height), priv->max_cubemap_size);
+      *tile_height = *tile_width;
+      *width = *tile_width;
+      *height = *tile_height;
+    }
+  else if (GTHREE_IS_POINT_LIGHT (light))
+    {
+      *width *= 4;
+      *height *= 2;
+    }
+}
 
-#ifdef TODO
-  result.side = ( material.shadowSide != null ) ? material.shadowSide : shadowSide[ material.side ];
-#endif
+static int
+compare_atlas_area_height (gconstpointer a,
+                           gconstpointer b)
+{
+  const GthreeShadowAtlasArea *area_a = a;
+  const GthreeShadowAtlasArea *area_b = b;
 
-#ifdef TODO
-  result.clipShadows = material.clipShadows;
-  result.clippingPlanes = material.clippingPlanes;
-  result.clipIntersection = material.clipIntersection;
-#endif
+  if (area_a->area[3] != area_b->area[3])
+    return area_b->area[3] - area_a->area[3];
 
-#ifdef TODO
-  result.wireframeLinewidth = material.wireframeLinewidth;
-  result.linewidth = material.linewidth;
-#endif
+  return area_a->index - area_b->index;
+}
 
-  if (isPointLight && GTHREE_IS_MESH_DISTANCE_MATERIAL (result))
-    {
-      gthree_mesh_distance_material_set_reference_point (GTHREE_MESH_DISTANCE_MATERIAL (result),
-                                                         lightPositionWorld);
-      gthree_mesh_distance_material_set_near_distance (GTHREE_MESH_DISTANCE_MATERIAL (result),
-                                                       shadowCameraNear);
-      gthree_mesh_distance_material_set_far_distance (GTHREE_MESH_DISTANCE_MATERIAL (result),
-                                                      shadowCameraFar);
-    }
+static int
+compare_atlas_area_index (gconstpointer a,
+                          gconstpointer b)
+{
+  const GthreeShadowAtlasArea *area_a = a;
+  const GthreeShadowAtlasArea *area_b = b;
 
-  return result;
+  return area_a->index - area_b->index;
 }
 
-static void
-shadow_map_render_object (GthreeRenderer *renderer,
-                          GthreeObject *object,
-                          GthreeCamera *camera,
-                          graphene_frustum_t *frustum,
-                          GthreeCamera *shadow_camera,
-                          const graphene_vec3_t *_lightPositionWorld,
-                          gboolean is_point_light)
+/* Places the maps of the lights in priv->shadows in rows of the atlas,
+   the tallest ones first. Returns whether the atlas was (re)created, so
+   everything in it must be rendered again. */
+static gboolean
+pack_shadow_atlas (GthreeRenderer *renderer)
 {
-  GthreeObject *child;
-  GthreeObjectIter iter;
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int size = MIN (priv->shadow_atlas_size, priv->max_texture_size);
+  int x = 0, shelf_y = 0, shelf_height = 0;
+  gboolean any_packed = FALSE;
+  int i;
+
+  g_array_set_size (priv->shadow_atlas_areas, priv->shadows->len);
+  for (i = 0; i < priv->shadows->len; i++)
+    {
+      GthreeLight *light = g_ptr_array_index (priv->shadows, i);
+      GthreeLightShadow *shadow = gthree_light_get_shadow (light);
+      GthreeShadowAtlasArea *area = &g_array_index (priv->shadow_atlas_areas, GthreeShadowAtlasArea, i);
+      int tile_width, tile_height;
+
+      memset (area, 0, sizeof (GthreeShadowAtlasArea));
+      area->index = i;
+      if (shadow)
+        get_shadow_map_size (renderer, light, shadow, &area->area[2], &area->area[3], &tile_width, &tile_height);
+    }
 
-  if (!gthree_object_get_visible (object))
-    return;
+  if (size <= 0)
+    return FALSE;
 
-  if (gthree_object_check_layer (object, gthree_object_get_layer_mask (GTHREE_OBJECT (camera))) &&
-      (GTHREE_IS_MESH (object) || GTHREE_IS_LINE_SEGMENTS (object) || GTHREE_IS_POINTS (object)))
+  g_array_sort (priv->shadow_atlas_areas, compare_atlas_area_height);
+
+  for (i = 0; i < priv->shadow_atlas_areas->len; i++)
     {
-      if (gthree_object_get_cast_shadow (object) &&
-          (!gthree_object_get_is_frustum_culled (object) || gthree_object_is_in_frustum (object, frustum)))
-        {
-          GthreeGeometry *geometry = NULL;
-          GthreeMaterial *material = NULL;
-          gboolean uses_groups = FALSE;
+      GthreeShadowAtlasArea *area = &g_array_index (priv->shadow_atlas_areas, GthreeShadowAtlasArea, i);
+      GthreeLight *light = g_ptr_array_index (priv->shadows, area->index);
+      int width = area->area[2];
+      int height = area->area[3];
 
-          gthree_object_update_matrix_view (object, gthree_camera_get_world_inverse_matrix (shadow_camera));
-          gthree_object_update (object);
+      if (width == 0 || height == 0 || width > size)
+        continue;
 
-          // TODO: Abstract this out into vfuncs
-          if (GTHREE_IS_MESH (object))
-            {
-              // TODO: Handle multi material
-              geometry = gthree_mesh_get_geometry (GTHREE_MESH (object));
-              uses_groups = gthree_mesh_get_n_materials (GTHREE_MESH (object)) > 1;
-              material = gthree_mesh_get_material (GTHREE_MESH (object), 0);
-            }
-          else
-            {
-              g_warning ("Unsupported object type for shadows: %s", g_type_name_from_instance ((gpointer)object));
-            }
+      /* The atlas is a depth texture too then */
+      if (priv->shadowmap_depth_compare && !shadow_map_is_depth_only (renderer, light))
+        continue;
 
-          if (uses_groups)
-            {
-#ifdef TODO
-              var groups = geometry.groups;
+      /* Cube maps are their own textures */
+      if (shadow_map_is_layered (renderer, light))
+        continue;
 
-              for ( var k = 0, kl = groups.length; k < kl; k ++ )
-                {
-                  var group = groups[ k ];
-                  var groupMaterial = material[ group.materialIndex ];
-
-                  if ( groupMaterial && groupMaterial.visible )
-                    {
-                      var depthMaterial = getDepthMaterial( object, groupMaterial, is_point_light, _lightPositionWorld, shadow_camera.near, shadow_camera.far );
-                      _renderer.renderBufferDirect( shadow_camera, null, geometry, depthMaterial, object, group );
-                    }
-                }
-#endif
-            }
-          else if (gthree_material_get_is_visible (material))
-            {
-              GthreeMaterial *depthMaterial = getDepthMaterial (renderer, object, geometry, material, is_point_light, _lightPositionWorld,
-                                                                gthree_camera_get_near (shadow_camera), gthree_camera_get_far (shadow_camera));
-              GthreeRenderListItem item = { object, geometry, depthMaterial, NULL, 0.0 };
-              render_item (renderer, shadow_camera, FALSE, depthMaterial, &item);
-            }
+      if (x + width > size)
+        {
+          shelf_y += shelf_height;
+          shelf_height = 0;
+          x = 0;
         }
+
+      if (shelf_y + height > size)
+        continue;
+
+      area->area[0] = x;
+      area->area[1] = shelf_y;
+      area->packed = TRUE;
+      any_packed = TRUE;
+
+      x += width;
+      shelf_height = MAX (shelf_height, height);
     }
 
-  gthree_object_iter_init (&iter, object);
-  while (gthree_object_iter_next (&iter, &child))
-    shadow_map_render_object (renderer, child, camera, frustum, shadow_camera, _lightPositionWorld, is_point_light);
-}
+  g_array_sort (priv->shadow_atlas_areas, compare_atlas_area_index);
 
+  if (!any_packed ||
+      (priv->shadow_atlas != NULL && gthree_render_target_get_width (priv->shadow_atlas) == size))
+    return FALSE;
+
+  g_clear_object (&priv->shadow_atlas);
+  priv->shadow_atlas = shadow_map_target_new (renderer, size, size, priv->shadowmap_depth_compare, FALSE);
+
+  return TRUE;
+}
 
 static void
 render_shadow_map (GthreeRenderer *renderer,
@@ -1679,9 +5480,10 @@ render_shadow_map (GthreeRenderer *renderer,
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
   g_autoptr(GthreeRenderTarget) current_render_target = NULL;
-  GList *l;
+  int i;
   int faceCount;
   graphene_vec3_t c;
+  gboolean atlas_created;
 
   if (!priv->shadowmap_enabled)
     return;
@@ -1689,11 +5491,14 @@ render_shadow_map (GthreeRenderer *renderer,
   if (!priv->shadowmap_auto_update && !priv->shadowmap_needs_update)
     return;
 
-  if (priv->shadows == NULL)
+  if (priv->shadows->len == 0)
     return;
 
   push_debug_group ("rendering shadow maps");
 
+  collect_shadow_casters (renderer);
+  atlas_created = pack_shadow_atlas (renderer);
+
   g_set_object (&current_render_target,  priv->current_render_target);
 
   // Set GL state for depth map.
@@ -1707,10 +5512,13 @@ render_shadow_map (GthreeRenderer *renderer,
 #endif
 
   // render depth map
-  for (l = priv->shadows; l != NULL; l = l->next)
+  for (i = 0; i < priv->shadows->len; i++)
     {
-      GthreeLight *light = l->data;
+      GthreeLight *light = g_ptr_array_index (priv->shadows, i);
       GthreeLightShadow *shadow = gthree_light_get_shadow (light);
+      GthreeShadowAtlasArea *atlas_area = &g_array_index (priv->shadow_atlas_areas, GthreeShadowAtlasArea, i);
+      const int *area = atlas_area->area;
+      const int static_area[4] = { 0, 0, area[2], area[3] };
       graphene_vec4_t cube2DViewPorts[6];
 
       if (shadow == NULL)
@@ -1721,15 +5529,24 @@ render_shadow_map (GthreeRenderer *renderer,
 
       GthreeCamera *shadow_camera = gthree_light_shadow_get_camera (shadow);
 
-      int shadow_map_width = MIN (gthree_light_shadow_get_map_width (shadow), priv->max_texture_size);
-      int shadow_map_height = MIN (gthree_light_shadow_get_map_height (shadow), priv->max_texture_size);
+      int shadow_map_width, shadow_map_height;
+      gboolean cascaded = GTHREE_IS_DIRECTIONAL_LIGHT_SHADOW (shadow) &&
+        gthree_directional_light_shadow_get_n_cascades (GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow)) > 1;
+      gboolean created = FALSE;
+      gboolean depth_only = shadow_map_is_depth_only (renderer, light);
+      gboolean layered = shadow_map_is_layered (renderer, light);
+      int tile_width, tile_height;
+
+      get_shadow_map_size (renderer, light, shadow,
+                           &shadow_map_width, &shadow_map_height,
+                           &tile_width, &tile_height);
 
       push_debug_group ("shadow maps light %p", light);
 
       if (GTHREE_IS_POINT_LIGHT (light))
         {
-          int vpWidth = shadow_map_width;
-          int vpHeight = shadow_map_height;
+          int vpWidth = tile_width;
+          int vpHeight = tile_height;
 
           // These viewports map a cube-map onto a 2D texture with the
           // following orientation:
@@ -1762,20 +5579,48 @@ render_shadow_map (GthreeRenderer *renderer,
           // negative Y
           graphene_vec4_init (&cube2DViewPorts[5],
                               vpWidth, 0, vpWidth, vpHeight );
-
-          shadow_map_width *= 4;
-          shadow_map_height *= 2;
         }
 
       GthreeRenderTarget *shadow_map = gthree_light_shadow_get_map (shadow);
+      GthreeLightShadowCache *cache = gthree_light_shadow_get_cache (shadow);
+      gboolean use_cache;
+      guint64 static_signature = 0;
+      int n_dynamic = 0;
+
+      if (atlas_area->packed)
+        {
+          /* Moved into the atlas, or to another place in it */
+          if (shadow_map != priv->shadow_atlas || !cache->shared || atlas_created ||
+              memcmp (cache->area, area, sizeof (cache->area)) != 0)
+            {
+              created = TRUE;
+              cache->valid = FALSE;
+              cache->shared = TRUE;
+              memcpy (cache->area, area, sizeof (cache->area));
+              gthree_light_shadow_set_map (shadow, priv->shadow_atlas);
+              gthree_camera_update (shadow_camera);
+            }
+
+          shadow_map = priv->shadow_atlas;
+        }
+      else if (shadow_map != NULL &&
+               (cache->shared ||
+                /* The map size or the number of cascades changed */
+                gthree_render_target_get_width (shadow_map) != shadow_map_width ||
+                gthree_render_target_get_height (shadow_map) != shadow_map_height ||
+                gthree_render_target_get_color_buffer (shadow_map) == depth_only ||
+                shadow_map_get_layered (shadow_map) != layered))
+        shadow_map = NULL;
 
       if (shadow_map == NULL)
         {
-          shadow_map = gthree_render_target_new (shadow_map_width, shadow_map_height);
+          g_autoptr(GthreeRenderTarget) new_map = shadow_map_target_new (renderer, shadow_map_width, shadow_map_height, depth_only, layered);
 
-          GthreeTexture *texture = gthree_render_target_get_texture (shadow_map);
-          gthree_texture_set_mag_filter (texture, GTHREE_FILTER_NEAREST);
-          gthree_texture_set_min_filter (texture, GTHREE_FILTER_NEAREST);
+          created = TRUE;
+          cache->valid = FALSE;
+          cache->shared = FALSE;
+          memcpy (cache->area, area, sizeof (cache->area));
+          shadow_map = new_map;
 
           gthree_light_shadow_set_map (shadow, shadow_map);
 
@@ -1786,6 +5631,19 @@ render_shadow_map (GthreeRenderer *renderer,
           gthree_camera_update (shadow_camera);
         }
 
+      /* Cascades have their own update intervals instead of the caching */
+      if (cascaded)
+        {
+          gthree_renderer_set_render_target (renderer, shadow_map, 0, 0);
+          render_shadow_cascades (renderer, camera, GTHREE_DIRECTIONAL_LIGHT (light),
+                                  GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow),
+                                  area, tile_width, tile_height,
+                                  created || priv->shadowmap_needs_update);
+          cache->valid = FALSE;
+          pop_debug_group ();
+          continue;
+        }
+
       if (GTHREE_IS_SPOT_LIGHT_SHADOW (shadow))
         gthree_spot_light_shadow_update (GTHREE_SPOT_LIGHT_SHADOW (shadow), GTHREE_SPOT_LIGHT (light));
 
@@ -1844,49 +5702,83 @@ render_shadow_map (GthreeRenderer *renderer,
                                     shadowMatrix);
         }
 
-      gthree_renderer_set_render_target (renderer, shadow_map, 0, 0);
-      gthree_renderer_clear (renderer, TRUE, TRUE, TRUE);
-
-      // render shadow map for each cube face (if omni-directional) or
-      // run a single pass if not
-      for (int face = 0; face < faceCount; face++)
+      use_cache = priv->shadowmap_caching && priv->shadowmap_auto_update && !priv->shadowmap_needs_update;
+      if (use_cache)
         {
-          if (GTHREE_IS_POINT_LIGHT (light))
+          static_signature = get_shadow_signature (renderer, shadow_camera, &_lightPositionWorld,
+                                                   GTHREE_IS_POINT_LIGHT (light),
+                                                   area[2], area[3], &n_dynamic);
+
+          /* Nothing it shows changed */
+          if (cache->valid && cache->static_signature == static_signature &&
+              n_dynamic == 0 && !cache->has_dynamic)
             {
-              graphene_point3d_t p;
-              graphene_vec3_t _lookTarget;
-              graphene_vec3_add (gthree_object_get_position (GTHREE_OBJECT (shadow_camera)),
-                                 &cube_directions[face], &_lookTarget);
-
-              gthree_object_set_up (GTHREE_OBJECT (shadow_camera), &cube_ups[face]);
-              gthree_object_look_at (GTHREE_OBJECT (shadow_camera),
-                                     graphene_point3d_init (&p,
-                                                            graphene_vec3_get_x (&_lookTarget),
-                                                            graphene_vec3_get_y (&_lookTarget),
-                                                            graphene_vec3_get_z (&_lookTarget)));
-
-              gthree_object_update_matrix_world (GTHREE_OBJECT (shadow_camera), FALSE);
-              gthree_camera_update_matrix (shadow_camera);
-
-              graphene_vec4_t *vpDimensions = &cube2DViewPorts[face];
-
-              glViewport (graphene_vec4_get_x (vpDimensions),
-                          graphene_vec4_get_y (vpDimensions),
-                          graphene_vec4_get_z (vpDimensions),
-                          graphene_vec4_get_w (vpDimensions));
+              pop_debug_group ();
+              continue;
             }
+        }
+
+      if (!use_cache)
+        {
+          gthree_renderer_set_render_target (renderer, shadow_map, 0, 0);
+          clear_shadow_area (renderer, area);
+          render_shadow_faces (renderer, shadow_camera, cube2DViewPorts, area, faceCount,
+                               &_lightPositionWorld, GTHREE_IS_POINT_LIGHT (light),
+                               layered, SHADOW_CASTERS_ALL);
+          cache->valid = FALSE;
+        }
+      else if (n_dynamic == 0 || layered)
+        {
+          gthree_renderer_set_render_target (renderer, shadow_map, 0, 0);
+          clear_shadow_area (renderer, area);
+          render_shadow_faces (renderer, shadow_camera, cube2DViewPorts, area, faceCount,
+                               &_lightPositionWorld, GTHREE_IS_POINT_LIGHT (light),
+                               layered, SHADOW_CASTERS_ALL);
+
+          /* The map itself is the static cache now. Layered maps have no
+             static base, a blit would only copy their first layer. */
+          g_clear_object (&cache->static_map);
+          cache->has_dynamic = n_dynamic > 0;
+        }
+      else
+        {
+          if (cache->static_map == NULL || static_signature != cache->static_signature || !cache->valid)
+            {
+              if (cache->static_map == NULL ||
+                  gthree_render_target_get_width (cache->static_map) != area[2] ||
+                  gthree_render_target_get_height (cache->static_map) != area[3] ||
+                  gthree_render_target_get_color_buffer (cache->static_map) == depth_only)
+                {
+                  g_clear_object (&cache->static_map);
+                  cache->static_map = shadow_map_target_new (renderer, area[2], area[3], depth_only, FALSE);
+                }
 
-          // update camera matrices and frustum
-          graphene_matrix_t _projScreenMatrix;
-          graphene_frustum_t frustum;
+              gthree_renderer_set_render_target (renderer, cache->static_map, 0, 0);
+              gthree_renderer_clear (renderer, TRUE, TRUE, TRUE);
+              render_shadow_faces (renderer, shadow_camera, cube2DViewPorts, static_area, faceCount,
+                                   &_lightPositionWorld, GTHREE_IS_POINT_LIGHT (light),
+                                   FALSE, SHADOW_CASTERS_STATIC);
+            }
 
-          gthree_camera_get_proj_screen_matrix (shadow_camera, &_projScreenMatrix);
-          graphene_frustum_init_from_matrix (&frustum, &_projScreenMatrix);
+          /* Start from the static casters, depth included, and add the dynamic ones */
+          gthree_renderer_set_render_target (renderer, shadow_map, 0, 0);
+          glBindFramebuffer (GL_READ_FRAMEBUFFER, gthree_render_target_get_gl_framebuffer (cache->static_map));
+          glBlitFramebuffer (0, 0, area[2], area[3],
+                             area[0], area[1], area[0] + area[2], area[1] + area[3],
+                             depth_only ? GL_DEPTH_BUFFER_BIT : GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT,
+                             GL_NEAREST);
+          glBindFramebuffer (GL_READ_FRAMEBUFFER, gthree_render_target_get_gl_framebuffer (shadow_map));
+
+          render_shadow_faces (renderer, shadow_camera, cube2DViewPorts, area, faceCount,
+                               &_lightPositionWorld, GTHREE_IS_POINT_LIGHT (light),
+                               FALSE, SHADOW_CASTERS_DYNAMIC);
+          cache->has_dynamic = TRUE;
+        }
 
-          // set object matrices & frustum culling
-          shadow_map_render_object (renderer, GTHREE_OBJECT (scene), camera, &frustum, shadow_camera,
-                                    &_lightPositionWorld,
-                                    GTHREE_IS_POINT_LIGHT (light));
+      if (use_cache)
+        {
+          cache->valid = TRUE;
+          cache->static_signature = static_signature;
         }
 
       pop_debug_group ();
@@ -1928,6 +5820,86 @@ mark_uniforms_lights_needs_update (GthreeUniforms *uniforms, gboolean needs_upda
 
 }
 
+static void
+reset_frame_uniforms (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_ptr_array_set_size (priv->frame_cameras, 0);
+  priv->frame_camera = NULL;
+
+  /* Orphan the old storage so we don't stall on draws still using it */
+  glBindBuffer (GL_UNIFORM_BUFFER, priv->frame_ubo);
+  glBufferData (GL_UNIFORM_BUFFER, priv->frame_ubo_stride * MAX_FRAME_UNIFORM_SLOTS, NULL, GL_STREAM_DRAW);
+}
+
+/* Call when the camera matrices change while rendering a frame */
+static void
+invalidate_frame_uniforms (GthreeRenderer *renderer,
+                           GthreeCamera *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int i;
+
+  for (i = 0; i < priv->frame_cameras->len; i++)
+    {
+      if (g_ptr_array_index (priv->frame_cameras, i) == camera)
+        g_ptr_array_index (priv->frame_cameras, i) = NULL;
+    }
+
+  if (priv->frame_camera == camera)
+    priv->frame_camera = NULL;
+}
+
+static void
+use_frame_uniforms (GthreeRenderer *renderer,
+                    GthreeCamera *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeFrameUniforms data;
+  graphene_vec4_t pos;
+  int slot, n_planes;
+
+  if (camera == priv->frame_camera)
+    return;
+
+  for (slot = 0; slot < priv->frame_cameras->len; slot++)
+    {
+      if (g_ptr_array_index (priv->frame_cameras, slot) == camera)
+        break;
+    }
+
+  if (slot == priv->frame_cameras->len)
+    {
+      if (slot == MAX_FRAME_UNIFORM_SLOTS)
+        {
+          reset_frame_uniforms (renderer);
+          slot = 0;
+        }
+
+      graphene_matrix_to_float (gthree_camera_get_projection_matrix (camera), data.projection_matrix);
+      graphene_matrix_to_float (gthree_camera_get_world_inverse_matrix (camera), data.view_matrix);
+      graphene_matrix_get_row (gthree_object_get_world_matrix (GTHREE_OBJECT (camera)), 3, &pos);
+      data.camera_position[0] = graphene_vec4_get_x (&pos);
+      data.camera_position[1] = graphene_vec4_get_y (&pos);
+      data.camera_position[2] = graphene_vec4_get_z (&pos);
+      data.time = (g_get_monotonic_time () - priv->start_time) / (float)G_USEC_PER_SEC;
+
+      memset (data.clipping_planes, 0, sizeof (data.clipping_planes));
+      n_planes = MIN (priv->num_clipping_planes, GTHREE_MAX_FRAME_CLIPPING_PLANES);
+      if (n_planes > 0)
+        memcpy (data.clipping_planes, priv->clipping_state->data, n_planes * 4 * sizeof (float));
+
+      glBindBuffer (GL_UNIFORM_BUFFER, priv->frame_ubo);
+      glBufferSubData (GL_UNIFORM_BUFFER, slot * priv->frame_ubo_stride, sizeof (data), &data);
+      g_ptr_array_add (priv->frame_cameras, camera);
+    }
+
+  glBindBufferRange (GL_UNIFORM_BUFFER, GTHREE_FRAME_UNIFORMS_BINDING, priv->frame_ubo,
+                     slot * priv->frame_ubo_stride, sizeof (GthreeFrameUniforms));
+  priv->frame_camera = camera;
+}
+
 static GthreeProgram *
 set_program (GthreeRenderer *renderer,
              GthreeCamera *camera,
@@ -1943,6 +5915,7 @@ set_program (GthreeRenderer *renderer,
   GthreeShader *shader;
   GthreeUniforms *m_uniforms;
   GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
+  GthreeMaterialVariantKey variant_key;
 
 #ifdef TODO
   // This is only needed for local clipping
@@ -1957,19 +5930,27 @@ set_program (GthreeRenderer *renderer,
 
   /* Maybe the light state (e.g. nr of lights, or if this is a shaded
      object) changed since we last initialized the material, even if
-     the material itself didn't change */
-  priv->light_setup.hash.obj_receive_shadow = gthree_object_get_receive_shadow (object) && priv->shadowmap_enabled;
-  if (!gthree_material_get_needs_update (material))
-    {
-      if (!gthree_light_setup_hash_equal (&material_properties->light_hash, &priv->light_setup.hash))
-        gthree_material_set_needs_update (material, TRUE);
-    }
+     the material itself didn't change. Materials shared between
+     different kinds of objects keep a program for each of them. */
+  get_material_variant_key (renderer, object, &variant_key);
 
   if (gthree_material_get_needs_update (material))
     {
-      init_material (renderer, material, fog, object);
+      /* The material itself changed, so all variants are stale */
+      gthree_material_properties_clear_variants (material_properties);
+      if (!init_material (renderer, material, fog, object, &variant_key))
+        return NULL;
       gthree_material_set_needs_update (material, FALSE);
     }
+  else if (memcmp (&material_properties->key, &variant_key, sizeof (GthreeMaterialVariantKey)) != 0)
+    {
+      GthreeMaterialVariant *variant = find_material_variant (material_properties, &variant_key);
+
+      if (variant != NULL)
+        use_material_variant (renderer, material, variant);
+      else if (!init_material (renderer, material, fog, object, &variant_key))
+        return NULL;
+    }
 
   program = material_properties->program;
   shader = gthree_material_get_shader (material);
@@ -1991,15 +5972,11 @@ set_program (GthreeRenderer *renderer,
       refreshMaterial = TRUE;
     }
 
+  /* projectionMatrix, viewMatrix and cameraPosition live in the shared frame uniform block */
+  use_frame_uniforms (renderer, camera);
+
   if (refreshProgram || camera != priv->current_camera)
     {
-      const graphene_matrix_t *projection_matrix = gthree_camera_get_projection_matrix (camera);
-      float projection_matrixv[16];
-      gint proction_matrix_location = gthree_program_lookup_uniform_location (program, q_projectionMatrix);
-
-      graphene_matrix_to_float (projection_matrix, projection_matrixv);
-      glUniformMatrix4fv (proction_matrix_location, 1, FALSE, projection_matrixv);
-
 #ifdef TODO
       if ( _logarithmicDepthBuffer )
         glUniform1f (uniform_locations.logDepthBufFC, 2.0 / ( Math.log( camera.far + 1.0 ) / Math.LN2 ));
@@ -2015,38 +5992,6 @@ set_program (GthreeRenderer *renderer,
           refreshMaterial = TRUE;	// set to true on material change
           refreshLights = TRUE;		// remains set until update done
         }
-
-      // load material specific uniforms
-      // (shader material also gets them for the sake of genericity)
-
-      if (gthree_material_needs_camera_pos (material)
-#if TODO
-          || material.envMap
-#endif
-          )
-        {
-          gint camera_position_location = gthree_program_lookup_uniform_location (program, q_cameraPosition);
-          if (camera_position_location >= 0)
-            {
-              const graphene_matrix_t *camera_matrix_world = gthree_object_get_world_matrix (GTHREE_OBJECT (camera));
-              graphene_vec4_t pos;
-              graphene_matrix_get_row (camera_matrix_world, 3, &pos);
-              glUniform3f (camera_position_location,
-                           graphene_vec4_get_x (&pos), graphene_vec4_get_y (&pos), graphene_vec4_get_z (&pos));
-            }
-        }
-
-      if (gthree_material_needs_view_matrix (material))
-        {
-          gint view_matrix_location = gthree_program_lookup_uniform_location (program, q_viewMatrix);
-          if (view_matrix_location >= 0)
-            {
-              const graphene_matrix_t *m = gthree_camera_get_world_inverse_matrix (camera);
-              float floats[16];
-              graphene_matrix_to_float (m, floats);
-              glUniformMatrix4fv (view_matrix_location, 1, FALSE, floats);
-            }
-        }
     }
 
   // skinning uniforms must be set even if material didn't change
@@ -2125,7 +6070,7 @@ set_program (GthreeRenderer *renderer,
       if (gthree_material_needs_lights (material))
         {
           mark_uniforms_lights_needs_update (m_uniforms, refreshLights);
-          if (refreshLights)
+          if (refreshLights && !material_properties->key.light_block)
             {
               /* We marked the uniforms so they are uploaded, but we also need to sync
                * the actual values from the light uniforms into the material uniforms
@@ -2181,6 +6126,13 @@ set_program (GthreeRenderer *renderer,
 
   gthree_object_set_direct_uniforms (object, program, renderer);
 
+  if (priv->shadow_cube_pass)
+    {
+      int mask_location = gthree_program_lookup_uniform_location (program, q_cubeFaceMask);
+      if (mask_location >= 0)
+        glUniform1i (mask_location, priv->cube_face_mask);
+    }
+
   return program;
 }
 
@@ -2195,8 +6147,9 @@ init_attributes (GthreeRenderer *renderer)
 }
 
 static void
-enable_attribute (GthreeRenderer *renderer,
-                  guint attribute)
+enable_attribute_and_divisor (GthreeRenderer *renderer,
+                              guint attribute,
+                              guint mesh_per_attribute)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
@@ -2206,6 +6159,12 @@ enable_attribute (GthreeRenderer *renderer,
       glEnableVertexAttribArray(attribute);
       priv->enabled_attributes[attribute] = 1;
     }
+
+  if (priv->attribute_divisors[attribute] != mesh_per_attribute)
+    {
+      glVertexAttribDivisor (attribute, mesh_per_attribute);
+      priv->attribute_divisors[attribute] = mesh_per_attribute;
+    }
 }
 
 static void
@@ -2224,16 +6183,51 @@ disable_unused_attributes (GthreeRenderer *renderer)
     }
 }
 
+static GthreeAttribute *
+get_object_attribute (GthreeObject *object,
+                      GthreeGeometry *geometry,
+                      GQuark nameq,
+                      const char *name)
+{
+  if (GTHREE_IS_INSTANCED_MESH (object))
+    {
+      if (nameq == q_instanceMatrix)
+        return gthree_instanced_mesh_get_instance_matrix (GTHREE_INSTANCED_MESH (object));
+      if (nameq == q_instanceColor)
+        return gthree_instanced_mesh_get_instance_color (GTHREE_INSTANCED_MESH (object));
+    }
+
+  return gthree_geometry_get_attribute (geometry, name);
+}
+
+static void
+bind_vertex_array (GthreeRenderer *renderer,
+                   guint vao)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->current_vertex_array != vao)
+    {
+      glBindVertexArray (vao);
+      priv->current_vertex_array = vao;
+    }
+}
+
 static void
 setup_vertex_attributes (GthreeRenderer *renderer,
-                         GthreeMaterial *material,
+                         GthreeVertexArray *va,
                          GthreeProgram *program,
+                         GthreeObject *object,
                          GthreeGeometry *geometry)
 {
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
   GHashTable *program_attributes;
   GHashTableIter iter;
   gpointer key, value;
 
+  /* This is a fresh vao, so everything is disabled */
+  memset (priv->enabled_attributes, 0, sizeof (priv->enabled_attributes));
+  memset (priv->attribute_divisors, 0, sizeof (priv->attribute_divisors));
   init_attributes (renderer);
 
   program_attributes = gthree_program_get_attribute_locations (program);
@@ -2247,45 +6241,151 @@ setup_vertex_attributes (GthreeRenderer *renderer,
 
       if (program_attribute >= 0)
         {
-          GthreeAttribute *geometry_attribute = gthree_geometry_get_attribute (geometry, name);
+          GthreeAttribute *geometry_attribute = get_object_attribute (object, geometry, nameq, name);
           if (geometry_attribute != NULL)
             {
               gboolean normalized = gthree_attribute_get_normalized (geometry_attribute);
               int size = gthree_attribute_get_item_size (geometry_attribute);
               int offset = gthree_attribute_get_item_offset (geometry_attribute);
               int stride = gthree_attribute_get_stride (geometry_attribute);
+              int mesh_per_attribute = gthree_attribute_get_mesh_per_attribute (geometry_attribute);
+              int n_slots, slot;
+              GthreeVertexArrayBinding binding;
 
               int buffer = gthree_attribute_get_gl_buffer (geometry_attribute);
               int type = gthree_attribute_get_gl_type (geometry_attribute);
               int bytes_per_element = gthree_attribute_get_gl_bytes_per_element (geometry_attribute);
 
-              /*
-                if ( geometryAttribute.isInstancedBufferAttribute )
-                {
-                state.enableAttributeAndDivisor( programAttribute, geometryAttribute.meshPerAttribute );
-                if ( geometry.maxInstancedCount === undefined )
+              /* Matrix attributes take one location per column */
+              n_slots = 1;
+              if (size == 16)
+                n_slots = 4;
+              else if (size == 9)
+                n_slots = 3;
+              size /= n_slots;
+
+              glBindBuffer (GL_ARRAY_BUFFER, buffer);
+              for (slot = 0; slot < n_slots; slot++)
                 {
-                geometry.maxInstancedCount = geometryAttribute.meshPerAttribute * geometryAttribute.count;
+                  enable_attribute_and_divisor (renderer, program_attribute + slot, mesh_per_attribute);
+                  glVertexAttribPointer (program_attribute + slot, size, type, normalized, stride * bytes_per_element,
+                                         GINT_TO_POINTER ((offset + slot * size) * bytes_per_element));
                 }
-                }
-                else
-              */
-              {
-                enable_attribute (renderer, program_attribute);
-              }
-              glBindBuffer (GL_ARRAY_BUFFER, buffer);
-              glVertexAttribPointer (program_attribute, size, type, normalized, stride * bytes_per_element, GINT_TO_POINTER (offset * bytes_per_element));
+
+              binding.name = nameq;
+              binding.attribute = geometry_attribute;
+              binding.gl_buffer = buffer;
+              binding.from_object = geometry_attribute != gthree_geometry_get_attribute (geometry, name);
+              g_array_append_val (va->bindings, binding);
             }
           else
             {
-              gthree_material_load_default_attribute (material, program_attribute, nameq);
+              GthreeVertexArrayDefault def = { nameq, program_attribute };
+              g_array_append_val (va->defaults, def);
             }
         }
     }
 
+  disable_unused_attributes (renderer);
 
+  if (va->index != NULL)
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, va->index_buffer);
+}
 
-  disable_unused_attributes (renderer);
+static gboolean
+vertex_array_is_valid (GthreeVertexArray *va,
+                       GthreeObject *object,
+                       GthreeGeometry *geometry,
+                       GthreeAttribute *index)
+{
+  int i;
+
+  /* If the version is unchanged the geometry still owns all the
+     attributes we reference, so it is safe to look at them */
+  if (va->geometry_version != gthree_geometry_get_attributes_version (geometry))
+    return FALSE;
+
+  if (va->index != index ||
+      (index != NULL && gthree_attribute_get_gl_buffer (index) != va->index_buffer))
+    return FALSE;
+
+  for (i = 0; i < va->bindings->len; i++)
+    {
+      GthreeVertexArrayBinding *binding = &g_array_index (va->bindings, GthreeVertexArrayBinding, i);
+
+      if (binding->from_object &&
+          get_object_attribute (object, geometry, binding->name, NULL) != binding->attribute)
+        return FALSE;
+
+      /* Buffers get recreated if the attribute was unrealized */
+      if (gthree_attribute_get_gl_buffer (binding->attribute) != binding->gl_buffer)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+use_vertex_array (GthreeRenderer *renderer,
+                  GthreeMaterial *material,
+                  GthreeProgram *program,
+                  GthreeObject *object,
+                  GthreeGeometry *geometry,
+                  GthreeAttribute *index,
+                  gboolean wireframe)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeVertexArrayKey key;
+  GthreeVertexArray *va;
+  int i;
+
+  key.geometry = geometry;
+  key.program = program;
+  key.object = GTHREE_IS_INSTANCED_MESH (object) ? object : NULL;
+  key.wireframe = wireframe;
+
+  va = g_hash_table_lookup (priv->vertex_arrays, &key);
+  if (va != NULL && !vertex_array_is_valid (va, object, geometry, index))
+    {
+      glDeleteVertexArrays (1, &va->vao);
+      if (priv->current_vertex_array == va->vao)
+        priv->current_vertex_array = 0;
+      va->vao = 0;
+      g_array_set_size (va->bindings, 0);
+      g_array_set_size (va->defaults, 0);
+    }
+
+  if (va == NULL)
+    {
+      va = g_new0 (GthreeVertexArray, 1);
+      va->key = key;
+      va->bindings = g_array_new (FALSE, FALSE, sizeof (GthreeVertexArrayBinding));
+      va->defaults = g_array_new (FALSE, FALSE, sizeof (GthreeVertexArrayDefault));
+      g_hash_table_insert (priv->vertex_arrays, &va->key, va);
+
+      vertex_array_add_owner (renderer, key.geometry);
+      vertex_array_add_owner (renderer, key.program);
+      vertex_array_add_owner (renderer, key.object);
+    }
+
+  if (va->vao == 0)
+    {
+      va->geometry_version = gthree_geometry_get_attributes_version (geometry);
+      va->index = index;
+      va->index_buffer = index ? gthree_attribute_get_gl_buffer (index) : 0;
+
+      glGenVertexArrays (1, &va->vao);
+      bind_vertex_array (renderer, va->vao);
+      setup_vertex_attributes (renderer, va, program, object, geometry);
+    }
+  else
+    bind_vertex_array (renderer, va->vao);
+
+  for (i = 0; i < va->defaults->len; i++)
+    {
+      GthreeVertexArrayDefault *def = &g_array_index (va->defaults, GthreeVertexArrayDefault, i);
+      gthree_material_load_default_attribute (material, def->location, def->name);
+    }
 }
 
 //	var influencesList = {};
@@ -2311,6 +6411,30 @@ influence_info_cmp (InfluenceInfo *a, InfluenceInfo *b)
   return 1;
 }
 
+static const char *morph_target_names[8] = {
+  "morphTarget0", "morphTarget1", "morphTarget2", "morphTarget3",
+  "morphTarget4", "morphTarget5", "morphTarget6", "morphTarget7",
+};
+
+static const char *morph_normal_names[8] = {
+  "morphNormal0", "morphNormal1", "morphNormal2", "morphNormal3",
+  "morphNormal4", "morphNormal5", "morphNormal6", "morphNormal7",
+};
+
+static void
+set_morph_attribute (GthreeGeometry *geometry,
+                     const char *name,
+                     GthreeAttribute *attribute)
+{
+  if (gthree_geometry_get_attribute (geometry, name) == attribute)
+    return;
+
+  if (attribute)
+    gthree_geometry_add_attribute (geometry, name, attribute);
+  else
+    gthree_geometry_remove_attribute (geometry, name);
+}
+
 static void
 update_morphtargets (GthreeRenderer *renderer,
                      GthreeMesh *mesh,
@@ -2344,75 +6468,184 @@ update_morphtargets (GthreeRenderer *renderer,
   if (gthree_mesh_material_get_morph_normals (material))
     morphNormals = gthree_geometry_get_morph_attributes (geometry, "normal");
 
-  // Remove current morphAttributes
+  // Collect influences
   for (i = 0; i < length; i++)
     {
       InfluenceInfo *info = &g_array_index (influences, InfluenceInfo, i);
-      if (info->value != 0)
+      info->index = i;
+      info->value = g_array_index (object_influences, float, i);
+    }
+
+  g_array_sort (influences, (GCompareFunc)influence_info_cmp);
+
+  // Swap in the morphAttributes, only touching the slots that changed
+  // so the cached vertex array objects stay valid for unchanged influences
+  for (i = 0; i < 8; i++)
+    {
+      GthreeAttribute *target = NULL;
+      GthreeAttribute *normal = NULL;
+
+      priv->morph_influences[i] = 0;
+
+      if (i < length)
         {
-          if (morphTargets)
-            {
-              g_autofree char *name = g_strdup_printf ("morphTarget%d", i);
-              gthree_geometry_remove_attribute (geometry, name);
-            }
+          InfluenceInfo *info = &g_array_index (influences, InfluenceInfo, i);
 
-          if (morphNormals)
+          if (info->value != 0)
             {
-              g_autofree char *name = g_strdup_printf ("morphNormal%d", i);
-              gthree_geometry_remove_attribute (geometry, name);
+              if (morphTargets)
+                target = g_ptr_array_index (morphTargets, info->index);
+              if (morphNormals)
+                normal = g_ptr_array_index (morphNormals, info->index);
+
+              priv->morph_influences[i] = info->value;
             }
         }
+
+      set_morph_attribute (geometry, morph_target_names[i], target);
+      set_morph_attribute (geometry, morph_normal_names[i], normal);
     }
 
-  // Collect influences
-  for (i = 0; i < length; i++)
+  gint morph_target_influences_location =
+    gthree_program_lookup_uniform_location_from_string (program, "morphTargetInfluences[0]");
+
+  if (morph_target_influences_location >= 0)
+    glUniform1fv (morph_target_influences_location, 8, priv->morph_influences);
+  else
+    g_warning ("No morphTargetInfluences uniform");
+}
+
+/* Intersects the geometry draw range with the group, returns the count */
+static int
+get_draw_range (GthreeGeometry *geometry,
+                GthreeGeometryGroup *group,
+                int data_count,
+                int range_factor,
+                int *draw_start)
+{
+  int range_start, range_count, group_start, group_count, draw_end;
+
+  range_start = gthree_geometry_get_draw_range_start (geometry) * range_factor;
+  range_count = gthree_geometry_get_draw_range_count (geometry) * range_factor;
+
+  group_start = group != NULL ? group->start * range_factor : 0;
+  group_count = group != NULL ? group->count * range_factor : -1;
+
+  /* Handle unlimited ranges (-1 * maybe range_factor) */
+  if (group_count < 0)
+    group_count = data_count;
+  if (range_count < 0)
+    range_count = data_count;
+
+  *draw_start = MAX (range_start, group_start);
+  draw_end = MIN (data_count, MIN (range_start + range_count, group_start + group_count)) - 1;
+
+  return MAX (0, draw_end - *draw_start + 1);
+}
+
+/* Draws all members of a batch with one glMultiDrawElementsIndirect() */
+static void
+render_batch (GthreeRenderer *renderer,
+              GthreeScene *scene,
+              GthreeCamera *camera,
+              gpointer fog,
+              GthreeBatch *batch)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeBatchPool *pool = batch->key.pool;
+  GthreeMaterial *material = batch->key.material;
+  GthreeProgram *program;
+  int i;
+
+  if (!gthree_material_get_is_visible (material))
+    return;
+
+  batch_pool_update (renderer, pool);
+
+  if (pool->geometry == NULL)
+    return;
+
+  /* The proxy mesh references the pool geometry, so replace it after repacking */
+  if (batch->mesh == NULL ||
+      gthree_mesh_get_geometry (GTHREE_MESH (batch->mesh)) != pool->geometry ||
+      gthree_instanced_mesh_get_max_count (batch->mesh) < batch->members->len)
     {
-      InfluenceInfo *info = &g_array_index (influences, InfluenceInfo, i);
-      info->index = i;
-      info->value = g_array_index (object_influences, float, i);
+      int max_count = 1;
+
+      while (max_count < batch->members->len)
+        max_count *= 2;
+
+      g_clear_object (&batch->mesh);
+      batch->mesh = gthree_instanced_mesh_new (pool->geometry, material, max_count);
+      gthree_object_set_receive_shadow (GTHREE_OBJECT (batch->mesh), batch->key.receive_shadow);
+      g_array_set_size (batch->instances, 0);
     }
 
-  g_array_sort (influences, (GCompareFunc)influence_info_cmp);
+  if (batch->instances->len < batch->members->len)
+    g_array_set_size (batch->instances, batch->members->len);
 
-  // Add morphAttributes
-  for (i = 0; i < 8; i++)
+  g_array_set_size (batch->commands, 0);
+  for (i = 0; i < batch->members->len; i++)
     {
-      if (i < length)
-        {
-          InfluenceInfo *info = &g_array_index (influences, InfluenceInfo, i);
-
-          if (info->value != 0)
-            {
-              if (morphTargets)
-                {
-                  g_autofree char *name = g_strdup_printf ("morphTarget%d", i);
-                  GthreeAttribute *attribute = g_ptr_array_index (morphTargets, info->index);
-                  gthree_geometry_add_attribute (geometry, name, attribute);
-                }
+      int index = g_array_index (batch->members, int, i);
+      GthreeRenderListItem *item = &g_array_index (priv->current_render_list->items, GthreeRenderListItem, index);
+      GthreeBatchRange *range = g_hash_table_lookup (priv->batch_ranges, item->geometry);
+      GthreeDrawElementsCommand command;
+      GthreeBatchInstance *instance;
+      int draw_start, draw_count;
+      guint version;
 
-              if (morphNormals)
-                {
-                  g_autofree char *name = g_strdup_printf ("morphNormal%d", i);
-                  GthreeAttribute *attribute = g_ptr_array_index (morphTargets, info->index);
-                  gthree_geometry_add_attribute (geometry, name, attribute);
-                }
+      gthree_object_call_before_render_callback (item->object, scene, camera);
 
-              priv->morph_influences[i] = info->value;
-              continue;
-            }
+      draw_count = get_draw_range (item->geometry, item->group, range->index_count, 1, &draw_start);
+      if (draw_count == 0)
+        continue;
 
+      command.count = draw_count;
+      command.instance_count = 1;
+      command.first_index = range->first_index + draw_start;
+      command.base_vertex = range->base_vertex;
+      command.base_instance = batch->commands->len;
+
+      /* Only upload the matrices that changed since the last frame */
+      instance = &g_array_index (batch->instances, GthreeBatchInstance, command.base_instance);
+      version = gthree_object_get_world_matrix_version (item->object);
+      if (instance->object != item->object ||
+          instance->world_matrix_version != version)
+        {
+          gthree_instanced_mesh_set_matrix_at (batch->mesh, command.base_instance,
+                                               gthree_object_get_world_matrix (item->object));
+          instance->object = item->object;
+          instance->world_matrix_version = version;
         }
 
-      priv->morph_influences[i] = 0;
+      g_array_append_val (batch->commands, command);
     }
 
-  gint morph_target_influences_location =
-    gthree_program_lookup_uniform_location_from_string (program, "morphTargetInfluences[0]");
+  if (batch->commands->len == 0)
+    return;
 
-  if (morph_target_influences_location >= 0)
-    glUniform1fv (morph_target_influences_location, 8, priv->morph_influences);
-  else
-    g_warning ("No morphTargetInfluences uniform");
+  gthree_instanced_mesh_set_count (batch->mesh, batch->commands->len);
+  gthree_object_update (GTHREE_OBJECT (batch->mesh));
+  gthree_object_update_matrix_view (GTHREE_OBJECT (batch->mesh), gthree_camera_get_world_inverse_matrix (camera));
+
+  program = set_program (renderer, camera, fog, material, GTHREE_OBJECT (batch->mesh));
+  if (program == NULL)
+    return;
+
+  use_vertex_array (renderer, material, program, GTHREE_OBJECT (batch->mesh), pool->geometry,
+                    gthree_geometry_get_index (pool->geometry), FALSE);
+  priv->current_geometry_program_geometry = NULL;
+  priv->current_geometry_program_program = NULL;
+
+  if (batch->indirect_buffer == 0)
+    glGenBuffers (1, &batch->indirect_buffer);
+
+  glBindBuffer (GL_DRAW_INDIRECT_BUFFER, batch->indirect_buffer);
+  glBufferData (GL_DRAW_INDIRECT_BUFFER, batch->commands->len * sizeof (GthreeDrawElementsCommand),
+                batch->commands->data, GL_STREAM_DRAW);
+  glMultiDrawElementsIndirect (GL_TRIANGLES, GL_UNSIGNED_INT, NULL, batch->commands->len, 0);
+  glBindBuffer (GL_DRAW_INDIRECT_BUFFER, 0);
 }
 
 static void
@@ -2431,8 +6664,9 @@ render_item (GthreeRenderer *renderer,
   gboolean update_buffers = FALSE;
   gboolean wireframe = FALSE;
   int data_count;
-  int range_factor, range_start, range_count, group_start, group_count, draw_start, draw_end, draw_count;
+  int range_factor, draw_start, draw_count;
   int draw_mode = GL_TRIANGLES;
+  int instance_count;
 
   if (!gthree_material_get_is_visible (material))
     return;
@@ -2442,6 +6676,19 @@ render_item (GthreeRenderer *renderer,
     wireframe = TRUE;
 
   program = set_program (renderer, camera, fog, material, object);
+  if (program == NULL)
+    return;
+
+  index = gthree_geometry_get_index (geometry);
+  position = gthree_geometry_get_position (geometry);
+  range_factor = 1;
+
+  if (wireframe)
+    {
+      index = gthree_geometry_get_wireframe_index (geometry);
+      gthree_attribute_update (index, GL_ELEMENT_ARRAY_BUFFER);
+      range_factor = 2;
+    }
 
   if (geometry != priv->current_geometry_program_geometry ||
       program != priv->current_geometry_program_program ||
@@ -2453,6 +6700,10 @@ render_item (GthreeRenderer *renderer,
       update_buffers = true;
     }
 
+  /* Instanced meshes can share a geometry but not their instance buffers */
+  if (GTHREE_IS_INSTANCED_MESH (object))
+    update_buffers = TRUE;
+
   if (GTHREE_IS_MESH (object) &&
       gthree_mesh_has_morph_targets (GTHREE_MESH (object)) &&
       GTHREE_IS_MESH_MATERIAL (material))
@@ -2461,23 +6712,8 @@ render_item (GthreeRenderer *renderer,
       update_buffers = TRUE;
     }
 
-  index = gthree_geometry_get_index (geometry);
-  position = gthree_geometry_get_position (geometry);
-  range_factor = 1;
-
-  if (wireframe)
-    {
-      index = gthree_geometry_get_wireframe_index (geometry);
-      gthree_attribute_update (index, GL_ELEMENT_ARRAY_BUFFER);
-      range_factor = 2;
-    }
-
   if (update_buffers)
-    {
-      setup_vertex_attributes (renderer, material, program, geometry);
-      if (index != NULL)
-        glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, gthree_attribute_get_gl_buffer (index));
-    }
+    use_vertex_array (renderer, material, program, object, geometry, index, wireframe);
 
   data_count = -1;
 
@@ -2486,25 +6722,18 @@ render_item (GthreeRenderer *renderer,
   else if (position != NULL)
     data_count = gthree_attribute_get_count (position);
 
-  range_start = gthree_geometry_get_draw_range_start (geometry) * range_factor;
-  range_count = gthree_geometry_get_draw_range_count (geometry) * range_factor;
-
-  group_start = group != NULL ? group->start * range_factor : 0;
-  group_count = group != NULL ? group->count * range_factor : -1;
-
-  /* Handle unlimited ranges (-1 * maybe range_factor) */
-  if (group_count < 0)
-    group_count = data_count;
-  if (range_count < 0)
-    range_count = data_count;
-
-  draw_start = MAX (range_start, group_start);
-  draw_end = MIN (data_count, MIN (range_start + range_count, group_start + group_count)) - 1;
-  draw_count = MAX( 0, draw_end - draw_start + 1);
-
+  draw_count = get_draw_range (geometry, group, data_count, range_factor, &draw_start);
   if ( draw_count == 0 )
     return;
 
+  instance_count = -1;
+  if (GTHREE_IS_INSTANCED_MESH (object))
+    {
+      instance_count = gthree_instanced_mesh_get_count (GTHREE_INSTANCED_MESH (object));
+      if (instance_count == 0)
+        return;
+    }
+
   // render mesh
   if (GTHREE_IS_MESH (object))
     {
@@ -2554,11 +6783,18 @@ render_item (GthreeRenderer *renderer,
       int index_bytes_per_element = gthree_attribute_get_gl_bytes_per_element (index);
       int index_offset = gthree_attribute_get_item_offset (index);
 
-      glDrawElements (draw_mode, draw_count, index_type, GINT_TO_POINTER ((index_offset + draw_start) * index_bytes_per_element));
+      if (instance_count >= 0)
+        glDrawElementsInstanced (draw_mode, draw_count, index_type, GINT_TO_POINTER ((index_offset + draw_start) * index_bytes_per_element),
+                                 instance_count);
+      else
+        glDrawElements (draw_mode, draw_count, index_type, GINT_TO_POINTER ((index_offset + draw_start) * index_bytes_per_element));
     }
   else
     {
-      glDrawArrays (draw_mode, draw_start, draw_count);
+      if (instance_count >= 0)
+        glDrawArraysInstanced (draw_mode, draw_start, draw_count, instance_count);
+      else
+        glDrawArrays (draw_mode, draw_start, draw_count);
     }
 }
 
@@ -2579,10 +6815,31 @@ render_objects (GthreeRenderer *renderer,
     {
       int render_list_index = g_array_index (render_list_indexes, int, i);
       GthreeRenderListItem *item = &g_array_index (priv->current_render_list->items, GthreeRenderListItem, render_list_index);
+      GthreeRenderListItem range_item;
+      GthreeGeometryGroup range;
+
+      /* With an override material the group materials don't matter, so
+         draw a multi-material mesh once with the range of all its groups,
+         from the item of the first group, and skip the others. */
+      if (override_material && item->group != NULL && item->batch == NULL &&
+          GTHREE_IS_MESH (item->object) &&
+          get_groups_range (GTHREE_MESH (item->object), item->geometry, FALSE, &range))
+        {
+          if (item->group != gthree_geometry_peek_groups (item->geometry))
+            continue;
 
-      gthree_object_call_before_render_callback (item->object, scene, camera);
+          range_item = *item;
+          range_item.group = &range;
+          item = &range_item;
+        }
 
-      gthree_object_update_matrix_view (item->object, gthree_camera_get_world_inverse_matrix (camera));
+      /* Batch members are handled in render_batch() */
+      if (item->batch == NULL)
+        {
+          gthree_object_call_before_render_callback (item->object, scene, camera);
+
+          gthree_object_update_matrix_view (item->object, gthree_camera_get_world_inverse_matrix (camera));
+        }
 
       if (override_material)
         material = override_material;
@@ -2612,7 +6869,10 @@ render_objects (GthreeRenderer *renderer,
       }
       set_material_faces (renderer, material);
 
-      render_item (renderer, camera, fog, material, item);
+      if (item->batch)
+        render_batch (renderer, scene, camera, fog, item->batch);
+      else
+        render_item (renderer, camera, fog, material, item);
     }
 }
 
@@ -2775,6 +7035,192 @@ gthree_renderer_render_background (GthreeRenderer *renderer,
     }
 }
 
+static void
+add_compiled_program (GthreeRenderer *renderer,
+                      GPtrArray      *programs,
+                      GHashTable     *seen,
+                      GthreeMaterial *material,
+                      GthreeObject   *object)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeProgramParameters parameters;
+  GthreeProgram *program;
+
+  get_program_parameters (renderer, material, object, &parameters);
+  program = gthree_program_cache_get (priv->program_cache,
+                                      gthree_material_get_shader (material),
+                                      &parameters, renderer);
+
+  if (g_hash_table_contains (seen, program))
+    {
+      g_object_unref (program);
+      return;
+    }
+
+  g_hash_table_add (seen, program);
+  g_ptr_array_add (programs, program);
+}
+
+/* The depth and distance programs the shadow passes will use for the
+   shadow casting meshes */
+static void
+add_compiled_shadow_programs (GthreeRenderer *renderer,
+                              GPtrArray      *programs,
+                              GHashTable     *seen)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  gboolean has_point = FALSE, has_other = FALSE;
+  int i;
+
+  if (!priv->shadowmap_enabled)
+    return;
+
+  for (i = 0; i < priv->shadows->len; i++)
+    {
+      if (GTHREE_IS_POINT_LIGHT (g_ptr_array_index (priv->shadows, i)))
+        has_point = TRUE;
+      else
+        has_other = TRUE;
+    }
+
+  for (i = 0; i < priv->renderables->len; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (priv->renderables, i);
+      GthreeMaterial *material, *depth_material;
+      GthreeGeometry *geometry;
+      int variant;
+
+      if (!gthree_object_get_cast_shadow (object) || !GTHREE_IS_MESH (object))
+        continue;
+
+      geometry = gthree_mesh_get_geometry (GTHREE_MESH (object));
+      material = gthree_mesh_get_material (GTHREE_MESH (object), 0);
+      if (geometry == NULL || material == NULL)
+        continue;
+
+      variant = get_depth_material_variant (object, geometry, material);
+
+      if (has_other)
+        {
+          depth_material = getDepthMaterial (renderer, object, variant, FALSE);
+          depth_material_copy_state (depth_material, material);
+          add_compiled_program (renderer, programs, seen, depth_material, object);
+        }
+
+      if (has_point)
+        {
+          priv->shadow_cube_pass = shadow_maps_layered (renderer);
+          depth_material = getDepthMaterial (renderer, object, variant, TRUE);
+          depth_material_copy_state (depth_material, material);
+          priv->shadow_cube_pass = FALSE;
+          add_compiled_program (renderer, programs, seen, depth_material, object);
+        }
+    }
+}
+
+/* Creates the programs for every material in @scene as seen from
+ * @camera, without drawing anything. With KHR_parallel_shader_compile
+ * the driver compiles them in the background, so this can be called
+ * during a loading screen and polled with
+ * gthree_renderer_get_n_pending_programs(). This includes the depth
+ * programs of the shadow passes. The programs are kept alive until
+ * the next call. */
+void
+gthree_renderer_compile (GthreeRenderer *renderer,
+                         GthreeScene    *scene,
+                         GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GPtrArray *programs = g_ptr_array_new_with_free_func (g_object_unref);
+  GHashTable *seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+  GthreeMaterial *override_material;
+  GthreeRenderList *list = priv->current_render_list;
+  int i;
+
+  g_assert (gdk_gl_context_get_current () == priv->gl_context);
+
+  gthree_object_update_matrix_world (GTHREE_OBJECT (scene), FALSE);
+
+  if (gthree_object_get_parent (GTHREE_OBJECT (camera)) == NULL)
+    gthree_object_update_matrix_world (GTHREE_OBJECT (camera), FALSE);
+
+  gthree_camera_update_matrix (camera);
+
+  priv->clipping_enabled = clipping_init (renderer, camera);
+
+  collect_scene (renderer, scene, camera);
+  setup_lights (renderer, camera);
+
+  /* Everything, not just what is in the frustum right now */
+  gthree_render_list_init (list);
+  for (i = 0; i < priv->renderables->len; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (priv->renderables, i);
+
+      gthree_object_update (object);
+      gthree_object_fill_render_list (object, list);
+    }
+
+  override_material = gthree_scene_get_override_material (scene);
+
+  for (i = 0; i < list->items->len; i++)
+    {
+      GthreeRenderListItem *item = &g_array_index (list->items, GthreeRenderListItem, i);
+      GthreeMaterial *material = override_material ? override_material : item->material;
+
+      if (material == NULL || !gthree_material_get_is_visible (material))
+        continue;
+
+      add_compiled_program (renderer, programs, seen, material, item->object);
+    }
+
+  gthree_render_list_init (list);
+
+  add_compiled_shadow_programs (renderer, programs, seen);
+  g_hash_table_unref (seen);
+
+  /* Swap after creating the new ones so shared programs stay in the cache */
+  g_ptr_array_unref (priv->compiled_programs);
+  priv->compiled_programs = programs;
+}
+
+/* Number of programs from the last gthree_renderer_compile() that the
+ * driver is still working on. This never blocks when parallel
+ * compilation is supported. */
+int
+gthree_renderer_get_n_pending_programs (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int i, n_pending = 0;
+
+  for (i = 0; i < priv->compiled_programs->len; i++)
+    {
+      if (!gthree_program_is_ready (g_ptr_array_index (priv->compiled_programs, i)))
+        n_pending++;
+    }
+
+  return n_pending;
+}
+
+gboolean
+gthree_renderer_get_skip_pending_programs (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->skip_pending_programs;
+}
+
+/* If set, objects whose program is still compiling are not drawn
+ * instead of waiting for the compile to finish. */
+void
+gthree_renderer_set_skip_pending_programs (GthreeRenderer *renderer,
+                                           gboolean        skip)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->skip_pending_programs = skip;
+}
+
 void
 gthree_renderer_render (GthreeRenderer *renderer,
                         GthreeScene    *scene,
@@ -2788,11 +7234,6 @@ gthree_renderer_render (GthreeRenderer *renderer,
 
   g_assert (gdk_gl_context_get_current () == priv->gl_context);
 
-  g_list_free (priv->lights);
-  priv->lights = NULL;
-
-  g_list_free (priv->shadows);
-  priv->shadows = NULL;
 
   fog = NULL;
 
@@ -2805,6 +7246,7 @@ gthree_renderer_render (GthreeRenderer *renderer,
   /* update scene graph */
 
   gthree_object_update_matrix_world (GTHREE_OBJECT (scene), FALSE);
+  priv->spatial_index = gthree_scene_update_spatial_index (scene);
 
   /* update camera matrices and frustum */
 
@@ -2820,13 +7262,23 @@ gthree_renderer_render (GthreeRenderer *renderer,
 
   /* Flush lazily deleted resources to avoid leaking until widget unrealize */
   gthree_resources_flush_deletes (priv->gl_context);
+  flush_vertex_array_deletes (renderer);
+
+  reset_frame_uniforms (renderer);
+
+  /* Someone else might have bound a vao since the last frame */
+  priv->current_vertex_array = 0;
+  bind_vertex_array (renderer, priv->vertex_array_object);
 
   gthree_render_list_init (priv->current_render_list);
 
-  project_object (renderer, scene, GTHREE_OBJECT (scene), camera);
+  project_scene (renderer, scene, camera);
 
   if (priv->sort_objects)
-    gthree_render_list_sort (priv->current_render_list);
+    gthree_render_list_sort (priv->current_render_list, priv->opaque_sort, priv->sort_statistics);
+
+  if (gthree_scene_get_override_material (scene) == NULL)
+    batch_render_list (renderer, priv->current_render_list);
 
   if (priv->clipping_enabled )
     clipping_begin_shadows (renderer);
@@ -2884,6 +7336,8 @@ gthree_renderer_render (GthreeRenderer *renderer,
       update_multisample_render_target (renderer, priv->current_render_target);
     }
 
+  priv->spatial_index = NULL;
+
   pop_debug_group ();
 }
 
@@ -2892,9 +7346,20 @@ gthree_renderer_allocate_texture_unit (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
   guint texture_unit = priv->used_texture_units;
+  int max_textures = priv->max_textures;
+
+  /* The units above these keep the cluster textures bound all frame */
+  if (priv->clustered_lighting)
+    max_textures = MIN (max_textures, GTHREE_CLUSTER_LIGHTS_TEXTURE_UNIT);
 
-  if (texture_unit >= priv->max_textures )
-    g_warning ("Trying to use %dtexture units while this GPU supports only %d",  texture_unit,priv->max_textures);
+  if (texture_unit >= max_textures)
+    {
+      g_warning ("Trying to use %dtexture units while this GPU supports only %d",  texture_unit, max_textures);
+
+      /* Rather share a unit than overwrite the cluster textures */
+      if (priv->clustered_lighting)
+        texture_unit = max_textures - 1;
+    }
 
   priv->used_texture_units += 1;
 
@@ -2911,6 +7376,8 @@ gthree_render_list_new ()
   list->opaque = g_array_new (FALSE, FALSE, sizeof (int));
   list->transparent = g_array_new (FALSE, FALSE, sizeof (int));
   list->background = g_array_new (FALSE, FALSE, sizeof (int));
+  list->sort_entries = g_array_new (FALSE, FALSE, sizeof (GthreeRenderListSortEntry));
+  list->sort_tmp = g_array_new (FALSE, FALSE, sizeof (GthreeRenderListSortEntry));
 
   return list;
 }
@@ -2922,6 +7389,8 @@ gthree_render_list_free (GthreeRenderList *list)
   g_array_unref (list->opaque);
   g_array_unref (list->transparent);
   g_array_unref (list->background);
+  g_array_unref (list->sort_entries);
+  g_array_unref (list->sort_tmp);
   g_free (list);
 }
 
@@ -2990,10 +7459,186 @@ render_list_reverse_painter_sort_stable (gconstpointer _a, gconstpointer _b, gpo
   return 0;
 }
 
+/* Opaque state sort key, most significant first:
+ *   16 bits program id
+ *   16 bits material id
+ *   16 bits geometry id
+ *   16 bits depth bucket
+ * The ids are truncated, so a collision only makes the order a bit less optimal.
+ */
+#define SORT_KEY_DEPTH_BUCKETS 1024
+
+static guint64
+render_list_depth_key (GthreeRenderListItem *item)
+{
+  float d = CLAMP ((item->z + 1.0f) * 0.5f, 0.0f, 1.0f);
+
+  return (guint64)(d * (SORT_KEY_DEPTH_BUCKETS - 1));
+}
+
+static guint64
+render_list_state_key (GthreeRenderListItem *item)
+{
+  GthreeMaterialProperties *properties = gthree_material_get_properties (item->material);
+  guint64 program_id = 0;
+  guint64 material_id, geometry_id;
+
+  /* The program is only known once the material has been rendered once */
+  if (properties->program)
+    program_id = gthree_program_get_id (properties->program);
+  material_id = properties->id;
+  geometry_id = item->geometry ? gthree_geometry_get_id (item->geometry) : 0;
+
+  return
+    ((program_id & 0xffff) << 48) |
+    ((material_id & 0xffff) << 32) |
+    ((geometry_id & 0xffff) << 16) |
+    render_list_depth_key (item);
+}
+
+/* Stable LSD radix sort, 8 bits per pass. Passes where all keys share
+   the same digit (like the unused high bits) are skipped. */
+static void
+render_list_radix_sort (GArray *entries,
+                        GArray *tmp)
+{
+  GthreeRenderListSortEntry *src, *dst, *swap;
+  guint n = entries->len;
+  guint counts[256];
+  int shift, i;
+
+  if (n < 2)
+    return;
+
+  g_array_set_size (tmp, n);
+  src = (GthreeRenderListSortEntry *)entries->data;
+  dst = (GthreeRenderListSortEntry *)tmp->data;
+
+  for (shift = 0; shift < 64; shift += 8)
+    {
+      guint offset = 0;
+
+      memset (counts, 0, sizeof (counts));
+      for (i = 0; i < n; i++)
+        counts[(src[i].key >> shift) & 0xff]++;
+
+      if (counts[(src[0].key >> shift) & 0xff] == n)
+        continue;
+
+      for (i = 0; i < 256; i++)
+        {
+          guint c = counts[i];
+          counts[i] = offset;
+          offset += c;
+        }
+
+      for (i = 0; i < n; i++)
+        dst[counts[(src[i].key >> shift) & 0xff]++] = src[i];
+
+      swap = src;
+      src = dst;
+      dst = swap;
+    }
+
+  if (src != (GthreeRenderListSortEntry *)entries->data)
+    memcpy (entries->data, src, n * sizeof (GthreeRenderListSortEntry));
+}
+
+static void
+render_list_count_switches (GthreeRenderList *list,
+                            GArray *entries,
+                            int *program_switches,
+                            int *material_switches,
+                            int *vao_switches)
+{
+  GthreeProgram *last_program = NULL;
+  GthreeMaterial *last_material = NULL;
+  GthreeGeometry *last_geometry = NULL;
+  int i;
+
+  *program_switches = 0;
+  *material_switches = 0;
+  *vao_switches = 0;
+
+  for (i = 0; i < entries->len; i++)
+    {
+      int index = g_array_index (entries, GthreeRenderListSortEntry, i).index;
+      GthreeRenderListItem *item = &g_array_index (list->items, GthreeRenderListItem, index);
+      GthreeProgram *program = gthree_material_get_properties (item->material)->program;
+
+      if (program != last_program)
+        (*program_switches)++;
+      if (item->material != last_material)
+        (*material_switches)++;
+      if (program != last_program || item->geometry != last_geometry)
+        (*vao_switches)++;
+
+      last_program = program;
+      last_material = item->material;
+      last_geometry = item->geometry;
+    }
+}
+
+static void
+render_list_state_sort (GthreeRenderList *list,
+                        gboolean statistics)
+{
+  GArray *entries = list->sort_entries;
+  int depth_programs, depth_materials, depth_vaos;
+  int state_programs, state_materials, state_vaos;
+  int i;
+
+  g_array_set_size (entries, list->opaque->len);
+
+  for (i = 0; i < list->opaque->len; i++)
+    g_array_index (entries, GthreeRenderListSortEntry, i).index = g_array_index (list->opaque, int, i);
+
+  /* Only for the statistics, count the switches a plain front-to-back
+     order would need */
+  if (statistics)
+    {
+      for (i = 0; i < entries->len; i++)
+        {
+          GthreeRenderListSortEntry *entry = &g_array_index (entries, GthreeRenderListSortEntry, i);
+          entry->key = render_list_depth_key (&g_array_index (list->items, GthreeRenderListItem, entry->index));
+        }
+      render_list_radix_sort (entries, list->sort_tmp);
+      render_list_count_switches (list, entries, &depth_programs, &depth_materials, &depth_vaos);
+    }
+
+  for (i = 0; i < entries->len; i++)
+    {
+      GthreeRenderListSortEntry *entry = &g_array_index (entries, GthreeRenderListSortEntry, i);
+      entry->key = render_list_state_key (&g_array_index (list->items, GthreeRenderListItem, entry->index));
+    }
+  render_list_radix_sort (entries, list->sort_tmp);
+
+  for (i = 0; i < entries->len; i++)
+    g_array_index (list->opaque, int, i) = g_array_index (entries, GthreeRenderListSortEntry, i).index;
+
+  if (statistics)
+    {
+      render_list_count_switches (list, entries, &state_programs, &state_materials, &state_vaos);
+      list->saved_program_switches = depth_programs - state_programs;
+      list->saved_material_switches = depth_materials - state_materials;
+      list->saved_vao_switches = depth_vaos - state_vaos;
+    }
+}
+
 void
-gthree_render_list_sort (GthreeRenderList *list)
+gthree_render_list_sort (GthreeRenderList *list,
+                         GthreeOpaqueSort  opaque_sort,
+                         gboolean          statistics)
 {
-  g_array_sort_with_data (list->opaque, render_list_painter_sort_stable, list);
+  list->saved_program_switches = 0;
+  list->saved_material_switches = 0;
+  list->saved_vao_switches = 0;
+
+  if (opaque_sort == GTHREE_OPAQUE_SORT_STATE)
+    render_list_state_sort (list, statistics);
+  else
+    g_array_sort_with_data (list->opaque, render_list_painter_sort_stable, list);
+
   g_array_sort_with_data (list->transparent, render_list_reverse_painter_sort_stable, list);
 }
 
@@ -97,6 +97,79 @@ GTHREE_API
 void                gthree_renderer_set_shadow_map_needs_update (GthreeRenderer     *renderer,
                                                                  gboolean            needs_update);
 GTHREE_API
+gboolean            gthree_renderer_get_shadow_map_caching    (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_shadow_map_caching    (GthreeRenderer     *renderer,
+                                                               gboolean            caching);
+GTHREE_API
+int                 gthree_renderer_get_shadow_atlas_size     (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_shadow_atlas_size     (GthreeRenderer     *renderer,
+                                                               int                 size);
+GTHREE_API
+gboolean            gthree_renderer_get_shadow_map_depth_compare (GthreeRenderer  *renderer);
+GTHREE_API
+void                gthree_renderer_set_shadow_map_depth_compare (GthreeRenderer  *renderer,
+                                                                  gboolean         depth_compare);
+GTHREE_API
+gboolean            gthree_renderer_get_shadow_map_layered       (GthreeRenderer  *renderer);
+GTHREE_API
+void                gthree_renderer_set_shadow_map_layered       (GthreeRenderer  *renderer,
+                                                                  gboolean         layered);
+GTHREE_API
+gboolean            gthree_renderer_get_retained              (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_retained              (GthreeRenderer     *renderer,
+                                                               gboolean            retained);
+GTHREE_API
+GthreeOpaqueSort    gthree_renderer_get_opaque_sort           (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_opaque_sort           (GthreeRenderer     *renderer,
+                                                               GthreeOpaqueSort    opaque_sort);
+GTHREE_API
+void                gthree_renderer_set_sort_statistics_enabled (GthreeRenderer   *renderer,
+                                                                 gboolean          enabled);
+GTHREE_API
+gboolean            gthree_renderer_get_sort_statistics_enabled (GthreeRenderer   *renderer);
+GTHREE_API
+void                gthree_renderer_get_sort_statistics       (GthreeRenderer     *renderer,
+                                                               int                *saved_program_switches,
+                                                               int                *saved_material_switches,
+                                                               int                *saved_vao_switches);
+GTHREE_API
+const char *        gthree_renderer_get_program_cache_dir     (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_program_cache_dir     (GthreeRenderer     *renderer,
+                                                               const char         *dir);
+GTHREE_API
+void                gthree_renderer_get_program_cache_stats   (GthreeRenderer     *renderer,
+                                                               guint              *hits,
+                                                               guint              *misses);
+GTHREE_API
+void                gthree_renderer_set_light_block_enabled   (GthreeRenderer     *renderer,
+                                                               gboolean            enabled);
+GTHREE_API
+gboolean            gthree_renderer_get_light_block_enabled   (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_clustered_lighting    (GthreeRenderer     *renderer,
+                                                               gboolean            clustered);
+GTHREE_API
+gboolean            gthree_renderer_get_clustered_lighting    (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_batching              (GthreeRenderer     *renderer,
+                                                               gboolean            batching);
+GTHREE_API
+gboolean            gthree_renderer_get_batching              (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_n_threads             (GthreeRenderer     *renderer,
+                                                               int                 n_threads);
+GTHREE_API
+int                 gthree_renderer_get_n_threads             (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_get_batch_statistics      (GthreeRenderer     *renderer,
+                                                               int                *n_batches,
+                                                               int                *n_batched_objects);
+GTHREE_API
 int                 gthree_renderer_get_n_clipping_planes     (GthreeRenderer     *renderer);
 GTHREE_API
 const graphene_plane_t *gthree_renderer_get_clipping_plane    (GthreeRenderer     *renderer,
@@ -135,6 +208,17 @@ void                gthree_renderer_clear_depth               (GthreeRenderer
 GTHREE_API
 void                gthree_renderer_clear_color               (GthreeRenderer     *renderer);
 GTHREE_API
+void                gthree_renderer_compile                   (GthreeRenderer     *renderer,
+                                                               GthreeScene        *scene,
+                                                               GthreeCamera       *camera);
+GTHREE_API
+int                 gthree_renderer_get_n_pending_programs    (GthreeRenderer     *renderer);
+GTHREE_API
+gboolean            gthree_renderer_get_skip_pending_programs (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_skip_pending_programs (GthreeRenderer     *renderer,
+                                                               gboolean            skip);
+GTHREE_API
 void                gthree_renderer_render                    (GthreeRenderer     *renderer,
                                                                GthreeScene        *scene,
                                                                GthreeCamera       *camera);
@@ -3,6 +3,7 @@
 
 #include "gthreerendertarget.h"
 #include "gthreetexture.h"
+#include "gthreecubetexture.h"
 #include "gthreeprivate.h"
 
 typedef struct {
@@ -18,6 +19,7 @@ typedef struct {
 
   graphene_rect_t viewport;
 
+  gboolean color_buffer;
   gboolean depth_buffer;
   gboolean stencil_buffer;
 
@@ -61,6 +63,7 @@ gthree_render_target_init (GthreeRenderTarget *target)
   gthree_texture_set_data_type (priv->texture, GTHREE_DATA_TYPE_UNSIGNED_BYTE);
   gthree_texture_set_anisotropy (priv->texture, 1);
 
+  priv->color_buffer = TRUE;
   priv->depth_buffer = TRUE;
   priv->stencil_buffer = TRUE;
 }
@@ -153,6 +156,7 @@ gthree_render_target_clone (GthreeRenderTarget *target)
   clone_priv->scissor_test = priv->scissor_test;
 
   clone_priv->viewport = priv->viewport;
+  clone_priv->color_buffer = priv->color_buffer;
   clone_priv->depth_buffer = priv->depth_buffer;
   clone_priv->stencil_buffer = priv->stencil_buffer;
 
@@ -228,6 +232,23 @@ gthree_render_target_set_stencil_buffer (GthreeRenderTarget *target,
   priv->stencil_buffer = stencil_buffer;
 }
 
+/* Without a color buffer only the depth is rendered, into the depth
+   texture if there is one */
+gboolean
+gthree_render_target_get_color_buffer (GthreeRenderTarget *target)
+{
+  GthreeRenderTargetPrivate *priv = gthree_render_target_get_instance_private (target);
+  return priv->color_buffer;
+}
+
+void
+gthree_render_target_set_color_buffer (GthreeRenderTarget *target,
+                                       gboolean            color_buffer)
+{
+  GthreeRenderTargetPrivate *priv = gthree_render_target_get_instance_private (target);
+  priv->color_buffer = color_buffer;
+}
+
 GthreeTexture *
 gthree_render_target_get_depth_texture (GthreeRenderTarget *target)
 {
@@ -308,15 +329,36 @@ setup_depth_renderbuffer (GthreeRenderTarget *render_target)
   is_cube = ( renderTarget.isWebGLRenderTargetCube === true );
 #endif
 
-  if (priv->depth_texture)
+  if (priv->depth_texture && GTHREE_IS_CUBE_TEXTURE (priv->depth_texture))
+    {
+      /* A layered target, all six faces are rendered in each pass */
+      gthree_texture_bind (priv->depth_texture, -1, GL_TEXTURE_CUBE_MAP);
+      gthree_texture_set_parameters (GL_TEXTURE_CUBE_MAP, priv->depth_texture, FALSE);
+      gthree_texture_setup_cube_framebuffer (priv->depth_texture,
+                                             priv->width,
+                                             priv->gl_framebuffer,
+                                             GL_DEPTH_ATTACHMENT);
+      gthree_texture_set_needs_update (priv->depth_texture, FALSE);
+      glBindTexture (GL_TEXTURE_CUBE_MAP, 0);
+    }
+  else if (priv->depth_texture)
     {
       if (is_cube)
         {
           g_error ("target.depthTexture not supported in Cube render targets");
         }
-#ifdef TODO
-    setupDepthTexture( renderTargetProperties.__webglFramebuffer, renderTarget );
-#endif
+
+      /* The depth texture has no stencil, so stencil_buffer is ignored.
+         It is never mipmapped, so it is set up like a npot texture. */
+      gthree_texture_bind (priv->depth_texture, -1, GL_TEXTURE_2D);
+      gthree_texture_set_parameters (GL_TEXTURE_2D, priv->depth_texture, FALSE);
+      gthree_texture_setup_framebuffer (priv->depth_texture,
+                                        priv->width,
+                                        priv->height,
+                                        priv->gl_framebuffer,
+                                        GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D);
+      gthree_texture_set_needs_update (priv->depth_texture, FALSE);
+      glBindTexture (GL_TEXTURE_2D, 0);
     }
   else
     {
@@ -403,7 +445,8 @@ gthree_render_target_update_mipmap (GthreeRenderTarget *target)
   GthreeRenderTargetPrivate *priv = gthree_render_target_get_instance_private (target);
   gboolean supports_mips = gthree_render_target_is_power_of_two (target);
 
-  if (texture_needs_generate_mipmaps (priv->texture, supports_mips))
+  if (priv->color_buffer &&
+      texture_needs_generate_mipmaps (priv->texture, supports_mips))
     {
       guint target = GL_TEXTURE_2D;
 #ifdef TOOD
@@ -502,6 +545,15 @@ gthree_render_target_realize (GthreeRenderTarget *target)
       state.bindTexture( _gl.TEXTURE_CUBE_MAP, null );
 #endif
     }
+  else if (!priv->color_buffer)
+    {
+      GLenum none = GL_NONE;
+
+      glBindFramebuffer (GL_FRAMEBUFFER, priv->gl_framebuffer);
+      glDrawBuffers (1, &none);
+      glReadBuffer (GL_NONE);
+      glBindFramebuffer (GL_FRAMEBUFFER, 0);
+    }
   else
     {
       gthree_texture_bind (texture, -1, GL_TEXTURE_2D);
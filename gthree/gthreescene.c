@@ -5,12 +5,15 @@
 #include "gthreelight.h"
 
 #include "gthreeobjectprivate.h"
+#include "gthreeprivate.h"
 
 typedef struct {
   graphene_vec3_t bg_color;
   gboolean bg_color_is_set;
   GthreeTexture *bg_texture;
   GthreeMaterial *override_material;
+  GthreeSpatialIndex *spatial_index;
+  GthreeTransforms *transforms;
 } GthreeScenePrivate;
 
 
@@ -43,6 +46,9 @@ gthree_scene_finalize (GObject *obj)
 
   g_clear_object (&priv->override_material);
 
+  g_clear_pointer (&priv->spatial_index, gthree_spatial_index_free);
+  g_clear_pointer (&priv->transforms, gthree_transforms_free);
+
   G_OBJECT_CLASS (gthree_scene_parent_class)->finalize (obj);
 }
 
@@ -108,6 +114,75 @@ gthree_scene_set_override_material (GthreeScene *scene,
   priv->override_material = material;
 }
 
+gboolean
+gthree_scene_get_use_spatial_index (GthreeScene *scene)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  return priv->spatial_index != NULL;
+}
+
+/* If set, the scene keeps a bounding volume tree of the objects in it,
+ * which the renderer uses for frustum culling and shadow caster
+ * collection, and the raycaster for picking. This makes those scale
+ * with what is visible rather than with the size of the scene, at the
+ * cost of keeping the tree up to date as objects move. */
+void
+gthree_scene_set_use_spatial_index (GthreeScene *scene,
+                                    gboolean     use_spatial_index)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  if (use_spatial_index == (priv->spatial_index != NULL))
+    return;
+
+  if (use_spatial_index)
+    priv->spatial_index = gthree_spatial_index_new ();
+  else
+    g_clear_pointer (&priv->spatial_index, gthree_spatial_index_free);
+}
+
+gboolean
+gthree_scene_get_use_flat_transforms (GthreeScene *scene)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  return priv->transforms != NULL;
+}
+
+/* If set, the local and world matrices of all the objects in the scene
+ * are kept in contiguous arrays, parents before children, and
+ * gthree_object_update_matrix_world() on the scene becomes a linear pass
+ * over them that skips everything that didn't move. The results are the
+ * same as with the default tree walk. */
+void
+gthree_scene_set_use_flat_transforms (GthreeScene *scene,
+                                      gboolean     use_flat_transforms)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  if (use_flat_transforms == (priv->transforms != NULL))
+    return;
+
+  if (use_flat_transforms)
+    priv->transforms = gthree_transforms_new (GTHREE_OBJECT (scene));
+  else
+    g_clear_pointer (&priv->transforms, gthree_transforms_free);
+}
+
+/* Returns the spatial index, synced with the current world matrices,
+   or NULL if the scene doesn't use one */
+GthreeSpatialIndex *
+gthree_scene_update_spatial_index (GthreeScene *scene)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  if (priv->spatial_index)
+    gthree_spatial_index_sync (priv->spatial_index, GTHREE_OBJECT (scene));
+
+  return priv->spatial_index;
+}
+
 static void
 gthree_scene_class_init (GthreeSceneClass *klass)
 {
@@ -50,6 +50,16 @@ GthreeTexture * gthree_scene_get_background_texture (GthreeScene   *scene);
 GTHREE_API
 void            gthree_scene_set_background_texture (GthreeScene   *scene,
                                                      GthreeTexture *texture);
+GTHREE_API
+gboolean        gthree_scene_get_use_spatial_index  (GthreeScene   *scene);
+GTHREE_API
+void            gthree_scene_set_use_spatial_index  (GthreeScene   *scene,
+                                                     gboolean       use_spatial_index);
+GTHREE_API
+gboolean        gthree_scene_get_use_flat_transforms (GthreeScene  *scene);
+GTHREE_API
+void            gthree_scene_set_use_flat_transforms (GthreeScene  *scene,
+                                                      gboolean      use_flat_transforms);
 
 G_END_DECLS
 
@@ -198,6 +198,86 @@ gthree_shader_get_name (GthreeShader *shader)
   return priv->name;
 }
 
+/* All uniforms that have a location, in the same order as long as no
+   uniforms are added or removed */
+static void
+collect_located_uniforms (GthreeShader *shader,
+                          GPtrArray    *located)
+{
+  GthreeShaderPrivate *priv = gthree_shader_get_instance_private (shader);
+  GList *unis, *l, *ll;
+
+  unis = gthree_uniforms_get_all (priv->uniforms);
+  for (l = unis; l != NULL; l = l->next)
+    {
+      GthreeUniform *uni = l->data;
+
+      if (gthree_uniform_get_type (uni) == GTHREE_UNIFORM_TYPE_UNIFORMS_ARRAY)
+        {
+          GPtrArray *uarray = gthree_uniform_get_uarray (uni);
+          int i;
+
+          for (i = 0; uarray && i < uarray->len; i++)
+            {
+              GthreeUniforms *child_unis = g_ptr_array_index (uarray, i);
+              GList *child_unis_list;
+
+              if (child_unis == NULL)
+                continue;
+
+              child_unis_list = gthree_uniforms_get_all (child_unis);
+              for (ll = child_unis_list; ll != NULL; ll = ll->next)
+                g_ptr_array_add (located, ll->data);
+              g_list_free (child_unis_list);
+            }
+        }
+      else
+        g_ptr_array_add (located, uni);
+    }
+  g_list_free (unis);
+}
+
+/* Snapshot of the current uniform locations, to be restored with
+   gthree_shader_restore_uniform_locations() when switching back to the
+   same program, instead of looking them all up again */
+GArray *
+gthree_shader_save_uniform_locations (GthreeShader *shader)
+{
+  g_autoptr(GPtrArray) located = g_ptr_array_new ();
+  GArray *locations;
+  int i;
+
+  collect_located_uniforms (shader, located);
+
+  locations = g_array_sized_new (FALSE, FALSE, sizeof (int), located->len);
+  for (i = 0; i < located->len; i++)
+    {
+      int location = gthree_uniform_get_location (g_ptr_array_index (located, i));
+      g_array_append_val (locations, location);
+    }
+
+  return locations;
+}
+
+/* Returns FALSE if the uniforms changed since the locations were saved */
+gboolean
+gthree_shader_restore_uniform_locations (GthreeShader *shader,
+                                         GArray       *locations)
+{
+  g_autoptr(GPtrArray) located = g_ptr_array_new ();
+  int i;
+
+  collect_located_uniforms (shader, located);
+  if (located->len != locations->len)
+    return FALSE;
+
+  for (i = 0; i < located->len; i++)
+    gthree_uniform_set_location (g_ptr_array_index (located, i),
+                                 g_array_index (locations, int, i));
+
+  return TRUE;
+}
+
 void
 gthree_shader_update_uniform_locations_for_program (GthreeShader *shader,
                                                     GthreeProgram *program)
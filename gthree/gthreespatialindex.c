@@ -0,0 +1,717 @@
+#include <math.h>
+#include <string.h>
+
+#include "gthreeprivate.h"
+#include "gthreeobjectprivate.h"
+#include "gthreelinesegments.h"
+#include "gthreepoints.h"
+
+/* A dynamic bounding volume tree over the world bounding spheres of the
+ * drawable objects in a scene. Leaves keep a box a bit larger than
+ * their sphere, so objects that move a little only get their sphere
+ * updated, and only re-inserted when they leave the box. Objects mark
+ * themselves dirty when their world bounds may have changed, so keeping
+ * the tree up to date costs in proportion to what moved. */
+
+#define NULL_NODE -1
+
+/* How much larger than the sphere the box of a leaf is */
+#define FAT_MARGIN 0.1f
+#define MIN_FAT_MARGIN 0.01f
+
+typedef struct {
+  graphene_box_t box;
+  graphene_sphere_t sphere; /* Leaves only */
+  GthreeObject *object; /* Leaves only, NULL for internal nodes */
+  int parent; /* Next free node when on the free list */
+  int child1;
+  int child2;
+  int height; /* 0 for leaves, -1 for free nodes */
+  guint seen;
+  guint dirty : 1;
+  guint in_tree : 1; /* Has bounds, otherwise in the unbounded list */
+} GthreeSpatialNode;
+
+struct _GthreeSpatialIndex {
+  GArray *nodes;
+  int root;
+  int free_list;
+
+  GArray *dirty;
+  GArray *unbounded;
+  GArray *stack;
+
+  guint graph_age;
+  gboolean graph_age_valid;
+  guint seen;
+};
+
+#define NODE(_index, _i) (&g_array_index ((_index)->nodes, GthreeSpatialNode, (_i)))
+
+GthreeSpatialIndex *
+gthree_spatial_index_new (void)
+{
+  GthreeSpatialIndex *index = g_new0 (GthreeSpatialIndex, 1);
+
+  index->nodes = g_array_new (FALSE, TRUE, sizeof (GthreeSpatialNode));
+  index->root = NULL_NODE;
+  index->free_list = NULL_NODE;
+  index->dirty = g_array_new (FALSE, FALSE, sizeof (int));
+  index->unbounded = g_array_new (FALSE, FALSE, sizeof (int));
+  index->stack = g_array_new (FALSE, FALSE, sizeof (int));
+
+  return index;
+}
+
+void
+gthree_spatial_index_free (GthreeSpatialIndex *index)
+{
+  int i;
+
+  for (i = 0; i < index->nodes->len; i++)
+    {
+      GthreeSpatialNode *node = NODE (index, i);
+
+      if (node->height >= 0 && node->object != NULL)
+        {
+          gthree_object_set_spatial_index (node->object, NULL, NULL_NODE);
+          g_object_unref (node->object);
+        }
+    }
+
+  g_array_unref (index->nodes);
+  g_array_unref (index->dirty);
+  g_array_unref (index->unbounded);
+  g_array_unref (index->stack);
+  g_free (index);
+}
+
+static int
+allocate_node (GthreeSpatialIndex *index)
+{
+  GthreeSpatialNode *node;
+  int i;
+
+  if (index->free_list != NULL_NODE)
+    {
+      i = index->free_list;
+      index->free_list = NODE (index, i)->parent;
+    }
+  else
+    {
+      i = index->nodes->len;
+      g_array_set_size (index->nodes, i + 1);
+    }
+
+  node = NODE (index, i);
+  memset (node, 0, sizeof (GthreeSpatialNode));
+  node->parent = NULL_NODE;
+  node->child1 = NULL_NODE;
+  node->child2 = NULL_NODE;
+
+  return i;
+}
+
+static void
+free_node (GthreeSpatialIndex *index,
+           int i)
+{
+  GthreeSpatialNode *node = NODE (index, i);
+
+  node->object = NULL;
+  node->height = -1;
+  node->parent = index->free_list;
+  index->free_list = i;
+}
+
+static float
+box_area (const graphene_box_t *box)
+{
+  float w = graphene_box_get_width (box);
+  float h = graphene_box_get_height (box);
+  float d = graphene_box_get_depth (box);
+
+  return 2 * (w * h + h * d + d * w);
+}
+
+static float
+union_area (const graphene_box_t *a,
+            const graphene_box_t *b)
+{
+  graphene_box_t u;
+
+  graphene_box_union (a, b, &u);
+  return box_area (&u);
+}
+
+static gboolean
+box_contains_box (const graphene_box_t *outer,
+                  const graphene_box_t *inner)
+{
+  graphene_point3d_t min, max;
+
+  graphene_box_get_min (inner, &min);
+  graphene_box_get_max (inner, &max);
+
+  return
+    graphene_box_contains_point (outer, &min) &&
+    graphene_box_contains_point (outer, &max);
+}
+
+static void
+box_init_from_sphere (graphene_box_t *box,
+                      const graphene_sphere_t *sphere,
+                      float margin)
+{
+  graphene_point3d_t center, min, max;
+  float r = graphene_sphere_get_radius (sphere) + margin;
+
+  graphene_sphere_get_center (sphere, &center);
+  graphene_point3d_init (&min, center.x - r, center.y - r, center.z - r);
+  graphene_point3d_init (&max, center.x + r, center.y + r, center.z + r);
+  graphene_box_init (box, &min, &max);
+}
+
+static gboolean
+box_intersects_sphere (const graphene_box_t *box,
+                       const graphene_point3d_t *center,
+                       float radius)
+{
+  graphene_point3d_t min, max;
+  float dx, dy, dz;
+
+  graphene_box_get_min (box, &min);
+  graphene_box_get_max (box, &max);
+
+  dx = MAX (MAX (min.x - center->x, 0), center->x - max.x);
+  dy = MAX (MAX (min.y - center->y, 0), center->y - max.y);
+  dz = MAX (MAX (min.z - center->z, 0), center->z - max.z);
+
+  return dx * dx + dy * dy + dz * dz <= radius * radius;
+}
+
+static void
+refit (GthreeSpatialIndex *index,
+       int i)
+{
+  GthreeSpatialNode *node = NODE (index, i);
+  GthreeSpatialNode *child1 = NODE (index, node->child1);
+  GthreeSpatialNode *child2 = NODE (index, node->child2);
+
+  graphene_box_union (&child1->box, &child2->box, &node->box);
+  node->height = 1 + MAX (child1->height, child2->height);
+}
+
+/* Rotates the taller child of a up if the children of i are
+   unbalanced, returns the new root of the subtree */
+static int
+balance (GthreeSpatialIndex *index,
+         int a)
+{
+  GthreeSpatialNode *A = NODE (index, a);
+  int b, c, diff;
+
+  if (A->object != NULL || A->height < 2)
+    return a;
+
+  b = A->child1;
+  c = A->child2;
+  diff = NODE (index, c)->height - NODE (index, b)->height;
+
+  if (diff > 1 || diff < -1)
+    {
+      /* Rotate the taller child x up, a takes the place of its shorter child */
+      int x = diff > 1 ? c : b;
+      int other = diff > 1 ? b : c;
+      GthreeSpatialNode *X = NODE (index, x);
+      int f = X->child1;
+      int g = X->child2;
+      int keep, give;
+
+      X->child1 = a;
+      X->parent = A->parent;
+      A->parent = x;
+
+      if (X->parent != NULL_NODE)
+        {
+          GthreeSpatialNode *P = NODE (index, X->parent);
+          if (P->child1 == a)
+            P->child1 = x;
+          else
+            P->child2 = x;
+        }
+      else
+        index->root = x;
+
+      if (NODE (index, f)->height > NODE (index, g)->height)
+        {
+          keep = f;
+          give = g;
+        }
+      else
+        {
+          keep = g;
+          give = f;
+        }
+
+      X->child2 = keep;
+      A->child1 = other;
+      A->child2 = give;
+      NODE (index, give)->parent = a;
+
+      refit (index, a);
+      refit (index, x);
+
+      return x;
+    }
+
+  return a;
+}
+
+static void
+insert_leaf (GthreeSpatialIndex *index,
+             int leaf)
+{
+  graphene_box_t leaf_box;
+  int sibling, old_parent, new_parent, i;
+
+  if (index->root == NULL_NODE)
+    {
+      index->root = leaf;
+      NODE (index, leaf)->parent = NULL_NODE;
+      return;
+    }
+
+  leaf_box = NODE (index, leaf)->box;
+
+  /* Walk down to the sibling that grows the total area least */
+  sibling = index->root;
+  while (NODE (index, sibling)->object == NULL)
+    {
+      GthreeSpatialNode *node = NODE (index, sibling);
+      GthreeSpatialNode *child1 = NODE (index, node->child1);
+      GthreeSpatialNode *child2 = NODE (index, node->child2);
+      float area = box_area (&node->box);
+      float combined = union_area (&node->box, &leaf_box);
+      float cost = 2 * combined;
+      float inheritance = 2 * (combined - area);
+      float cost1, cost2;
+
+      cost1 = union_area (&child1->box, &leaf_box) + inheritance;
+      if (child1->object == NULL)
+        cost1 -= box_area (&child1->box);
+
+      cost2 = union_area (&child2->box, &leaf_box) + inheritance;
+      if (child2->object == NULL)
+        cost2 -= box_area (&child2->box);
+
+      if (cost < cost1 && cost < cost2)
+        break;
+
+      sibling = cost1 < cost2 ? node->child1 : node->child2;
+    }
+
+  old_parent = NODE (index, sibling)->parent;
+  new_parent = allocate_node (index);
+
+  NODE (index, new_parent)->parent = old_parent;
+  NODE (index, new_parent)->child1 = sibling;
+  NODE (index, new_parent)->child2 = leaf;
+  NODE (index, sibling)->parent = new_parent;
+  NODE (index, leaf)->parent = new_parent;
+
+  if (old_parent != NULL_NODE)
+    {
+      if (NODE (index, old_parent)->child1 == sibling)
+        NODE (index, old_parent)->child1 = new_parent;
+      else
+        NODE (index, old_parent)->child2 = new_parent;
+    }
+  else
+    index->root = new_parent;
+
+  for (i = new_parent; i != NULL_NODE; i = NODE (index, i)->parent)
+    {
+      i = balance (index, i);
+      refit (index, i);
+    }
+}
+
+static void
+remove_leaf (GthreeSpatialIndex *index,
+             int leaf)
+{
+  int parent, grand_parent, sibling, i;
+
+  if (leaf == index->root)
+    {
+      index->root = NULL_NODE;
+      return;
+    }
+
+  parent = NODE (index, leaf)->parent;
+  grand_parent = NODE (index, parent)->parent;
+  sibling = NODE (index, parent)->child1 == leaf ? NODE (index, parent)->child2 : NODE (index, parent)->child1;
+
+  if (grand_parent != NULL_NODE)
+    {
+      if (NODE (index, grand_parent)->child1 == parent)
+        NODE (index, grand_parent)->child1 = sibling;
+      else
+        NODE (index, grand_parent)->child2 = sibling;
+      NODE (index, sibling)->parent = grand_parent;
+      free_node (index, parent);
+
+      for (i = grand_parent; i != NULL_NODE; i = NODE (index, i)->parent)
+        {
+          i = balance (index, i);
+          refit (index, i);
+        }
+    }
+  else
+    {
+      index->root = sibling;
+      NODE (index, sibling)->parent = NULL_NODE;
+      free_node (index, parent);
+    }
+
+  NODE (index, leaf)->parent = NULL_NODE;
+}
+
+static void
+remove_from_list (GArray *list,
+                  int leaf)
+{
+  int i;
+
+  for (i = 0; i < list->len; i++)
+    {
+      if (g_array_index (list, int, i) == leaf)
+        {
+          g_array_remove_index_fast (list, i);
+          return;
+        }
+    }
+}
+
+/* Moves the leaf to where its current world bounds say it belongs */
+static void
+update_leaf (GthreeSpatialIndex *index,
+             int leaf)
+{
+  GthreeSpatialNode *node = NODE (index, leaf);
+  graphene_sphere_t sphere;
+  graphene_box_t box;
+
+  node->dirty = FALSE;
+
+  if (!gthree_object_get_world_bounding_sphere (node->object, &sphere))
+    {
+      if (node->in_tree)
+        {
+          remove_leaf (index, leaf);
+          node = NODE (index, leaf);
+          node->in_tree = FALSE;
+          g_array_append_val (index->unbounded, leaf);
+        }
+      return;
+    }
+
+  node->sphere = sphere;
+  box_init_from_sphere (&box, &sphere, 0);
+
+  if (node->in_tree && box_contains_box (&node->box, &box))
+    return;
+
+  if (node->in_tree)
+    remove_leaf (index, leaf);
+  else
+    remove_from_list (index->unbounded, leaf);
+
+  node = NODE (index, leaf);
+  node->in_tree = TRUE;
+  box_init_from_sphere (&node->box, &sphere,
+                        MAX (graphene_sphere_get_radius (&sphere) * FAT_MARGIN, MIN_FAT_MARGIN));
+  insert_leaf (index, leaf);
+}
+
+/* Only these get a leaf, everything else is unbounded to users of
+   the index */
+gboolean
+gthree_spatial_index_is_indexed_type (GthreeObject *object)
+{
+  return
+    GTHREE_IS_MESH (object) ||
+    GTHREE_IS_LINE_SEGMENTS (object) ||
+    GTHREE_IS_POINTS (object) ||
+    GTHREE_IS_SPRITE (object);
+}
+
+static void
+add_object (GthreeSpatialIndex *index,
+            GthreeObject *object)
+{
+  GthreeSpatialIndex *old_index;
+  GthreeSpatialNode *node;
+  int leaf;
+
+  old_index = gthree_object_get_spatial_index (object, &leaf);
+  if (old_index == index)
+    {
+      NODE (index, leaf)->seen = index->seen;
+      return;
+    }
+
+  /* Moved here from another scene */
+  if (old_index != NULL)
+    gthree_spatial_index_remove (old_index, object);
+
+  leaf = allocate_node (index);
+  node = NODE (index, leaf);
+  node->object = g_object_ref (object);
+  node->seen = index->seen;
+  gthree_object_set_spatial_index (object, index, leaf);
+
+  g_array_append_val (index->unbounded, leaf);
+
+  update_leaf (index, leaf);
+}
+
+static void
+add_objects (GthreeSpatialIndex *index,
+             GthreeObject *object)
+{
+  GthreeObjectIter iter;
+  GthreeObject *child;
+
+  if (gthree_spatial_index_is_indexed_type (object))
+    add_object (index, object);
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    add_objects (index, child);
+}
+
+void
+gthree_spatial_index_remove (GthreeSpatialIndex *index,
+                             GthreeObject *object)
+{
+  GthreeSpatialNode *node;
+  int leaf;
+
+  if (gthree_object_get_spatial_index (object, &leaf) != index)
+    return;
+
+  node = NODE (index, leaf);
+  if (node->in_tree)
+    remove_leaf (index, leaf);
+  else
+    remove_from_list (index->unbounded, leaf);
+
+  node = NODE (index, leaf);
+  if (node->dirty)
+    remove_from_list (index->dirty, leaf);
+
+  gthree_object_set_spatial_index (object, NULL, NULL_NODE);
+  free_node (index, leaf);
+  g_object_unref (object);
+}
+
+void
+gthree_spatial_index_mark_dirty (GthreeSpatialIndex *index,
+                                 int leaf)
+{
+  GthreeSpatialNode *node = NODE (index, leaf);
+
+  if (node->dirty)
+    return;
+
+  node->dirty = TRUE;
+  g_array_append_val (index->dirty, leaf);
+}
+
+/* Brings the index up to date with the graph under root. The graph is
+   only walked when the graph age changed, otherwise only the objects
+   whose world bounds changed since the last sync are looked at,
+   which includes changes of the bounds of their geometry. */
+void
+gthree_spatial_index_sync (GthreeSpatialIndex *index,
+                           GthreeObject *root)
+{
+  guint graph_age = gthree_object_get_graph_age (root);
+  int i;
+
+  if (!index->graph_age_valid || index->graph_age != graph_age)
+    {
+      index->seen++;
+      add_objects (index, root);
+
+      for (i = 0; i < index->nodes->len; i++)
+        {
+          GthreeSpatialNode *node = NODE (index, i);
+
+          if (node->height >= 0 && node->object != NULL && node->seen != index->seen)
+            gthree_spatial_index_remove (index, node->object);
+        }
+
+      index->graph_age = graph_age;
+      index->graph_age_valid = TRUE;
+    }
+
+  for (i = 0; i < index->dirty->len; i++)
+    update_leaf (index, g_array_index (index->dirty, int, i));
+  g_array_set_size (index->dirty, 0);
+}
+
+gboolean
+gthree_spatial_index_get_bounding_sphere (GthreeSpatialIndex *index,
+                                          GthreeObject *object,
+                                          graphene_sphere_t *sphere)
+{
+  GthreeSpatialNode *node;
+  int leaf;
+
+  if (gthree_object_get_spatial_index (object, &leaf) != index)
+    return gthree_object_get_world_bounding_sphere (object, sphere);
+
+  node = NODE (index, leaf);
+  if (!node->in_tree)
+    return FALSE;
+
+  *sphere = node->sphere;
+  return TRUE;
+}
+
+static void
+add_unbounded (GthreeSpatialIndex *index,
+               GPtrArray *results)
+{
+  int i;
+
+  for (i = 0; i < index->unbounded->len; i++)
+    g_ptr_array_add (results, NODE (index, g_array_index (index->unbounded, int, i))->object);
+}
+
+static int
+pop (GArray *stack)
+{
+  int i = g_array_index (stack, int, stack->len - 1);
+  g_array_set_size (stack, stack->len - 1);
+  return i;
+}
+
+static void
+push_children (GArray *stack,
+               GthreeSpatialNode *node)
+{
+  g_array_append_val (stack, node->child1);
+  g_array_append_val (stack, node->child2);
+}
+
+/* Adds the objects whose world bounding sphere intersects the frustum
+ * to results, in no particular order. Objects without bounds are
+ * always added. */
+void
+gthree_spatial_index_query_frustum (GthreeSpatialIndex *index,
+                                    const graphene_frustum_t *frustum,
+                                    GPtrArray *results)
+{
+  GArray *stack = index->stack;
+
+  add_unbounded (index, results);
+
+  if (index->root == NULL_NODE)
+    return;
+
+  g_array_append_val (stack, index->root);
+  while (stack->len > 0)
+    {
+      GthreeSpatialNode *node = NODE (index, pop (stack));
+
+      if (!graphene_frustum_intersects_box (frustum, &node->box))
+        continue;
+
+      if (node->object != NULL)
+        {
+          if (graphene_frustum_intersects_sphere (frustum, &node->sphere))
+            g_ptr_array_add (results, node->object);
+        }
+      else
+        push_children (stack, node);
+    }
+}
+
+/* Like gthree_spatial_index_query_frustum(), for the objects in reach of
+   a sphere, such as the range of a point light */
+void
+gthree_spatial_index_query_sphere (GthreeSpatialIndex *index,
+                                   const graphene_sphere_t *sphere,
+                                   GPtrArray *results)
+{
+  GArray *stack = index->stack;
+  graphene_point3d_t center;
+  float radius = graphene_sphere_get_radius (sphere);
+
+  add_unbounded (index, results);
+
+  if (index->root == NULL_NODE)
+    return;
+
+  graphene_sphere_get_center (sphere, &center);
+
+  g_array_append_val (stack, index->root);
+  while (stack->len > 0)
+    {
+      GthreeSpatialNode *node = NODE (index, pop (stack));
+
+      if (!box_intersects_sphere (&node->box, &center, radius))
+        continue;
+
+      if (node->object != NULL)
+        {
+          graphene_point3d_t node_center;
+
+          graphene_sphere_get_center (&node->sphere, &node_center);
+          if (graphene_point3d_distance (&center, &node_center, NULL) <=
+              radius + graphene_sphere_get_radius (&node->sphere))
+            g_ptr_array_add (results, node->object);
+        }
+      else
+        push_children (stack, node);
+    }
+}
+
+/* Broadphase for raycasting, adds the objects whose box the ray enters
+   before far */
+void
+gthree_spatial_index_query_ray (GthreeSpatialIndex *index,
+                                const graphene_ray_t *ray,
+                                float far,
+                                GPtrArray *results)
+{
+  GArray *stack = index->stack;
+
+  add_unbounded (index, results);
+
+  if (index->root == NULL_NODE)
+    return;
+
+  g_array_append_val (stack, index->root);
+  while (stack->len > 0)
+    {
+      GthreeSpatialNode *node = NODE (index, pop (stack));
+      graphene_ray_intersection_kind_t kind;
+      float t;
+
+      /* Leaving means the origin is inside the box */
+      kind = graphene_ray_intersect_box (ray, &node->box, &t);
+      if (kind == GRAPHENE_RAY_INTERSECTION_KIND_NONE ||
+          (kind == GRAPHENE_RAY_INTERSECTION_KIND_ENTER && t > far))
+        continue;
+
+      if (node->object != NULL)
+        g_ptr_array_add (results, node->object);
+      else
+        push_children (stack, node);
+    }
+}
@@ -53,6 +53,7 @@ static int i0 = 0;
 static float f0 = 0.0;
 static float f1 = 1.0;
 static float zerov2[2] = { 0, 0 };
+static float unit_rect[4] = { 0, 0, 1, 1 };
 
 static GthreeUniformsDefinition light_uniforms[] = {
   {"position", GTHREE_UNIFORM_TYPE_VECTOR3, &zerov3},
@@ -67,6 +68,7 @@ static GthreeUniformsDefinition light_uniforms[] = {
   {"shadowBias", GTHREE_UNIFORM_TYPE_FLOAT, &f0 },
   {"shadowRadius", GTHREE_UNIFORM_TYPE_FLOAT, &f1 },
   {"shadowMapSize", GTHREE_UNIFORM_TYPE_VECTOR2, &zerov2 },
+  {"shadowMapRect", GTHREE_UNIFORM_TYPE_VECTOR4, &unit_rect },
 };
 
 static void
@@ -145,24 +147,38 @@ gthree_spot_light_real_setup (GthreeLight *light,
     {
       GthreeLightShadow *shadow = gthree_light_get_shadow (light);
       graphene_vec2_t size;
+      graphene_vec4_t rect;
 
       gthree_uniforms_set_float (priv->uniforms, "shadowBias", gthree_light_shadow_get_bias (shadow));
       gthree_uniforms_set_float (priv->uniforms, "shadowRadius", gthree_light_shadow_get_radius (shadow));
 
-      graphene_vec2_init (&size,
-                          gthree_light_shadow_get_map_width (shadow),
-                          gthree_light_shadow_get_map_height (shadow));
+      /* The size of the whole map, which is the atlas if one is used */
+      gthree_light_shadow_get_map_size (shadow, &size);
       gthree_uniforms_set_vec2 (priv->uniforms, "shadowMapSize", &size);
 
-      GthreeRenderTarget *shadow_map = gthree_light_shadow_get_map (shadow);
-      if (shadow_map)
-        shadow_map_texture = gthree_render_target_get_texture (shadow_map);
+      gthree_light_shadow_get_map_rect (shadow, &rect);
+      gthree_uniforms_set_vec4 (priv->uniforms, "shadowMapRect", &rect);
+
+      shadow_map_texture = gthree_light_shadow_get_map_texture (shadow);
 
       shadow_matrix = *gthree_light_shadow_get_matrix (shadow);
     }
   else
     graphene_matrix_init_identity (&shadow_matrix);
 
+  {
+    GthreeSpotLightBlock block = { { 0 } };
+
+    graphene_vec3_to_float (&light_pos_view3, block.position);
+    block.position[3] = priv->distance;
+    graphene_vec3_to_float (&direction3, block.direction);
+    block.direction[3] = priv->decay;
+    graphene_vec3_to_float (&color, block.color);
+    block.cone[0] = cosf (priv->angle);
+    block.cone[1] = cosf (priv->angle * (1 - priv->penumbra));
+    g_array_append_val (setup->spot_data, block);
+  }
+
   g_ptr_array_add (setup->spot, priv->uniforms);
   g_ptr_array_add (setup->spot_shadow_map, shadow_map_texture);
   g_array_append_val (setup->spot_shadow_map_matrix, shadow_matrix);
@@ -43,6 +43,7 @@ typedef struct {
   gboolean generate_mipmaps;
   gboolean premultiply_alpha;
   gboolean flip_y;
+  gboolean compare; /* Depth texture sampled with a shadow sampler */
   int unpack_alignment;
 
   guint max_mip_level;
@@ -127,6 +128,7 @@ gthree_texture_copy_settings (GthreeTexture        *texture,
   priv->premultiply_alpha = source_priv->premultiply_alpha;
   priv->flip_y = source_priv->flip_y;
   priv->unpack_alignment = source_priv->unpack_alignment;
+  priv->compare = source_priv->compare;
 }
 
 static void
@@ -509,6 +511,12 @@ gthree_texture_set_parameters (guint texture_type, GthreeTexture *texture, gbool
       glTexParameteri( texture_type, GL_TEXTURE_MIN_FILTER, filter_fallback (priv->min_filter));
     }
 
+  if (priv->compare)
+    {
+      glTexParameteri (texture_type, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+      glTexParameteri (texture_type, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    }
+
 #if TODO
   if ( _glExtensionTextureFilterAnisotropic && texture.type !== THREE.FloatType ) {
     if ( texture.anisotropy > 1 || texture.__oldAnisotropy ) {
@@ -577,6 +585,8 @@ gthree_texture_data_type_to_gl (GthreeDataType type)
       return GL_UNSIGNED_BYTE;
     case GTHREE_DATA_TYPE_BYTE:
       return GL_BYTE;
+    case GTHREE_DATA_TYPE_UNSIGNED_INT:
+      return GL_UNSIGNED_INT;
     }
 }
 
@@ -590,6 +600,8 @@ gthree_texture_format_to_gl (GthreeTextureFormat format)
       return GL_RGBA;
     case GTHREE_TEXTURE_FORMAT_RGB:
       return GL_RGB;
+    case GTHREE_TEXTURE_FORMAT_DEPTH:
+      return GL_DEPTH_COMPONENT;
     }
 }
 
@@ -629,6 +641,16 @@ gthree_texture_get_internal_gl_format (guint gl_format,
         internal_format = GL_RGBA8;
   }
 
+  if (gl_format == GL_DEPTH_COMPONENT)
+    {
+      if (gl_type == GL_FLOAT)
+        internal_format = GL_DEPTH_COMPONENT32F;
+      if (gl_type == GL_UNSIGNED_INT)
+        internal_format = GL_DEPTH_COMPONENT24;
+      if (gl_type == GL_UNSIGNED_SHORT)
+        internal_format = GL_DEPTH_COMPONENT16;
+    }
+
   return internal_format;
 }
 
@@ -655,6 +677,30 @@ gthree_texture_setup_framebuffer (GthreeTexture *texture,
   glBindFramebuffer (GL_FRAMEBUFFER, 0);
 }
 
+/* Allocates all faces of the bound cube map and attaches them as the
+   layers of the framebuffer, they are picked with gl_Layer */
+void
+gthree_texture_setup_cube_framebuffer (GthreeTexture *texture,
+                                       int size,
+                                       guint framebuffer,
+                                       int attachment)
+{
+  GthreeTexturePrivate *priv = gthree_texture_get_instance_private (texture);
+  guint gl_format, gl_type, gl_internal_format;
+  int i;
+
+  gl_format = gthree_texture_format_to_gl (priv->format);
+  gl_type = gthree_texture_data_type_to_gl (priv->type);
+  gl_internal_format = gthree_texture_get_internal_gl_format (gl_format, gl_type);
+
+  for (i = 0; i < 6; i++)
+    glTexImage2D (GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, gl_internal_format,
+                  size, size, 0, gl_format, gl_type, 0);
+  glBindFramebuffer (GL_FRAMEBUFFER, framebuffer);
+  glFramebufferTexture (GL_FRAMEBUFFER, attachment, priv->gl_texture, 0);
+  glBindFramebuffer (GL_FRAMEBUFFER, 0);
+}
+
 
 static void
 gthree_texture_real_load (GthreeTexture *texture, int slot)
@@ -922,3 +968,22 @@ gthree_texture_get_gl_texture (GthreeTexture *texture)
 
   return priv->gl_texture;
 }
+
+/* Makes lookups through a shadow sampler compare against the depth
+   in the texture, see shadowmap_pars_fragment.glsl */
+void
+gthree_texture_set_compare (GthreeTexture *texture,
+                            gboolean       compare)
+{
+  GthreeTexturePrivate *priv = gthree_texture_get_instance_private (texture);
+
+  priv->compare = !!compare;
+}
+
+gboolean
+gthree_texture_get_compare (GthreeTexture *texture)
+{
+  GthreeTexturePrivate *priv = gthree_texture_get_instance_private (texture);
+
+  return priv->compare;
+}
@@ -0,0 +1,274 @@
+#include <string.h>
+
+#include "gthreeprivate.h"
+#include "gthreeobjectprivate.h"
+
+/* Keeps the local and world matrices of all the objects in a graph in
+ * two contiguous arrays, ordered breadth first so that every parent
+ * comes before its children. Objects point their matrices into these
+ * arrays, so the accessors keep working, and updating the world
+ * matrices is then a single linear pass that only reads the arrays
+ * for objects that didn't change locally. The pass starts at the first
+ * dirty object, as nothing before it can have changed. */
+
+enum {
+  CLEAN = 0,
+  DIRTY = 1, /* Local transform changed, needs to look at the object */
+  CHANGED = 2, /* World matrix changed in the current pass */
+};
+
+struct _GthreeTransforms {
+  GthreeObject *root; /* Not owned, it owns us */
+
+  GPtrArray *objects; /* Owned, except for the root at 0. NULL if taken by other transforms */
+  GArray *parents; /* int, -1 for the root */
+  GArray *local; /* graphene_matrix_t */
+  GArray *world; /* graphene_matrix_t */
+  GByteArray *state;
+  GByteArray *custom; /* Has its own update_matrix_world() */
+
+  int first_dirty;
+  int first_custom; /* These are called every update, like in the tree walk */
+  guint graph_age;
+  gboolean graph_age_valid;
+};
+
+GthreeTransforms *
+gthree_transforms_new (GthreeObject *root)
+{
+  GthreeTransforms *transforms = g_new0 (GthreeTransforms, 1);
+
+  transforms->root = root;
+  transforms->objects = g_ptr_array_new ();
+  transforms->parents = g_array_new (FALSE, FALSE, sizeof (int));
+  transforms->local = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
+  transforms->world = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
+  transforms->state = g_byte_array_new ();
+  transforms->custom = g_byte_array_new ();
+  transforms->first_dirty = G_MAXINT;
+  transforms->first_custom = G_MAXINT;
+
+  gthree_object_set_root_transforms (root, transforms);
+
+  return transforms;
+}
+
+/* Gives the object its own matrix storage back */
+static void
+unbind (GthreeTransforms *transforms,
+        int index)
+{
+  GthreeObject *object = g_ptr_array_index (transforms->objects, index);
+
+  if (object == NULL)
+    return;
+
+  gthree_object_bind_transforms (object, NULL, -1,
+                                 &g_array_index (transforms->local, graphene_matrix_t, index),
+                                 &g_array_index (transforms->world, graphene_matrix_t, index));
+  if (object != transforms->root)
+    g_object_unref (object);
+
+  g_ptr_array_index (transforms->objects, index) = NULL;
+}
+
+void
+gthree_transforms_free (GthreeTransforms *transforms)
+{
+  int i;
+
+  for (i = 0; i < transforms->objects->len; i++)
+    unbind (transforms, i);
+
+  gthree_object_set_root_transforms (transforms->root, NULL);
+
+  g_ptr_array_unref (transforms->objects);
+  g_array_unref (transforms->parents);
+  g_array_unref (transforms->local);
+  g_array_unref (transforms->world);
+  g_byte_array_unref (transforms->state);
+  g_byte_array_unref (transforms->custom);
+  g_free (transforms);
+}
+
+/* For when an object moved to the graph of other transforms */
+void
+gthree_transforms_remove (GthreeTransforms *transforms,
+                          int index)
+{
+  unbind (transforms, index);
+}
+
+void
+gthree_transforms_mark_dirty (GthreeTransforms *transforms,
+                              int index)
+{
+  transforms->state->data[index] = DIRTY;
+  transforms->first_dirty = MIN (transforms->first_dirty, index);
+}
+
+/* Lays the graph out breadth first in new arrays, moving over the
+   current matrices, and releases the objects that left the graph */
+static void
+rebuild (GthreeTransforms *transforms)
+{
+  GPtrArray *objects = g_ptr_array_new ();
+  GArray *parents = g_array_new (FALSE, FALSE, sizeof (int));
+  GArray *local = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
+  GArray *world = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
+  GByteArray *kept = g_byte_array_new ();
+  int parent = -1;
+  int i;
+
+  g_byte_array_set_size (kept, transforms->objects->len);
+  memset (kept->data, 0, kept->len);
+
+  g_ptr_array_add (objects, transforms->root);
+  g_array_append_val (parents, parent);
+
+  for (i = 0; i < objects->len; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (objects, i);
+      GthreeTransforms *old_transforms;
+      GthreeObject *child;
+      int old_index;
+
+      old_transforms = gthree_object_get_transforms (object, &old_index);
+      if (old_transforms == transforms)
+        kept->data[old_index] = TRUE;
+      else
+        {
+          if (old_transforms != NULL)
+            gthree_transforms_remove (old_transforms, old_index);
+          if (object != transforms->root)
+            g_object_ref (object);
+        }
+
+      g_array_append_vals (local, gthree_object_get_matrix (object), 1);
+      g_array_append_vals (world, gthree_object_get_world_matrix (object), 1);
+
+      for (child = gthree_object_get_first_child (object);
+           child != NULL;
+           child = gthree_object_get_next_sibling (child))
+        {
+          g_ptr_array_add (objects, child);
+          g_array_append_val (parents, i);
+        }
+    }
+
+  for (i = 0; i < transforms->objects->len; i++)
+    {
+      if (!kept->data[i])
+        unbind (transforms, i);
+    }
+
+  g_byte_array_set_size (transforms->state, objects->len);
+  g_byte_array_set_size (transforms->custom, objects->len);
+  transforms->first_custom = G_MAXINT;
+
+  /* The kept objects still point into the old arrays until they are
+     rebound here, so those are only freed afterwards */
+  for (i = 0; i < objects->len; i++)
+    {
+      GthreeObject *object = g_ptr_array_index (objects, i);
+
+      gthree_object_bind_transforms (object, transforms, i,
+                                     &g_array_index (local, graphene_matrix_t, i),
+                                     &g_array_index (world, graphene_matrix_t, i));
+
+      transforms->custom->data[i] = gthree_object_has_custom_update_matrix_world (object);
+      if (transforms->custom->data[i])
+        transforms->first_custom = MIN (transforms->first_custom, i);
+      transforms->state->data[i] = gthree_object_get_transform_need_update (object) ? DIRTY : CLEAN;
+    }
+
+  g_ptr_array_unref (transforms->objects);
+  g_array_unref (transforms->parents);
+  g_array_unref (transforms->local);
+  g_array_unref (transforms->world);
+  g_byte_array_unref (kept);
+
+  transforms->objects = objects;
+  transforms->parents = parents;
+  transforms->local = local;
+  transforms->world = world;
+  transforms->first_dirty = 0;
+}
+
+/* Same result as gthree_object_update_matrix_world() on the root */
+void
+gthree_transforms_update (GthreeTransforms *transforms,
+                          gboolean force)
+{
+  guint graph_age = gthree_object_get_graph_age (transforms->root);
+  graphene_matrix_t *local, *world;
+  const int *parents;
+  const guint8 *custom;
+  guint8 *state;
+  int i, n, start;
+
+  if (!transforms->graph_age_valid || transforms->graph_age != graph_age)
+    {
+      rebuild (transforms);
+      transforms->graph_age = graph_age;
+      transforms->graph_age_valid = TRUE;
+    }
+
+  n = transforms->objects->len;
+  start = force ? 0 : MIN (transforms->first_dirty, transforms->first_custom);
+  if (start >= n)
+    return;
+
+  local = (graphene_matrix_t *)transforms->local->data;
+  world = (graphene_matrix_t *)transforms->world->data;
+  parents = (const int *)transforms->parents->data;
+  state = transforms->state->data;
+  custom = transforms->custom->data;
+
+  for (i = start; i < n; i++)
+    {
+      int parent = parents[i];
+      gboolean update = force || (parent >= 0 && state[parent] == CHANGED);
+      GthreeObject *object;
+
+      /* Only the objects that changed themselves or have their own
+         update function need to be looked at */
+      if (state[i] == CLEAN && !update && !custom[i])
+        continue;
+
+      object = g_ptr_array_index (transforms->objects, i);
+      if (object == NULL)
+        {
+          state[i] = CLEAN;
+          continue;
+        }
+
+      if (custom[i])
+        {
+          if (gthree_object_update_matrix_world_node (object, update))
+            state[i] = CHANGED;
+          else
+            state[i] = CLEAN;
+          continue;
+        }
+
+      if (state[i] == DIRTY && gthree_object_prepare_world_matrix (object))
+        update = TRUE;
+
+      if (update)
+        {
+          if (parent < 0)
+            world[i] = local[i];
+          else
+            graphene_matrix_multiply (&local[i], &world[parent], &world[i]);
+
+          gthree_object_world_matrix_updated (object);
+          state[i] = CHANGED;
+        }
+      else
+        state[i] = CLEAN;
+    }
+
+  memset (state + start, CLEAN, n - start);
+  transforms->first_dirty = G_MAXINT;
+}
@@ -395,6 +395,12 @@ gthree_uniform_set_location (GthreeUniform *uniform,
   uniform->location = location;
 }
 
+int
+gthree_uniform_get_location (GthreeUniform *uniform)
+{
+  return uniform->location;
+}
+
 gboolean
 gthree_uniform_is_array (GthreeUniform *uniform)
 {
@@ -853,18 +859,55 @@ gthree_uniform_load (GthreeUniform *uniform,
     case GTHREE_UNIFORM_TYPE_TEXTURE_ARRAY:
       if (uniform->value.ptr_array)
         {
-          guint i, len = uniform->value.ptr_array->len;
+          guint i, j, len = uniform->value.ptr_array->len;
           int *units = g_alloca (len * sizeof (int));
+          int empty_unit = -1;
           for (i = 0; i < len; i++)
             {
               GthreeTexture *texture = g_ptr_array_index (uniform->value.ptr_array, i);
-              if (texture)
+
+              units[i] = -1;
+              if (texture == NULL)
+                continue;
+
+              /* A texture that is in the array more than once, like a
+                 shared shadow atlas, only needs one unit */
+              for (j = 0; j < i; j++)
+                {
+                  if (g_ptr_array_index (uniform->value.ptr_array, j) == texture)
+                    break;
+                }
+
+              if (j < i)
+                units[i] = units[j];
+              else
                 {
                   units[i] = gthree_renderer_allocate_texture_unit (renderer);
                   gthree_texture_load (texture, units[i]);
-                  glUniform1iv (uniform->location, len, units);
                 }
+
+              if (empty_unit < 0)
+                empty_unit = units[i];
+            }
+
+          /* Empty slots must not share a unit with a sampler of another
+             type, like a shadow sampler with unit 0, so they use a unit
+             of the same array or one of their own with nothing bound */
+          for (i = 0; i < len; i++)
+            {
+              if (units[i] >= 0)
+                continue;
+
+              if (empty_unit < 0)
+                {
+                  empty_unit = gthree_renderer_allocate_texture_unit (renderer);
+                  glActiveTexture (GL_TEXTURE0 + empty_unit);
+                  glBindTexture (GL_TEXTURE_2D, 0);
+                }
+
+              units[i] = empty_unit;
             }
+          glUniform1iv (uniform->location, len, units);
         }
 
       break;
@@ -1003,6 +1046,9 @@ static GthreeUniformsDefinition lights_lib[] = {
   {"directionalLights", GTHREE_UNIFORM_TYPE_UNIFORMS_ARRAY, NULL},
   {"directionalShadowMap", GTHREE_UNIFORM_TYPE_TEXTURE_ARRAY, NULL},
   {"directionalShadowMatrix", GTHREE_UNIFORM_TYPE_MATRIX4_ARRAY, NULL},
+  {"directionalCascadeSplits", GTHREE_UNIFORM_TYPE_FLOAT4_ARRAY, NULL},
+  {"directionalCascadeScale", GTHREE_UNIFORM_TYPE_MATRIX4_ARRAY, NULL},
+  {"directionalCascadeOffset", GTHREE_UNIFORM_TYPE_MATRIX4_ARRAY, NULL},
   /*
     properties: {
       direction: {},
@@ -1010,7 +1056,9 @@ static GthreeUniformsDefinition lights_lib[] = {
       shadow: {},
       shadowBias: {},
       shadowRadius: {},
-      shadowMapSize: {}
+      shadowMapSize: {},
+      shadowMapRect: {},
+      shadowCascades: {}
       }
   */
 
@@ -1028,6 +1076,7 @@ static GthreeUniformsDefinition lights_lib[] = {
        shadowBias: {},
        shadowRadius: {},
        shadowMapSize: {},
+       shadowMapRect: {},
        shadowCameraNear: {},
        shadowCameraFar: {}
        }
@@ -1047,7 +1096,8 @@ static GthreeUniformsDefinition lights_lib[] = {
     shadow: {},
     shadowBias: {},
     shadowRadius: {},
-    shadowMapSize: {}
+    shadowMapSize: {},
+    shadowMapRect: {}
     }
   */
 
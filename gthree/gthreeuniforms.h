@@ -144,6 +144,8 @@ GTHREE_API
 void        gthree_uniform_set_location     (GthreeUniform   *uniform,
                                              int              location);
 GTHREE_API
+int         gthree_uniform_get_location     (GthreeUniform   *uniform);
+GTHREE_API
 void        gthree_uniform_set_needs_update (GthreeUniform   *uniform,
                                              gboolean         needs_update);
 GTHREE_API
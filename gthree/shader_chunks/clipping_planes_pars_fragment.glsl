@@ -4,6 +4,10 @@
 		varying vec3 vViewPosition;
 	#endif
 
-	uniform vec4 clippingPlanes[ NUM_CLIPPING_PLANES ];
+	#if NUM_CLIPPING_PLANES <= MAX_FRAME_CLIPPING_PLANES
+		#define clippingPlanes frameClippingPlanes
+	#else
+		uniform vec4 clippingPlanes[ NUM_CLIPPING_PLANES ];
+	#endif
 
 #endif
@@ -0,0 +1,7 @@
+layout(std140) uniform GthreeFrame {
+	mat4 projectionMatrix;
+	mat4 viewMatrix;
+	vec3 cameraPosition;
+	float frameTime;
+	vec4 frameClippingPlanes[ MAX_FRAME_CLIPPING_PLANES ];
+};
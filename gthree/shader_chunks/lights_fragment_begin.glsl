@@ -33,7 +33,7 @@ IncidentLight directLight;
 		getPointDirectLightIrradiance( pointLight, geometry, directLight );
 
 		#ifdef USE_SHADOWMAP
-		directLight.color *= all( bvec2( pointLight.shadow, directLight.visible ) ) ? getPointShadow( pointShadowMap[ i ], pointLight.shadowMapSize, pointLight.shadowBias, pointLight.shadowRadius, vPointShadowCoord[ i ], pointLight.shadowCameraNear, pointLight.shadowCameraFar ) : 1.0;
+		directLight.color *= all( bvec2( pointLight.shadow, directLight.visible ) ) ? getPointShadow( pointShadowMap[ i ], pointLight.shadowMapSize, pointLight.shadowMapRect, pointLight.shadowBias, pointLight.shadowRadius, vPointShadowCoord[ i ], pointLight.shadowCameraNear, pointLight.shadowCameraFar ) : 1.0;
 		#endif
 
 		RE_Direct( directLight, geometry, material, reflectedLight );
@@ -54,7 +54,7 @@ IncidentLight directLight;
 		getSpotDirectLightIrradiance( spotLight, geometry, directLight );
 
 		#ifdef USE_SHADOWMAP
-		directLight.color *= all( bvec2( spotLight.shadow, directLight.visible ) ) ? getShadow( spotShadowMap[ i ], spotLight.shadowMapSize, spotLight.shadowBias, spotLight.shadowRadius, vSpotShadowCoord[ i ] ) : 1.0;
+		directLight.color *= all( bvec2( spotLight.shadow, directLight.visible ) ) ? getShadow( spotShadowMap[ i ], spotLight.shadowMapSize, spotLight.shadowMapRect, spotLight.shadowBias, spotLight.shadowRadius, vSpotShadowCoord[ i ] ) : 1.0;
 		#endif
 
 		RE_Direct( directLight, geometry, material, reflectedLight );
@@ -74,8 +74,10 @@ IncidentLight directLight;
 
 		getDirectionalDirectLightIrradiance( directionalLight, geometry, directLight );
 
-		#ifdef USE_SHADOWMAP
-		directLight.color *= all( bvec2( directionalLight.shadow, directLight.visible ) ) ? getShadow( directionalShadowMap[ i ], directionalLight.shadowMapSize, directionalLight.shadowBias, directionalLight.shadowRadius, vDirectionalShadowCoord[ i ] ) : 1.0;
+		#if defined( USE_SHADOWMAP ) && defined( USE_SHADOW_CASCADES )
+		directLight.color *= all( bvec2( directionalLight.shadow, directLight.visible ) ) ? getCascadedShadow( directionalShadowMap[ i ], directionalLight.shadowMapSize, directionalLight.shadowMapRect, directionalLight.shadowBias, directionalLight.shadowRadius, vDirectionalShadowCoord[ i ], directionalLight.shadowCascades, directionalCascadeSplits[ i ], directionalCascadeScale[ i ], directionalCascadeOffset[ i ] ) : 1.0;
+		#elif defined( USE_SHADOWMAP )
+		directLight.color *= all( bvec2( directionalLight.shadow, directLight.visible ) ) ? getShadow( directionalShadowMap[ i ], directionalLight.shadowMapSize, directionalLight.shadowMapRect, directionalLight.shadowBias, directionalLight.shadowRadius, vDirectionalShadowCoord[ i ] ) : 1.0;
 		#endif
 
 		RE_Direct( directLight, geometry, material, reflectedLight );
@@ -84,6 +86,52 @@ IncidentLight directLight;
 
 #endif
 
+#if defined( USE_LIGHT_BLOCK ) && defined( RE_Direct )
+
+	// The light counts come from the block, so these loops can't be unrolled
+
+	for ( int i = 0; i < blockLightCounts.y; i ++ ) {
+
+		getPointDirectLightIrradiance( getBlockPointLight( i ), geometry, directLight );
+
+		RE_Direct( directLight, geometry, material, reflectedLight );
+
+	}
+
+	for ( int i = 0; i < blockLightCounts.z; i ++ ) {
+
+		getSpotDirectLightIrradiance( getBlockSpotLight( i ), geometry, directLight );
+
+		RE_Direct( directLight, geometry, material, reflectedLight );
+
+	}
+
+	for ( int i = 0; i < blockLightCounts.x; i ++ ) {
+
+		getDirectionalDirectLightIrradiance( getBlockDirectionalLight( i ), geometry, directLight );
+
+		RE_Direct( directLight, geometry, material, reflectedLight );
+
+	}
+
+#endif
+
+#if defined( USE_CLUSTERED_LIGHTS ) && defined( RE_Direct )
+
+	// Only the point and spot lights that reach this fragment's cluster
+
+	uvec2 lightCluster = getLightCluster( ( gl_FragCoord.xy - clusterViewport.xy ) * clusterViewport.zw, geometry.position.z );
+
+	for ( int i = 0; i < int( lightCluster.y ); i ++ ) {
+
+		getClusterDirectLightIrradiance( int( lightCluster.x ) + i, geometry, directLight );
+
+		RE_Direct( directLight, geometry, material, reflectedLight );
+
+	}
+
+#endif
+
 #if ( NUM_RECT_AREA_LIGHTS > 0 ) && defined( RE_Direct_RectArea )
 
 	RectAreaLight rectAreaLight;
@@ -99,6 +99,86 @@ vec3 directLightColor_Diffuse;
 
 #endif
 
+#ifdef USE_LIGHT_BLOCK
+
+	for ( int i = 0; i < blockLightCounts.y; i ++ ) {
+
+		getPointDirectLightIrradiance( getBlockPointLight( i ), geometry, directLight );
+
+		dotNL = dot( geometry.normal, directLight.direction );
+		directLightColor_Diffuse = PI * directLight.color;
+
+		vLightFront += saturate( dotNL ) * directLightColor_Diffuse;
+
+		#ifdef DOUBLE_SIDED
+
+			vLightBack += saturate( -dotNL ) * directLightColor_Diffuse;
+
+		#endif
+
+	}
+
+	for ( int i = 0; i < blockLightCounts.z; i ++ ) {
+
+		getSpotDirectLightIrradiance( getBlockSpotLight( i ), geometry, directLight );
+
+		dotNL = dot( geometry.normal, directLight.direction );
+		directLightColor_Diffuse = PI * directLight.color;
+
+		vLightFront += saturate( dotNL ) * directLightColor_Diffuse;
+
+		#ifdef DOUBLE_SIDED
+
+			vLightBack += saturate( -dotNL ) * directLightColor_Diffuse;
+
+		#endif
+
+	}
+
+	for ( int i = 0; i < blockLightCounts.x; i ++ ) {
+
+		getDirectionalDirectLightIrradiance( getBlockDirectionalLight( i ), geometry, directLight );
+
+		dotNL = dot( geometry.normal, directLight.direction );
+		directLightColor_Diffuse = PI * directLight.color;
+
+		vLightFront += saturate( dotNL ) * directLightColor_Diffuse;
+
+		#ifdef DOUBLE_SIDED
+
+			vLightBack += saturate( -dotNL ) * directLightColor_Diffuse;
+
+		#endif
+
+	}
+
+#endif
+
+#ifdef USE_CLUSTERED_LIGHTS
+
+	// Lit per vertex, so use the cluster the vertex is in
+
+	uvec2 lightCluster = getLightCluster( gl_Position.xy / gl_Position.w * 0.5 + 0.5, mvPosition.z );
+
+	for ( int i = 0; i < int( lightCluster.y ); i ++ ) {
+
+		getClusterDirectLightIrradiance( int( lightCluster.x ) + i, geometry, directLight );
+
+		dotNL = dot( geometry.normal, directLight.direction );
+		directLightColor_Diffuse = PI * directLight.color;
+
+		vLightFront += saturate( dotNL ) * directLightColor_Diffuse;
+
+		#ifdef DOUBLE_SIDED
+
+			vLightBack += saturate( -dotNL ) * directLightColor_Diffuse;
+
+		#endif
+
+	}
+
+#endif
+
 #if NUM_HEMI_LIGHTS > 0
 
 	#pragma unroll_loop
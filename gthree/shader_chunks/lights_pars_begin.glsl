@@ -1,4 +1,6 @@
+#ifndef USE_LIGHT_BLOCK
 uniform vec3 ambientLightColor;
+#endif
 uniform vec3 lightProbe[ 9 ];
 
 // get the irradiance (radiance convolved with cosine lobe) at the point 'normal' on the unit sphere
@@ -38,9 +40,9 @@ vec3 getLightProbeIrradiance( const in vec3 lightProbe[ 9 ], const in GeometricC
 
 }
 
-vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
+vec3 getAmbientLightIrradiance( const in vec3 ambientColor ) {
 
-	vec3 irradiance = ambientLightColor;
+	vec3 irradiance = ambientColor;
 
 	#ifndef PHYSICALLY_CORRECT_LIGHTS
 
@@ -52,7 +54,7 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 
 }
 
-#if NUM_DIR_LIGHTS > 0
+#if NUM_DIR_LIGHTS > 0 || defined( USE_LIGHT_BLOCK )
 
 	struct DirectionalLight {
 		vec3 direction;
@@ -62,9 +64,13 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 		float shadowBias;
 		float shadowRadius;
 		vec2 shadowMapSize;
+		vec4 shadowMapRect;
+		int shadowCascades;
 	};
 
+	#if NUM_DIR_LIGHTS > 0
 	uniform DirectionalLight directionalLights[ NUM_DIR_LIGHTS ];
+	#endif
 
 	void getDirectionalDirectLightIrradiance( const in DirectionalLight directionalLight, const in GeometricContext geometry, out IncidentLight directLight ) {
 
@@ -77,7 +83,7 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 #endif
 
 
-#if NUM_POINT_LIGHTS > 0
+#if NUM_POINT_LIGHTS > 0 || defined( USE_LIGHT_BLOCK )
 
 	struct PointLight {
 		vec3 position;
@@ -89,11 +95,14 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 		float shadowBias;
 		float shadowRadius;
 		vec2 shadowMapSize;
+		vec4 shadowMapRect;
 		float shadowCameraNear;
 		float shadowCameraFar;
 	};
 
+	#if NUM_POINT_LIGHTS > 0
 	uniform PointLight pointLights[ NUM_POINT_LIGHTS ];
+	#endif
 
 	// directLight is an out parameter as having it as a return value caused compiler errors on some devices
 	void getPointDirectLightIrradiance( const in PointLight pointLight, const in GeometricContext geometry, out IncidentLight directLight ) {
@@ -112,7 +121,7 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 #endif
 
 
-#if NUM_SPOT_LIGHTS > 0
+#if NUM_SPOT_LIGHTS > 0 || defined( USE_LIGHT_BLOCK )
 
 	struct SpotLight {
 		vec3 position;
@@ -127,9 +136,12 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 		float shadowBias;
 		float shadowRadius;
 		vec2 shadowMapSize;
+		vec4 shadowMapRect;
 	};
 
+	#if NUM_SPOT_LIGHTS > 0
 	uniform SpotLight spotLights[ NUM_SPOT_LIGHTS ];
+	#endif
 
 	// directLight is an out parameter as having it as a return value caused compiler errors on some devices
 	void getSpotDirectLightIrradiance( const in SpotLight spotLight, const in GeometricContext geometry, out IncidentLight directLight  ) {
@@ -159,6 +171,185 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 #endif
 
 
+#ifdef USE_LIGHT_BLOCK
+
+	// Must match GthreeLightsUniforms in gthreeprivate.h
+	#define MAX_BLOCK_LIGHTS 16
+
+	struct BlockDirectionalLight {
+		vec4 direction;
+		vec4 color;
+	};
+
+	struct BlockPointLight {
+		vec4 position; // w is distance
+		vec4 color; // w is decay
+	};
+
+	struct BlockSpotLight {
+		vec4 position; // w is distance
+		vec4 direction; // w is decay
+		vec4 color;
+		vec4 cone; // x is coneCos, y is penumbraCos
+	};
+
+	layout(std140) uniform GthreeLights {
+		vec4 blockAmbientLightColor;
+		ivec4 blockLightCounts; // directional, point, spot
+		vec4 clusterViewport; // xy is the offset, zw is 1 / size, in pixels
+		vec4 clusterDepth; // x is scale, y is bias from log( view depth ) to slice
+		ivec4 clusterSize; // xyz is the number of clusters, w is the number of point lights
+		BlockDirectionalLight blockDirectionalLights[ MAX_BLOCK_LIGHTS ];
+		BlockPointLight blockPointLights[ MAX_BLOCK_LIGHTS ];
+		BlockSpotLight blockSpotLights[ MAX_BLOCK_LIGHTS ];
+	};
+
+	#define ambientLightColor ( blockAmbientLightColor.rgb )
+
+	// Lights from the block never have shadows, see use_light_block()
+
+	DirectionalLight getBlockDirectionalLight( const in int i ) {
+
+		DirectionalLight light;
+		light.direction = blockDirectionalLights[ i ].direction.xyz;
+		light.color = blockDirectionalLights[ i ].color.rgb;
+		light.shadow = 0;
+		light.shadowBias = 0.0;
+		light.shadowRadius = 0.0;
+		light.shadowMapSize = vec2( 0.0 );
+		light.shadowMapRect = vec4( 0.0, 0.0, 1.0, 1.0 );
+		light.shadowCascades = 0;
+		return light;
+
+	}
+
+	PointLight getBlockPointLight( const in int i ) {
+
+		PointLight light;
+		light.position = blockPointLights[ i ].position.xyz;
+		light.distance = blockPointLights[ i ].position.w;
+		light.color = blockPointLights[ i ].color.rgb;
+		light.decay = blockPointLights[ i ].color.w;
+		light.shadow = 0;
+		light.shadowBias = 0.0;
+		light.shadowRadius = 0.0;
+		light.shadowMapSize = vec2( 0.0 );
+		light.shadowMapRect = vec4( 0.0, 0.0, 1.0, 1.0 );
+		light.shadowCameraNear = 0.0;
+		light.shadowCameraFar = 0.0;
+		return light;
+
+	}
+
+	SpotLight getBlockSpotLight( const in int i ) {
+
+		SpotLight light;
+		light.position = blockSpotLights[ i ].position.xyz;
+		light.distance = blockSpotLights[ i ].position.w;
+		light.direction = blockSpotLights[ i ].direction.xyz;
+		light.decay = blockSpotLights[ i ].direction.w;
+		light.color = blockSpotLights[ i ].color.rgb;
+		light.coneCos = blockSpotLights[ i ].cone.x;
+		light.penumbraCos = blockSpotLights[ i ].cone.y;
+		light.shadow = 0;
+		light.shadowBias = 0.0;
+		light.shadowRadius = 0.0;
+		light.shadowMapSize = vec2( 0.0 );
+		light.shadowMapRect = vec4( 0.0, 0.0, 1.0, 1.0 );
+		return light;
+
+	}
+
+#endif
+
+
+#ifdef USE_CLUSTERED_LIGHTS
+
+	// Must match GTHREE_CLUSTER_INDICES_WIDTH in gthreeprivate.h
+	#define CLUSTER_INDICES_WIDTH 1024
+
+	// Point lights first, then spot lights, one light per row
+	uniform sampler2D clusterLightData;
+	// One texel per cluster, x is the first index, y the number of lights
+	uniform usampler2D clusterGrid;
+	uniform usampler2D clusterIndices;
+
+	// screenPosition is 0 to 1 over the viewport
+	uvec2 getLightCluster( const in vec2 screenPosition, const in float viewZ ) {
+
+		ivec2 tile = ivec2( clamp( screenPosition, 0.0, 0.9999 ) * vec2( clusterSize.xy ) );
+		float slice = log( max( - viewZ, 1e-4 ) ) * clusterDepth.x + clusterDepth.y;
+		int z = int( clamp( slice, 0.0, float( clusterSize.z - 1 ) ) );
+
+		return texelFetch( clusterGrid, ivec2( tile.y * clusterSize.x + tile.x, z ), 0 ).xy;
+
+	}
+
+	int getClusterLightIndex( const in int i ) {
+
+		return int( texelFetch( clusterIndices, ivec2( i % CLUSTER_INDICES_WIDTH, i / CLUSTER_INDICES_WIDTH ), 0 ).r );
+
+	}
+
+	PointLight getClusterPointLight( const in int i ) {
+
+		vec4 position = texelFetch( clusterLightData, ivec2( 0, i ), 0 );
+		vec4 color = texelFetch( clusterLightData, ivec2( 1, i ), 0 );
+
+		PointLight light;
+		light.position = position.xyz;
+		light.distance = position.w;
+		light.color = color.rgb;
+		light.decay = color.w;
+		light.shadow = 0;
+		light.shadowBias = 0.0;
+		light.shadowRadius = 0.0;
+		light.shadowMapSize = vec2( 0.0 );
+		light.shadowMapRect = vec4( 0.0, 0.0, 1.0, 1.0 );
+		light.shadowCameraNear = 0.0;
+		light.shadowCameraFar = 0.0;
+		return light;
+
+	}
+
+	SpotLight getClusterSpotLight( const in int i ) {
+
+		vec4 position = texelFetch( clusterLightData, ivec2( 0, i ), 0 );
+		vec4 direction = texelFetch( clusterLightData, ivec2( 1, i ), 0 );
+		vec4 color = texelFetch( clusterLightData, ivec2( 2, i ), 0 );
+		vec4 cone = texelFetch( clusterLightData, ivec2( 3, i ), 0 );
+
+		SpotLight light;
+		light.position = position.xyz;
+		light.distance = position.w;
+		light.direction = direction.xyz;
+		light.decay = direction.w;
+		light.color = color.rgb;
+		light.coneCos = cone.x;
+		light.penumbraCos = cone.y;
+		light.shadow = 0;
+		light.shadowBias = 0.0;
+		light.shadowRadius = 0.0;
+		light.shadowMapSize = vec2( 0.0 );
+		light.shadowMapRect = vec4( 0.0, 0.0, 1.0, 1.0 );
+		return light;
+
+	}
+
+	void getClusterDirectLightIrradiance( const in int i, const in GeometricContext geometry, out IncidentLight directLight ) {
+
+		int index = getClusterLightIndex( i );
+
+		if ( index < clusterSize.w )
+			getPointDirectLightIrradiance( getClusterPointLight( index ), geometry, directLight );
+		else
+			getSpotDirectLightIrradiance( getClusterSpotLight( index ), geometry, directLight );
+
+	}
+
+#endif
+
+
 #if NUM_RECT_AREA_LIGHTS > 0
 
 	struct RectAreaLight {
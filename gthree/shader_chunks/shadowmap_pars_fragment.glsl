@@ -1,22 +1,58 @@
 #ifdef USE_SHADOWMAP
 
+	// Directional and spot maps are depth textures with depth compare, point
+	// light maps have the distance packed into RGBA, unless they are depth
+	// cube maps with the distance as depth
+
+	#ifdef USE_SHADOWMAP_DEPTH_COMPARE
+
+		#define SHADOW_SAMPLER sampler2DShadow
+
+	#else
+
+		#define SHADOW_SAMPLER sampler2D
+
+	#endif
+
 	#if NUM_DIR_LIGHTS > 0
 
-		uniform sampler2D directionalShadowMap[ NUM_DIR_LIGHTS ];
+		uniform SHADOW_SAMPLER directionalShadowMap[ NUM_DIR_LIGHTS ];
 		varying vec4 vDirectionalShadowCoord[ NUM_DIR_LIGHTS ];
 
+		#ifdef USE_SHADOW_CASCADES
+
+			// For cascaded lights vDirectionalShadowCoord is in light space, and
+			// each cascade scales and offsets it into its tile of the shadow map
+
+			uniform vec4 directionalCascadeSplits[ NUM_DIR_LIGHTS ];
+			uniform mat4 directionalCascadeScale[ NUM_DIR_LIGHTS ];
+			uniform mat4 directionalCascadeOffset[ NUM_DIR_LIGHTS ];
+			varying float vShadowViewDepth;
+
+		#endif
+
 	#endif
 
 	#if NUM_SPOT_LIGHTS > 0
 
-		uniform sampler2D spotShadowMap[ NUM_SPOT_LIGHTS ];
+		uniform SHADOW_SAMPLER spotShadowMap[ NUM_SPOT_LIGHTS ];
 		varying vec4 vSpotShadowCoord[ NUM_SPOT_LIGHTS ];
 
 	#endif
 
+	#ifdef USE_SHADOWMAP_CUBE
+
+		#define POINT_SHADOW_SAMPLER samplerCubeShadow
+
+	#else
+
+		#define POINT_SHADOW_SAMPLER sampler2D
+
+	#endif
+
 	#if NUM_POINT_LIGHTS > 0
 
-		uniform sampler2D pointShadowMap[ NUM_POINT_LIGHTS ];
+		uniform POINT_SHADOW_SAMPLER pointShadowMap[ NUM_POINT_LIGHTS ];
 		varying vec4 vPointShadowCoord[ NUM_POINT_LIGHTS ];
 
 	#endif
@@ -57,7 +93,25 @@
 
 	}
 
-	float getShadow( sampler2D shadowMap, vec2 shadowMapSize, float shadowBias, float shadowRadius, vec4 shadowCoord ) {
+	#ifdef USE_SHADOWMAP_DEPTH_COMPARE
+
+	// The texture unit does the comparison, and with linear filtering it
+	// also blends the results of the 4 nearest texels like texture2DShadowLerp()
+
+	float textureShadowCompare( sampler2DShadow depths, vec2 uv, float compare ) {
+
+		return texture( depths, vec3( uv, compare ) );
+
+	}
+
+	#endif
+
+	// shadowMapRect is the offset and scale of the part of the shadow map
+	// used by the light, which is not all of it when it is an atlas. The
+	// lookups stay inside it, inset by the filter radius and a texel for
+	// the linear filtering, so they don't pick up other lights or cascades
+
+	float getShadow( SHADOW_SAMPLER shadowMap, vec2 shadowMapSize, vec4 shadowMapRect, float shadowBias, float shadowRadius, vec4 shadowCoord ) {
 
 		float shadow = 1.0;
 
@@ -76,7 +130,52 @@
 
 		if ( frustumTest ) {
 
-		#if defined( SHADOWMAP_TYPE_PCF )
+		shadowCoord.xy = shadowMapRect.xy + shadowCoord.xy * shadowMapRect.zw;
+
+		vec2 filterInset = min( vec2( shadowRadius + 1.0 ) / shadowMapSize, shadowMapRect.zw * 0.5 );
+		vec2 rectMin = shadowMapRect.xy + filterInset;
+		vec2 rectMax = shadowMapRect.xy + shadowMapRect.zw - filterInset;
+
+		#if defined( USE_SHADOWMAP_DEPTH_COMPARE ) && defined( SHADOWMAP_TYPE_PCF )
+
+			// Four filtered lookups half a radius apart cover the same
+			// texels as the nine lookups below, with tent weights
+
+			vec2 texelSize = vec2( 0.5 ) * shadowRadius / shadowMapSize;
+
+			shadow = (
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( - texelSize.x, - texelSize.y ), rectMin, rectMax ), shadowCoord.z ) +
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( + texelSize.x, - texelSize.y ), rectMin, rectMax ), shadowCoord.z ) +
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( - texelSize.x, + texelSize.y ), rectMin, rectMax ), shadowCoord.z ) +
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( + texelSize.x, + texelSize.y ), rectMin, rectMax ), shadowCoord.z )
+			) * ( 1.0 / 4.0 );
+
+		#elif defined( USE_SHADOWMAP_DEPTH_COMPARE ) && defined( SHADOWMAP_TYPE_PCF_SOFT )
+
+			vec2 texelSize = vec2( 1.0 ) / shadowMapSize;
+
+			float dx0 = - texelSize.x * shadowRadius;
+			float dy0 = - texelSize.y * shadowRadius;
+			float dx1 = + texelSize.x * shadowRadius;
+			float dy1 = + texelSize.y * shadowRadius;
+
+			shadow = (
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx0, dy0 ), rectMin, rectMax ), shadowCoord.z ) +
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( 0.0, dy0 ), rectMin, rectMax ), shadowCoord.z ) +
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx1, dy0 ), rectMin, rectMax ), shadowCoord.z ) +
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx0, 0.0 ), rectMin, rectMax ), shadowCoord.z ) +
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy, rectMin, rectMax ), shadowCoord.z ) +
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx1, 0.0 ), rectMin, rectMax ), shadowCoord.z ) +
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx0, dy1 ), rectMin, rectMax ), shadowCoord.z ) +
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( 0.0, dy1 ), rectMin, rectMax ), shadowCoord.z ) +
+				textureShadowCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx1, dy1 ), rectMin, rectMax ), shadowCoord.z )
+			) * ( 1.0 / 9.0 );
+
+		#elif defined( USE_SHADOWMAP_DEPTH_COMPARE )
+
+			shadow = textureShadowCompare( shadowMap, clamp( shadowCoord.xy, rectMin, rectMax ), shadowCoord.z );
+
+		#elif defined( SHADOWMAP_TYPE_PCF )
 
 			vec2 texelSize = vec2( 1.0 ) / shadowMapSize;
 
@@ -86,15 +185,15 @@
 			float dy1 = + texelSize.y * shadowRadius;
 
 			shadow = (
-				texture2DCompare( shadowMap, shadowCoord.xy + vec2( dx0, dy0 ), shadowCoord.z ) +
-				texture2DCompare( shadowMap, shadowCoord.xy + vec2( 0.0, dy0 ), shadowCoord.z ) +
-				texture2DCompare( shadowMap, shadowCoord.xy + vec2( dx1, dy0 ), shadowCoord.z ) +
-				texture2DCompare( shadowMap, shadowCoord.xy + vec2( dx0, 0.0 ), shadowCoord.z ) +
-				texture2DCompare( shadowMap, shadowCoord.xy, shadowCoord.z ) +
-				texture2DCompare( shadowMap, shadowCoord.xy + vec2( dx1, 0.0 ), shadowCoord.z ) +
-				texture2DCompare( shadowMap, shadowCoord.xy + vec2( dx0, dy1 ), shadowCoord.z ) +
-				texture2DCompare( shadowMap, shadowCoord.xy + vec2( 0.0, dy1 ), shadowCoord.z ) +
-				texture2DCompare( shadowMap, shadowCoord.xy + vec2( dx1, dy1 ), shadowCoord.z )
+				texture2DCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx0, dy0 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DCompare( shadowMap, clamp( shadowCoord.xy + vec2( 0.0, dy0 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx1, dy0 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx0, 0.0 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DCompare( shadowMap, clamp( shadowCoord.xy, rectMin, rectMax ), shadowCoord.z ) +
+				texture2DCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx1, 0.0 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx0, dy1 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DCompare( shadowMap, clamp( shadowCoord.xy + vec2( 0.0, dy1 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DCompare( shadowMap, clamp( shadowCoord.xy + vec2( dx1, dy1 ), rectMin, rectMax ), shadowCoord.z )
 			) * ( 1.0 / 9.0 );
 
 		#elif defined( SHADOWMAP_TYPE_PCF_SOFT )
@@ -107,20 +206,20 @@
 			float dy1 = + texelSize.y * shadowRadius;
 
 			shadow = (
-				texture2DShadowLerp( shadowMap, shadowMapSize, shadowCoord.xy + vec2( dx0, dy0 ), shadowCoord.z ) +
-				texture2DShadowLerp( shadowMap, shadowMapSize, shadowCoord.xy + vec2( 0.0, dy0 ), shadowCoord.z ) +
-				texture2DShadowLerp( shadowMap, shadowMapSize, shadowCoord.xy + vec2( dx1, dy0 ), shadowCoord.z ) +
-				texture2DShadowLerp( shadowMap, shadowMapSize, shadowCoord.xy + vec2( dx0, 0.0 ), shadowCoord.z ) +
-				texture2DShadowLerp( shadowMap, shadowMapSize, shadowCoord.xy, shadowCoord.z ) +
-				texture2DShadowLerp( shadowMap, shadowMapSize, shadowCoord.xy + vec2( dx1, 0.0 ), shadowCoord.z ) +
-				texture2DShadowLerp( shadowMap, shadowMapSize, shadowCoord.xy + vec2( dx0, dy1 ), shadowCoord.z ) +
-				texture2DShadowLerp( shadowMap, shadowMapSize, shadowCoord.xy + vec2( 0.0, dy1 ), shadowCoord.z ) +
-				texture2DShadowLerp( shadowMap, shadowMapSize, shadowCoord.xy + vec2( dx1, dy1 ), shadowCoord.z )
+				texture2DShadowLerp( shadowMap, shadowMapSize, clamp( shadowCoord.xy + vec2( dx0, dy0 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DShadowLerp( shadowMap, shadowMapSize, clamp( shadowCoord.xy + vec2( 0.0, dy0 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DShadowLerp( shadowMap, shadowMapSize, clamp( shadowCoord.xy + vec2( dx1, dy0 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DShadowLerp( shadowMap, shadowMapSize, clamp( shadowCoord.xy + vec2( dx0, 0.0 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DShadowLerp( shadowMap, shadowMapSize, clamp( shadowCoord.xy, rectMin, rectMax ), shadowCoord.z ) +
+				texture2DShadowLerp( shadowMap, shadowMapSize, clamp( shadowCoord.xy + vec2( dx1, 0.0 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DShadowLerp( shadowMap, shadowMapSize, clamp( shadowCoord.xy + vec2( dx0, dy1 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DShadowLerp( shadowMap, shadowMapSize, clamp( shadowCoord.xy + vec2( 0.0, dy1 ), rectMin, rectMax ), shadowCoord.z ) +
+				texture2DShadowLerp( shadowMap, shadowMapSize, clamp( shadowCoord.xy + vec2( dx1, dy1 ), rectMin, rectMax ), shadowCoord.z )
 			) * ( 1.0 / 9.0 );
 
 		#else // no percentage-closer filtering:
 
-			shadow = texture2DCompare( shadowMap, shadowCoord.xy, shadowCoord.z );
+			shadow = texture2DCompare( shadowMap, clamp( shadowCoord.xy, rectMin, rectMax ), shadowCoord.z );
 
 		#endif
 
@@ -130,6 +229,44 @@
 
 	}
 
+	#if NUM_DIR_LIGHTS > 0 && defined( USE_SHADOW_CASCADES )
+
+	// Column c of scale and offset maps the light space coordinates into the tile of cascade c
+
+	float getCascadedShadow( SHADOW_SAMPLER shadowMap, vec2 shadowMapSize, vec4 shadowMapRect, float shadowBias, float shadowRadius, vec4 shadowCoord, int cascades, vec4 splits, mat4 scale, mat4 offset ) {
+
+		if ( cascades <= 1 ) return getShadow( shadowMap, shadowMapSize, shadowMapRect, shadowBias, shadowRadius, shadowCoord );
+
+		vec2 tiles = vec2( 2.0, float( ( cascades + 1 ) / 2 ) );
+
+		for ( int c = 0; c < MAX_SHADOW_CASCADES; c ++ ) {
+
+			if ( c >= cascades ) break;
+
+			// Use the first cascade reaching this far that has the fragment in its
+			// tile, one that was not updated recently may not cover all of its slice
+
+			if ( vShadowViewDepth > splits[ c ] ) continue;
+
+			vec3 tileCoord = shadowCoord.xyz * scale[ c ].xyz + offset[ c ].xyz;
+
+			if ( any( lessThan( tileCoord.xy, vec2( 0.0 ) ) ) || any( greaterThan( tileCoord.xy, vec2( 1.0 ) ) ) ) continue;
+
+			// The tile of the cascade is the rect getShadow() samples in
+
+			vec2 tile = vec2( mod( float( c ), 2.0 ), floor( float( c ) / 2.0 ) );
+			vec4 tileRect = vec4( shadowMapRect.xy + tile / tiles * shadowMapRect.zw, shadowMapRect.zw / tiles );
+
+			return getShadow( shadowMap, shadowMapSize, tileRect, shadowBias, shadowRadius, vec4( tileCoord, 1.0 ) );
+
+		}
+
+		return 1.0;
+
+	}
+
+	#endif
+
 	// cubeToUV() maps a 3D direction vector suitable for cube texture mapping to a 2D
 	// vector suitable for 2D texture mapping. This code uses the following layout for the
 	// 2D texture:
@@ -201,9 +338,38 @@
 
 	}
 
-	float getPointShadow( sampler2D shadowMap, vec2 shadowMapSize, float shadowBias, float shadowRadius, vec4 shadowCoord, float shadowCameraNear, float shadowCameraFar ) {
+	// The cube layout above is placed in shadowMapRect of the shadow map
+
+	vec2 cubeToRectUV( vec3 v, float texelSizeY, vec4 shadowMapRect ) {
+
+		return shadowMapRect.xy + cubeToUV( v, texelSizeY ) * shadowMapRect.zw;
+
+	}
+
+	#ifdef USE_SHADOWMAP_CUBE
+
+	// Seamless lookups filter across the cube edges, so the offsets
+	// don't need to stay away from them like cubeToUV() does
+
+	float textureCubeShadowCompare( samplerCubeShadow distances, vec3 direction, float compare ) {
+
+		return texture( distances, vec4( direction, compare ) );
+
+	}
+
+	#endif
+
+	float getPointShadow( POINT_SHADOW_SAMPLER shadowMap, vec2 shadowMapSize, vec4 shadowMapRect, float shadowBias, float shadowRadius, vec4 shadowCoord, float shadowCameraNear, float shadowCameraFar ) {
+
+		#ifdef USE_SHADOWMAP_CUBE
 
-		vec2 texelSize = vec2( 1.0 ) / ( shadowMapSize * vec2( 4.0, 2.0 ) );
+			vec2 texelSize = vec2( 2.0 ) / shadowMapSize;
+
+		#else
+
+			vec2 texelSize = vec2( 1.0 ) / ( shadowMapSize * vec2( 4.0, 2.0 ) );
+
+		#endif
 
 		// for point lights, the uniform @vShadowCoord is re-purposed to hold
 		// the vector from the light to the world-space position of the fragment.
@@ -216,25 +382,43 @@
 		// bd3D = base direction 3D
 		vec3 bd3D = normalize( lightToPosition );
 
-		#if defined( SHADOWMAP_TYPE_PCF ) || defined( SHADOWMAP_TYPE_PCF_SOFT )
+		#if defined( USE_SHADOWMAP_CUBE ) && ( defined( SHADOWMAP_TYPE_PCF ) || defined( SHADOWMAP_TYPE_PCF_SOFT ) )
+
+			// The directions are normalized, so a texel at the face center is
+			// 2 / size wide, and each lookup blends 2x2 compares by itself
+
+			vec2 offset = vec2( - 0.5, 0.5 ) * shadowRadius * texelSize.y;
+
+			return (
+				textureCubeShadowCompare( shadowMap, bd3D + offset.xxx, dp ) +
+				textureCubeShadowCompare( shadowMap, bd3D + offset.yyx, dp ) +
+				textureCubeShadowCompare( shadowMap, bd3D + offset.yxy, dp ) +
+				textureCubeShadowCompare( shadowMap, bd3D + offset.xyy, dp )
+			) * ( 1.0 / 4.0 );
+
+		#elif defined( USE_SHADOWMAP_CUBE )
+
+			return textureCubeShadowCompare( shadowMap, bd3D, dp );
+
+		#elif defined( SHADOWMAP_TYPE_PCF ) || defined( SHADOWMAP_TYPE_PCF_SOFT )
 
 			vec2 offset = vec2( - 1, 1 ) * shadowRadius * texelSize.y;
 
 			return (
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xyy, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yyy, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xyx, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yyx, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xxy, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yxy, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xxx, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yxx, texelSize.y ), dp )
+				texture2DCompare( shadowMap, cubeToRectUV( bd3D + offset.xyy, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToRectUV( bd3D + offset.yyy, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToRectUV( bd3D + offset.xyx, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToRectUV( bd3D + offset.yyx, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToRectUV( bd3D, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToRectUV( bd3D + offset.xxy, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToRectUV( bd3D + offset.yxy, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToRectUV( bd3D + offset.xxx, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToRectUV( bd3D + offset.yxx, texelSize.y, shadowMapRect ), dp )
 			) * ( 1.0 / 9.0 );
 
 		#else // no percentage-closer filtering
 
-			return texture2DCompare( shadowMap, cubeToUV( bd3D, texelSize.y ), dp );
+			return texture2DCompare( shadowMap, cubeToRectUV( bd3D, texelSize.y, shadowMapRect ), dp );
 
 		#endif
 
@@ -5,6 +5,12 @@
 		uniform mat4 directionalShadowMatrix[ NUM_DIR_LIGHTS ];
 		varying vec4 vDirectionalShadowCoord[ NUM_DIR_LIGHTS ];
 
+		#ifdef USE_SHADOW_CASCADES
+
+			varying float vShadowViewDepth;
+
+		#endif
+
 	#endif
 
 	#if NUM_SPOT_LIGHTS > 0
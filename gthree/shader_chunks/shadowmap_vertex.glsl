@@ -9,6 +9,12 @@
 
 	}
 
+	#ifdef USE_SHADOW_CASCADES
+
+		vShadowViewDepth = - mvPosition.z;
+
+	#endif
+
 	#endif
 
 	#if NUM_SPOT_LIGHTS > 0
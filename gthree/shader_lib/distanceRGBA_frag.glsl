@@ -26,6 +26,16 @@ void main () {
 	dist = ( dist - nearDistance ) / ( farDistance - nearDistance );
 	dist = saturate( dist ); // clamp to [ 0, 1 ]
 
-	gl_FragColor = packDepthToRGBA( dist );
+	#ifdef SHADOWMAP_CUBE_LAYERS
+
+		// Layered maps are depth cube maps, compared against the distance
+
+		gl_FragDepth = dist;
+
+	#else
+
+		gl_FragColor = packDepthToRGBA( dist );
+
+	#endif
 
 }
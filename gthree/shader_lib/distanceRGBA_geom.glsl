@@ -0,0 +1,36 @@
+// Emits each triangle once per cube face it may cover, so a single draw
+// renders all six faces of a layered depth cube map. The vertex shader
+// leaves the world position in gl_Position.
+
+layout( triangles ) in;
+layout( triangle_strip, max_vertices = 18 ) out;
+
+layout(std140) uniform GthreeCubeFaces {
+	mat4 cubeFaceViewProjection[ 6 ];
+};
+
+// Faces the object was not culled from, one bit per face
+uniform int cubeFaceMask;
+
+out vec3 vWorldPosition;
+
+void main() {
+
+	for ( int face = 0; face < 6; face ++ ) {
+
+		if ( ( cubeFaceMask & ( 1 << face ) ) == 0 ) continue;
+
+		for ( int i = 0; i < 3; i ++ ) {
+
+			gl_Layer = face;
+			vWorldPosition = gl_in[ i ].gl_Position.xyz;
+			gl_Position = cubeFaceViewProjection[ face ] * gl_in[ i ].gl_Position;
+			EmitVertex();
+
+		}
+
+		EndPrimitive();
+
+	}
+
+}
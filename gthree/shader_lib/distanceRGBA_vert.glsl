@@ -1,6 +1,10 @@
 #define DISTANCE
 
-varying vec3 vWorldPosition;
+#ifndef SHADOWMAP_CUBE_LAYERS
+
+	varying vec3 vWorldPosition;
+
+#endif
 
 #include <common>
 #include <uv_pars_vertex>
@@ -31,6 +35,16 @@ void main() {
 	#include <worldpos_vertex>
 	#include <clipping_planes_vertex>
 
-	vWorldPosition = worldPosition.xyz;
+	#ifdef SHADOWMAP_CUBE_LAYERS
+
+		// The geometry shader projects it onto the cube faces
+
+		gl_Position = worldPosition;
+
+	#else
+
+		vWorldPosition = worldPosition.xyz;
+
+	#endif
 
 }
@@ -0,0 +1,98 @@
+#include <gthree/gthree.h>
+
+/* Builds root -> a -> b with flat transforms, moves them and returns
+ * the scene after a first update, so the arrays have been laid out */
+static GthreeScene *
+create_scene (GthreeObject **a,
+              GthreeObject **b)
+{
+  GthreeScene *scene = gthree_scene_new ();
+  graphene_vec3_t pos;
+
+  gthree_scene_set_use_flat_transforms (scene, TRUE);
+
+  *a = GTHREE_OBJECT (gthree_group_new ());
+  *b = GTHREE_OBJECT (gthree_group_new ());
+  gthree_object_add_child (GTHREE_OBJECT (scene), *a);
+  gthree_object_add_child (*a, *b);
+  g_object_unref (*a);
+  g_object_unref (*b);
+
+  gthree_object_set_position (GTHREE_OBJECT (scene), graphene_vec3_init (&pos, 1, 2, 3));
+  gthree_object_set_position (*a, graphene_vec3_init (&pos, 4, 5, 6));
+  gthree_object_set_position (*b, graphene_vec3_init (&pos, 7, 8, 9));
+
+  gthree_object_update_matrix_world (GTHREE_OBJECT (scene), FALSE);
+
+  return scene;
+}
+
+static void
+assert_matrix_equal (const graphene_matrix_t *a,
+                     const graphene_matrix_t *b)
+{
+  g_assert_true (graphene_matrix_equal (a, b));
+}
+
+/* Changing the graph rebuilds the arrays, the objects that stay must
+ * keep their local and world matrices */
+static void
+test_transforms_graph_change (void)
+{
+  GthreeObject *a, *b, *c;
+  GthreeScene *scene;
+  graphene_matrix_t matrices[3], world_matrices[3];
+  GthreeObject *objects[3];
+  int i;
+
+  scene = create_scene (&a, &b);
+  objects[0] = GTHREE_OBJECT (scene);
+  objects[1] = a;
+  objects[2] = b;
+
+  for (i = 0; i < 3; i++)
+    {
+      matrices[i] = *gthree_object_get_matrix (objects[i]);
+      world_matrices[i] = *gthree_object_get_world_matrix (objects[i]);
+    }
+
+  c = GTHREE_OBJECT (gthree_group_new ());
+  gthree_object_add_child (GTHREE_OBJECT (scene), c);
+  gthree_object_update_matrix_world (GTHREE_OBJECT (scene), FALSE);
+
+  for (i = 0; i < 3; i++)
+    {
+      assert_matrix_equal (gthree_object_get_matrix (objects[i]), &matrices[i]);
+      assert_matrix_equal (gthree_object_get_world_matrix (objects[i]), &world_matrices[i]);
+    }
+
+  gthree_object_remove_child (GTHREE_OBJECT (scene), c);
+  gthree_object_update_matrix_world (GTHREE_OBJECT (scene), FALSE);
+
+  for (i = 0; i < 3; i++)
+    {
+      assert_matrix_equal (gthree_object_get_matrix (objects[i]), &matrices[i]);
+      assert_matrix_equal (gthree_object_get_world_matrix (objects[i]), &world_matrices[i]);
+    }
+
+  /* A removed object gets its matrices back */
+  g_object_ref (b);
+  gthree_object_remove_child (a, b);
+  gthree_object_update_matrix_world (GTHREE_OBJECT (scene), FALSE);
+  assert_matrix_equal (gthree_object_get_matrix (b), &matrices[2]);
+  assert_matrix_equal (gthree_object_get_world_matrix (b), &world_matrices[2]);
+
+  g_object_unref (b);
+  g_object_unref (c);
+  g_object_unref (scene);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/transforms/graph-change", test_transforms_graph_change);
+
+  return g_test_run ();
+}